@@ -8,9 +8,29 @@
 #define OTA_SOF  0x2A    // Start of Frame
 #define OTA_EOF  0x23    // End of Frame
 #define OTA_ACK  0x00    // ACK
-#define OTA_NACK 0x01    // NACK
+#define OTA_NACK 0x01    // NACK (other NACK statuses : OTA_EX_ reason codes)
+
+#define OTA_ENTER_REQ 0x55  // Request to enter the OTA mode (single byte, no frame)
+#define OTA_COBS_DELIM 0x00 // Ends a COBS encoded frame (and starts the first one)
 
 #define PACKET_CAPTURE_TIMEOUT 250
+#define OTA_RX_MAX_RETRIES     5      // Consecutive bad frames before the session is dropped
+#define OTA_RX_RING_SIZE       1024u  // Session bytes received by the UART interrupt (power of 2)
+
+#define OTA_PROTOCOL_VERSION  7     // Reported in the PING response
+#define OTA_RX_WINDOW         1     // Frames the receiver takes before it has to answer
+#define OTA_FEC_MAX_FRAMES    32    // Largest PARITY block (DATA frames), 0 : no FEC
+#define OTA_PAGE_ERASE_MAX_MS 25    // Page erase time, worst case (tERASE max 24.47 ms)
+
+#define OTA_SESSION_FLAG_RESUME  0x01   // SESSION : continue a pending upload of the same image
+#define OTA_SESSION_FLAG_NOOP    0x02   // SESSION : end the session if the image is installed or staged
+#define OTA_SLOT_FLAG_VALID      0x01   // SESSION response : the slot holds a complete image
+#define OTA_SLOT_FLAG_PENDING    0x02   // SESSION response : an upload to the slot was interrupted
+#define OTA_SLOT_FLAG_STAGED     0x04   // SESSION response : the slot image is installed at the next reset
+
+#define OTA_SESSION_UPLOAD       0      // SESSION response action : send the image
+#define OTA_SESSION_UP_TO_DATE   1      // SESSION response action : image running, session closed
+#define OTA_SESSION_INSTALL      2      // SESSION response action : image staged, the device resets to install it
 
 
 /* active bootloader : 2KB
@@ -44,12 +64,32 @@
 #define FW_TYPE_BOOTLDR		0x02
 
 
-#define OTA_NO_OF_SLOTS           1            //Number of slots
-#define OTA_SLOT_MAX_SIZE        (128 * 1024)  //Each slot size (512KB)
+/*
+ * Staging slots : the new application region split in OTA_NO_OF_SLOTS
+ * slots of whole pages, then the scratch page of the swap install. The
+ * bootloader swaps a slot with the active region : the slot then holds the
+ * image that was running, it can switch back to it without a new upload.
+ */
+#define OTA_NO_OF_SLOTS           2            //Number of slots
+#define OTA_SLOT_SIZE            ( ( ( OTA_NEW_FW_END_ADDR - OTA_NEW_FW_START_ADDR - FLASH_PAGE_SIZE ) / \
+                                     OTA_NO_OF_SLOTS ) & ~( FLASH_PAGE_SIZE - 1u ) )  //Each slot size
+#define OTA_SLOT_ADDR( n )       ( OTA_NEW_FW_START_ADDR + ( (n) * OTA_SLOT_SIZE ) )  //Slot n start address
+#define OTA_SCRATCH_ADDR         OTA_SLOT_ADDR( OTA_NO_OF_SLOTS )  //Swap install scratch page
+#define OTA_JOURNAL_FLASH_ADDR   OTA_CONFIG_FLASH_END_ADDR         //Swap install progress (last config page)
+#define OTA_PAGE_MARK_FLASH_ADDR ADDR_FLASH_PAGE_253              //Image pages written, one doubleword each (resume)
 
 #define OTA_DATA_MAX_SIZE ( 128 )  //Maximum data Size
+#define OTA_DATA_HDR_SIZE (    6 )  //DATA sequence number + offset
+#define OTA_PARITY_HDR_SIZE (  7 )  //PARITY sequence number + offset + frames
+#define OTA_SKIP_SIZE       ( 10 )  //SKIP sequence number + offset + length
+#define OTA_COPY_SIZE       ( 14 )  //COPY sequence number + offset + length + source
+#define OTA_COPY_MAX_SIZE   ( FLASH_PAGE_SIZE )  //Largest COPY, bounds the ota_poll() time
+#define OTA_HASHES_MAX_PAGES ( OTA_DATA_MAX_SIZE / 4u ) //Page hashes per PAGE_HASHES response
 #define OTA_DATA_OVERHEAD (    9 )  //data overhead
-#define OTA_PACKET_MAX_SIZE ( OTA_DATA_MAX_SIZE + OTA_DATA_OVERHEAD )
+#define OTA_PACKET_MAX_SIZE ( OTA_DATA_MAX_SIZE + OTA_PARITY_HDR_SIZE + OTA_DATA_OVERHEAD )
+#define OTA_COBS_SIZE( n )  ( (n) + ( (n) / 254u ) + 1u )  //COBS encoded size of n bytes, worst case
+
+#define OTA_NEW_FW_MAX_SIZE ( OTA_SLOT_SIZE )  //Largest application image
 
 /*
  * Reboot reason
@@ -66,6 +106,16 @@ typedef enum
 {
   OTA_EX_OK       = 0,    // Success
   OTA_EX_ERR      = 1,    // Failure
+  OTA_EX_CRC      = 2,    // Frame CRC mismatch
+  OTA_EX_FRAMING  = 3,    // No SOF/EOF, truncated or too long frame
+  OTA_EX_SEQUENCE = 4,    // Command not expected in this state, DATA out of the image
+  OTA_EX_FLASH    = 5,    // Flash erase/program error
+  OTA_EX_NO_SPACE = 6,    // Image larger than its region
+  OTA_EX_MISSING  = 7,    // PARITY : more than one frame of the block missing
+  OTA_EX_NO_UPDATE = 8,   // Not a NACK : the image is already running (ota_poll())
+  OTA_EX_BUSY     = 9,    // Not a NACK : the session goes on (ota_poll())
+  OTA_EX_IDLE     = 10,   // Not a NACK : no session (ota_poll())
+  OTA_EX_ABORTED  = 11,   // Not a NACK : the host aborted the session (ota_poll())
 }OTA_EX_;
 
 /*
@@ -101,8 +151,27 @@ typedef enum
   OTA_CMD_FWDATA = 3,
   OTA_CMD_END   = 4,    // OTA End command
   OTA_CMD_ABORT = 5,    // OTA Abort command
+  OTA_CMD_ENTER = 6,    // Response to OTA_ENTER_REQ
+  OTA_CMD_PING  = 7,    // Link probe, answered in any state
+  OTA_CMD_SESSION = 8,  // START + HEADER in one round trip
+  OTA_CMD_STATS = 9,    // Error counters of the session, answered in any state
+  OTA_CMD_PARITY = 10,  // XOR of a block of DATA frames, rebuilds one lost frame
+  OTA_CMD_SKIP  = 11,   // Image range left erased (0xFF), nothing to write
+  OTA_CMD_PAGE_HASHES = 12, // CRC-32 of the active application pages, answered in any state
+  OTA_CMD_COPY  = 13,   // Image range found in the active application, copied from there
 }OTA_CMD_;
 
+/*
+ * What triggered the OTA mode
+ */
+typedef enum
+{
+  OTA_ENTRY_NONE    = 0,
+  OTA_ENTRY_BUTTON  = 1,    // BOOT_SWITCH pressed (EXTI)
+  OTA_ENTRY_UART    = 2,    // OTA_ENTER_REQ received
+  OTA_ENTRY_REBOOT  = 3,    // reboot_cause == OTA_REQUEST
+}OTA_ENTRY_;
+
 /*
  * Slot table
  */
@@ -115,18 +184,32 @@ typedef struct
     uint32_t fw_crc;                  //Slot's firmware/application CRC
     uint16_t fw_version;
     uint8_t new_app_fw_available;
-    uint8_t reserved1;
-    uint32_t reserved2;
+    uint8_t fw_type;                  //Slot's firmware type (FW_TYPE_APP, FW_TYPE_BOOTLDR)
+    uint32_t stage_seq;               //Staging order, the newest image has the highest (0xFFFFFFFF : none)
     uint32_t reserved3;
 }__attribute__((packed)) OTA_SLOT_;
 
+/*
+ * Application in the active region, written by the bootloader when it
+ * installs a slot. Erased (0xFF) until the first install.
+ */
+typedef struct
+{
+    uint32_t fw_size;
+    uint32_t fw_crc;
+    uint16_t fw_version;
+    uint8_t  fw_type;
+    uint8_t  reserved;
+}__attribute__((packed)) OTA_ACTIVE_FW_;
+
 /*
  * General configuration
  */
 typedef struct
 {
-    uint32_t  reboot_cause;
-    OTA_SLOT_ slot_table[OTA_NO_OF_SLOTS];
+    uint32_t       reboot_cause;
+    OTA_SLOT_      slot_table[OTA_NO_OF_SLOTS];
+    OTA_ACTIVE_FW_ active_fw;
 }__attribute__((packed)) OTA_GNRL_CFG_;
 
 /*
@@ -141,6 +224,22 @@ typedef struct
 
 }__attribute__((packed)) meta_info;
 
+/*
+ * COBS transport
+ *
+ * _______________________________________________
+ * |      |                                |      |
+ * | 0x00 | COBS( SOF ... EOF )            | 0x00 |
+ * |______|________________________________|______|
+ *   1B     frame + 1B per 254B (+1B)        1B
+ *
+ * Any frame below can also be sent COBS encoded, ended by OTA_COBS_DELIM.
+ * 0x00 never appears inside an encoded frame, so a broken frame only costs
+ * the bytes up to the next delimiter. The first frame starts with a
+ * delimiter too : it switches the session to COBS, and the device then
+ * answers COBS encoded as well.
+ */
+
 /*
  * OTA Command format
  *
@@ -182,20 +281,119 @@ typedef struct
 /*
  * OTA Data format
  *
- * __________________________________________
- * |     | Packet |     |        |     |     |
- * | SOF | Type   | Len |  Data  | CRC | EOF |
- * |_____|________|_____|________|_____|_____|
- *   1B      1B     2B    nBytes   4B    1B
+ * __________________________________________________________
+ * |     | Packet |     |     |        |        |     |     |
+ * | SOF | Type   | Len | Seq | Offset |  Data  | CRC | EOF |
+ * |_____|________|_____|_____|________|________|_____|_____|
+ *   1B      1B     2B    2B     4B     nBytes   2B    1B
+ *
+ * Offset is the image offset of the data (multiple of 8). Len counts Seq
+ * and Offset. A frame received twice is written once.
  */
 typedef struct
 {
   uint8_t     sof;
   uint8_t     cmd;
   uint16_t    data_len;
-  uint8_t     *data;
+  uint16_t    seq;
+  uint32_t    offset;
 }__attribute__((packed)) OTA_DATA_;
 
+/*
+ * OTA Parity format
+ *
+ * ___________________________________________________________________
+ * |     | Packet |     |     |        |        |        |     |     |
+ * | SOF | Type   | Len | Seq | Offset | Frames | Parity | CRC | EOF |
+ * |_____|________|_____|_____|________|________|________|_____|_____|
+ *   1B      1B     2B    2B     4B       1B     nBytes   2B    1B
+ *
+ * Parity is the XOR of the 'Frames' DATA frames of n bytes starting at the
+ * image offset Offset, the last one zero padded. When one of them is
+ * missing, the device rebuilds it from the parity and the others (read back
+ * from the slot). The response is a DATA response with the PARITY Seq : ACK
+ * once the whole block is written.
+ */
+typedef struct
+{
+  uint8_t     sof;
+  uint8_t     cmd;
+  uint16_t    data_len;
+  uint16_t    seq;
+  uint32_t    offset;
+  uint8_t     frames;
+}__attribute__((packed)) OTA_PARITY_;
+
+/*
+ * OTA Skip format
+ *
+ * __________________________________________________________
+ * |     | Packet |     |     |        |        |     |     |
+ * | SOF | Type   | Len | Seq | Offset | Length | CRC | EOF |
+ * |_____|________|_____|_____|________|________|_____|_____|
+ *   1B      1B     2B    2B     4B       4B      2B    1B
+ *
+ * The image holds 0xFF from Offset for Length bytes (doubleword aligned,
+ * or up to the end of the image) : the slot is erased there already, the
+ * range is only marked as written. The response is a DATA response.
+ */
+typedef struct
+{
+  uint8_t     sof;
+  uint8_t     cmd;
+  uint16_t    data_len;
+  uint16_t    seq;
+  uint32_t    offset;
+  uint32_t    length;
+}__attribute__((packed)) OTA_SKIP_;
+
+/*
+ * OTA Copy format
+ *
+ * ___________________________________________________________________
+ * |     | Packet |     |     |        |        |        |     |     |
+ * | SOF | Type   | Len | Seq | Offset | Length | Source | CRC | EOF |
+ * |_____|________|_____|_____|________|________|________|_____|_____|
+ *   1B      1B     2B    2B     4B       4B       4B      2B    1B
+ *
+ * The image holds from Offset, for Length bytes (up to OTA_COPY_MAX_SIZE),
+ * what the active application region holds from Source (offset in the
+ * region) : the device copies it to the slot. Offset and Source are
+ * doubleword aligned. Application images only. The host finds those ranges
+ * with PAGE_HASHES. The response is a DATA response.
+ */
+typedef struct
+{
+  uint8_t     sof;
+  uint8_t     cmd;
+  uint16_t    data_len;
+  uint16_t    seq;
+  uint32_t    offset;
+  uint32_t    length;
+  uint32_t    source;
+}__attribute__((packed)) OTA_COPY_;
+
+/*
+ * OTA Page hashes format
+ *
+ * _________________________________________________
+ * |     | Packet |     |       |       |     |     |
+ * | SOF | Type   | Len | First | Count | CRC | EOF |
+ * |_____|________|_____|_______|_______|_____|_____|
+ *   1B      1B     2B     2B      2B     2B    1B
+ *
+ * Asks for the CRC-32 (as zlib crc32()) of Count FLASH_PAGE_SIZE pages of
+ * the active application region, from page First.
+ */
+typedef struct
+{
+  uint8_t     sof;
+  uint8_t     cmd;
+  uint16_t    data_len;
+  uint16_t    first;
+  uint16_t    count;
+}__attribute__((packed)) OTA_PAGE_HASHES_;
+
 /*
  * OTA Response format
  *
@@ -215,6 +413,129 @@ typedef struct
   uint8_t   eof;
 }__attribute__((packed)) OTA_RESP_;
 
+/*
+ * OTA Data response format
+ *
+ * _________________________________________________
+ * |     | Packet |     |        |     |     |     |
+ * | SOF | Type   | Len | Status | Seq | CRC | EOF |
+ * |_____|________|_____|________|_____|_____|_____|
+ *   1B      1B     2B      1B     2B    2B    1B
+ *
+ * Seq is the one of the DATA frame. The CRC covers Status and Seq.
+ */
+typedef struct
+{
+  uint8_t   sof;
+  uint8_t   cmd;
+  uint16_t  data_len;
+  uint8_t   status;
+  uint16_t  seq;
+  uint16_t  crc;
+  uint8_t   eof;
+}__attribute__((packed)) OTA_DATA_RESP_;
+
+/*
+ * OTA Ping response
+ *
+ * ____________________________________________________
+ * |     | Packet |     |        |      |     |     |
+ * | SOF | Type   | Len |  Caps  | Echo | CRC | EOF |
+ * |_____|________|_____|________|______|_____|_____|
+ *   1B      1B     2B     20B     nB     2B    1B
+ *
+ * Echo is the PING payload. The CRC covers Caps and Echo.
+ */
+typedef struct
+{
+  uint8_t   status;
+  uint8_t   proto_version;    //OTA_PROTOCOL_VERSION
+  uint16_t  max_data_size;    //Largest DATA payload (OTA_DATA_MAX_SIZE)
+  uint8_t   rx_window;        //OTA_RX_WINDOW
+  uint16_t  max_busy_ms;      //Longest flash operation behind a single response
+  uint32_t  uid[3];           //Device unique ID
+  uint8_t   fec_max_frames;   //OTA_FEC_MAX_FRAMES
+}__attribute__((packed)) OTA_CAPS_;
+
+/*
+ * OTA Session format (START and HEADER in one frame)
+ *
+ * ___________________________________________________
+ * |     | Packet |     | Header |       |     |     |
+ * | SOF | Type   | Len |  Data  | Flags | CRC | EOF |
+ * |_____|________|_____|________|_______|_____|_____|
+ *   1B      1B     2B      9B      1B     2B    1B
+ */
+typedef struct
+{
+  uint8_t     sof;
+  uint8_t     cmd;
+  uint16_t    data_len;
+  meta_info   meta_data;
+  uint8_t     flags;        //OTA_SESSION_FLAG_xxx
+}__attribute__((packed)) OTA_SESSION_;
+
+/*
+ * OTA Session response payload : the capabilities (as in the PING
+ * response), what the slot holds, where the upload starts, then (protocol
+ * 6) the running application and what the session does next.
+ * With OTA_SESSION_FLAG_NOOP, an image already running or staged ends the
+ * session with this answer (action UP_TO_DATE or INSTALL).
+ * A NACK is a plain OTA_RESP_.
+ */
+typedef struct
+{
+  OTA_CAPS_ caps;
+  uint32_t  slot_fw_size;
+  uint32_t  slot_fw_crc;
+  uint16_t  slot_fw_version;
+  uint8_t   slot_flags;       //OTA_SLOT_FLAG_xxx
+  uint32_t  resume_offset;    //Image offset of the first DATA to send
+  uint32_t  active_fw_size;   //OTA_ACTIVE_FW_ (0xFF... : unknown)
+  uint32_t  active_fw_crc;
+  uint16_t  active_fw_version;
+  uint8_t   action;           //OTA_SESSION_UPLOAD, _UP_TO_DATE or _INSTALL
+}__attribute__((packed)) OTA_SESSION_RESP_;
+
+/*
+ * OTA Page hashes response payload : the pages answered (at most
+ * OTA_HASHES_MAX_PAGES, none past the active application or its region),
+ * then one CRC-32 per page. Count 0 : no page from First.
+ */
+typedef struct
+{
+  uint8_t   status;
+  uint16_t  first;
+  uint16_t  count;
+  uint32_t  hash[];
+}__attribute__((packed)) OTA_PAGE_HASHES_RESP_;
+
+/*
+ * OTA Stats response payload. The error counters count the frames rejected,
+ * per reason.
+ */
+typedef struct
+{
+  uint8_t   status;
+  uint32_t  frames;             //Frames received without error
+  uint32_t  duplicates;         //DATA frames already written
+  uint16_t  fec_recovered;      //DATA frames rebuilt from a PARITY
+  uint16_t  crc_errors;
+  uint16_t  framing_errors;
+  uint16_t  sequence_errors;
+  uint16_t  flash_errors;
+  uint16_t  other_errors;
+  uint8_t   max_retries;        //Longest run of consecutive bad frames
+  uint16_t  rx_overruns;        //UART overrun errors (bytes lost)
+}__attribute__((packed)) OTA_STATS_;
+
 OTA_EX_ ota_download_and_flash( void );
+OTA_EX_ ota_poll( void );
+void ota_sleep( void );
+void ota_entry_init( void );
+void ota_entry_request( OTA_ENTRY_ source );
+void ota_entry_uart_rx_cplt( void );
+void ota_entry_uart_error( void );
+OTA_ENTRY_ ota_entry_get( void );
 void load_new_app( void );
 #endif /* BOOT_H */
@@ -0,0 +1,23 @@
+#ifndef CONSOLE_H
+#define CONSOLE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "main.h"
+
+/*
+ * Non-blocking console output (printf) on LPUART1.
+ *
+ * Characters go to a ring buffer which is drained by LPUART1 TX DMA.
+ * The writer never waits : when the buffer is full the characters are
+ * dropped and counted.
+ */
+#define CONSOLE_BUF_SIZE    ( 1024u )   //Ring buffer size. Must be a power of 2.
+
+void console_putc( uint8_t ch );
+void console_write( const uint8_t *data, uint32_t len );
+bool console_write_record( const uint8_t *data, uint32_t len );
+void console_flush( uint32_t timeout );
+void console_tx_cplt( void );
+uint32_t console_dropped( void );
+#endif /* CONSOLE_H */
@@ -56,7 +56,10 @@ void DebugMon_Handler(void);
 void PendSV_Handler(void);
 void SysTick_Handler(void);
 /* USER CODE BEGIN EFP */
-
+void EXTI9_5_IRQHandler(void);
+void USART3_IRQHandler(void);
+void LPUART1_IRQHandler(void);
+void DMA2_Channel6_IRQHandler(void);
 /* USER CODE END EFP */
 
 #ifdef __cplusplus
@@ -0,0 +1,127 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "main.h"
+
+/*
+ * Tokenized binary tracing.
+ *
+ * A call site only emits a 16-bit event ID, a cycle counter timestamp and up
+ * to 3 raw 32-bit arguments. The format strings below are never compiled into
+ * the firmware : host_app/trace_decode.py reads them from this file and
+ * formats the records on the host.
+ *
+ * Record (little endian), sent through the console ring buffer in between
+ * the printf text :
+ *
+ * ______________________________________________
+ * |     |       |       |           |          |
+ * | SOR | Event | Nargs | Timestamp | Args     |
+ * |_____|_______|_______|___________|__________|
+ *   1B     2B      1B       4B        4B*Nargs
+ */
+#define TRACE_SOR  0x1E    // Start of Record (ASCII RS, never in printf text)
+
+/*
+ * Trace levels. Call sites above TRACE_LEVEL are removed by the preprocessor.
+ */
+#define TRACE_LVL_NONE    0
+#define TRACE_LVL_ERROR   1
+#define TRACE_LVL_WARN    2
+#define TRACE_LVL_INFO    3
+#define TRACE_LVL_DEBUG   4
+
+#ifndef TRACE_LEVEL
+#ifdef DEBUG
+#define TRACE_LEVEL       TRACE_LVL_DEBUG
+#else
+#define TRACE_LEVEL       TRACE_LVL_WARN
+#endif
+#endif
+
+/*
+ * Trace events : X( ID, "host side format" ).
+ * Append only, the ID is the position in this list.
+ */
+#define TRACE_EVENTS(X)                                                         \
+  X( TRC_OTA_WAIT,          "Waiting for the OTA data..."                    )  \
+  X( TRC_OTA_ACK,           "Sending ACK (cmd %u)"                           )  \
+  X( TRC_OTA_NACK,          "Sending NACK (cmd %u, reason %u)"               )  \
+  X( TRC_OTA_STATE_IDLE,    "OTA_STATE_IDLE..."                              )  \
+  X( TRC_OTA_START,         "Received OTA START Command"                     )  \
+  X( TRC_OTA_HEADER,        "Received OTA Header. FW Size = %u Type = %u Version = 0x%04X" ) \
+  X( TRC_OTA_DATA,          "[%u/%u]"                                        )  \
+  X( TRC_OTA_END,           "Received OTA END Command"                       )  \
+  X( TRC_OTA_FW_CRC_ERR,    "ERROR: FW CRC Mismatch [Cal CRC = 0x%04X] [Rec CRC = 0x%04X]" ) \
+  X( TRC_OTA_DONE,          "Done!!!"                                        )  \
+  X( TRC_CHUNK_CRC_ERR,     "Chunk's CRC mismatch [Cal CRC = 0x%04X] [Rec CRC = 0x%04X]" ) \
+  X( TRC_CHUNK_TOO_BIG,     "Received more data than expected. Expected = %u, Received = %u" ) \
+  X( TRC_SLOT_ERASE,        "Erasing the Slot %u Flash memory..."            )  \
+  X( TRC_SLOT_ERASE_ERR,    "Flash Erase Error"                              )  \
+  X( TRC_SLOT_WRITE_ERR,    "Flash Write Error at offset %u"                 )  \
+  X( TRC_SLOT_AVAILABLE,    "Slot %u is available for OTA update"            )  \
+  X( TRC_CFG_WRITE_ERR,     "Slot table Flash Write Error"                   )  \
+  X( TRC_OTA_NO_UPDATE,     "Image already installed or staged, action %u"   )  \
+  X( TRC_OTA_PAGE_HASHES,   "PAGE_HASHES from page %u, %u pages"             )  \
+  X( TRC_OTA_COPY,          "COPY %u bytes from active offset %u to %u"      )  \
+  X( TRC_SLOT_STAGE,        "Slot %u holds the image, staged for the install" ) \
+  X( TRC_OTA_PAGE_MARK_ERR, "Page %u written, its mark is not"               )  \
+  X( TRC_OTA_PING,          "Ping, %u bytes"                                 )  \
+  X( TRC_OTA_DATA_DUP,      "Duplicated DATA, seq %u offset %u"              )  \
+  X( TRC_OTA_DATA_RANGE,    "DATA out of the image, offset %u len %u"        )  \
+  X( TRC_OTA_DATA_CONFLICT, "DATA differs from the written one at offset %u" )  \
+  X( TRC_OTA_TOO_BIG,       "Firmware too big, %u bytes"                     )  \
+  X( TRC_OTA_SESSION,       "Received OTA SESSION Command, flags 0x%02X"     )  \
+  X( TRC_OTA_RESUME,        "Resuming the upload at offset %u"               )  \
+  X( TRC_OTA_ABORT,         "Received OTA ABORT Command"                     )  \
+  X( TRC_OTA_FEC_RECOVER,   "PARITY seq %u rebuilt the frame at offset %u"   )  \
+  X( TRC_OTA_FEC_MISSING,   "PARITY seq %u : %u frames missing"              )  \
+  X( TRC_OTA_SKIP,          "SKIP %u bytes at offset %u"                     )
+
+#define TRACE_ENUM_( id, fmt )  id,
+typedef enum
+{
+  TRACE_EVENTS( TRACE_ENUM_ )
+  TRC_EVENT_COUNT
+}TRACE_EVENT_;
+#undef TRACE_ENUM_
+
+void trace_init( void );
+void trace_emit( uint16_t id, uint8_t nargs, uint32_t a0, uint32_t a1, uint32_t a2 );
+
+/* Argument counting (0 to 3 arguments) */
+#define TRACE_NARGS_( _0, _1, _2, _3, N, ... )  N
+#define TRACE_NARGS( ... )  TRACE_NARGS_( 0, ##__VA_ARGS__, 3, 2, 1, 0 )
+#define TRACE_EMIT_( id, n, a0, a1, a2, ... ) \
+  trace_emit( (uint16_t)(id), (n), (uint32_t)(a0), (uint32_t)(a1), (uint32_t)(a2) )
+#define TRACE_EMIT( id, ... ) \
+  TRACE_EMIT_( id, TRACE_NARGS( __VA_ARGS__ ), ##__VA_ARGS__, 0, 0, 0, 0 )
+
+#define TRACE_NOP()  do{ }while( 0 )
+
+#if ( TRACE_LEVEL >= TRACE_LVL_ERROR )
+#define TRACE_ERR( ... )  TRACE_EMIT( __VA_ARGS__ )
+#else
+#define TRACE_ERR( ... )  TRACE_NOP()
+#endif
+
+#if ( TRACE_LEVEL >= TRACE_LVL_WARN )
+#define TRACE_WRN( ... )  TRACE_EMIT( __VA_ARGS__ )
+#else
+#define TRACE_WRN( ... )  TRACE_NOP()
+#endif
+
+#if ( TRACE_LEVEL >= TRACE_LVL_INFO )
+#define TRACE_INF( ... )  TRACE_EMIT( __VA_ARGS__ )
+#else
+#define TRACE_INF( ... )  TRACE_NOP()
+#endif
+
+#if ( TRACE_LEVEL >= TRACE_LVL_DEBUG )
+#define TRACE_DBG( ... )  TRACE_EMIT( __VA_ARGS__ )
+#else
+#define TRACE_DBG( ... )  TRACE_NOP()
+#endif
+
+#endif /* TRACE_H */
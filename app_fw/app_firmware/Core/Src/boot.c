@@ -5,13 +5,16 @@
 #include <stdbool.h>
 
 #include "flash.h"
+#include "trace.h"
 
 extern UART_HandleTypeDef huart3;
 #define BL_UART huart3
 extern CRC_HandleTypeDef hcrc;
 
 /* Buffer to hold the received data */
-static uint8_t Rx_Buffer[ OTA_PACKET_MAX_SIZE ];
+static uint8_t Rx_Buffer[ OTA_COBS_SIZE( OTA_PACKET_MAX_SIZE ) ];
+/* Responses with a payload (PING, SESSION) */
+static uint8_t Tx_Buffer[ OTA_PACKET_MAX_SIZE + sizeof(OTA_CAPS_) ];
 /* OTA State */
 static OTA_STATE_ ota_state = OTA_STATE_IDLE;
 
@@ -25,17 +28,105 @@ static uint32_t ota_fw_crc;
 static uint32_t ota_fw_received_size;
 /* Slot number to write the received firmware */
 static uint8_t slot_num_to_write;
+/* Doublewords of the slot already written, one bit each */
+static uint32_t ota_dw_map[ OTA_NEW_FW_MAX_SIZE / 8u / 32u ];
+/* Slot erased for this image (first DATA, or resumed upload) */
+static bool ota_slot_ready;
+/* Image offset the upload (re)starts from, reported by the SESSION response */
+static uint32_t ota_resume_offset;
+/* What the session does after SESSION : OTA_SESSION_UPLOAD, _UP_TO_DATE or _INSTALL */
+static uint8_t ota_session_action;
+/* Error counters of the session (STATS command) */
+static OTA_STATS_ ota_stats;
+/* Bytes read after the SOF of a broken frame, parsed again before the UART :
+ * they can hold the next frames */
+static uint8_t  ota_rx_replay[ OTA_PACKET_MAX_SIZE ];
+static uint16_t ota_rx_replay_len;
+static uint16_t ota_rx_replay_pos;
+/* The host sends COBS encoded frames, answer the same way */
+static bool ota_cobs;
+/* Bytes received by the UART interrupt during a session, free running
+ * indexes */
+static uint8_t           ota_rx_ring[ OTA_RX_RING_SIZE ];
+static volatile uint16_t ota_rx_head;
+static volatile uint16_t ota_rx_tail;
+/* Last ota_rx_head seen and when : a frame not complete PACKET_CAPTURE_TIMEOUT
+ * after its last byte is parsed as it is (broken frame) */
+static uint16_t ota_rx_seen;
+static uint32_t ota_rx_since;
+static bool     ota_rx_stale;
+/* The received bytes hold no complete frame : ota_sleep() can wait for the
+ * next one */
+static bool     ota_rx_waiting;
+/* Session running : ota_poll() takes the frames, the UART interrupt fills
+ * ota_rx_ring */
+static volatile bool ota_service;
+/* Slot pages still to erase, one per ota_poll() : first page of the
+ * region, one bit per page from there (49 pages at most) */
+static uint32_t ota_erase_page;
+static uint64_t ota_erase_map;
+/* Image pages whose mark is written (OTA_PAGE_MARK_FLASH_ADDR), one bit each */
+static uint64_t ota_page_marked;
+/* PAGE_HASHES response being built (Tx_Buffer) : active pages still to
+ * hash, one per ota_poll() */
+static uint16_t ota_hash_left;
+/* Frame waiting for the slot erase (Rx_Buffer), 0 : none */
+static uint16_t ota_parked_len;
+/* Consecutive errors, still looking for the next frame after a broken one */
+static uint8_t ota_errors;
+static bool    ota_resync;
 /* Configuration */
 OTA_GNRL_CFG_ *cfg_flash   = (OTA_GNRL_CFG_*) (OTA_CONFIG_FLASH_START_ADDR);
+/* Pending request to enter the OTA mode (set from interrupts) */
+static volatile OTA_ENTRY_ ota_entry = OTA_ENTRY_NONE;
+/* Byte received by the OTA_ENTER_REQ listener */
+static uint8_t ota_entry_rx_byte;
 
 /* Hardware CRC handle */
-static uint16_t ota_receive_chunk( uint8_t *buf, uint16_t max_len );
+static OTA_EX_ ota_receive_chunk( uint8_t *buf, uint16_t max_len, uint16_t *len );
+static OTA_EX_ ota_receive_cobs( uint8_t *buf, uint16_t max_len, uint16_t *len );
+static HAL_StatusTypeDef ota_rx( uint8_t *buf, uint16_t len, uint32_t timeout );
+static void ota_rx_replay_from( const uint8_t *buf, uint16_t len );
+static void ota_rx_unread( const uint8_t *buf, uint16_t len );
+static void ota_rx_drop_noise( void );
+static void ota_start( void );
+static OTA_EX_ ota_handle_frame( OTA_EX_ ret, uint16_t len );
+static bool ota_take_frame( OTA_EX_ *ret, uint16_t *len );
+static OTA_EX_ ota_erase_step( void );
+static void ota_count_error( OTA_EX_ ex );
 static OTA_EX_ ota_process_data( uint8_t *buf, uint16_t len );
+static OTA_EX_ ota_set_image( const meta_info *meta );
+static OTA_EX_ ota_open_session( uint8_t *buf );
+static bool ota_resume_upload( void );
+static uint8_t ota_installed_action( void );
+static bool ota_slot_holds_image( const OTA_SLOT_ *slot );
+static OTA_EX_ ota_stage_slot( uint8_t slot_num );
+static OTA_EX_ ota_drop_upload( void );
+static uint32_t ota_image_addr( void );
+static OTA_EX_ ota_write_fw_data( uint8_t *buf );
+static OTA_EX_ ota_write_parity( uint8_t *buf );
+static OTA_EX_ ota_write_skip( uint8_t *buf );
+static OTA_EX_ ota_write_copy( uint8_t *buf );
+static uint32_t ota_active_pages( void );
+static uint32_t ota_crc32( const uint8_t *data, uint32_t length );
+static OTA_EX_ ota_open_slot( void );
+static bool ota_is_written( uint32_t offset, uint32_t len );
+static uint64_t ota_page_mark( uint32_t page );
+static void ota_mark_pages( uint32_t offset, uint32_t len );
+static void ota_get_caps( OTA_CAPS_ *caps );
 static void ota_send_resp( uint8_t cmd , uint8_t type );
+static void ota_send_data_resp( uint8_t cmd, uint16_t seq, uint8_t type );
+static void ota_send_ping_resp( const uint8_t *echo, uint16_t echo_len );
+static void ota_send_session_resp( void );
+static void ota_send_stats_resp( void );
+static void ota_send_page_hashes_resp( const uint8_t *buf, uint16_t len );
+static void ota_hash_step( void );
+static void ota_send_tx_frame( uint8_t cmd, uint16_t len );
+static void ota_tx( const uint8_t *buf, uint16_t len );
 static HAL_StatusTypeDef write_data_to_slot( uint8_t slot_num,
                                              uint8_t *data,
-                                             uint16_t data_len,
-                                             bool is_first_block );
+                                             uint32_t offset,
+                                             uint16_t data_len );
 //static HAL_StatusTypeDef write_data_to_flash_app( uint8_t *data, uint32_t data_len );
 static uint8_t get_available_slot_number( void );
 static HAL_StatusTypeDef write_cfg_to_flash( OTA_GNRL_CFG_ *cfg );
@@ -95,10 +186,8 @@ uint32_t CalcCRC(uint8_t * pData, uint32_t DataLength)
 // Calculate CRC-16
 uint16_t CalcCRC(const uint8_t *data, uint32_t length) {
     uint16_t crc = 0xFFFF;
-    uint8_t dt=0;
     for (uint32_t i = 0; i < length; i++) {
         crc = (crc << 8) ^ crc16_table[((crc >> 8) ^ data[i]) & 0xFF];
-        dt = data[i];
     }
 
     return crc;
@@ -106,17 +195,147 @@ uint16_t CalcCRC(const uint8_t *data, uint32_t length) {
 
 
 /**
-  * @brief Download the application from UART and flash it.
+  * @brief Download the application from UART and flash it. Blocking : runs
+  *        ota_poll() until the session ends.
   * @param None
   * @retval OTA_EX_
   */
 OTA_EX_ ota_download_and_flash( void )
 {
-  OTA_EX_ ret  = OTA_EX_OK;
-  uint16_t    len;
+  OTA_EX_ ret;
 
-  printf("Waiting for the OTA data...\r\n");
-  uint8_t rx_cmd;
+  ota_start();
+  do
+  {
+    ret = ota_poll();
+  }while( ret == OTA_EX_BUSY );
+
+  return ret;
+}
+
+/**
+  * @brief Run the OTA service : start a session when the OTA mode is
+  *        requested, then take one frame (or erase one slot page) per call.
+  *        The UART interrupt keeps receiving in between, so the application
+  *        runs while the image is written to the slot.
+  * @param None
+  * @retval OTA_EX_IDLE when no session runs, OTA_EX_BUSY while one runs, the
+  *         session result (once) when it ends
+  */
+OTA_EX_ ota_poll( void )
+{
+  OTA_EX_  ret = OTA_EX_BUSY;
+  uint16_t len;
+
+  if( !ota_service )
+  {
+    if( ota_entry == OTA_ENTRY_NONE )
+    {
+      return OTA_EX_IDLE;
+    }
+    ota_start();
+  }
+
+  if( ota_erase_map != 0u )
+  {
+    //Slot erase, the frame that needs it waits. A resumed upload erases
+    //with no frame waiting : the next one opens the slot again.
+    if( ( ota_erase_step() != OTA_EX_OK ) && ( ota_parked_len != 0u ) )
+    {
+      ret = ota_handle_frame( OTA_EX_FLASH, ota_parked_len );
+      ota_parked_len = 0u;
+    }
+  }
+  else if( ota_hash_left != 0u )
+  {
+    //PAGE_HASHES, answered once all its pages are hashed
+    ota_hash_step();
+  }
+  else if( ota_parked_len != 0u )
+  {
+    len = ota_parked_len;
+    ota_parked_len = 0u;
+    ret = ota_handle_frame( OTA_EX_OK, len );
+  }
+  else if( ota_take_frame( &ret, &len ) )
+  {
+    ret = ota_handle_frame( ret, len );
+  }
+  else
+  {
+    ret = OTA_EX_BUSY;
+  }
+
+  if( ret != OTA_EX_BUSY )
+  {
+    //Session over : the UART interrupt listens for OTA_ENTER_REQ again
+    ota_service = false;
+    if( ( ret == OTA_EX_OK ) && ( ota_session_action == OTA_SESSION_UP_TO_DATE ) )
+    {
+      //Nothing written, no reset : back to the application
+      ret = OTA_EX_NO_UPDATE;
+    }
+  }
+
+  return ret;
+}
+
+/**
+  * @brief Sleep (WFI) until the next interrupt when the OTA service has
+  *        nothing to do : no entry request, no slot page to erase, no
+  *        frame complete. A received byte (UART interrupt) or the SysTick
+  *        wakes the core, the application loop then calls ota_poll().
+  * @param None
+  * @retval None
+  */
+void ota_sleep( void )
+{
+  bool pending;
+
+  //An interrupt from now on stays pending and ends the WFI at once
+  __disable_irq();
+  if( ota_service )
+  {
+    pending = ( ota_erase_map != 0u ) || ( ota_hash_left != 0u ) || ( ota_parked_len != 0u ) ||
+              !ota_rx_waiting || ( ota_rx_head != ota_rx_seen );
+  }
+  else
+  {
+    pending = ( ota_entry != OTA_ENTRY_NONE );
+  }
+  if( !pending )
+  {
+    HAL_PWR_EnterSLEEPMode( PWR_MAINREGULATOR_ON, PWR_SLEEPENTRY_WFI );
+  }
+  __enable_irq();
+}
+
+/**
+  * @brief Start an OTA session : the UART interrupt fills ota_rx_ring from
+  *        now on, ota_poll() takes the frames.
+  * @param None
+  * @retval None
+  */
+static void ota_start( void )
+{
+  HAL_UART_AbortReceive_IT( &BL_UART );
+  ota_rx_head  = 0u;
+  ota_rx_tail  = 0u;
+  ota_rx_seen  = 0u;
+  ota_rx_since = HAL_GetTick();
+  ota_rx_waiting = false;
+  ota_service  = true;
+  HAL_UART_Receive_IT( &BL_UART, &ota_entry_rx_byte, 1 );
+
+  ota_cobs = false;
+  if( ota_entry == OTA_ENTRY_UART )
+  {
+    //Let the host know we are ready for the START command
+    ota_send_resp( OTA_CMD_ENTER, OTA_ACK );
+  }
+  ota_entry = OTA_ENTRY_NONE;
+
+  TRACE_INF( TRC_OTA_WAIT );
   /* Reset the variables */
   ota_fw_total_size    = 0u;
   ota_fw_received_size = 0u;
@@ -125,41 +344,364 @@ OTA_EX_ ota_download_and_flash( void )
   slot_num_to_write    = 0xFFu;
   fw_type			= 0x00;
   fw_version		= 0x0;
+  memset( ota_dw_map, 0, sizeof(ota_dw_map) );
+  ota_slot_ready       = false;
+  ota_erase_map        = 0u;
+  ota_page_marked      = 0u;
+  ota_hash_left        = 0u;
+  ota_parked_len       = 0u;
+  ota_resume_offset    = 0u;
+  ota_session_action   = OTA_SESSION_UPLOAD;
+  memset( &ota_stats, 0, sizeof(ota_stats) );
+  ota_rx_replay_len    = 0u;
+  ota_rx_replay_pos    = 0u;
+  ota_errors           = 0u;
+  ota_resync           = false;
+}
 
-  do
+/**
+  * @brief Process a received frame (or its receive error) and answer it.
+  * @param ret receive result
+  * @param len frame length in Rx_Buffer
+  * @retval OTA_EX_BUSY while the session goes on, its result once it ends
+  */
+static OTA_EX_ ota_handle_frame( OTA_EX_ ret, uint16_t len )
+{
+  uint8_t rx_cmd = Rx_Buffer[1];
+
+  if( ( ret == OTA_EX_OK ) && ( rx_cmd == OTA_CMD_PING ) )
+  {
+    //Link probe : answered in any state, the session goes on
+    ota_send_ping_resp( &Rx_Buffer[4], *(uint16_t *)&Rx_Buffer[2] );
+    return OTA_EX_BUSY;
+  }
+  if( ( ret == OTA_EX_OK ) && ( rx_cmd == OTA_CMD_STATS ) )
+  {
+    ota_send_stats_resp();
+    return OTA_EX_BUSY;
+  }
+  if( ( ret == OTA_EX_OK ) && ( rx_cmd == OTA_CMD_PAGE_HASHES ) )
+  {
+    ota_send_page_hashes_resp( Rx_Buffer, len );
+    return OTA_EX_BUSY;
+  }
+  if( ret == OTA_EX_OK )
+  {
+    ret = ota_process_data( Rx_Buffer, len );
+    if( ret == OTA_EX_BUSY )
+    {
+      //The slot erase has started : the frame is processed again once it
+      //is done, answered then
+      ota_parked_len = len;
+      return OTA_EX_BUSY;
+    }
+    HAL_GPIO_TogglePin(LED_GPIO_Port, LED_Pin);
+  }
+  else if( ( ret == OTA_EX_FRAMING ) && ota_resync )
   {
-    //clear the buffer
-    memset( Rx_Buffer, 0, OTA_PACKET_MAX_SIZE );
+    //Still looking for the next frame after a broken one : the host
+    //already has its NACK
+    ota_count_error( ret );
+    return OTA_EX_BUSY;
+  }
 
-    len = ota_receive_chunk( Rx_Buffer, OTA_PACKET_MAX_SIZE );
-    rx_cmd = Rx_Buffer[1];
-    if( len != 0u )
+  //Send ACK or NACK. DATA, PARITY, SKIP and COPY responses carry the frame
+  //sequence number, NACKs the reason (OTA_EX_). ABORT is acknowledged.
+  if( ( ret != OTA_EX_OK ) && ( ret != OTA_EX_ABORTED ) )
+  {
+    TRACE_WRN( TRC_OTA_NACK, rx_cmd, ret );
+    ota_count_error( ret );
+    if( ( len != 0u ) && ( ( rx_cmd == OTA_CMD_FWDATA ) || ( rx_cmd == OTA_CMD_PARITY ) ||
+                           ( rx_cmd == OTA_CMD_SKIP ) || ( rx_cmd == OTA_CMD_COPY ) ) )
     {
-      ret = ota_process_data( Rx_Buffer, len );
-      HAL_GPIO_TogglePin(LED_GPIO_Port, LED_Pin);
+      ota_send_data_resp( rx_cmd, ((OTA_DATA_ *)Rx_Buffer)->seq, ret );
     }
     else
     {
-      //didn't received data. break.
-      ret = OTA_EX_ERR;
+      ota_send_resp(rx_cmd, ret );
     }
 
-    //Send ACK or NACK
-    if( ret != OTA_EX_OK )
+    //A bad frame or a failed write is retried by the host. Give up on
+    //anything else, or when the errors keep coming.
+    ota_resync = ( ret == OTA_EX_FRAMING ) && !ota_cobs;
+    ota_errors++;
+    if( ota_errors > ota_stats.max_retries )
     {
-      printf("Sending NACK\r\n");
-      ota_send_resp(rx_cmd, OTA_NACK );
-      break;
+      ota_stats.max_retries = ota_errors;
     }
-    else
+    if( ( ( ret != OTA_EX_CRC ) && ( ret != OTA_EX_FRAMING ) && ( ret != OTA_EX_SEQUENCE ) &&
+          ( ret != OTA_EX_FLASH ) && ( ret != OTA_EX_MISSING ) ) ||
+        ( ota_errors > OTA_RX_MAX_RETRIES ) )
+    {
+      return ret;
+    }
+  }
+  else
+  {
+    ota_errors = 0u;
+    ota_resync = false;
+    ota_stats.frames++;
+    TRACE_DBG( TRC_OTA_ACK, rx_cmd );
+    switch( rx_cmd )
     {
-      printf("Sending ACK\r\n");
-      ota_send_resp(rx_cmd, OTA_ACK );
+      case OTA_CMD_FWDATA:
+      case OTA_CMD_PARITY:
+      case OTA_CMD_SKIP:
+      case OTA_CMD_COPY:
+        ota_send_data_resp( rx_cmd, ((OTA_DATA_ *)Rx_Buffer)->seq, OTA_ACK );
+        break;
+      case OTA_CMD_SESSION:
+        ota_send_session_resp();
+        break;
+      default:
+        ota_send_resp(rx_cmd, OTA_ACK );
+        break;
     }
+  }
 
-  }while( ota_state != OTA_STATE_IDLE );
+  return ( ota_state == OTA_STATE_IDLE ) ? ret : OTA_EX_BUSY;
+}
 
-  return ret;
+/**
+  * @brief Take the next frame from the received bytes, if it is complete.
+  *        Waits (returns false) while the frame is still coming, a frame
+  *        not complete PACKET_CAPTURE_TIMEOUT after its last byte is taken
+  *        as it is, the receive error then answers it.
+  * @param ret receive result
+  * @param len frame length in Rx_Buffer
+  * @retval true if a frame (or its receive error) was taken
+  */
+static bool ota_take_frame( OTA_EX_ *ret, uint16_t *len )
+{
+  uint16_t tail       = ota_rx_tail;
+  uint16_t replay_pos = ota_rx_replay_pos;
+  uint16_t head       = ota_rx_head;
+  uint32_t now        = HAL_GetTick();
+
+  if( head != ota_rx_seen )
+  {
+    ota_rx_seen  = head;
+    ota_rx_since = now;
+  }
+  else if( ota_rx_waiting && ( ( now - ota_rx_since ) < PACKET_CAPTURE_TIMEOUT ) )
+  {
+    //Woken by something else (SysTick) : nothing new to parse
+    return false;
+  }
+  if( ( head == tail ) && ( replay_pos == ota_rx_replay_len ) )
+  {
+    ota_rx_waiting = true;
+    return false;
+  }
+
+  //clear the buffer
+  memset( Rx_Buffer, 0, OTA_PACKET_MAX_SIZE );
+
+  ota_rx_stale = ( ( now - ota_rx_since ) >= PACKET_CAPTURE_TIMEOUT );
+  *ret = ota_receive_chunk( Rx_Buffer, OTA_PACKET_MAX_SIZE, len );
+  if( *ret == OTA_EX_BUSY )
+  {
+    //Not there yet : parsed again from the same byte next time
+    ota_rx_tail       = tail;
+    ota_rx_replay_pos = replay_pos;
+    ota_rx_drop_noise();
+    ota_rx_waiting = true;
+    return false;
+  }
+  ota_rx_waiting = false;
+  if( ota_rx_stale )
+  {
+    //What is left of a broken frame waits PACKET_CAPTURE_TIMEOUT again
+    ota_rx_since = now;
+  }
+
+  return true;
+}
+
+/**
+  * @brief Drop the bytes no frame starts with (the repeated OTA_ENTER_REQ
+  *        bytes, the rest of a broken frame) while waiting for a frame.
+  * @param none
+  * @retval none
+  */
+static void ota_rx_drop_noise( void )
+{
+  uint8_t byte;
+
+  if( ota_cobs )
+  {
+    return;
+  }
+  while( ota_rx_replay_pos < ota_rx_replay_len )
+  {
+    byte = ota_rx_replay[ota_rx_replay_pos];
+    if( ( byte == OTA_SOF ) || ( byte == OTA_COBS_DELIM ) )
+    {
+      return;
+    }
+    ota_rx_replay_pos++;
+  }
+  while( ota_rx_tail != ota_rx_head )
+  {
+    byte = ota_rx_ring[ota_rx_tail & ( OTA_RX_RING_SIZE - 1u )];
+    if( ( byte == OTA_SOF ) || ( byte == OTA_COBS_DELIM ) )
+    {
+      return;
+    }
+    ota_rx_tail++;
+  }
+}
+
+/**
+  * @brief Erase the next page of the slot (ota_open_slot(),
+  *        ota_resume_upload()).
+  * @param none
+  * @retval OTA_EX_OK or OTA_EX_FLASH
+  */
+static OTA_EX_ ota_erase_step( void )
+{
+  FLASH_EraseInitTypeDef EraseInitStruct;
+  uint32_t PAGEError = 0;
+  HAL_StatusTypeDef ret;
+  uint32_t page = 0u;
+
+  while( ( ota_erase_map & ( 1uLL << page ) ) == 0u )
+  {
+    page++;
+  }
+
+  EraseInitStruct.TypeErase   = FLASH_TYPEERASE_PAGES;
+  EraseInitStruct.Banks       = GetBank(FLASH_USER_START_ADDR);
+  EraseInitStruct.Page        = ota_erase_page + page;
+  EraseInitStruct.NbPages     = 1u;
+
+  HAL_FLASH_Unlock();
+  ret = HAL_FLASHEx_Erase(&EraseInitStruct, &PAGEError);
+  HAL_FLASH_Lock();
+  if( ret != HAL_OK )
+  {
+    TRACE_ERR( TRC_SLOT_ERASE_ERR );
+    ota_erase_map = 0u;
+    return OTA_EX_FLASH;
+  }
+
+  ota_erase_map &= ~( 1uLL << page );
+  if( ota_erase_map == 0u )
+  {
+    ota_slot_ready = true;
+  }
+
+  return OTA_EX_OK;
+}
+
+/**
+  * @brief Count a NACK in the session stats.
+  * @param ex NACK reason
+  * @retval none
+  */
+static void ota_count_error( OTA_EX_ ex )
+{
+  switch( ex )
+  {
+    case OTA_EX_CRC:      ota_stats.crc_errors++;      break;
+    case OTA_EX_FRAMING:  ota_stats.framing_errors++;  break;
+    case OTA_EX_SEQUENCE: ota_stats.sequence_errors++; break;
+    case OTA_EX_FLASH:    ota_stats.flash_errors++;    break;
+    default:              ota_stats.other_errors++;    break;
+  }
+}
+
+/**
+  * @brief Arm the OTA entry triggers. Honors the OTA_REQUEST reboot cause
+  *        and starts listening for OTA_ENTER_REQ on the OTA UART.
+  *        The BOOT_SWITCH EXTI calls ota_entry_request() directly.
+  * @param none
+  * @retval none
+  */
+void ota_entry_init( void )
+{
+  if( cfg_flash->reboot_cause == OTA_REQUEST )
+  {
+    ota_entry_request( OTA_ENTRY_REBOOT );
+  }
+
+  HAL_UART_Receive_IT( &BL_UART, &ota_entry_rx_byte, 1 );
+}
+
+/**
+  * @brief Request the OTA mode. Can be called from an interrupt.
+  * @param source what triggered the request
+  * @retval none
+  */
+void ota_entry_request( OTA_ENTRY_ source )
+{
+  if( ota_entry == OTA_ENTRY_NONE )
+  {
+    ota_entry = source;
+  }
+}
+
+/**
+  * @brief OTA UART receive complete (interrupt context).
+  * @param none
+  * @retval none
+  */
+void ota_entry_uart_rx_cplt( void )
+{
+  if( ota_service )
+  {
+    //Session byte : for ota_poll(), dropped if it does not keep up
+    if( (uint16_t)( ota_rx_head - ota_rx_tail ) < OTA_RX_RING_SIZE )
+    {
+      ota_rx_ring[ota_rx_head & ( OTA_RX_RING_SIZE - 1u )] = ota_entry_rx_byte;
+      ota_rx_head++;
+    }
+    HAL_UART_Receive_IT( &BL_UART, &ota_entry_rx_byte, 1 );
+  }
+  else if( ota_entry_rx_byte == OTA_ENTER_REQ )
+  {
+    ota_entry_request( OTA_ENTRY_UART );
+  }
+  else
+  {
+    //Not for us. Keep listening.
+    HAL_UART_Receive_IT( &BL_UART, &ota_entry_rx_byte, 1 );
+  }
+}
+
+/**
+  * @brief OTA UART error (interrupt context). An overrun aborts the
+  *        reception (the HAL cleared the flags) : it is counted and the
+  *        reception started again, the broken frame is NACKed and sent
+  *        again. A noise, framing or parity error does not stop it.
+  * @param none
+  * @retval none
+  */
+void ota_entry_uart_error( void )
+{
+  uint32_t error = HAL_UART_GetError( &BL_UART );
+
+  if( ( error & HAL_UART_ERROR_ORE ) != 0u )
+  {
+    if( ota_stats.rx_overruns < UINT16_MAX )
+    {
+      ota_stats.rx_overruns++;
+    }
+  }
+  BL_UART.ErrorCode = HAL_UART_ERROR_NONE;
+
+  //HAL_BUSY if the reception goes on
+  HAL_UART_Receive_IT( &BL_UART, &ota_entry_rx_byte, 1 );
+}
+
+/**
+  * @brief Return the pending OTA entry request.
+  * @param none
+  * @retval OTA_ENTRY_NONE if the OTA mode has not been requested
+  */
+OTA_ENTRY_ ota_entry_get( void )
+{
+  return ota_entry;
 }
 
 /**
@@ -183,11 +725,30 @@ static OTA_EX_ ota_process_data( uint8_t *buf, uint16_t len )
     }
 
     //Check we received OTA Abort command
+    if( buf[1] == OTA_CMD_ABORT )
+    {
+      //Leave the OTA mode, the slot keeps what was written (see SESSION resume)
+      TRACE_INF( TRC_OTA_ABORT );
+      ota_state = OTA_STATE_IDLE;
+      ret = OTA_EX_ABORTED;
+      break;
+    }
+
+    //SESSION (re)opens the session in any state : the host sends it again
+    //when its answer was lost
+    if( buf[1] == OTA_CMD_SESSION )
+    {
+      ret = ota_open_session( buf );
+      break;
+    }
+
+    //Anything else has to be what the current state expects
+    ret = OTA_EX_SEQUENCE;
     switch( ota_state )
     {
       case OTA_STATE_IDLE:
       {
-        printf("OTA_STATE_IDLE...\r\n");
+        TRACE_DBG( TRC_OTA_STATE_IDLE );
         ret = OTA_EX_OK;
       }
       break;
@@ -198,7 +759,7 @@ static OTA_EX_ ota_process_data( uint8_t *buf, uint16_t len )
 
 	    if( cmd->cmd == OTA_CMD_START )
 	    {
-		  printf("Received OTA START Command\r\n");
+		  TRACE_INF( TRC_OTA_START );
 		  ota_state = OTA_STATE_HEADER;
 		  ret = OTA_EX_OK;
 	    }
@@ -211,69 +772,37 @@ static OTA_EX_ ota_process_data( uint8_t *buf, uint16_t len )
         OTA_HEADER_ *header = (OTA_HEADER_*)buf;
         if( header->cmd == OTA_CMD_HEADER )
 		{
-		  ota_fw_total_size = header->meta_data.fw_size;
-		  fw_type = header->meta_data.fw_type;
-		  ota_fw_crc = header->meta_data.fw_crc;
-		  fw_version = header->meta_data.version;
-		  printf("Received OTA Header. FW Size = %ld\r\n", ota_fw_total_size);
-
-		  //get the slot number
-		  //ota_state = OTA_STATE_DATA;
-		  //ret = OTA_EX_OK;
-
-		  slot_num_to_write = get_available_slot_number();
-		  if( slot_num_to_write != 0xFF )
+		  ret = ota_set_image( &header->meta_data );
+		  if( ret == OTA_EX_OK )
 		  {
 			ota_state = OTA_STATE_DATA;
-			ret = OTA_EX_OK;
 		  }
-
 		}
       }
       break;
 
       case OTA_STATE_DATA:
       {
-
-        OTA_DATA_     *data     = (OTA_DATA_*)buf;
-        uint16_t          data_len = data->data_len;
-        HAL_StatusTypeDef ex;
-
-        if( data->cmd == OTA_CMD_FWDATA )
+        if( ((OTA_DATA_*)buf)->cmd == OTA_CMD_FWDATA )
         {
-          bool is_first_block = false;
-          if( ota_fw_received_size == 0 )
-          {
-            //This is the first block
-            is_first_block = true;
-
-            /* Read the configuration */
-            OTA_GNRL_CFG_ cfg;
-            memcpy( &cfg, cfg_flash, sizeof(OTA_GNRL_CFG_) );
-
-            /* Before writing the data, reset the available slot */
-            cfg.slot_table[slot_num_to_write].is_this_slot_not_valid = 1u;
-            /* write back the updated config */
-            ret = write_cfg_to_flash( &cfg );
-            if( ret != OTA_EX_OK )
-            {
-              break;
-            }
-          }
-
-          /* write the chunk to the Flash (App location) */
-          ex = write_data_to_slot( slot_num_to_write, buf+4, data_len, is_first_block );
-
-          if( ex == HAL_OK )
-          {
-            printf("[%ld/%ld]\r\n", ota_fw_received_size/OTA_DATA_MAX_SIZE, ota_fw_total_size/OTA_DATA_MAX_SIZE);
-            if( ota_fw_received_size >= ota_fw_total_size )
-            {
-              //received the full data. So, move to end
-              ota_state = OTA_STATE_END;
-            }
-            ret = OTA_EX_OK;
-          }
+          ret = ota_write_fw_data( buf );
+        }
+        else if( ((OTA_DATA_*)buf)->cmd == OTA_CMD_PARITY )
+        {
+          ret = ota_write_parity( buf );
+        }
+        else if( ((OTA_DATA_*)buf)->cmd == OTA_CMD_SKIP )
+        {
+          ret = ota_write_skip( buf );
+        }
+        else if( ((OTA_DATA_*)buf)->cmd == OTA_CMD_COPY )
+        {
+          ret = ota_write_copy( buf );
+        }
+        if( ( ret == OTA_EX_OK ) && ( ota_fw_received_size >= ota_fw_total_size ) )
+        {
+          //received the full data. So, move to end
+          ota_state = OTA_STATE_END;
         }
       }
       break;
@@ -283,56 +812,89 @@ static OTA_EX_ ota_process_data( uint8_t *buf, uint16_t len )
 
         OTA_COMMAND_ *cmd = (OTA_COMMAND_*)buf;
 
+          if( cmd->cmd == OTA_CMD_FWDATA )
+          {
+            //The host did not get the ACK of the last DATA frames and sends
+            //them again : already written, only acknowledged
+            ret = ota_write_fw_data( buf );
+            break;
+          }
+
+          if( cmd->cmd == OTA_CMD_PARITY )
+          {
+            //Last block complete : nothing to rebuild
+            ret = ota_write_parity( buf );
+            break;
+          }
+
+          if( cmd->cmd == OTA_CMD_SKIP )
+          {
+            ret = ota_write_skip( buf );
+            break;
+          }
+
+          if( cmd->cmd == OTA_CMD_COPY )
+          {
+            ret = ota_write_copy( buf );
+            break;
+          }
 
           if( cmd->cmd == OTA_CMD_END )
           {
-            printf("Received OTA END Command\r\n");
+            TRACE_INF( TRC_OTA_END );
 
-            printf("Validating the received Binary...\r\n");
 
-            uint32_t slot_addr;
-
-            if( fw_type == FW_TYPE_APP )
-            {
-              slot_addr = OTA_NEW_FW_START_ADDR;
-            }
-            else
-            {
-              slot_addr = OTA_NEW_BOOTLOADER_START_ADDR;
-            }
+            uint32_t slot_addr = ota_image_addr();
 
             //slot_addr = OTA_APP_SLOT0_FLASH_ADDR;
             //Calculate and verify the CRC
             //uint32_t cal_crc = HAL_CRC_Calculate( &hcrc, (uint32_t*)slot_addr, ota_fw_total_size);
-            uint16_t cal_crc = CalcCRC((uint32_t*)slot_addr, ota_fw_total_size);
+            uint16_t cal_crc = CalcCRC((const uint8_t*)slot_addr, ota_fw_total_size);
             //uint16_t cal_data_crc = CalcCRC((uint32_t*)OTA_APP_FLASH_ADDR, cfg.slot_table[slot_num].fw_size);
             if( cal_crc != ota_fw_crc )
             {
-              printf("ERROR: FW CRC Mismatch\r\n");
-              /* Mayank : removing below break statement for testing purpose */
-              //break;
+              //The slot stays not valid, and the next session uploads the
+              //image again instead of resuming what is in it
+              TRACE_ERR( TRC_OTA_FW_CRC_ERR, cal_crc, ota_fw_crc );
+              ret = ota_drop_upload();
+              break;
+            }
+            TRACE_INF( TRC_OTA_DONE );
+
+            if( fw_type != FW_TYPE_APP )
+            {
+              //Not in the slot table (ota_set_image())
+              ota_state = OTA_STATE_IDLE;
+              ret = OTA_EX_OK;
+              break;
             }
-            printf("Done!!!\r\n");
 
             /* Read the configuration */
             OTA_GNRL_CFG_ cfg;
             memcpy( &cfg, cfg_flash, sizeof(OTA_GNRL_CFG_) );
 
             //update the slot
-            cfg.slot_table[slot_num_to_write].fw_crc                 = cal_crc;
+            cfg.slot_table[slot_num_to_write].fw_crc                 = ota_fw_crc;
             cfg.slot_table[slot_num_to_write].fw_size                = ota_fw_total_size;
             cfg.slot_table[slot_num_to_write].is_this_slot_not_valid = 0u;
             cfg.slot_table[slot_num_to_write].should_we_run_this_fw  = 1u;
             cfg.slot_table[slot_num_to_write].fw_version			 = fw_version;
+            cfg.slot_table[slot_num_to_write].fw_type                = fw_type;
             cfg.slot_table[slot_num_to_write].new_app_fw_available 	 = 1u;
+            cfg.slot_table[slot_num_to_write].stage_seq              = 0u;
 
-            //reset other slots
+            //reset other slots, the newest image comes after all of them
             for( uint8_t i = 0; i < OTA_NO_OF_SLOTS; i++ )
             {
               if( slot_num_to_write != i )
               {
                 //update the slot as inactive
                 cfg.slot_table[i].should_we_run_this_fw = 0u;
+                if( ( cfg.slot_table[i].stage_seq != UINT32_MAX ) &&
+                    ( cfg.slot_table[i].stage_seq >= cfg.slot_table[slot_num_to_write].stage_seq ) )
+                {
+                  cfg.slot_table[slot_num_to_write].stage_seq = cfg.slot_table[i].stage_seq + 1u;
+                }
               }
             }
 
@@ -340,12 +902,13 @@ static OTA_EX_ ota_process_data( uint8_t *buf, uint16_t len )
             cfg.reboot_cause = OTA_NORMAL_BOOT;
 
             /* write back the updated config */
-            ret = write_cfg_to_flash( &cfg );
-            if( ret == OTA_EX_OK )
+            if( write_cfg_to_flash( &cfg ) != HAL_OK )
             {
-              ota_state = OTA_STATE_IDLE;
-              ret = OTA_EX_OK;
+              ret = OTA_EX_FLASH;
+              break;
             }
+            ota_state = OTA_STATE_IDLE;
+            ret = OTA_EX_OK;
           }
 
       }
@@ -364,16 +927,718 @@ static OTA_EX_ ota_process_data( uint8_t *buf, uint16_t len )
 }
 
 
+/**
+  * @brief Take the image description of a HEADER or SESSION command and
+  *        pick the slot to write it to (an application only).
+  * @param meta image size, type, CRC and version
+  * @retval OTA_EX_
+  */
+static OTA_EX_ ota_set_image( const meta_info *meta )
+{
+  OTA_EX_ ret = OTA_EX_ERR;
+
+  do
+  {
+    ota_fw_total_size = meta->fw_size;
+    fw_type = meta->fw_type;
+    ota_fw_crc = meta->fw_crc;
+    fw_version = meta->version;
+    TRACE_INF( TRC_OTA_HEADER, ota_fw_total_size, fw_type, fw_version );
+
+    if( ota_fw_total_size > ( ( fw_type == FW_TYPE_APP ) ? OTA_NEW_FW_MAX_SIZE :
+            ( OTA_NEW_BOOTLOADER_END_ADDR - OTA_NEW_BOOTLOADER_START_ADDR ) ) )
+    {
+      TRACE_ERR( TRC_OTA_TOO_BIG, ota_fw_total_size );
+      ret = OTA_EX_NO_SPACE;
+      break;
+    }
+
+    if( fw_type != FW_TYPE_APP )
+    {
+      //Written to the new bootloader region : the slot table and the
+      //images kept in the slots are left as they are
+      slot_num_to_write = 0xFFu;
+      ret = OTA_EX_OK;
+      break;
+    }
+
+    //get the slot number
+    slot_num_to_write = get_available_slot_number();
+    if( slot_num_to_write != 0xFF )
+    {
+      ret = OTA_EX_OK;
+    }
+  }while( false );
+
+  return ret;
+}
+
+/**
+  * @brief Process a SESSION command : START and HEADER in one frame, and
+  *        resume a pending upload of the same image when the host allows it.
+  *        With OTA_SESSION_FLAG_NOOP, an image already running or staged
+  *        ends the session (see ota_installed_action()).
+  * @param buf received SESSION frame
+  * @retval OTA_EX_
+  */
+static OTA_EX_ ota_open_session( uint8_t *buf )
+{
+  OTA_EX_      ret     = OTA_EX_ERR;
+  OTA_SESSION_ *session = (OTA_SESSION_*)buf;
+
+  do
+  {
+    if( session->data_len < ( sizeof(OTA_SESSION_) - 4u ) )
+    {
+      ret = OTA_EX_FRAMING;
+      break;
+    }
+    TRACE_INF( TRC_OTA_SESSION, session->flags );
+
+    //Start over : a SESSION received again re-reads the slot
+    ota_fw_received_size = 0u;
+    ota_slot_ready       = false;
+    ota_erase_map        = 0u;
+    ota_page_marked      = 0u;
+    ota_resume_offset    = 0u;
+    ota_session_action   = OTA_SESSION_UPLOAD;
+    memset( ota_dw_map, 0, sizeof(ota_dw_map) );
+
+    ret = ota_set_image( &session->meta_data );
+    if( ret != OTA_EX_OK )
+    {
+      break;
+    }
+
+    if( ( session->flags & OTA_SESSION_FLAG_NOOP ) != 0u )
+    {
+      ota_session_action = ota_installed_action();
+      if( ota_session_action != OTA_SESSION_UPLOAD )
+      {
+        //Nothing to transfer, the SESSION response closes the session
+        TRACE_INF( TRC_OTA_NO_UPDATE, ota_session_action );
+        ota_state = OTA_STATE_IDLE;
+        break;
+      }
+    }
+
+    if( ( ( session->flags & OTA_SESSION_FLAG_RESUME ) != 0u ) && ota_resume_upload() )
+    {
+      TRACE_INF( TRC_OTA_RESUME, ota_resume_offset );
+    }
+
+    ota_state = ( ota_fw_received_size >= ota_fw_total_size ) ? OTA_STATE_END : OTA_STATE_DATA;
+    ret = OTA_EX_OK;
+  }while( false );
+
+  return ret;
+}
+
+/**
+  * @brief Compare the image of the session with the staged and the running
+  *        ones. A staged image is installed at the next reset, it wins over
+  *        the running one. An image still complete in its slot (an earlier
+  *        one, see get_available_slot_number()) is staged again : going
+  *        back to it takes no upload.
+  * @param none
+  * @retval OTA_SESSION_INSTALL if the slot holds this image, staged,
+  *         OTA_SESSION_UP_TO_DATE if it runs and nothing else is staged,
+  *         OTA_SESSION_UPLOAD otherwise (always for a bootloader image)
+  */
+static uint8_t ota_installed_action( void )
+{
+  OTA_SLOT_      *slot;
+  OTA_ACTIVE_FW_ *active = &cfg_flash->active_fw;
+  bool           staged  = false;
+
+  if( fw_type != FW_TYPE_APP )
+  {
+    //A bootloader image has no slot entry, nothing tells it is installed
+    return OTA_SESSION_UPLOAD;
+  }
+  slot = &cfg_flash->slot_table[slot_num_to_write];
+
+  for( uint8_t i = 0; i < OTA_NO_OF_SLOTS; i++ )
+  {
+    if( ( cfg_flash->slot_table[i].is_this_slot_not_valid == 0u ) &&
+        ( cfg_flash->slot_table[i].should_we_run_this_fw == 1u ) )
+    {
+      staged = true;
+    }
+  }
+
+  if( ( slot->is_this_slot_not_valid == 0u ) && ( slot->should_we_run_this_fw == 1u ) &&
+      ota_slot_holds_image( slot ) )
+  {
+    return OTA_SESSION_INSTALL;
+  }
+
+  if( !staged && ( active->fw_size == ota_fw_total_size ) && ( active->fw_crc == ota_fw_crc ) &&
+      ( active->fw_version == fw_version ) && ( active->fw_type == fw_type ) )
+  {
+    return OTA_SESSION_UP_TO_DATE;
+  }
+
+  if( ( slot->is_this_slot_not_valid == 0u ) &&
+      ota_slot_holds_image( slot ) && ( ota_stage_slot( slot_num_to_write ) == OTA_EX_OK ) )
+  {
+    //Installed from the slot at the next reset, instead of another staged image
+    TRACE_INF( TRC_SLOT_STAGE, slot_num_to_write );
+    return OTA_SESSION_INSTALL;
+  }
+  return OTA_SESSION_UPLOAD;
+}
+
+/**
+  * @brief Tell if a slot entry describes the image of the session.
+  * @param slot slot table entry
+  * @retval true if the size, CRC, version and type are the same
+  */
+static bool ota_slot_holds_image( const OTA_SLOT_ *slot )
+{
+  return ( slot->fw_size == ota_fw_total_size ) && ( slot->fw_crc == ota_fw_crc ) &&
+         ( slot->fw_version == fw_version ) && ( slot->fw_type == fw_type );
+}
+
+/**
+  * @brief Mark a complete slot as the one to install at the next reset,
+  *        the other slots are not installed.
+  * @param slot_num slot to stage
+  * @retval OTA_EX_OK or OTA_EX_FLASH
+  */
+static OTA_EX_ ota_stage_slot( uint8_t slot_num )
+{
+  /* Read the configuration */
+  OTA_GNRL_CFG_ cfg;
+  memcpy( &cfg, cfg_flash, sizeof(OTA_GNRL_CFG_) );
+
+  for( uint8_t i = 0; i < OTA_NO_OF_SLOTS; i++ )
+  {
+    cfg.slot_table[i].should_we_run_this_fw = ( i == slot_num ) ? 1u : 0u;
+  }
+  cfg.reboot_cause = OTA_NORMAL_BOOT;
+
+  /* write back the updated config */
+  if( write_cfg_to_flash( &cfg ) != HAL_OK )
+  {
+    return OTA_EX_FLASH;
+  }
+  return OTA_EX_OK;
+}
+
+/**
+  * @brief Forget an upload whose image fails its CRC check : its slot entry
+  *        is freed, so that a SESSION does not resume it
+  *        (ota_resume_upload()).
+  * @param none
+  * @retval OTA_EX_CRC, or OTA_EX_FLASH if the configuration is not written
+  */
+static OTA_EX_ ota_drop_upload( void )
+{
+  /* Read the configuration */
+  OTA_GNRL_CFG_ cfg;
+
+  if( fw_type != FW_TYPE_APP )
+  {
+    //No slot entry (ota_set_image())
+    return OTA_EX_CRC;
+  }
+  memcpy( &cfg, cfg_flash, sizeof(OTA_GNRL_CFG_) );
+
+  //Already freed when the host sends END again
+  if( cfg.slot_table[slot_num_to_write].is_this_slot_not_valid != 0xFFu )
+  {
+    memset( &cfg.slot_table[slot_num_to_write], 0xFF, sizeof(OTA_SLOT_) );
+    if( write_cfg_to_flash( &cfg ) != HAL_OK )
+    {
+      return OTA_EX_FLASH;
+    }
+  }
+  return OTA_EX_CRC;
+}
+
+/**
+  * @brief Flash address of the image of the session : its slot for an
+  *        application, the new bootloader region otherwise.
+  * @param none
+  * @retval address
+  */
+static uint32_t ota_image_addr( void )
+{
+  return ( fw_type == FW_TYPE_APP ) ? OTA_SLOT_ADDR( slot_num_to_write ) : OTA_NEW_BOOTLOADER_START_ADDR;
+}
+
+/**
+  * @brief Pick up an interrupted upload of the current image. Only the
+  *        pages marked before the power loss are kept (ota_mark_pages()) :
+  *        a page written in part, or whose last doubleword may be half
+  *        programmed, is missing. The ones not erased are erased again, one
+  *        per ota_poll() (ota_erase_step()), the rest of the slot is not.
+  * @param none
+  * @retval true if the upload is resumed
+  */
+static bool ota_resume_upload( void )
+{
+  OTA_SLOT_ *slot;
+  uint32_t  flash_addr = ota_image_addr();
+  uint32_t  pages      = ( ota_fw_total_size + FLASH_PAGE_SIZE - 1u ) / FLASH_PAGE_SIZE;
+  uint32_t  start;
+  uint32_t  end;
+  uint64_t  data;
+
+  if( fw_type != FW_TYPE_APP )
+  {
+    //No slot entry to tell what was written : a bootloader image is sent again
+    return false;
+  }
+  slot = &cfg_flash->slot_table[slot_num_to_write];
+  if( ( slot->is_this_slot_not_valid != 1u ) || !ota_slot_holds_image( slot ) )
+  {
+    //Not an interrupted upload of this image
+    return false;
+  }
+
+  ota_erase_page    = GetPage( flash_addr );
+  ota_resume_offset = ota_fw_total_size;
+  for( uint32_t page = 0u; page < pages; page++ )
+  {
+    start = page * FLASH_PAGE_SIZE;
+    end   = ( ( start + FLASH_PAGE_SIZE ) < ota_fw_total_size ) ? ( start + FLASH_PAGE_SIZE ) : ota_fw_total_size;
+    if( flash_read_dw( OTA_PAGE_MARK_FLASH_ADDR + ( page * 8u ), &data ) && ( data == ota_page_mark( page ) ) )
+    {
+      for( uint32_t dw = start / 8u; dw < ( ( end + 7u ) / 8u ); dw++ )
+      {
+        ota_dw_map[dw / 32u] |= ( 1uL << ( dw % 32u ) );
+        ota_fw_received_size += 8u;
+      }
+      ota_page_marked |= ( 1uLL << page );
+      continue;
+    }
+
+    if( ota_resume_offset == ota_fw_total_size )
+    {
+      ota_resume_offset = start;
+    }
+    for( uint32_t addr = flash_addr + start; addr < ( flash_addr + end ); addr += 8u )
+    {
+      if( !flash_read_dw( addr, &data ) || ( data != UINT64_MAX ) )
+      {
+        ota_erase_map |= ( 1uLL << page );
+        break;
+      }
+    }
+  }
+  ota_slot_ready = ( ota_erase_map == 0u );
+
+  return true;
+}
+
+/**
+  * @brief Write a DATA frame to the slot. The frame can arrive in any order
+  *        and more than once : the doublewords already written are skipped
+  *        (after checking they hold the same data).
+  * @param buf received DATA frame
+  * @retval OTA_EX_
+  */
+static OTA_EX_ ota_write_fw_data( uint8_t *buf )
+{
+  OTA_EX_  ret  = OTA_EX_ERR;
+  OTA_DATA_ *data = (OTA_DATA_*)buf;
+  uint16_t data_len;
+
+  do
+  {
+    if( data->data_len < OTA_DATA_HDR_SIZE )
+    {
+      ret = OTA_EX_FRAMING;
+      break;
+    }
+    data_len = data->data_len - OTA_DATA_HDR_SIZE;
+
+    if( ( ( data->offset % 8u ) != 0u ) || ( data->offset > ota_fw_total_size ) ||
+        ( data_len > ( ota_fw_total_size - data->offset ) ) )
+    {
+      TRACE_WRN( TRC_OTA_DATA_RANGE, data->offset, data_len );
+      ret = OTA_EX_SEQUENCE;
+      break;
+    }
+
+    if( !ota_slot_ready )
+    {
+      //This is the first block
+      ret = ota_open_slot();
+      if( ret != OTA_EX_OK )
+      {
+        break;
+      }
+    }
+
+    /* write the chunk to the Flash (App location) */
+    uint32_t received = ota_fw_received_size;
+    if( write_data_to_slot( slot_num_to_write, buf + sizeof(OTA_DATA_), data->offset,
+                            data_len ) != HAL_OK )
+    {
+      ret = OTA_EX_FLASH;
+      break;
+    }
+    if( ( data_len != 0u ) && ( ota_fw_received_size == received ) )
+    {
+      TRACE_DBG( TRC_OTA_DATA_DUP, data->seq, data->offset );
+      ota_stats.duplicates++;
+    }
+
+    TRACE_DBG( TRC_OTA_DATA, ota_fw_received_size/OTA_DATA_MAX_SIZE, ota_fw_total_size/OTA_DATA_MAX_SIZE );
+    ret = OTA_EX_OK;
+  }while( false );
+
+  return ret;
+}
+
+/**
+  * @brief Check a PARITY block and rebuild its DATA frame missing, when it
+  *        is the only one : the parity XOR the other frames of the block,
+  *        read back from the slot.
+  * @param buf received PARITY frame (the frame is rebuilt in place)
+  * @retval OTA_EX_
+  */
+static OTA_EX_ ota_write_parity( uint8_t *buf )
+{
+  OTA_EX_      ret        = OTA_EX_ERR;
+  OTA_PARITY_ *parity     = (OTA_PARITY_*)buf;
+  uint8_t     *data       = buf + sizeof(OTA_PARITY_);
+  uint32_t     flash_addr = ota_image_addr();
+  uint32_t     lost       = 0u;
+  uint32_t     offset;
+  uint32_t     len;
+  uint16_t     frame_size;
+  uint8_t      missing    = 0u;
+
+  do
+  {
+    if( parity->data_len < OTA_PARITY_HDR_SIZE )
+    {
+      ret = OTA_EX_FRAMING;
+      break;
+    }
+    frame_size = parity->data_len - OTA_PARITY_HDR_SIZE;
+
+    if( ( frame_size == 0u ) || ( ( frame_size % 8u ) != 0u ) || ( parity->frames == 0u ) ||
+        ( parity->frames > OTA_FEC_MAX_FRAMES ) || ( ( parity->offset % 8u ) != 0u ) ||
+        ( parity->offset >= ota_fw_total_size ) )
+    {
+      TRACE_WRN( TRC_OTA_DATA_RANGE, parity->offset, frame_size );
+      ret = OTA_EX_SEQUENCE;
+      break;
+    }
+
+    //Frames of the block not completely written
+    for( uint8_t i = 0u; i < parity->frames; i++ )
+    {
+      offset = parity->offset + ( i * frame_size );
+      if( offset >= ota_fw_total_size )
+      {
+        break;
+      }
+      len = ota_fw_total_size - offset;
+      if( !ota_is_written( offset, ( len < frame_size ) ? len : frame_size ) )
+      {
+        missing++;
+        lost = offset;
+      }
+    }
+    if( missing == 0u )
+    {
+      ret = OTA_EX_OK;
+      break;
+    }
+    if( ( missing > 1u ) || !ota_slot_ready )
+    {
+      TRACE_WRN( TRC_OTA_FEC_MISSING, parity->seq, missing );
+      ret = OTA_EX_MISSING;
+      break;
+    }
+
+    //parity XOR the other frames (zero padded) is the missing one
+    for( uint8_t i = 0u; i < parity->frames; i++ )
+    {
+      offset = parity->offset + ( i * frame_size );
+      if( offset >= ota_fw_total_size )
+      {
+        break;
+      }
+      if( offset == lost )
+      {
+        continue;
+      }
+      len = ota_fw_total_size - offset;
+      len = ( len < frame_size ) ? len : frame_size;
+      for( uint32_t j = 0u; j < len; j++ )
+      {
+        data[j] ^= *(__IO uint8_t *)( flash_addr + offset + j );
+      }
+    }
+
+    len = ota_fw_total_size - lost;
+    len = ( len < frame_size ) ? len : frame_size;
+    if( write_data_to_slot( slot_num_to_write, data, lost, len ) != HAL_OK )
+    {
+      ret = OTA_EX_FLASH;
+      break;
+    }
+    TRACE_INF( TRC_OTA_FEC_RECOVER, parity->seq, lost );
+    ota_stats.fec_recovered++;
+    ret = OTA_EX_OK;
+  }while( false );
+
+  return ret;
+}
+
+/**
+  * @brief Mark an image range left erased (SKIP) as written.
+  * @param buf SKIP frame
+  * @retval OTA_EX_
+  */
+static OTA_EX_ ota_write_skip( uint8_t *buf )
+{
+  OTA_EX_    ret        = OTA_EX_OK;
+  OTA_SKIP_ *skip       = (OTA_SKIP_*)buf;
+  uint32_t   flash_addr = ota_image_addr();
+  uint32_t   dw;
+
+  do
+  {
+    if( skip->data_len != OTA_SKIP_SIZE )
+    {
+      ret = OTA_EX_FRAMING;
+      break;
+    }
+    if( ( ( skip->offset % 8u ) != 0u ) || ( skip->offset > ota_fw_total_size ) ||
+        ( skip->length > ( ota_fw_total_size - skip->offset ) ) ||
+        ( ( ( skip->length % 8u ) != 0u ) && ( ( skip->offset + skip->length ) != ota_fw_total_size ) ) )
+    {
+      TRACE_WRN( TRC_OTA_DATA_RANGE, skip->offset, skip->length );
+      ret = OTA_EX_SEQUENCE;
+      break;
+    }
+
+    if( !ota_slot_ready )
+    {
+      ret = ota_open_slot();
+      if( ret != OTA_EX_OK )
+      {
+        break;
+      }
+    }
+
+    TRACE_DBG( TRC_OTA_SKIP, skip->length, skip->offset );
+    for( dw = skip->offset / 8u; dw < ( ( skip->offset + skip->length + 7u ) / 8u ); dw++ )
+    {
+      if( ( ota_dw_map[dw / 32u] & ( 1uL << ( dw % 32u ) ) ) != 0u )
+      {
+        continue;
+      }
+      //erased with the slot, a resumed upload only keeps erased doublewords
+      //unmarked
+      if( *(__IO uint64_t *)( flash_addr + ( dw * 8u ) ) != UINT64_MAX )
+      {
+        TRACE_ERR( TRC_OTA_DATA_CONFLICT, dw * 8u );
+        ret = OTA_EX_FLASH;
+        break;
+      }
+      ota_dw_map[dw / 32u] |= ( 1uL << ( dw % 32u ) );
+      ota_fw_received_size += 8u;
+    }
+    if( ret == OTA_EX_OK )
+    {
+      HAL_FLASH_Unlock();
+      ota_mark_pages( skip->offset, skip->length );
+      HAL_FLASH_Lock();
+    }
+  }while( false );
+
+  return ret;
+}
+
+/**
+  * @brief Process a COPY command : the image range is in the active
+  *        application, copy it from there to the slot.
+  * @param buf received COPY frame
+  * @retval OTA_EX_
+  */
+static OTA_EX_ ota_write_copy( uint8_t *buf )
+{
+  OTA_EX_    ret  = OTA_EX_OK;
+  OTA_COPY_ *copy = (OTA_COPY_*)buf;
+
+  do
+  {
+    if( copy->data_len != OTA_COPY_SIZE )
+    {
+      ret = OTA_EX_FRAMING;
+      break;
+    }
+    if( ( fw_type != FW_TYPE_APP ) || ( ( copy->offset % 8u ) != 0u ) || ( ( copy->source % 8u ) != 0u ) ||
+        ( copy->offset > ota_fw_total_size ) || ( copy->length > ( ota_fw_total_size - copy->offset ) ) ||
+        ( copy->length > OTA_COPY_MAX_SIZE ) ||
+        ( copy->source > ( OTA_ACTV_FW_END_ADDR - OTA_ACTV_FW_START_ADDR ) ) ||
+        ( copy->length > ( ( OTA_ACTV_FW_END_ADDR - OTA_ACTV_FW_START_ADDR ) - copy->source ) ) )
+    {
+      TRACE_WRN( TRC_OTA_DATA_RANGE, copy->offset, copy->length );
+      ret = OTA_EX_SEQUENCE;
+      break;
+    }
+
+    if( !ota_slot_ready )
+    {
+      ret = ota_open_slot();
+      if( ret != OTA_EX_OK )
+      {
+        break;
+      }
+    }
+
+    //Programmed doubleword by doubleword, each read from the active region
+    //first. The doublewords already written are only checked.
+    TRACE_DBG( TRC_OTA_COPY, copy->length, copy->source, copy->offset );
+    if( write_data_to_slot( slot_num_to_write, (uint8_t *)( OTA_ACTV_FW_START_ADDR + copy->source ),
+                            copy->offset, (uint16_t)copy->length ) != HAL_OK )
+    {
+      ret = OTA_EX_FLASH;
+      break;
+    }
+  }while( false );
+
+  return ret;
+}
+
+/**
+  * @brief Get the slot ready for the first block : mark it as being written
+  *        with this image (a SESSION can then resume the upload) and start
+  *        erasing it, one page per ota_poll() (ota_erase_step()). A
+  *        bootloader image only erases the new bootloader region.
+  * @param none
+  * @retval OTA_EX_BUSY (the block waits for the erase) or OTA_EX_FLASH
+  */
+static OTA_EX_ ota_open_slot( void )
+{
+  /* Read the configuration */
+  OTA_GNRL_CFG_ cfg;
+
+  if( fw_type == FW_TYPE_APP )
+  {
+    memcpy( &cfg, cfg_flash, sizeof(OTA_GNRL_CFG_) );
+
+    /* Before writing the data, reset the available slot. Keep what is
+     * being written, a SESSION can then resume the upload. */
+    cfg.slot_table[slot_num_to_write].is_this_slot_not_valid = 1u;
+    cfg.slot_table[slot_num_to_write].fw_size                = ota_fw_total_size;
+    cfg.slot_table[slot_num_to_write].fw_crc                 = ota_fw_crc;
+    cfg.slot_table[slot_num_to_write].fw_version             = fw_version;
+    cfg.slot_table[slot_num_to_write].fw_type                = fw_type;
+    /* write back the updated config */
+    if( write_cfg_to_flash( &cfg ) != HAL_OK )
+    {
+      return OTA_EX_FLASH;
+    }
+
+    /* erase the slot, nothing written yet */
+    TRACE_INF( TRC_SLOT_ERASE, slot_num_to_write );
+    ota_erase_page = GetPage( OTA_SLOT_ADDR( slot_num_to_write ) );
+    ota_erase_map  = ( 1uLL << ( OTA_SLOT_SIZE / FLASH_PAGE_SIZE ) ) - 1u;
+  }
+  else
+  {
+    ota_erase_page = GetPage( OTA_NEW_BOOTLOADER_START_ADDR );
+    ota_erase_map  = ( 1uLL << ( GetPage( OTA_NEW_BOOTLOADER_END_ADDR ) - ota_erase_page ) ) - 1u;
+  }
+  //the configuration write erased the page marks
+  ota_page_marked = 0u;
+
+  return OTA_EX_BUSY;
+}
+
+/**
+  * @brief Tell if an image range is completely written.
+  * @param offset image offset
+  * @param len length
+  * @retval true if all its doublewords are written
+  */
+static bool ota_is_written( uint32_t offset, uint32_t len )
+{
+  for( uint32_t dw = offset / 8u; dw < ( ( offset + len + 7u ) / 8u ); dw++ )
+  {
+    if( ( ota_dw_map[dw / 32u] & ( 1uL << ( dw % 32u ) ) ) == 0u )
+    {
+      return false;
+    }
+  }
+  return true;
+}
+
+/**
+  * @brief Mark of an image page completely written : its page number, the
+  *        slot and the image CRC, stored with its complement (a half
+  *        programmed mark, or one left by another upload, does not match).
+  * @param page image page
+  * @retval mark doubleword
+  */
+static uint64_t ota_page_mark( uint32_t page )
+{
+  uint32_t tag = ( ota_fw_crc << 16 ) | ( (uint32_t)slot_num_to_write << 8 ) | page;
+
+  return ( (uint64_t)~tag << 32 ) | tag;
+}
+
+/**
+  * @brief Write the mark of the image pages of a range completely written
+  *        (ota_resume_upload() keeps them after a reset). The flash is
+  *        unlocked.
+  * @param offset image offset
+  * @param len length
+  * @retval none
+  */
+static void ota_mark_pages( uint32_t offset, uint32_t len )
+{
+  uint32_t start;
+  uint32_t end;
+
+  if( fw_type != FW_TYPE_APP )
+  {
+    //Not resumed (ota_resume_upload()), and the marks page is only
+    //erased with the configuration
+    return;
+  }
+
+  for( uint32_t page = offset / FLASH_PAGE_SIZE; page < ( ( offset + len + FLASH_PAGE_SIZE - 1u ) / FLASH_PAGE_SIZE ); page++ )
+  {
+    start = page * FLASH_PAGE_SIZE;
+    end   = ( ( start + FLASH_PAGE_SIZE ) < ota_fw_total_size ) ? ( start + FLASH_PAGE_SIZE ) : ota_fw_total_size;
+    if( ( ( ota_page_marked & ( 1uLL << page ) ) != 0u ) || !ota_is_written( start, end - start ) )
+    {
+      continue;
+    }
+    //Not marked : sent again after a reset
+    if( HAL_FLASH_Program( FLASH_TYPEPROGRAM_DOUBLEWORD, OTA_PAGE_MARK_FLASH_ADDR + ( page * 8u ),
+                           ota_page_mark( page ) ) != HAL_OK )
+    {
+      TRACE_WRN( TRC_OTA_PAGE_MARK_ERR, page );
+    }
+    ota_page_marked |= ( 1uLL << page );
+  }
+}
+
 /**
   * @brief Receive a one chunk of data.
   * @param buf buffer to store the received data
   * @param max_len maximum length to receive
-  * @retval OTA_EX_
+  * @param len received frame length (0 on error)
+  * @retval OTA_EX_OK, OTA_EX_FRAMING, OTA_EX_CRC or OTA_EX_BUSY (not complete yet)
   */
 
-static uint16_t ota_receive_chunk( uint8_t *buf, uint16_t max_len )
+static OTA_EX_ ota_receive_chunk( uint8_t *buf, uint16_t max_len, uint16_t *len )
 {
-  int16_t  ret;
+  OTA_EX_  ret          = OTA_EX_FRAMING;
+  HAL_StatusTypeDef hal = HAL_OK;
   uint16_t index        = 0u;
   uint16_t data_len;
   uint16_t cal_data_crc = 0u;
@@ -383,33 +1648,44 @@ static uint16_t ota_receive_chunk( uint8_t *buf, uint16_t max_len )
   {
 	//__HAL_UART_CLEAR_OREFLAG(&BL_UART);
 
-    //receive SOF byte (1byte)
-    ret = HAL_UART_Receive( &BL_UART, &buf[index], 1, HAL_MAX_DELAY );
-    if( ret != HAL_OK )
+    //COBS session : the frame starts right after the previous delimiter
+    if( ota_cobs )
+    {
+      ret = ota_receive_cobs( buf, max_len, &index );
+      break;
+    }
+
+    //receive SOF byte (1byte), or the delimiter starting a COBS frame.
+    //Skip anything else : the repeated OTA_ENTER_REQ bytes, the rest of a
+    //broken frame.
+    do
+    {
+      hal = ota_rx( &buf[index], 1, HAL_MAX_DELAY );
+    }while( ( hal == HAL_OK ) && ( buf[index] != OTA_SOF ) && ( buf[index] != OTA_COBS_DELIM ) );
+    if( hal != HAL_OK )
     {
       break;
     }
-
-	//__HAL_UART_CLEAR_FLAG(&BL_UART,HAL_UART_STATE_BUSY_TX_RX);
-
-
-    if( buf[index++] != OTA_SOF )
+    if( buf[index] == OTA_COBS_DELIM )
     {
-      //Not received start of frame
-      ret = OTA_EX_ERR;
+      ret = ota_receive_cobs( buf, max_len, &index );
+      ota_cobs = ( ret == OTA_EX_OK );
       break;
     }
+    index++;
+
+	//__HAL_UART_CLEAR_FLAG(&BL_UART,HAL_UART_STATE_BUSY_TX_RX);
 
     //Receive the packet type (1byte).
-    ret = HAL_UART_Receive( &BL_UART, &buf[index++], 1, PACKET_CAPTURE_TIMEOUT );
-    if( ret != HAL_OK )
+    hal = ota_rx( &buf[index++], 1, PACKET_CAPTURE_TIMEOUT );
+    if( hal != HAL_OK )
     {
       break;
     }
 
     //Get the data length (2bytes).
-    ret = HAL_UART_Receive( &BL_UART, &buf[index], 2, PACKET_CAPTURE_TIMEOUT );
-    if( ret != HAL_OK )
+    hal = ota_rx( &buf[index], 2, PACKET_CAPTURE_TIMEOUT );
+    if( hal != HAL_OK )
     {
       break;
     }
@@ -417,23 +1693,23 @@ static uint16_t ota_receive_chunk( uint8_t *buf, uint16_t max_len )
     //data_len = buf[index] << 8 | buf[index+1];
     index += 2u;
 
-    for( uint16_t i = 0u; i < data_len; i++ )
+    //SOF + cmd + len + data + CRC + EOF has to fit in the buffer
+    if( ( (uint32_t)data_len + 7u ) > max_len )
     {
-      ret = HAL_UART_Receive( &BL_UART, &buf[index++], 1, PACKET_CAPTURE_TIMEOUT );
-      if( ret != HAL_OK )
-      {
-        break;
-      }
+      TRACE_WRN( TRC_CHUNK_TOO_BIG, max_len, data_len + 7u );
+      break;
     }
 
-    if( ret != HAL_OK )
+    hal = ota_rx( &buf[index], data_len, PACKET_CAPTURE_TIMEOUT );
+    if( hal != HAL_OK )
     {
       break;
     }
+    index += data_len;
 
     //Get the CRC.
-    ret = HAL_UART_Receive( &BL_UART, &buf[index], 2, PACKET_CAPTURE_TIMEOUT );
-    if( ret != HAL_OK )
+    hal = ota_rx( &buf[index], 2, PACKET_CAPTURE_TIMEOUT );
+    if( hal != HAL_OK )
     {
       break;
     }
@@ -444,8 +1720,8 @@ static uint16_t ota_receive_chunk( uint8_t *buf, uint16_t max_len )
     index += 2u;
 
     //receive EOF byte (1byte)
-    ret = HAL_UART_Receive( &BL_UART, &buf[index], 1, PACKET_CAPTURE_TIMEOUT);
-    if( ret != HAL_OK )
+    hal = ota_rx( &buf[index], 1, PACKET_CAPTURE_TIMEOUT);
+    if( hal != HAL_OK )
     {
       break;
     }
@@ -453,7 +1729,6 @@ static uint16_t ota_receive_chunk( uint8_t *buf, uint16_t max_len )
     if( buf[index++] != OTA_EOF )
     {
       //Not received end of frame
-      ret = OTA_EX_ERR;
       break;
     }
 
@@ -461,35 +1736,208 @@ static uint16_t ota_receive_chunk( uint8_t *buf, uint16_t max_len )
     //cal_data_crc = HAL_CRC_Calculate( &hcrc, (uint32_t*)&buf[4], data_len);
     //cal_data_crc = CalcCRC((uint32_t*)&buf[4], data_len);
     // data len + cmd + data
-    cal_data_crc = CalcCRC((uint32_t*)&buf[1], data_len+3);
+    cal_data_crc = CalcCRC(&buf[1], data_len+3);
 
     //Verify the CRC
 
     if( cal_data_crc != rec_data_crc )
     {
-      printf("Chunk's CRC mismatch [Cal CRC = 0x%08lX] [Rec CRC = 0x%08lX]\r\n",
-                                                   cal_data_crc, rec_data_crc );
-      ret = OTA_EX_ERR;
+      TRACE_ERR( TRC_CHUNK_CRC_ERR, cal_data_crc, rec_data_crc );
+      ret = OTA_EX_CRC;
       break;
     }
 
-
+    ret = OTA_EX_OK;
   }while( false );
 
-  if( ret != HAL_OK )
+  if( hal == HAL_BUSY )
   {
-    //clear the index if error
-    index = 0u;
+    //Not complete yet (ota_take_frame())
+    ret = OTA_EX_BUSY;
+  }
+  if( ( ret == OTA_EX_FRAMING ) && !ota_cobs && ( index > 1u ) )
+  {
+    //Lost bytes, the frame ran into the next ones : look for them in what
+    //was read after the SOF
+    ota_rx_replay_from( &buf[1], index - 1u );
   }
 
-  if( max_len < index )
+  //clear the length if error
+  *len = ( ret == OTA_EX_OK ) ? index : 0u;
+
+  return ret;
+}
+
+/**
+  * @brief Receive a COBS frame up to its delimiter and decode it in place.
+  * @param buf buffer to store the frame, OTA_COBS_SIZE( max_len ) bytes
+  * @param max_len maximum decoded frame length
+  * @param len decoded frame length
+  * @retval OTA_EX_OK, OTA_EX_FRAMING, OTA_EX_CRC or OTA_EX_BUSY (not complete yet)
+  */
+static OTA_EX_ ota_receive_cobs( uint8_t *buf, uint16_t max_len, uint16_t *len )
+{
+  const uint16_t    max_raw = OTA_COBS_SIZE( max_len );
+  HAL_StatusTypeDef hal;
+  uint16_t          raw     = 0u;
+  uint16_t          in      = 0u;
+  uint16_t          out     = 0u;
+  uint16_t          data_len;
+  uint8_t           code;
+  uint8_t           byte;
+  const uint8_t    *end;
+
+  *len = 0u;
+
+  //Encoded bytes up to the delimiter, one code byte then the run it gives
+  //in one read. An empty frame (delimiters in a row) is skipped.
+  for( ;; )
   {
-    printf("Received more data than expected. Expected = %d, Received = %d\r\n",
-                                                              max_len, index );
-    index = 0u;
+    hal = ota_rx( &code, 1, ( raw == 0u ) ? HAL_MAX_DELAY : PACKET_CAPTURE_TIMEOUT );
+    if( hal != HAL_OK )
+    {
+      return ( hal == HAL_BUSY ) ? OTA_EX_BUSY : OTA_EX_FRAMING;
+    }
+    if( code == OTA_COBS_DELIM )
+    {
+      if( raw != 0u )
+      {
+        break;
+      }
+      continue;
+    }
+    if( ( raw + code ) > max_raw )
+    {
+      //Too long : dropped up to its delimiter
+      TRACE_WRN( TRC_CHUNK_TOO_BIG, max_len, raw + code );
+      do
+      {
+        hal = ota_rx( &byte, 1, PACKET_CAPTURE_TIMEOUT );
+      }while( ( hal == HAL_OK ) && ( byte != OTA_COBS_DELIM ) );
+      return ( hal == HAL_BUSY ) ? OTA_EX_BUSY : OTA_EX_FRAMING;
+    }
+    buf[raw++] = code;
+    hal = ota_rx( &buf[raw], code - 1u, PACKET_CAPTURE_TIMEOUT );
+    if( hal != HAL_OK )
+    {
+      return ( hal == HAL_BUSY ) ? OTA_EX_BUSY : OTA_EX_FRAMING;
+    }
+    end = memchr( &buf[raw], OTA_COBS_DELIM, code - 1u );
+    if( end != NULL )
+    {
+      //Bytes lost, the run went past the delimiter : what follows it is
+      //the next frame
+      ota_rx_unread( end + 1, (uint16_t)( &buf[raw + code - 1u] - ( end + 1 ) ) );
+      return OTA_EX_FRAMING;
+    }
+    raw += code - 1u;
   }
 
-  return index;
+  //Each code byte gives the distance to the next zero, the decoded bytes
+  //never get ahead of the encoded ones
+  while( in < raw )
+  {
+    code = buf[in++];
+    if( ( in + code - 1u ) > raw )
+    {
+      return OTA_EX_FRAMING;
+    }
+    memmove( &buf[out], &buf[in], code - 1u );
+    in  += code - 1u;
+    out += code - 1u;
+    if( ( code != 0xFFu ) && ( in < raw ) )
+    {
+      buf[out++] = 0u;
+    }
+  }
+
+  //Same layout as a plain frame
+  data_len = *(uint16_t *)&buf[2];
+  if( ( out < 7u ) || ( out > max_len ) || ( buf[0] != OTA_SOF ) ||
+      ( out != ( data_len + 7u ) ) || ( buf[out - 1u] != OTA_EOF ) )
+  {
+    return OTA_EX_FRAMING;
+  }
+  if( CalcCRC( &buf[1], data_len + 3u ) != *(uint16_t *)&buf[out - 3u] )
+  {
+    TRACE_ERR( TRC_CHUNK_CRC_ERR, CalcCRC( &buf[1], data_len + 3u ), *(uint16_t *)&buf[out - 3u] );
+    return OTA_EX_CRC;
+  }
+
+  *len = out;
+  return OTA_EX_OK;
+}
+
+/**
+  * @brief Read the received bytes, the bytes to parse again first. Does not
+  *        wait : nothing is read when they are not all there yet.
+  * @param buf buffer to store the received data
+  * @param len length to receive
+  * @param timeout PACKET_CAPTURE_TIMEOUT, or HAL_MAX_DELAY : no limit
+  * @retval HAL_OK, HAL_BUSY (not there yet) or HAL_TIMEOUT (no byte for
+  *         PACKET_CAPTURE_TIMEOUT)
+  */
+static HAL_StatusTypeDef ota_rx( uint8_t *buf, uint16_t len, uint32_t timeout )
+{
+  uint16_t replay = ota_rx_replay_len - ota_rx_replay_pos;
+
+  if( ( (uint32_t)replay + (uint16_t)( ota_rx_head - ota_rx_tail ) ) < len )
+  {
+    return ( ( timeout == HAL_MAX_DELAY ) || !ota_rx_stale ) ? HAL_BUSY : HAL_TIMEOUT;
+  }
+  while( ( len != 0u ) && ( ota_rx_replay_pos < ota_rx_replay_len ) )
+  {
+    *buf++ = ota_rx_replay[ota_rx_replay_pos++];
+    len--;
+  }
+  while( len != 0u )
+  {
+    *buf++ = ota_rx_ring[ota_rx_tail & ( OTA_RX_RING_SIZE - 1u )];
+    ota_rx_tail++;
+    len--;
+  }
+  return HAL_OK;
+}
+
+/**
+  * @brief Parse again the bytes of a broken frame, from its next SOF, before
+  *        the bytes still to parse again and the UART.
+  * @param buf bytes read after the SOF of the broken frame
+  * @param len length
+  * @retval none
+  */
+static void ota_rx_replay_from( const uint8_t *buf, uint16_t len )
+{
+  const uint8_t *sof  = memchr( buf, OTA_SOF, len );
+
+  if( sof != NULL )
+  {
+    ota_rx_unread( sof, len - (uint16_t)( sof - buf ) );
+  }
+}
+
+/**
+  * @brief Put bytes back, before the bytes still to parse again and the UART.
+  * @param buf bytes
+  * @param len length
+  * @retval none
+  */
+static void ota_rx_unread( const uint8_t *buf, uint16_t len )
+{
+  uint16_t rest = ota_rx_replay_len - ota_rx_replay_pos;
+
+  if( len > sizeof(ota_rx_replay) )
+  {
+    len = sizeof(ota_rx_replay);
+  }
+  if( ( len + rest ) > sizeof(ota_rx_replay) )
+  {
+    rest = sizeof(ota_rx_replay) - len;
+  }
+  memmove( &ota_rx_replay[len], &ota_rx_replay[ota_rx_replay_pos], rest );
+  memmove( ota_rx_replay, buf, len );
+  ota_rx_replay_len = len + rest;
+  ota_rx_replay_pos = 0u;
 }
 
 /*
@@ -611,7 +2059,7 @@ static uint16_t ota_receive_chunk( uint8_t *buf, uint16_t max_len )
 
 /**
   * @brief Send the response.
-  * @param type ACK or NACK
+  * @param type ACK, or the NACK reason (OTA_EX_)
   * @retval none
   */
 static void ota_send_resp( uint8_t cmd , uint8_t type )
@@ -625,33 +2073,311 @@ static void ota_send_resp( uint8_t cmd , uint8_t type )
     .eof         = OTA_EOF
   };
 
-  rsp.crc = CalcCRC((uint16_t*)&rsp.status, 1);
+  rsp.crc = CalcCRC((const uint8_t*)&rsp.status, 1);
+  //send response
+  ota_tx( (uint8_t *)&rsp, sizeof(OTA_RESP_) );
+}
+
+/**
+  * @brief Send the response to a DATA, PARITY or SKIP frame.
+  * @param cmd OTA_CMD_FWDATA, OTA_CMD_PARITY or OTA_CMD_SKIP
+  * @param seq sequence number of the frame
+  * @param type ACK, or the NACK reason (OTA_EX_)
+  * @retval none
+  */
+static void ota_send_data_resp( uint8_t cmd, uint16_t seq, uint8_t type )
+{
+  OTA_DATA_RESP_ rsp =
+  {
+    .sof         = OTA_SOF,
+    .cmd         = cmd,
+    .data_len    = 3u,
+    .status      = type,
+    .seq         = seq,
+    .eof         = OTA_EOF
+  };
+
+  rsp.crc = CalcCRC( &rsp.status, 3 );
   //send response
-  HAL_UART_Transmit(&BL_UART, (uint8_t *)&rsp, sizeof(OTA_RESP_), HAL_MAX_DELAY);
+  ota_tx( (uint8_t *)&rsp, sizeof(OTA_DATA_RESP_) );
+}
+
+/**
+  * @brief Fill the capabilities reported by PING and SESSION.
+  * @param caps capabilities to fill
+  * @retval none
+  */
+static void ota_get_caps( OTA_CAPS_ *caps )
+{
+  memset( caps, 0, sizeof(OTA_CAPS_) );
+  caps->status        = OTA_ACK;
+  caps->proto_version = OTA_PROTOCOL_VERSION;
+  caps->max_data_size = OTA_DATA_MAX_SIZE;
+  caps->rx_window     = OTA_RX_WINDOW;
+  caps->fec_max_frames = OTA_FEC_MAX_FRAMES;
+  caps->max_busy_ms   = ( OTA_NEW_FW_MAX_SIZE / FLASH_PAGE_SIZE ) * OTA_PAGE_ERASE_MAX_MS;
+  caps->uid[0]        = HAL_GetUIDw0();
+  caps->uid[1]        = HAL_GetUIDw1();
+  caps->uid[2]        = HAL_GetUIDw2();
+}
+
+/**
+  * @brief Answer a PING : capabilities then the PING payload.
+  * @param echo PING payload
+  * @param echo_len PING payload length
+  * @retval none
+  */
+static void ota_send_ping_resp( const uint8_t *echo, uint16_t echo_len )
+{
+  TRACE_DBG( TRC_OTA_PING, echo_len );
+
+  ota_get_caps( (OTA_CAPS_ *)&Tx_Buffer[4] );
+  memcpy( &Tx_Buffer[4 + sizeof(OTA_CAPS_)], echo, echo_len );
+  ota_send_tx_frame( OTA_CMD_PING, sizeof(OTA_CAPS_) + echo_len );
 }
 
 /**
-  * @brief Write data to the Slot
-  * @param slot_num slot to be written
+  * @brief Answer a SESSION : capabilities, slot content, resume point,
+  *        running application and what the session does next.
+  * @param none
+  * @retval none
+  */
+static void ota_send_session_resp( void )
+{
+  OTA_SESSION_RESP_ *rsp  = (OTA_SESSION_RESP_ *)&Tx_Buffer[4];
+  OTA_SLOT_         empty;
+  OTA_SLOT_         *slot = &empty;
+
+  //A bootloader image has no slot entry : reported as an empty slot
+  memset( &empty, 0xFF, sizeof(OTA_SLOT_) );
+  if( fw_type == FW_TYPE_APP )
+  {
+    slot = &cfg_flash->slot_table[slot_num_to_write];
+  }
+
+  ota_get_caps( &rsp->caps );
+  rsp->slot_fw_size    = slot->fw_size;
+  rsp->slot_fw_crc     = slot->fw_crc;
+  rsp->slot_fw_version = slot->fw_version;
+  rsp->slot_flags      = ( slot->is_this_slot_not_valid == 0u ) ? OTA_SLOT_FLAG_VALID :
+                         ( slot->is_this_slot_not_valid == 1u ) ? OTA_SLOT_FLAG_PENDING : 0u;
+  if( ( slot->is_this_slot_not_valid == 0u ) && ( slot->should_we_run_this_fw == 1u ) )
+  {
+    rsp->slot_flags |= OTA_SLOT_FLAG_STAGED;
+  }
+  rsp->resume_offset     = ota_resume_offset;
+  rsp->active_fw_size    = cfg_flash->active_fw.fw_size;
+  rsp->active_fw_crc     = cfg_flash->active_fw.fw_crc;
+  rsp->active_fw_version = cfg_flash->active_fw.fw_version;
+  rsp->action            = ota_session_action;
+  ota_send_tx_frame( OTA_CMD_SESSION, sizeof(OTA_SESSION_RESP_) );
+}
+
+/**
+  * @brief Answer a STATS : frame and error counters of the session.
+  * @param none
+  * @retval none
+  */
+static void ota_send_stats_resp( void )
+{
+  OTA_STATS_ *rsp = (OTA_STATS_ *)&Tx_Buffer[4];
+
+  *rsp        = ota_stats;
+  rsp->status = OTA_ACK;
+  ota_send_tx_frame( OTA_CMD_STATS, sizeof(OTA_STATS_) );
+}
+
+/**
+  * @brief Answer a PAGE_HASHES : CRC-32 of the requested pages of the
+  *        active application, as many as fit in one response. The pages
+  *        are hashed one per ota_poll() (ota_hash_step()), the response is
+  *        sent after the last one.
+  * @param buf received PAGE_HASHES frame
+  * @param len frame length
+  * @retval none
+  */
+static void ota_send_page_hashes_resp( const uint8_t *buf, uint16_t len )
+{
+  const OTA_PAGE_HASHES_ *req   = (const OTA_PAGE_HASHES_ *)buf;
+  OTA_PAGE_HASHES_RESP_  *rsp   = (OTA_PAGE_HASHES_RESP_ *)&Tx_Buffer[4];
+  uint32_t               pages = ota_active_pages();
+  uint32_t               count;
+
+  //frame : header, request, CRC, EOF
+  if( ( len != ( sizeof(OTA_PAGE_HASHES_) + 3u ) ) ||
+      ( req->data_len != ( sizeof(OTA_PAGE_HASHES_) - 4u ) ) )
+  {
+    ota_send_resp( OTA_CMD_PAGE_HASHES, OTA_EX_FRAMING );
+    return;
+  }
+
+  count = ( req->first < pages ) ? ( pages - req->first ) : 0u;
+  count = ( count < req->count ) ? count : req->count;
+  count = ( count < OTA_HASHES_MAX_PAGES ) ? count : OTA_HASHES_MAX_PAGES;
+  TRACE_DBG( TRC_OTA_PAGE_HASHES, req->first, count );
+
+  rsp->status   = OTA_ACK;
+  rsp->first    = req->first;
+  rsp->count    = 0u;
+  ota_hash_left = (uint16_t)count;
+  if( count == 0u )
+  {
+    ota_send_tx_frame( OTA_CMD_PAGE_HASHES, sizeof(OTA_PAGE_HASHES_RESP_) );
+  }
+}
+
+/**
+  * @brief Hash the next page of the PAGE_HASHES response, send it after
+  *        the last one.
+  * @param none
+  * @retval none
+  */
+static void ota_hash_step( void )
+{
+  OTA_PAGE_HASHES_RESP_ *rsp = (OTA_PAGE_HASHES_RESP_ *)&Tx_Buffer[4];
+
+  rsp->hash[rsp->count] = ota_crc32( (const uint8_t *)( OTA_ACTV_FW_START_ADDR +
+                                                        ( ( rsp->first + rsp->count ) * FLASH_PAGE_SIZE ) ),
+                                     FLASH_PAGE_SIZE );
+  rsp->count++;
+  ota_hash_left--;
+  if( ota_hash_left == 0u )
+  {
+    ota_send_tx_frame( OTA_CMD_PAGE_HASHES, sizeof(OTA_PAGE_HASHES_RESP_) + ( rsp->count * 4u ) );
+  }
+}
+
+/**
+  * @brief Pages of the active application region worth hashing : the ones
+  *        of the installed application when it is known, all otherwise.
+  * @param none
+  * @retval page count
+  */
+static uint32_t ota_active_pages( void )
+{
+  uint32_t region = ( OTA_ACTV_FW_END_ADDR - OTA_ACTV_FW_START_ADDR ) / FLASH_PAGE_SIZE;
+  uint32_t size   = cfg_flash->active_fw.fw_size;
+
+  if( size > ( OTA_ACTV_FW_END_ADDR - OTA_ACTV_FW_START_ADDR ) )
+  {
+    //unknown (erased record)
+    return region;
+  }
+  return ( size + FLASH_PAGE_SIZE - 1u ) / FLASH_PAGE_SIZE;
+}
+
+/**
+  * @brief CRC-32 (IEEE 802.3, reflected, as zlib crc32()), four bits at a
+  *        time : the PAGE_HASHES table stays small.
+  * @param data data
+  * @param length data length
+  * @retval CRC-32
+  */
+static uint32_t ota_crc32( const uint8_t *data, uint32_t length )
+{
+  static const uint32_t crc32_nibble[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+  };
+  uint32_t crc = 0xFFFFFFFFu;
+
+  for( uint32_t i = 0u; i < length; i++ )
+  {
+    crc ^= data[i];
+    crc = ( crc >> 4 ) ^ crc32_nibble[crc & 0x0Fu];
+    crc = ( crc >> 4 ) ^ crc32_nibble[crc & 0x0Fu];
+  }
+  return ~crc;
+}
+
+/**
+  * @brief Frame and send the payload already in Tx_Buffer[4].
+  * @param cmd frame command
+  * @param len payload length
+  * @retval none
+  */
+static void ota_send_tx_frame( uint8_t cmd, uint16_t len )
+{
+  uint16_t crc;
+
+  Tx_Buffer[0] = OTA_SOF;
+  Tx_Buffer[1] = cmd;
+  Tx_Buffer[2] = (uint8_t)len;
+  Tx_Buffer[3] = (uint8_t)( len >> 8 );
+
+  crc = CalcCRC( &Tx_Buffer[4], len );
+  Tx_Buffer[4 + len] = (uint8_t)crc;
+  Tx_Buffer[5 + len] = (uint8_t)( crc >> 8 );
+  Tx_Buffer[6 + len] = OTA_EOF;
+
+  ota_tx( Tx_Buffer, len + 7u );
+}
+
+/**
+  * @brief Send a frame, COBS encoded on the fly in a COBS session.
+  * @param buf frame
+  * @param len frame length
+  * @retval none
+  */
+static void ota_tx( const uint8_t *buf, uint16_t len )
+{
+  uint16_t pos = 0u;
+  uint16_t run;
+  uint8_t  code;
+
+  if( !ota_cobs )
+  {
+    HAL_UART_Transmit( &BL_UART, (uint8_t *)buf, len, HAL_MAX_DELAY );
+    return;
+  }
+
+  //code byte (distance to the next zero), then the bytes up to that zero
+  for( ;; )
+  {
+    run = 0u;
+    while( ( ( pos + run ) < len ) && ( run < 254u ) && ( buf[pos + run] != 0u ) )
+    {
+      run++;
+    }
+    code = (uint8_t)( run + 1u );
+    HAL_UART_Transmit( &BL_UART, &code, 1u, HAL_MAX_DELAY );
+    if( run != 0u )
+    {
+      HAL_UART_Transmit( &BL_UART, (uint8_t *)&buf[pos], run, HAL_MAX_DELAY );
+    }
+    pos += run;
+    if( pos >= len )
+    {
+      break;
+    }
+    if( run < 254u )
+    {
+      pos++;      //the zero, given by the code
+    }
+  }
+  code = OTA_COBS_DELIM;
+  HAL_UART_Transmit( &BL_UART, &code, 1u, HAL_MAX_DELAY );
+}
+
+/**
+  * @brief Write data to the Slot, erased by ota_open_slot()
+  * @param slot_num slot to be written (not used for a bootloader image)
   * @param data data to be written
+  * @param offset image offset of the data (multiple of 8)
   * @param data_len data length
-  * @is_first_block true - if this is first block, false - not first block
   * @retval HAL_StatusTypeDef
   */
 
 static HAL_StatusTypeDef write_data_to_slot( uint8_t slot_num,
                                              uint8_t *data,
-                                             uint16_t data_len,
-                                             bool is_first_block )
+                                             uint32_t offset,
+                                             uint16_t data_len )
 {
   HAL_StatusTypeDef ret;
-  uint32_t FirstPage = 0, NbOfPages = 0, BankNumber = 0;
-  uint32_t Address = 0, PAGEError = 0;
-  __IO uint32_t data32 = 0 , MemoryProgramStatus = 0;
   do
   {
 
-    if( slot_num >= OTA_NO_OF_SLOTS )
+    if( ( fw_type == FW_TYPE_APP ) && ( slot_num >= OTA_NO_OF_SLOTS ) )
     {
       ret = HAL_ERROR;
       break;
@@ -663,66 +2389,41 @@ static HAL_StatusTypeDef write_data_to_slot( uint8_t slot_num,
       break;
     }
 
-    //No need to erase every time. Erase only the first time.
-    if( is_first_block )
-    {
-        printf("Erasing the Slot %d Flash memory...\r\n", slot_num);
-        //Erase the Flash
-        FLASH_EraseInitTypeDef EraseInitStruct;
-		HAL_FLASH_Unlock();
-
-		uint32_t erase_start_addr,erase_end_addr;
-		if(fw_type == FW_TYPE_APP)
-		{
-			erase_start_addr = OTA_NEW_FW_START_ADDR;
-			erase_end_addr = OTA_NEW_FW_END_ADDR;
-		}
-		else
-		{
-			erase_start_addr = OTA_NEW_BOOTLOADER_START_ADDR;
-			erase_end_addr = OTA_NEW_BOOTLOADER_END_ADDR;
-		}
-		FirstPage = GetPage(erase_start_addr);
-		/* Get the number of pages to erase from 1st page */
-		NbOfPages = GetPage(erase_end_addr) - FirstPage;
-		/* Get the bank */
-		BankNumber = GetBank(FLASH_USER_START_ADDR);
-		/* Fill EraseInit structure*/
-		EraseInitStruct.TypeErase   = FLASH_TYPEERASE_PAGES;
-		EraseInitStruct.Banks       = BankNumber;
-		EraseInitStruct.Page        = FirstPage;
-		EraseInitStruct.NbPages     = NbOfPages;
-		ret = HAL_FLASHEx_Erase(&EraseInitStruct, &PAGEError);
-		HAL_FLASH_Lock();
-
-	  if( ret != HAL_OK )
-	  {
-		printf("Flash Erase Error\r\n");
-		break;
-	  }
-    }
-
-    uint32_t flash_addr = fw_type == FW_TYPE_APP ? OTA_NEW_FW_START_ADDR : OTA_NEW_BOOTLOADER_START_ADDR;
-
-	HAL_FLASH_Unlock();
+    uint32_t flash_addr = fw_type == FW_TYPE_APP ? OTA_SLOT_ADDR( slot_num ) : OTA_NEW_BOOTLOADER_START_ADDR;
 
     for(int i = 0; i < data_len; i += 8 )
     {
+      uint32_t dw = ( offset + i ) / 8u;
       uint64_t data64=0;
       for(int j=0; j<8; j++)
       {
-    	  data64 |= (uint64_t)data[i + j] << (j * 8);
+    	  //pad the last doubleword with the erased value
+    	  data64 |= (uint64_t)( ( i + j < data_len ) ? data[i + j] : 0xFFu ) << (j * 8);
+      }
+
+      if( ( ota_dw_map[dw / 32u] & ( 1uL << ( dw % 32u ) ) ) != 0u )
+      {
+        //already written by a previous copy of this frame
+        if( *(__IO uint64_t *)( flash_addr + offset + i ) != data64 )
+        {
+          TRACE_ERR( TRC_OTA_DATA_CONFLICT, offset + i );
+          ret = HAL_ERROR;
+          break;
+        }
+        continue;
       }
-      ret = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, (flash_addr + ota_fw_received_size), data64);
+
+      ret = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, (flash_addr + offset + i), data64);
 
       if( ret == HAL_OK )
       {
         //update the data count
+        ota_dw_map[dw / 32u] |= ( 1uL << ( dw % 32u ) );
         ota_fw_received_size += 8;
       }
       else
       {
-        printf("Flash Write Error\r\n");
+        TRACE_ERR( TRC_SLOT_WRITE_ERR, offset + i );
         break;
       }
     }
@@ -731,6 +2432,7 @@ static HAL_StatusTypeDef write_data_to_slot( uint8_t slot_num,
     {
       break;
     }
+    ota_mark_pages( offset, data_len );
 
     ret = HAL_FLASH_Lock();
     if( ret != HAL_OK )
@@ -744,37 +2446,59 @@ static HAL_StatusTypeDef write_data_to_slot( uint8_t slot_num,
 }
 
 /**
-  * @brief Return the available slot number
+  * @brief Return the available slot number, in this order :
+  *        - the slot already holding this image (complete or interrupted
+  *          upload), the session resumes or installs it,
+  *        - an empty slot, or an interrupted upload of another image,
+  *        - the oldest complete image that is not staged,
+  *        - the oldest staged image (last resort).
+  *        Oldest is the lowest stage_seq. The image the bootloader keeps
+  *        for rollback gets the highest one, it goes last. A complete image
+  *        with no stage_seq (erased) goes first.
   * @param none
   * @retval slot number
   */
 static uint8_t get_available_slot_number( void )
 {
   uint8_t   slot_number = 0xFF;
+  uint8_t   best_rank   = 0xFF;
+  uint32_t  best_age    = 0u;
 
-  /* Read the configuration */
-  OTA_GNRL_CFG_ cfg;
-  memcpy( &cfg, cfg_flash, sizeof(OTA_GNRL_CFG_) );
-  /*
-   * Check the slot is valid or not. If it is valid,
-   * then check the slot is active or not.
-   *
-   * If it is valid and not active, then use that slot.
-   * If it is not valid, then use that slot.
-   *
-   */
-
-   for( uint8_t i = 0; i < OTA_NO_OF_SLOTS; i++ )
-   {
-     if( ( cfg.slot_table[i].is_this_slot_not_valid != 0u ) || ( cfg.slot_table[i].is_this_slot_active == 0u ) )
-     {
-       slot_number = i;
-       printf("Slot %d is available for OTA update\r\n", slot_number);
-       break;
-     }
-   }
-
-   return 0;
+  for( uint8_t i = 0; i < OTA_NO_OF_SLOTS; i++ )
+  {
+    OTA_SLOT_ *slot = &cfg_flash->slot_table[i];
+    uint8_t   rank;
+    uint32_t  age;
+
+    if( ( slot->is_this_slot_not_valid <= 1u ) && ota_slot_holds_image( slot ) )
+    {
+      rank = 0u;
+    }
+    else if( slot->is_this_slot_not_valid != 0u )
+    {
+      rank = 1u;
+    }
+    else if( slot->should_we_run_this_fw == 1u )
+    {
+      rank = 3u;
+    }
+    else
+    {
+      rank = 2u;
+    }
+    //0 : no stage_seq, before the oldest one
+    age = ( slot->stage_seq == UINT32_MAX ) ? 0u : ( slot->stage_seq + 1u );
+
+    if( ( rank < best_rank ) || ( ( rank == best_rank ) && ( age < best_age ) ) )
+    {
+      slot_number = i;
+      best_rank   = rank;
+      best_age    = age;
+    }
+  }
+
+  TRACE_INF( TRC_SLOT_AVAILABLE, slot_number );
+  return slot_number;
 }
 
 
@@ -1021,7 +2745,7 @@ static HAL_StatusTypeDef write_cfg_to_flash( OTA_GNRL_CFG_ *cfg )
 							   data64);
       if( ret != HAL_OK )
       {
-        printf("Slot table Flash Write Error\r\n");
+        TRACE_ERR( TRC_CFG_WRITE_ERR );
         break;
       }
 
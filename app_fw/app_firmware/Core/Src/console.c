@@ -0,0 +1,164 @@
+#include "console.h"
+
+extern UART_HandleTypeDef hlpuart1;
+#define CONSOLE_UART hlpuart1
+
+#define CONSOLE_BUF_MASK  ( CONSOLE_BUF_SIZE - 1u )
+
+/*
+ * Single producer (printf, thread mode) / single consumer (DMA completion).
+ * head is only written by the producer, tail only by the consumer. Both are
+ * free running counters, (head - tail) is the number of queued bytes.
+ */
+static uint8_t console_buf[ CONSOLE_BUF_SIZE ];
+static volatile uint32_t console_head;
+static volatile uint32_t console_tail;
+/* Bytes handed to the DMA. 0 when the DMA is idle. */
+static volatile uint32_t console_dma_len;
+/* Bytes dropped because the buffer was full */
+static volatile uint32_t console_drop_cnt;
+
+/**
+  * @brief Start a DMA transfer of the queued bytes if the DMA is idle.
+  *        Only the DMA start is arbitrated (thread mode vs TX complete
+  *        interrupt), the ring buffer itself is lock-free.
+  * @param none
+  * @retval none
+  */
+static void console_kick( void )
+{
+  uint32_t primask = __get_PRIMASK();
+  __disable_irq();
+
+  if( console_dma_len == 0u )
+  {
+    uint32_t used = console_head - console_tail;
+    if( used != 0u )
+    {
+      uint32_t idx = console_tail & CONSOLE_BUF_MASK;
+      uint32_t len = CONSOLE_BUF_SIZE - idx;    //contiguous part only
+
+      if( len > used )
+      {
+        len = used;
+      }
+
+      console_dma_len = len;
+      if( HAL_UART_Transmit_DMA( &CONSOLE_UART, &console_buf[idx], (uint16_t)len ) != HAL_OK )
+      {
+        console_dma_len = 0u;
+      }
+    }
+  }
+
+  __set_PRIMASK( primask );
+}
+
+/**
+  * @brief Queue one character. Never blocks.
+  * @param ch character to send
+  * @retval none
+  */
+void console_putc( uint8_t ch )
+{
+  uint32_t head = console_head;
+
+  if( ( head - console_tail ) >= CONSOLE_BUF_SIZE )
+  {
+    //Full. Drop it.
+    console_drop_cnt++;
+    return;
+  }
+
+  console_buf[ head & CONSOLE_BUF_MASK ] = ch;
+  __DMB();
+  console_head = head + 1u;
+
+  //Send complete lines, or earlier if the buffer fills up
+  if( ( ch == '\n' ) || ( ( console_head - console_tail ) >= ( CONSOLE_BUF_SIZE / 2u ) ) )
+  {
+    console_kick();
+  }
+}
+
+/**
+  * @brief Queue a block of characters. Never blocks.
+  * @param data characters to send
+  * @param len number of characters
+  * @retval none
+  */
+void console_write( const uint8_t *data, uint32_t len )
+{
+  for( uint32_t i = 0u; i < len; i++ )
+  {
+    console_putc( data[i] );
+  }
+  console_kick();
+}
+
+/**
+  * @brief Queue a binary record as a whole. Never blocks. If the record does
+  *        not fit, nothing is queued, so the host never sees a partial record.
+  * @param data record to send
+  * @param len record length
+  * @retval true if queued, false if dropped
+  */
+bool console_write_record( const uint8_t *data, uint32_t len )
+{
+  uint32_t head = console_head;
+
+  if( ( CONSOLE_BUF_SIZE - ( head - console_tail ) ) < len )
+  {
+    console_drop_cnt += len;
+    return false;
+  }
+
+  for( uint32_t i = 0u; i < len; i++ )
+  {
+    console_buf[ ( head + i ) & CONSOLE_BUF_MASK ] = data[i];
+  }
+  __DMB();
+  console_head = head + len;
+
+  console_kick();
+  return true;
+}
+
+/**
+  * @brief Wait until everything queued has been sent (before a reset).
+  * @param timeout maximum wait in ms
+  * @retval none
+  */
+void console_flush( uint32_t timeout )
+{
+  uint32_t start = HAL_GetTick();
+
+  console_kick();
+  while( ( ( console_head != console_tail ) || ( console_dma_len != 0u ) ) &&
+         ( ( HAL_GetTick() - start ) < timeout ) )
+  {
+  }
+}
+
+/**
+  * @brief LPUART1 TX complete (interrupt context). Release the sent bytes
+  *        and start the next transfer.
+  * @param none
+  * @retval none
+  */
+void console_tx_cplt( void )
+{
+  console_tail    = console_tail + console_dma_len;
+  console_dma_len = 0u;
+  console_kick();
+}
+
+/**
+  * @brief Number of characters dropped because the buffer was full.
+  * @param none
+  * @retval dropped characters since boot
+  */
+uint32_t console_dropped( void )
+{
+  return console_drop_cnt;
+}
@@ -25,6 +25,9 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include "boot.h"
+#include "boot_prof.h"
+#include "console.h"
+#include "trace.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -49,7 +52,7 @@ UART_HandleTypeDef hlpuart1;
 UART_HandleTypeDef huart3;
 
 /* USER CODE BEGIN PV */
-
+DMA_HandleTypeDef hdma_lpuart1_tx;
 /* USER CODE END PV */
 
 /* Private function prototypes -----------------------------------------------*/
@@ -59,7 +62,8 @@ static void MX_LPUART1_UART_Init(void);
 static void MX_USART3_UART_Init(void);
 static void MX_CRC_Init(void);
 /* USER CODE BEGIN PFP */
-
+static void run_ota_update(void);
+static void console_dma_init(void);
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
@@ -72,7 +76,8 @@ static void MX_CRC_Init(void);
 
 PUTCHAR_PROTOTYPE
 {
-  HAL_UART_Transmit(&hlpuart1, (uint8_t *)&ch, 1, HAL_MAX_DELAY);
+  /* Queued, sent by LPUART1 TX DMA. Never blocks. */
+  console_putc( (uint8_t)ch );
   return ch;
 }
 
@@ -87,6 +92,61 @@ static void goto_application(void)
   void (*app_reset_handler)(void) = (void*)(*((volatile uint32_t*) (OTA_NEW_BOOTLOADER_START_ADDR + 4U)));
   app_reset_handler();    //call the app reset handler
 }
+
+static void run_ota_update(void)
+{
+  static bool running = false;
+
+  /* OTA Request. One frame from the UART per call, the application keeps
+   * running while the image is received and flashed. */
+  OTA_EX_ ret = ota_poll();
+  if( ret == OTA_EX_IDLE )
+  {
+	return;
+  }
+  if( ret == OTA_EX_BUSY )
+  {
+	if( !running )
+	{
+	  running = true;
+	  printf("Starting Firmware Download in the background!!!\r\n");
+	}
+	return;
+  }
+  running = false;
+
+  if( ret == OTA_EX_NO_UPDATE )
+  {
+	/* The host image is the one running : nothing written, keep running */
+	printf("Firmware is up to date\r\n");
+	HAL_GPIO_WritePin(LED_GPIO_Port, LED_Pin, GPIO_PIN_RESET);
+  }
+  else if( ret == OTA_EX_ABORTED )
+  {
+	/* The host stopped the session : nothing to install, keep running. The
+	 * slot keeps what was written, a new session resumes it. */
+	printf("Firmware Download aborted\r\n");
+	HAL_GPIO_WritePin(LED_GPIO_Port, LED_Pin, GPIO_PIN_RESET);
+  }
+  else if( ret != OTA_EX_OK )
+  {
+	/* Error. The session is lost (too many errors or a fatal one) : reset,
+	 * the host opens a new session and resumes the upload. */
+	printf("OTA Update : ERROR!!! Rebooting...\r\n");
+	//HAL_GPIO_WritePin(LED_OR_GPIO_Port, LED_OR_Pin, GPIO_PIN_SET);
+	console_flush( 100 );
+	HAL_NVIC_SystemReset();
+  }
+  else
+  {
+	HAL_GPIO_WritePin(LED_GPIO_Port, LED_Pin, GPIO_PIN_RESET);
+	/* Reset to load the new application */
+	printf("Firmware update is done!!! Rebooting...\r\n");
+	printf("Log bytes dropped : %lu\r\n", console_dropped());
+	console_flush( 100 );
+	HAL_NVIC_SystemReset();
+  }
+}
 /* USER CODE END 0 */
 
 /**
@@ -96,7 +156,8 @@ static void goto_application(void)
 int main(void)
 {
   /* USER CODE BEGIN 1 */
-
+  boot_prof_mark( BOOT_PROF_APP_START );
+  uint32_t led_tick = 0u;
   /* USER CODE END 1 */
 
   /* MCU Configuration--------------------------------------------------------*/
@@ -112,7 +173,7 @@ int main(void)
   SystemClock_Config();
 
   /* USER CODE BEGIN SysInit */
-
+  console_dma_init();
   /* USER CODE END SysInit */
 
   /* Initialize all configured peripherals */
@@ -121,46 +182,14 @@ int main(void)
   MX_USART3_UART_Init();
   MX_CRC_Init();
   /* USER CODE BEGIN 2 */
-  bool goto_ota_mode = false;
-	GPIO_PinState OTA_Pin_state;
-	uint32_t end_tick = HAL_GetTick() + 7000;   // from now to 7 Seconds
+  boot_prof_mark( BOOT_PROF_APP_INIT );
+  boot_prof_report();
+  trace_init();
 
+	/* OTA entry is event driven : BOOT_SWITCH (EXTI), OTA_ENTER_REQ on the
+	 * OTA UART or the OTA_REQUEST reboot cause. No delay on normal boots. */
+	ota_entry_init();
 	printf("Press Boot button to trigger OTA update...\r\n");
-	do
-	{
-	  OTA_Pin_state = HAL_GPIO_ReadPin( BOOT_SWITCH_GPIO_Port, BOOT_SWITCH_Pin );
-	  uint32_t current_tick = HAL_GetTick();
-
-	  /* Check the button is pressed or not for 7seconds */
-	  if( ( OTA_Pin_state != GPIO_PIN_SET ) || ( current_tick > end_tick ) )
-	  {
-		/* Either timeout or Button is pressed */
-		break;
-	  }
-	}while( !goto_ota_mode );
-
-	/*Start the Firmware or Application update */
-	if( ( OTA_Pin_state == GPIO_PIN_RESET ) || ( goto_ota_mode ) )
-	{
-	  printf("Starting Firmware Download!!!\r\n");
-	  HAL_GPIO_WritePin(LED_GPIO_Port, LED_Pin, GPIO_PIN_SET);
-	  /* OTA Request. Receive the data from the UART4 and flash */
-	  if( ota_download_and_flash() != OTA_EX_OK )
-	  {
-		/* Error. Don't process. */
-		printf("OTA Update : ERROR!!! HALT!!!\r\n");
-		//HAL_GPIO_WritePin(LED_OR_GPIO_Port, LED_OR_Pin, GPIO_PIN_SET);
-
-		while( 1 );
-	  }
-	  else
-	  {
-		HAL_GPIO_WritePin(LED_GPIO_Port, LED_Pin, GPIO_PIN_RESET);
-		/* Reset to load the new application */
-		printf("Firmware update is done!!! Rebooting...\r\n");
-		HAL_NVIC_SystemReset();
-	  }
-	}
 
 	HAL_GPIO_WritePin(LED_GPIO_Port, LED_Pin, GPIO_PIN_RESET);
 	//Load the updated app, if it is available
@@ -174,8 +203,15 @@ int main(void)
   /* USER CODE BEGIN WHILE */
   while (1)
   {
-	  HAL_GPIO_TogglePin(LED_GPIO_Port, LED_Pin);
-	  HAL_Delay(100);
+	  run_ota_update();
+	  if( ( HAL_GetTick() - led_tick ) >= 100u )
+	  {
+		led_tick = HAL_GetTick();
+		HAL_GPIO_TogglePin(LED_GPIO_Port, LED_Pin);
+	  }
+	  /* Nothing else to do : sleep until the next interrupt (OTA UART byte,
+	   * SysTick) */
+	  ota_sleep();
     /* USER CODE END WHILE */
 
     /* USER CODE BEGIN 3 */
@@ -292,7 +328,8 @@ static void MX_LPUART1_UART_Init(void)
     Error_Handler();
   }
   /* USER CODE BEGIN LPUART1_Init 2 */
-
+  HAL_NVIC_SetPriority(LPUART1_IRQn, 6, 0);
+  HAL_NVIC_EnableIRQ(LPUART1_IRQn);
   /* USER CODE END LPUART1_Init 2 */
 
 }
@@ -327,7 +364,8 @@ static void MX_USART3_UART_Init(void)
     Error_Handler();
   }
   /* USER CODE BEGIN USART3_Init 2 */
-
+  HAL_NVIC_SetPriority(USART3_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(USART3_IRQn);
   /* USER CODE END USART3_Init 2 */
 
 }
@@ -364,11 +402,62 @@ static void MX_GPIO_Init(void)
   HAL_GPIO_Init(LED_GPIO_Port, &GPIO_InitStruct);
 
 /* USER CODE BEGIN MX_GPIO_Init_2 */
+  /* BOOT_SWITCH requests the OTA mode through EXTI (pressed = low) */
+  GPIO_InitStruct.Pin = BOOT_SWITCH_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_IT_FALLING;
+  GPIO_InitStruct.Pull = GPIO_PULLUP;
+  HAL_GPIO_Init(BOOT_SWITCH_GPIO_Port, &GPIO_InitStruct);
+
+  HAL_NVIC_SetPriority(EXTI9_5_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(EXTI9_5_IRQn);
 /* USER CODE END MX_GPIO_Init_2 */
 }
 
 /* USER CODE BEGIN 4 */
+/**
+  * @brief DMA used by the console (LPUART1 TX : DMA2 channel 6, request 4).
+  *        Must run before MX_LPUART1_UART_Init() which links the channel.
+  * @retval None
+  */
+static void console_dma_init(void)
+{
+  __HAL_RCC_DMA2_CLK_ENABLE();
 
+  HAL_NVIC_SetPriority(DMA2_Channel6_IRQn, 6, 0);
+  HAL_NVIC_EnableIRQ(DMA2_Channel6_IRQn);
+}
+
+void HAL_GPIO_EXTI_Callback(uint16_t GPIO_Pin)
+{
+  if( GPIO_Pin == BOOT_SWITCH_Pin )
+  {
+    ota_entry_request( OTA_ENTRY_BUTTON );
+  }
+}
+
+void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart)
+{
+  if( huart == &hlpuart1 )
+  {
+    console_tx_cplt();
+  }
+}
+
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart)
+{
+  if( huart == &huart3 )
+  {
+    ota_entry_uart_rx_cplt();
+  }
+}
+
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart)
+{
+  if( huart == &huart3 )
+  {
+    ota_entry_uart_error();
+  }
+}
 /* USER CODE END 4 */
 
 /**
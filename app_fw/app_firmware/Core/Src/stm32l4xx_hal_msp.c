@@ -52,7 +52,7 @@
 
 /* External functions --------------------------------------------------------*/
 /* USER CODE BEGIN ExternalFunctions */
-
+extern DMA_HandleTypeDef hdma_lpuart1_tx;
 /* USER CODE END ExternalFunctions */
 
 /* USER CODE BEGIN 0 */
@@ -162,7 +162,23 @@ void HAL_UART_MspInit(UART_HandleTypeDef* huart)
     HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
 
   /* USER CODE BEGIN LPUART1_MspInit 1 */
+    /* LPUART1 DMA Init */
+    /* LPUART1_TX Init */
+    hdma_lpuart1_tx.Instance = DMA2_Channel6;
+    hdma_lpuart1_tx.Init.Request = DMA_REQUEST_4;
+    hdma_lpuart1_tx.Init.Direction = DMA_MEMORY_TO_PERIPH;
+    hdma_lpuart1_tx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_lpuart1_tx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_lpuart1_tx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_lpuart1_tx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_lpuart1_tx.Init.Mode = DMA_NORMAL;
+    hdma_lpuart1_tx.Init.Priority = DMA_PRIORITY_LOW;
+    if (HAL_DMA_Init(&hdma_lpuart1_tx) != HAL_OK)
+    {
+      Error_Handler();
+    }
 
+    __HAL_LINKDMA(huart,hdmatx,hdma_lpuart1_tx);
   /* USER CODE END LPUART1_MspInit 1 */
   }
   else if(huart->Instance==USART3)
@@ -225,7 +241,7 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef* huart)
     HAL_GPIO_DeInit(GPIOA, GPIO_PIN_2|GPIO_PIN_3);
 
   /* USER CODE BEGIN LPUART1_MspDeInit 1 */
-
+    HAL_DMA_DeInit(huart->hdmatx);
   /* USER CODE END LPUART1_MspDeInit 1 */
   }
   else if(huart->Instance==USART3)
@@ -0,0 +1,64 @@
+#include <string.h>
+#include "trace.h"
+#include "console.h"
+
+/* Largest record : SOR + ID + Nargs + Timestamp + 3 args */
+#define TRACE_REC_MAX  ( 1u + 2u + 1u + 4u + ( 3u * 4u ) )
+
+/* Records dropped because the console buffer was full */
+static uint32_t trace_drop_cnt;
+
+/**
+  * @brief Make sure the DWT cycle counter runs. When the bootloader already
+  *        started it (boot profiler) it is left untouched so the timestamps
+  *        continue from reset.
+  * @param none
+  * @retval none
+  */
+void trace_init( void )
+{
+  if( ( DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk ) == 0u )
+  {
+    CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+    DWT->CYCCNT       = 0u;
+    DWT->CTRL        |= DWT_CTRL_CYCCNTENA_Msk;
+  }
+}
+
+/**
+  * @brief Queue one binary trace record on the console. Use the TRACE_xxx
+  *        macros instead of calling this directly.
+  *        Thread mode only (the console has a single producer).
+  * @param id event (TRACE_EVENT_)
+  * @param nargs number of valid arguments (0 to 3)
+  * @param a0 first argument
+  * @param a1 second argument
+  * @param a2 third argument
+  * @retval none
+  */
+void trace_emit( uint16_t id, uint8_t nargs, uint32_t a0, uint32_t a1, uint32_t a2 )
+{
+  uint8_t  rec[TRACE_REC_MAX];
+  uint32_t args[3] = { a0, a1, a2 };
+  uint32_t ts      = DWT->CYCCNT;
+  uint32_t len     = 0u;
+
+  if( nargs > 3u )
+  {
+    nargs = 3u;
+  }
+
+  rec[len++] = TRACE_SOR;
+  rec[len++] = (uint8_t)( id );
+  rec[len++] = (uint8_t)( id >> 8 );
+  rec[len++] = nargs;
+  memcpy( &rec[len], &ts, sizeof(ts) );               //Cortex-M4 is little endian
+  len += sizeof(ts);
+  memcpy( &rec[len], args, nargs * sizeof(uint32_t) );
+  len += nargs * sizeof(uint32_t);
+
+  if( !console_write_record( rec, len ) )
+  {
+    trace_drop_cnt++;
+  }
+}
@@ -10,6 +10,8 @@
 #define OTA_ACK  0x00    // ACK
 #define OTA_NACK 0x01    // NACK
 
+#define OTA_ENTER_REQ 0x55  // Request to enter the OTA mode (single byte, no frame)
+
 #define PACKET_CAPTURE_TIMEOUT 250
 
 
@@ -46,8 +48,18 @@
 #define FW_TYPE_BOOTLDR		0x02
 
 
-#define OTA_NO_OF_SLOTS           1            //Number of slots
-#define OTA_SLOT_MAX_SIZE        (128 * 1024)  //Each slot size (512KB)
+/*
+ * Staging slots : the new application region split in OTA_NO_OF_SLOTS
+ * slots of whole pages, then the scratch page of the swap install. The
+ * bootloader swaps a slot with the active region : the slot then holds the
+ * image that was running, it can switch back to it without a new upload.
+ */
+#define OTA_NO_OF_SLOTS           2            //Number of slots
+#define OTA_SLOT_SIZE            ( ( ( OTA_NEW_FW_END_ADDR - OTA_NEW_FW_START_ADDR - FLASH_PAGE_SIZE ) / \
+                                     OTA_NO_OF_SLOTS ) & ~( FLASH_PAGE_SIZE - 1u ) )  //Each slot size
+#define OTA_SLOT_ADDR( n )       ( OTA_NEW_FW_START_ADDR + ( (n) * OTA_SLOT_SIZE ) )  //Slot n start address
+#define OTA_SCRATCH_ADDR         OTA_SLOT_ADDR( OTA_NO_OF_SLOTS )  //Swap install scratch page
+#define OTA_JOURNAL_FLASH_ADDR   OTA_CONFIG_FLASH_END_ADDR         //Swap install progress (last config page)
 
 #define OTA_DATA_MAX_SIZE ( 128 )  //Maximum data Size
 #define OTA_DATA_OVERHEAD (    9 )  //data overhead
@@ -103,6 +115,7 @@ typedef enum
   OTA_CMD_FWDATA = 3,
   OTA_CMD_END   = 4,    // OTA End command
   OTA_CMD_ABORT = 5,    // OTA Abort command
+  OTA_CMD_ENTER = 6,    // Response to OTA_ENTER_REQ
 }OTA_CMD_;
 
 /*
@@ -117,20 +130,60 @@ typedef struct
     uint32_t fw_crc;                  //Slot's firmware/application CRC
     uint16_t fw_version;
     uint8_t new_app_fw_available;
-    uint8_t reserved1;
-    uint32_t reserved2;
+    uint8_t fw_type;                  //Slot's firmware type (FW_TYPE_APP, FW_TYPE_BOOTLDR)
+    uint32_t stage_seq;               //Staging order, the newest image has the highest (0xFFFFFFFF : none)
     uint32_t reserved3;
 }__attribute__((packed)) OTA_SLOT_;
 
+/*
+ * Application in the active region, written when a slot is installed.
+ * Erased (0xFF) until the first install.
+ */
+typedef struct
+{
+    uint32_t fw_size;
+    uint32_t fw_crc;
+    uint16_t fw_version;
+    uint8_t  fw_type;
+    uint8_t  reserved;
+}__attribute__((packed)) OTA_ACTIVE_FW_;
+
 /*
  * General configuration
  */
 typedef struct
 {
-    uint32_t  reboot_cause;
-    OTA_SLOT_ slot_table[OTA_NO_OF_SLOTS];
+    uint32_t       reboot_cause;
+    OTA_SLOT_      slot_table[OTA_NO_OF_SLOTS];
+    OTA_ACTIVE_FW_ active_fw;
 }__attribute__((packed)) OTA_GNRL_CFG_;
 
+/*
+ * Swap install journal (OTA_JOURNAL_FLASH_ADDR)
+ *
+ * This header is programmed before the first page is touched. Then comes
+ * one doubleword per step done : the step number in the low word, its
+ * complement in the high word. A step whose record is missing or broken
+ * (power loss while it was programmed) is done again.
+ *
+ * Steps, 3 for each page i of the swap :
+ *   3i     scratch page  <- active page i
+ *   3i + 1 active page i <- slot page i
+ *   3i + 2 slot page i   <- scratch page
+ * then step 3 * pages : the configuration below is written, the journal
+ * is closed.
+ */
+#define OTA_SWAP_MAGIC            ( 0x53574150 )      //"SWAP"
+
+typedef struct
+{
+    uint32_t       magic;         //OTA_SWAP_MAGIC
+    uint8_t        slot;          //Slot swapped with the active region
+    uint8_t        pages;         //Pages swapped
+    uint16_t       crc;           //CalcCRC() of cfg
+    OTA_GNRL_CFG_  cfg;           //Configuration once the swap is done
+}__attribute__((packed)) OTA_SWAP_HDR_;
+
 /*
  * OTA meta info
  */
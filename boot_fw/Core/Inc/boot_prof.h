@@ -0,0 +1,53 @@
+#ifndef BOOT_PROF_H
+#define BOOT_PROF_H
+
+#include <stdint.h>
+#include "main.h"
+
+/*
+ * Boot phase profiler.
+ *
+ * Timestamps are taken from the Cortex-M4 DWT cycle counter. The bootloader
+ * starts the record, the application completes and reports it. The record
+ * lives in the ".noinit" section (start of SRAM2) which both images place at
+ * the same address and which the startup code does not clear, so it survives
+ * the jump from the bootloader to the application.
+ *
+ * NOTE: this file is shared between boot_fw and app_fw. Keep both copies and
+ *       host_app/boot_prof_decode.py in sync.
+ */
+
+#define BOOT_PROF_MAGIC_RUN   ( 0xB007C10C )      //Bootloader started the record
+#define BOOT_PROF_MAGIC_DONE  ( 0xB007D0E5 )      //App completed the record
+
+/*
+ * Boot phases (order matters for the host decoder)
+ */
+typedef enum
+{
+  BOOT_PROF_HAL_INIT    = 0,    // Bootloader HAL_Init()
+  BOOT_PROF_CLOCK       = 1,    // Bootloader clock setup
+  BOOT_PROF_CFG_READ    = 2,    // Config read and slot lookup
+  BOOT_PROF_INSTALL     = 3,    // swap_run()
+  BOOT_PROF_VERIFY      = 4,    // CRC verify of the installed app, config write
+  BOOT_PROF_JUMP        = 5,    // Clock restore and hand over
+  BOOT_PROF_APP_START   = 6,    // App reset handler up to main()
+  BOOT_PROF_APP_INIT    = 7,    // App HAL, clock and peripheral init
+  BOOT_PROF_PHASE_COUNT = 8,
+}BOOT_PROF_PHASE_;
+
+/*
+ * Boot timing record
+ */
+typedef struct
+{
+  uint32_t magic;                               //BOOT_PROF_MAGIC_xxx
+  uint32_t last_cyc;                            //DWT->CYCCNT at the latest mark
+  uint32_t last_hz;                             //Core clock at the latest mark
+  uint32_t phase_us[BOOT_PROF_PHASE_COUNT];     //Duration of each phase (us)
+}__attribute__((packed)) BOOT_PROF_;
+
+void boot_prof_start( void );
+void boot_prof_mark( BOOT_PROF_PHASE_ phase );
+void boot_prof_report( void );
+#endif /* BOOT_PROF_H */
@@ -2,6 +2,7 @@
 #define __FLASH_H
 
 /* Includes ------------------------------------------------------------------*/
+#include <stdbool.h>
 #include "main.h"
 
 /* Exported types ------------------------------------------------------------*/
@@ -302,5 +303,7 @@ uint32_t FLASH_If_Write(uint32_t destination, uint32_t *p_source, uint32_t lengt
 uint32_t FLASH_If_WriteProtectionConfig(uint32_t modifier);
 uint32_t GetBank(uint32_t Addr);
 uint32_t GetPage(uint32_t Addr);
+bool flash_read_dw(uint32_t addr, uint64_t *data);
+bool flash_ecc_nmi(void);
 
 #endif  /* __FLASH_H */
@@ -5,37 +5,32 @@
 #include <stdbool.h>
 
 #include "flash.h"
+#include "boot_prof.h"
 
 extern UART_HandleTypeDef huart3;
 #define BL_UART huart3
 
-/* Buffer to hold the received data */
-static uint8_t Rx_Buffer[ OTA_PACKET_MAX_SIZE ];
-/* OTA State */
-static OTA_STATE_ ota_state = OTA_STATE_IDLE;
-
-static uint8_t fw_type;
-static uint16_t fw_version;
-/* Firmware Total Size that we are going to receive */
-static uint32_t ota_fw_total_size;
-/* Firmware image's CRC32 */
-static uint32_t ota_fw_crc;
-/* Firmware Size that we have received */
-static uint32_t ota_fw_received_size;
-/* Slot number to write the received firmware */
-static uint8_t slot_num_to_write;
 /* Configuration */
 OTA_GNRL_CFG_ *cfg_flash   = (OTA_GNRL_CFG_*) (OTA_CONFIG_FLASH_START_ADDR);
 
+/* Swap install : journal header size (doublewords), steps of a swap */
+#define SWAP_HDR_SIZE         ( ( sizeof(OTA_SWAP_HDR_) + 7u ) & ~7u )
+#define SWAP_STEPS( pages )   ( (uint32_t)(pages) * 3u )
+
 /* Hardware CRC handle */
 
-static HAL_StatusTypeDef write_data_to_slot( uint8_t slot_num,
-                                             uint8_t *data,
-                                             uint16_t data_len,
-                                             bool is_first_block );
-//static HAL_StatusTypeDef write_data_to_flash_app( uint8_t *data, uint32_t data_len );
-static uint8_t get_available_slot_number( void );
 static HAL_StatusTypeDef write_cfg_to_flash( OTA_GNRL_CFG_ *cfg );
+static void swap_prepare( OTA_SWAP_HDR_ *hdr, const OTA_GNRL_CFG_ *cfg, uint8_t slot_num );
+static bool swap_back_prepare( OTA_GNRL_CFG_ *cfg, uint8_t slot_num );
+static bool swap_verify( const OTA_SWAP_HDR_ *hdr );
+static bool swap_journal_read( OTA_SWAP_HDR_ *hdr, uint32_t *done, uint32_t *next );
+static HAL_StatusTypeDef swap_journal_start( const OTA_SWAP_HDR_ *hdr, uint32_t *next );
+static HAL_StatusTypeDef swap_journal_mark( uint32_t *next, uint32_t step );
+static HAL_StatusTypeDef swap_run( const OTA_SWAP_HDR_ *hdr, uint32_t done, uint32_t *next );
+static HAL_StatusTypeDef swap_close( OTA_GNRL_CFG_ *cfg, uint32_t steps, uint32_t *next );
+static HAL_StatusTypeDef swap_copy_page( uint32_t dst, uint32_t src );
+static HAL_StatusTypeDef swap_erase_page( uint32_t addr );
+static HAL_StatusTypeDef swap_program( uint32_t addr, const uint8_t *data, uint32_t len );
 
 
 
@@ -92,10 +87,8 @@ uint32_t CalcCRC(uint8_t * pData, uint32_t DataLength)
 // Calculate CRC-16
 uint16_t CalcCRC(const uint8_t *data, uint32_t length) {
     uint16_t crc = 0xFFFF;
-    uint8_t dt=0;
     for (uint32_t i = 0; i < length; i++) {
         crc = (crc << 8) ^ crc16_table[((crc >> 8) ^ data[i]) & 0xFF];
-        dt = data[i];
     }
 
     return crc;
@@ -295,178 +288,468 @@ static HAL_StatusTypeDef write_cfg_to_flash( OTA_GNRL_CFG_ *cfg )
 
 
 /**
-  * @brief Write data to the Application's actual flash location.
-  * @param data data to be written
-  * @param data_len data length
-  * @retval HAL_StatusTypeDef
+  * @brief Describe the install of a slot : the pages to swap and the
+  *        configuration once it is done. The active region then runs the
+  *        slot image, and the slot holds the image that was running (the
+  *        newest of the kept ones). An image running from a debug flash can
+  *        be larger than a slot : it is not kept, there is nothing to roll
+  *        back to.
+  * @param hdr journal header to fill
+  * @param cfg current configuration
+  * @param slot_num slot to install
+  * @retval none
   */
-static HAL_StatusTypeDef write_data_to_flash_app( uint8_t *data, uint32_t data_len )
+static void swap_prepare( OTA_SWAP_HDR_ *hdr, const OTA_GNRL_CFG_ *cfg, uint8_t slot_num )
 {
-  HAL_StatusTypeDef ret;
-  uint32_t FirstPage = 0, NbOfPages = 0, BankNumber = 0;
-  uint32_t PAGEError = 0;
-  static FLASH_EraseInitTypeDef EraseInitStruct;
+  const OTA_SLOT_      *slot     = &cfg->slot_table[slot_num];
+  const OTA_ACTIVE_FW_ *old      = &cfg->active_fw;
+  OTA_SLOT_            *kept     = &hdr->cfg.slot_table[slot_num];
+  bool                 keep_old  = ( old->fw_type == FW_TYPE_APP ) && ( old->fw_size != 0u ) &&
+                                   ( old->fw_size <= OTA_SLOT_SIZE );
+  uint32_t             pages     = ( slot->fw_size + FLASH_PAGE_SIZE - 1u ) / FLASH_PAGE_SIZE;
+
+  if( keep_old && ( ( ( old->fw_size + FLASH_PAGE_SIZE - 1u ) / FLASH_PAGE_SIZE ) > pages ) )
+  {
+    pages = ( old->fw_size + FLASH_PAGE_SIZE - 1u ) / FLASH_PAGE_SIZE;
+  }
 
-  do
+  hdr->magic = OTA_SWAP_MAGIC;
+  hdr->slot  = slot_num;
+  hdr->pages = (uint8_t)pages;
+  memcpy( &hdr->cfg, cfg, sizeof(OTA_GNRL_CFG_) );
+
+  //the application now running, the OTA session compares with it
+  hdr->cfg.active_fw.fw_size    = slot->fw_size;
+  hdr->cfg.active_fw.fw_crc     = slot->fw_crc;
+  hdr->cfg.active_fw.fw_version = slot->fw_version;
+  hdr->cfg.active_fw.fw_type    = slot->fw_type;
+  hdr->cfg.active_fw.reserved   = 0xFFu;
+
+  if( keep_old )
   {
-    ret = HAL_FLASH_Unlock();
-    if( ret != HAL_OK )
+    kept->is_this_slot_not_valid = 0u;
+    kept->fw_size                = old->fw_size;
+    kept->fw_crc                 = old->fw_crc;
+    kept->fw_version             = old->fw_version;
+    kept->fw_type                = old->fw_type;
+    kept->new_app_fw_available   = 0u;
+    kept->stage_seq              = 0u;
+    for( uint8_t i = 0; i < OTA_NO_OF_SLOTS; i++ )
     {
-      break;
+      if( ( cfg->slot_table[i].stage_seq != UINT32_MAX ) && ( cfg->slot_table[i].stage_seq >= kept->stage_seq ) )
+      {
+        kept->stage_seq = cfg->slot_table[i].stage_seq + 1u;
+      }
     }
-    //Check if the FLASH_FLAG_BSY.
-    FLASH_WaitForLastOperation( HAL_MAX_DELAY );
-    printf("Erasing the App Flash memory...\r\n");
-    //Erase the Flash
-	FirstPage = GetPage(OTA_ACTV_FW_START_ADDR);
-	/* Get the number of pages to erase from 1st page */
-	NbOfPages = GetPage(OTA_ACTV_FW_END_ADDR) - FirstPage + 1;
-	/* Get the bank */
-	BankNumber = GetBank(FLASH_USER_START_ADDR);
-	/* Fill EraseInit structure*/
-	EraseInitStruct.TypeErase   = FLASH_TYPEERASE_PAGES;
-	EraseInitStruct.Banks       = BankNumber;
-	EraseInitStruct.Page        = FirstPage;
-	EraseInitStruct.NbPages     = NbOfPages;
-	ret = HAL_FLASHEx_Erase(&EraseInitStruct, &PAGEError);
+  }
+  else
+  {
+    if( ( old->fw_type == FW_TYPE_APP ) && ( old->fw_size > OTA_SLOT_SIZE ) )
+    {
+      printf("The running application (%lu bytes) does not fit in a slot, it is not kept!!!\r\n",
+             (unsigned long)old->fw_size);
+    }
+    //nothing worth keeping : the slot is free for the next upload
+    memset( kept, 0xFF, sizeof(OTA_SLOT_) );
+  }
 
-    if( ret != HAL_OK )
+  for( uint8_t i = 0; i < OTA_NO_OF_SLOTS; i++ )
+  {
+    hdr->cfg.slot_table[i].is_this_slot_active   = 0u;
+    hdr->cfg.slot_table[i].should_we_run_this_fw = 0u;
+  }
+  hdr->cfg.reboot_cause = OTA_NORMAL_BOOT;
+  hdr->crc = CalcCRC( (const uint8_t *)&hdr->cfg, sizeof(OTA_GNRL_CFG_) );
+}
+
+/**
+  * @brief Turn the configuration of an install whose image is corrupted into
+  *        a request for the previous image (OTA_LOAD_PREV_APP), which the
+  *        install kept in the slot. The corrupted image is not kept when it
+  *        is swapped out (swap_prepare()).
+  * @param cfg configuration of the install, updated
+  * @param slot_num slot installed
+  * @retval true if the previous image was kept in the slot
+  */
+static bool swap_back_prepare( OTA_GNRL_CFG_ *cfg, uint8_t slot_num )
+{
+  if( ( cfg->slot_table[slot_num].is_this_slot_not_valid != 0u ) ||
+      ( cfg->slot_table[slot_num].fw_type != FW_TYPE_APP ) )
+  {
+    return false;
+  }
+
+  cfg->reboot_cause      = OTA_LOAD_PREV_APP;
+  cfg->active_fw.fw_size = 0u;
+  return true;
+}
+
+/**
+  * @brief Check the image installed in the active region.
+  * @param hdr journal header of the install
+  * @retval true if its CRC is the one of the configuration
+  */
+static bool swap_verify( const OTA_SWAP_HDR_ *hdr )
+{
+  uint16_t cal_data_crc;
+
+  FLASH_WaitForLastOperation( HAL_MAX_DELAY );
+  //uint32_t cal_data_crc = HAL_CRC_Calculate( &hcrc, (uint32_t*)OTA_APP_FLASH_ADDR, cfg.slot_table[slot_num].fw_size );
+  cal_data_crc = CalcCRC( (const uint8_t *)OTA_ACTV_FW_START_ADDR, hdr->cfg.active_fw.fw_size );
+  FLASH_WaitForLastOperation( HAL_MAX_DELAY );
+
+  return ( cal_data_crc == hdr->cfg.active_fw.fw_crc );
+}
+
+/**
+  * @brief Read the swap journal. A power loss can leave a double word of it
+  *        half programmed (or the page half erased) : its ECC then fails
+  *        (flash_read_dw()), the header is taken as missing, a record as not
+  *        done.
+  * @param hdr journal header
+  * @param done number of steps done (the closing one included)
+  * @param next where the next record goes
+  * @retval true if the journal holds a swap (done or not)
+  */
+static bool swap_journal_read( OTA_SWAP_HDR_ *hdr, uint32_t *done, uint32_t *next )
+{
+  uint64_t buf[ SWAP_HDR_SIZE / 8u ];
+
+  for( uint32_t i = 0u; i < ( SWAP_HDR_SIZE / 8u ); i++ )
+  {
+    if( !flash_read_dw( OTA_JOURNAL_FLASH_ADDR + ( i * 8u ), &buf[i] ) )
     {
-      printf("Flash erase Error\r\n");
-      break;
+      return false;
     }
+  }
+  memcpy( hdr, buf, sizeof(OTA_SWAP_HDR_) );
+  if( ( hdr->magic != OTA_SWAP_MAGIC ) || ( hdr->slot >= OTA_NO_OF_SLOTS ) || ( hdr->pages == 0u ) ||
+      ( hdr->pages > ( OTA_SLOT_SIZE / FLASH_PAGE_SIZE ) ) ||
+      ( hdr->crc != CalcCRC( (const uint8_t *)&hdr->cfg, sizeof(OTA_GNRL_CFG_) ) ) )
+  {
+    return false;
+  }
+
+  *done = 0u;
+  *next = OTA_JOURNAL_FLASH_ADDR + SWAP_HDR_SIZE;
+  for( uint32_t addr = *next; addr < ( OTA_JOURNAL_FLASH_ADDR + FLASH_PAGE_SIZE ); addr += 8u )
+  {
+    uint64_t record;
+    bool     readable = flash_read_dw( addr, &record );
+    uint32_t step     = (uint32_t)record;
+    uint32_t check    = (uint32_t)( record >> 32 );
 
-    for( uint32_t i = 0; i < data_len; i += 8 )
+    if( readable && ( step == ~check ) && ( step <= SWAP_STEPS( hdr->pages ) ) && ( step >= *done ) )
     {
+      *done = step + 1u;
+    }
+    if( !readable || ( record != UINT64_MAX ) )
+    {
+      //a broken record is skipped, never programmed again
+      *next = addr + 8u;
+    }
+  }
+  return true;
+}
+
+/**
+  * @brief Start the swap journal : erase it and program the header.
+  * @param hdr journal header
+  * @param next where the first record goes
+  * @retval HAL_StatusTypeDef
+  */
+static HAL_StatusTypeDef swap_journal_start( const OTA_SWAP_HDR_ *hdr, uint32_t *next )
+{
+  HAL_StatusTypeDef ret;
+  uint8_t           buf[ SWAP_HDR_SIZE ];
 
-	 uint64_t data64=0;
+  memset( buf, 0xFF, sizeof(buf) );
+  memcpy( buf, hdr, sizeof(OTA_SWAP_HDR_) );
 
-	 for(int j=0; j<8; j++)
-	 {
-		 data64 |= (uint64_t)data[i + j] << (j * 8);
-	 }
+  HAL_FLASH_Unlock();
+  ret = swap_erase_page( OTA_JOURNAL_FLASH_ADDR );
+  if( ret == HAL_OK )
+  {
+    ret = swap_program( OTA_JOURNAL_FLASH_ADDR, buf, sizeof(buf) );
+  }
+  HAL_FLASH_Lock();
 
-      ret = HAL_FLASH_Program(FLASH_TYPEPROGRAM_DOUBLEWORD, OTA_ACTV_FW_START_ADDR + i, data64);
-      if( ret != HAL_OK )
-      {
-        printf("App Flash Write Error\r\n");
-        break;
-      }
+  *next = OTA_JOURNAL_FLASH_ADDR + SWAP_HDR_SIZE;
+  return ret;
+}
+
+/**
+  * @brief Record a step done in the swap journal. The flash is unlocked.
+  * @param next where the record goes, moved to the next one
+  * @param step step done
+  * @retval HAL_StatusTypeDef
+  */
+static HAL_StatusTypeDef swap_journal_mark( uint32_t *next, uint32_t step )
+{
+  HAL_StatusTypeDef ret = HAL_ERROR;
+
+  if( *next < ( OTA_JOURNAL_FLASH_ADDR + FLASH_PAGE_SIZE ) )
+  {
+    ret = HAL_FLASH_Program( FLASH_TYPEPROGRAM_DOUBLEWORD, *next,
+                             ( (uint64_t)(uint32_t)~step << 32 ) | step );
+    *next += 8u;
+  }
+  return ret;
+}
+
+/**
+  * @brief Swap the slot with the active region through the scratch page,
+  *        from the first step not done. Each step only reads a page the
+  *        previous steps left intact, so it can be done again after a power
+  *        loss. The journal stays open (swap_close()).
+  * @param hdr journal header
+  * @param done steps already done
+  * @param next where the next journal record goes, updated
+  * @retval HAL_StatusTypeDef
+  */
+static HAL_StatusTypeDef swap_run( const OTA_SWAP_HDR_ *hdr, uint32_t done, uint32_t *next )
+{
+  HAL_StatusTypeDef ret = HAL_OK;
+
+  HAL_FLASH_Unlock();
+  for( uint32_t step = done; ( step < SWAP_STEPS( hdr->pages ) ) && ( ret == HAL_OK ); step++ )
+  {
+    uint32_t active = OTA_ACTV_FW_START_ADDR + ( ( step / 3u ) * FLASH_PAGE_SIZE );
+    uint32_t slot   = OTA_SLOT_ADDR( hdr->slot ) + ( ( step / 3u ) * FLASH_PAGE_SIZE );
+
+    switch( step % 3u )
+    {
+      case 0u:  ret = swap_copy_page( OTA_SCRATCH_ADDR, active ); break;
+      case 1u:  ret = swap_copy_page( active, slot );             break;
+      default:  ret = swap_copy_page( slot, OTA_SCRATCH_ADDR );   break;
     }
+    if( ret == HAL_OK )
+    {
+      ret = swap_journal_mark( next, step );
+    }
+  }
+  HAL_FLASH_Lock();
 
-    if( ret != HAL_OK )	break;
-    ret = HAL_FLASH_Lock();
-    if( ret != HAL_OK )	break;
+  return ret;
+}
 
+/**
+  * @brief Write the configuration once the swap is checked, then close the
+  *        journal. Until it is closed, a power loss gets back to the check.
+  * @param cfg configuration to write
+  * @param steps swap steps (the closing record)
+  * @param next where the next journal record goes, updated
+  * @retval HAL_StatusTypeDef
+  */
+static HAL_StatusTypeDef swap_close( OTA_GNRL_CFG_ *cfg, uint32_t steps, uint32_t *next )
+{
+  HAL_StatusTypeDef ret = write_cfg_to_flash( cfg );
 
-    //Check if the FLASH_FLAG_BSY.
-    FLASH_WaitForLastOperation( HAL_MAX_DELAY );
+  HAL_FLASH_Unlock();
+  if( ret == HAL_OK )
+  {
+    ret = swap_journal_mark( next, steps );
+  }
+  HAL_FLASH_Lock();
 
-  }while( false );
+  return ret;
+}
+
+/**
+  * @brief Erase a page and copy another one to it. The flash is unlocked.
+  * @param dst page to write
+  * @param src page to copy
+  * @retval HAL_StatusTypeDef
+  */
+static HAL_StatusTypeDef swap_copy_page( uint32_t dst, uint32_t src )
+{
+  HAL_StatusTypeDef ret = swap_erase_page( dst );
+
+  if( ret == HAL_OK )
+  {
+    ret = swap_program( dst, (const uint8_t *)src, FLASH_PAGE_SIZE );
+  }
+  return ret;
+}
+
+/**
+  * @brief Erase one page. The flash is unlocked.
+  * @param addr page address
+  * @retval HAL_StatusTypeDef
+  */
+static HAL_StatusTypeDef swap_erase_page( uint32_t addr )
+{
+  FLASH_EraseInitTypeDef EraseInitStruct;
+  uint32_t PAGEError = 0;
+
+  EraseInitStruct.TypeErase   = FLASH_TYPEERASE_PAGES;
+  EraseInitStruct.Banks       = GetBank(FLASH_USER_START_ADDR);
+  EraseInitStruct.Page        = GetPage(addr);
+  EraseInitStruct.NbPages     = 1u;
+  return HAL_FLASHEx_Erase(&EraseInitStruct, &PAGEError);
+}
+
+/**
+  * @brief Program erased flash, the erased doublewords (0xFF) are skipped.
+  *        The flash is unlocked.
+  * @param addr flash address (doubleword aligned)
+  * @param data data to program
+  * @param len length (multiple of 8)
+  * @retval HAL_StatusTypeDef
+  */
+static HAL_StatusTypeDef swap_program( uint32_t addr, const uint8_t *data, uint32_t len )
+{
+  HAL_StatusTypeDef ret = HAL_OK;
 
+  for( uint32_t i = 0u; ( i < len ) && ( ret == HAL_OK ); i += 8u )
+  {
+    uint64_t data64;
+
+    memcpy( &data64, &data[i], sizeof(data64) );
+    if( data64 != UINT64_MAX )
+    {
+      ret = HAL_FLASH_Program( FLASH_TYPEPROGRAM_DOUBLEWORD, addr + i, data64 );
+    }
+  }
   return ret;
 }
 
 /**
-  * @brief Load the new app to the app's actual flash memory.
+  * @brief Load the new app to the app's actual flash memory. An app that
+  *        fails its check is swapped back out : the previous one is loaded
+  *        again (one more call).
   * @param none
   * @retval none
   */
 void load_new_app( void )
 {
   bool              is_update_available = false;
-  uint8_t           slot_num;
+  bool              is_install_stopped  = false;
+  bool              is_app_valid;
+  uint8_t           slot_num = 0u;
   HAL_StatusTypeDef ret;
+  OTA_SWAP_HDR_     swap;
+  uint32_t          done;
+  uint32_t          next;
 
   /* Read the configuration */
   OTA_GNRL_CFG_ cfg;
   memcpy( &cfg, cfg_flash, sizeof(OTA_GNRL_CFG_) );
 
+  /*
+   * An install stopped by a power loss : finish it first, the journal tells
+   * where it stopped.
+   */
+  if( swap_journal_read( &swap, &done, &next ) && ( done <= SWAP_STEPS( swap.pages ) ) )
+  {
+    printf("Resuming the install of the slot %d (step %lu of %lu)!!!\r\n", swap.slot,
+           (unsigned long)done, (unsigned long)SWAP_STEPS( swap.pages ));
+    is_update_available = true;
+    is_install_stopped  = true;
+    slot_num            = swap.slot;
+  }
+
   /*
    * Check the slot whether it has a new application.
    */
 
-   for( uint8_t i = 0; i < OTA_NO_OF_SLOTS; i++ )
+   for( uint8_t i = 0; ( i < OTA_NO_OF_SLOTS ) && !is_update_available; i++ )
    {
-     if( cfg.slot_table[i].should_we_run_this_fw == 1u )
+     if( ( cfg.slot_table[i].should_we_run_this_fw == 1u ) &&
+         ( cfg.slot_table[i].is_this_slot_not_valid == 0u ) && ( cfg.slot_table[i].fw_type == FW_TYPE_APP ) )
      {
        printf("New Application is available in the slot %d!!!\r\n", i);
        is_update_available               = true;
        slot_num                          = i;
-
-       //update the slot
-       cfg.slot_table[i].is_this_slot_active    = 1u;
-       cfg.slot_table[i].should_we_run_this_fw  = 0u;
-
        break;
      }
    }
 
-   if( is_update_available )
+   /*
+    * The application asks for the previous version : the newest image kept
+    * in another slot, installed without a new download.
+    */
+   if( !is_update_available && ( cfg.reboot_cause == OTA_LOAD_PREV_APP ) )
    {
-     //make other slots inactive
      for( uint8_t i = 0; i < OTA_NO_OF_SLOTS; i++ )
      {
-       if( slot_num != i )
+       if( ( cfg.slot_table[i].is_this_slot_not_valid == 0u ) && ( cfg.slot_table[i].is_this_slot_active != 1u ) &&
+           ( cfg.slot_table[i].fw_type == FW_TYPE_APP ) &&
+           ( !is_update_available || ( cfg.slot_table[i].stage_seq > cfg.slot_table[slot_num].stage_seq ) ) )
        {
-         //update the slot as inactive
-         cfg.slot_table[i].is_this_slot_active = 0u;
+         is_update_available = true;
+         slot_num            = i;
        }
      }
+     if( is_update_available )
+     {
+       printf("Rolling back to the application in the slot %d!!!\r\n", slot_num);
+     }
+   }
+   boot_prof_mark( BOOT_PROF_CFG_READ );
 
-
-
-     uint32_t slot_addr = OTA_NEW_FW_START_ADDR;
-     //Load the new app or firmware to app's flash address
-     ret = write_data_to_flash_app( (uint8_t*)slot_addr, cfg.slot_table[slot_num].fw_size );
-     if( ret != HAL_OK )
+   if( is_update_available )
+   {
+     /*
+      * Swap the slot with the active region : the slot then holds the image
+      * that was running, to roll back to without a new download.
+      */
+     if( !is_install_stopped )
      {
-       printf("App Flash write Error\r\n");
+       swap_prepare( &swap, &cfg, slot_num );
+       done = 0u;
+       ret  = swap_journal_start( &swap, &next );
      }
      else
      {
-       // write back the updated config
-       ret = write_cfg_to_flash( &cfg );
-       if( ret != HAL_OK )
-       {
-         printf("Config Flash write Error\r\n");
-       }
+       ret = HAL_OK;
      }
+     if( ret == HAL_OK )
+     {
+       ret = swap_run( &swap, done, &next );
+     }
+     if( ret != HAL_OK )
+     {
+       printf("App Flash write Error\r\n");
+     }
+     boot_prof_mark( BOOT_PROF_INSTALL );
    }
    else
    {
-     //Find the active slot in case the update is not available
-     for( uint8_t i = 0; i < OTA_NO_OF_SLOTS; i++ )
-     {
-       if( cfg.slot_table[i].is_this_slot_active == 1u )
-       {
-         slot_num = i;
-         break;
-       }
-     }
-
      return;
    }
 
-   uint16_t slot_addr = OTA_ACTV_FW_START_ADDR;
-
-   //Verify the application is corrupted or not
+   /*
+    * Verify the application is corrupted or not, before the journal is
+    * closed : a power loss until then gets back here.
+    */
    printf("Verifying the Application...");
-
-   FLASH_WaitForLastOperation( HAL_MAX_DELAY );
-   //Verify the application
-   //uint32_t cal_data_crc = HAL_CRC_Calculate( &hcrc, (uint32_t*)OTA_APP_FLASH_ADDR, cfg.slot_table[slot_num].fw_size );
-   uint16_t cal_data_crc = CalcCRC((uint32_t*)OTA_ACTV_FW_START_ADDR, cfg.slot_table[slot_num].fw_size);
-   FLASH_WaitForLastOperation( HAL_MAX_DELAY );
-   //Verify the CRC
-   if( cal_data_crc != cfg.slot_table[slot_num].fw_crc )
+   is_app_valid = swap_verify( &swap );
+   if( is_app_valid )
    {
-     printf("ERROR!!!\r\n");
-     printf("Invalid Application. HALT!!!\r\n");
-
-
-     while(1);
+     ret = swap_close( &swap.cfg, SWAP_STEPS( swap.pages ), &next );
+     boot_prof_mark( BOOT_PROF_VERIFY );
+     printf("Done!!!\r\n");
+     if( ret != HAL_OK )
+     {
+       printf("App Flash write Error\r\n");
+     }
+     return;
+   }
+   printf("ERROR!!!\r\n");
+
+   /*
+    * The previous application is in the slot : close the journal with a
+    * request for it, then install it like a rollback.
+    */
+   if( swap_back_prepare( &swap.cfg, swap.slot ) &&
+       ( swap_close( &swap.cfg, SWAP_STEPS( swap.pages ), &next ) == HAL_OK ) )
+   {
+     printf("Invalid Application, back to the previous one!!!\r\n");
+     load_new_app();
+     return;
    }
-   printf("Done!!!\r\n");
+   printf("Invalid Application. HALT!!!\r\n");
+   while(1);
 }
 
@@ -0,0 +1,76 @@
+#include <stdio.h>
+#include <string.h>
+#include "boot_prof.h"
+
+/* Boot timing record. Not cleared by the startup code (see boot_prof.h) */
+BOOT_PROF_ boot_prof_rec __attribute__((section(".noinit")));
+
+/**
+  * @brief Start the DWT cycle counter and a fresh boot timing record.
+  *        Called by the bootloader as early as possible.
+  * @param none
+  * @retval none
+  */
+void boot_prof_start( void )
+{
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT       = 0u;
+  DWT->CTRL        |= DWT_CTRL_CYCCNTENA_Msk;
+
+  memset( &boot_prof_rec, 0, sizeof(BOOT_PROF_) );
+  boot_prof_rec.last_hz = SystemCoreClock;
+  boot_prof_rec.magic   = BOOT_PROF_MAGIC_RUN;
+}
+
+/**
+  * @brief Close a phase. The time since the previous mark is added to it.
+  *        Cycles are converted with the clock that was running when the
+  *        phase started, so a phase that switches the clock is approximate.
+  * @param phase phase that just ended
+  * @retval none
+  */
+void boot_prof_mark( BOOT_PROF_PHASE_ phase )
+{
+  uint32_t now = DWT->CYCCNT;
+  uint32_t cyc_per_us;
+
+  if( ( boot_prof_rec.magic != BOOT_PROF_MAGIC_RUN ) || ( phase >= BOOT_PROF_PHASE_COUNT ) )
+  {
+    //No record in progress (e.g. app started by the debugger)
+    return;
+  }
+
+  cyc_per_us = boot_prof_rec.last_hz / 1000000u;
+  if( cyc_per_us == 0u )
+  {
+    cyc_per_us = 1u;
+  }
+
+  boot_prof_rec.phase_us[phase] += ( now - boot_prof_rec.last_cyc ) / cyc_per_us;
+  boot_prof_rec.last_cyc         = now;
+  boot_prof_rec.last_hz          = SystemCoreClock;
+}
+
+/**
+  * @brief Close the record and print it as one hex line. Decode it with
+  *        host_app/boot_prof_decode.py.
+  *        Format : "BOOTPROF:" followed by one %08lX per phase (in us).
+  * @param none
+  * @retval none
+  */
+void boot_prof_report( void )
+{
+  if( boot_prof_rec.magic != BOOT_PROF_MAGIC_RUN )
+  {
+    printf("No boot timing record\r\n");
+    return;
+  }
+  boot_prof_rec.magic = BOOT_PROF_MAGIC_DONE;
+
+  printf("BOOTPROF:");
+  for( uint8_t i = 0; i < BOOT_PROF_PHASE_COUNT; i++ )
+  {
+    printf("%08lX", boot_prof_rec.phase_us[i]);
+  }
+  printf("\r\n");
+}
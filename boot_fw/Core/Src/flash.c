@@ -2,6 +2,9 @@
 #include "flash.h"
 #include "main.h"
 
+/* Set by flash_ecc_nmi() : the flash ECC found a double error */
+static volatile bool flash_ecc_error;
+
 /* Clear flags */
 void FLASH_If_Init(void)
 {
@@ -35,6 +38,7 @@ uint32_t GetPage(uint32_t Addr)
   */
 uint32_t GetBank(uint32_t Addr)
 {
+  (void)Addr;   //single bank device
   return FLASH_BANK_1;
 }
 
@@ -43,8 +47,7 @@ uint32_t GetBank(uint32_t Addr)
 uint32_t FLASH_If_Erase(uint32_t start)
 {
 	uint32_t FirstPage = 0, NbOfPages = 0, BankNumber = 0;
-	uint32_t Address = 0, PAGEError = 0;
-	__IO uint32_t data32 = 0 , MemoryProgramStatus = 0;
+	uint32_t PAGEError = 0;
 	static FLASH_EraseInitTypeDef EraseInitStruct;
 	HAL_StatusTypeDef status = HAL_OK;
 	HAL_FLASH_Unlock();
@@ -102,3 +105,36 @@ uint32_t FLASH_If_Write(uint32_t destination, uint32_t *p_source, uint32_t lengt
 	HAL_FLASH_Lock();
 	return (FLASHIF_OK);
 }
+
+/**
+  * @brief  Read a double word that a power loss may have left half
+  *         programmed (or half erased). The ECC then finds a double error :
+  *         the NMI is raised, NMI_Handler() clears it (flash_ecc_nmi()).
+  * @param  addr: flash address (double word aligned)
+  * @param  data: value read, not meaningful on an ECC error
+  * @retval true if read, false if the ECC found it corrupted
+  */
+bool flash_read_dw(uint32_t addr, uint64_t *data)
+{
+  flash_ecc_error = false;
+  *data = *(__IO uint64_t *)addr;
+  __DSB();      /* the NMI is taken before the flag is checked */
+  return !flash_ecc_error;
+}
+
+/**
+  * @brief  Flash part of the NMI : a double ECC error (ECCD) is cleared and
+  *         reported to flash_read_dw() instead of halting.
+  * @param  None
+  * @retval true if the NMI came from the flash ECC
+  */
+bool flash_ecc_nmi(void)
+{
+  if (!__HAL_FLASH_GET_FLAG(FLASH_FLAG_ECCD))
+  {
+    return false;
+  }
+  __HAL_FLASH_CLEAR_FLAG(FLASH_FLAG_ECCD);
+  flash_ecc_error = true;
+  return true;
+}
@@ -22,6 +22,7 @@
 /* Private includes ----------------------------------------------------------*/
 /* USER CODE BEGIN Includes */
 #include "boot.h"
+#include "boot_prof.h"
 /* USER CODE END Includes */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -53,7 +54,8 @@ static void MX_GPIO_Init(void);
 static void MX_LPUART1_UART_Init(void);
 static void MX_USART3_UART_Init(void);
 /* USER CODE BEGIN PFP */
-
+static void SystemClock_Config_Fast(void);
+static void SystemClock_Restore(void);
 /* USER CODE END PFP */
 
 /* Private user code ---------------------------------------------------------*/
@@ -90,11 +92,18 @@ PUTCHAR_PROTOTYPE
 
 static void goto_application(void)
 {
+  printf("Boot time : %lu ms\r\n", HAL_GetTick());
   printf("Gonna Jump to Application\r\n");
   //void (*app_reset_handler)(void) = (void*)(*((volatile uint32_t*) (OTA_APP_FLASH_ADDR + 4U)));
 
   //void (*app_reset_handler)(void) = (void*)(*((volatile uint32_t*) (OTA_NEW_FW_START_ADDR + 4U)));
   void (*app_reset_handler)(void) = (void*)(*((volatile uint32_t*) (ADDR_FLASH_PAGE_25 + 4U)));
+
+  /* Hand over the MCU the way the app expects to find it after a reset */
+  SystemClock_Restore();
+  boot_prof_mark( BOOT_PROF_JUMP );
+  __set_MSP(*((volatile uint32_t*) ADDR_FLASH_PAGE_25));
+
   app_reset_handler();    //call the app reset handler
 }
 /* USER CODE END 0 */
@@ -106,7 +115,7 @@ static void goto_application(void)
 int main(void)
 {
   /* USER CODE BEGIN 1 */
-
+  boot_prof_start();
   /* USER CODE END 1 */
 
   /* MCU Configuration--------------------------------------------------------*/
@@ -115,14 +124,16 @@ int main(void)
   HAL_Init();
 
   /* USER CODE BEGIN Init */
-
+  boot_prof_mark( BOOT_PROF_HAL_INIT );
   /* USER CODE END Init */
 
   /* Configure the system clock */
   SystemClock_Config();
 
   /* USER CODE BEGIN SysInit */
-
+  /* Run the install/verify phase at full speed */
+  SystemClock_Config_Fast();
+  boot_prof_mark( BOOT_PROF_CLOCK );
   /* USER CODE END SysInit */
 
   /* Initialize all configured peripherals */
@@ -297,6 +308,72 @@ static void MX_GPIO_Init(void)
 
 /* USER CODE BEGIN 4 */
 
+/**
+  * @brief Fast boot clock profile : MSI 4MHz -> PLL 80MHz.
+  *        Used while the bootloader copies and verifies the application.
+  * @retval None
+  */
+static void SystemClock_Config_Fast(void)
+{
+  RCC_OscInitTypeDef RCC_OscInitStruct = {0};
+  RCC_ClkInitTypeDef RCC_ClkInitStruct = {0};
+
+  /* SYSCLK = (MSI 4MHz / PLLM 1) * PLLN 40 / PLLR 2 = 80MHz */
+  RCC_OscInitStruct.OscillatorType = RCC_OSCILLATORTYPE_NONE;
+  RCC_OscInitStruct.PLL.PLLState = RCC_PLL_ON;
+  RCC_OscInitStruct.PLL.PLLSource = RCC_PLLSOURCE_MSI;
+  RCC_OscInitStruct.PLL.PLLM = 1;
+  RCC_OscInitStruct.PLL.PLLN = 40;
+  RCC_OscInitStruct.PLL.PLLP = RCC_PLLP_DIV7;
+  RCC_OscInitStruct.PLL.PLLQ = RCC_PLLQ_DIV2;
+  RCC_OscInitStruct.PLL.PLLR = RCC_PLLR_DIV2;
+  if (HAL_RCC_OscConfig(&RCC_OscInitStruct) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  RCC_ClkInitStruct.ClockType = RCC_CLOCKTYPE_HCLK|RCC_CLOCKTYPE_SYSCLK
+                              |RCC_CLOCKTYPE_PCLK1|RCC_CLOCKTYPE_PCLK2;
+  RCC_ClkInitStruct.SYSCLKSource = RCC_SYSCLKSOURCE_PLLCLK;
+  RCC_ClkInitStruct.AHBCLKDivider = RCC_SYSCLK_DIV1;
+  RCC_ClkInitStruct.APB1CLKDivider = RCC_HCLK_DIV1;
+  RCC_ClkInitStruct.APB2CLKDivider = RCC_HCLK_DIV1;
+
+  /* 80MHz in voltage range 1 needs 4 wait states */
+  if (HAL_RCC_ClockConfig(&RCC_ClkInitStruct, FLASH_LATENCY_4) != HAL_OK)
+  {
+    Error_Handler();
+  }
+
+  __HAL_FLASH_INSTRUCTION_CACHE_ENABLE();
+  __HAL_FLASH_DATA_CACHE_ENABLE();
+  __HAL_FLASH_PREFETCH_BUFFER_ENABLE();
+}
+
+/**
+  * @brief Put the clocks and peripherals back to their reset state
+  *        (MSI 4MHz, PLL off, 0 wait state, no prefetch, SysTick off)
+  *        so the application can run its own SystemClock_Config().
+  * @retval None
+  */
+static void SystemClock_Restore(void)
+{
+  HAL_UART_DeInit(&hlpuart1);
+
+  if (HAL_RCC_DeInit() != HAL_OK)
+  {
+    Error_Handler();
+  }
+  HAL_DeInit();
+
+  __HAL_FLASH_PREFETCH_BUFFER_DISABLE();
+
+  SysTick->CTRL = 0;
+  SysTick->LOAD = 0;
+  SysTick->VAL  = 0;
+  SCB->ICSR = SCB_ICSR_PENDSTCLR_Msk;
+}
+
 /* USER CODE END 4 */
 
 /**
@@ -0,0 +1,187 @@
+import argparse
+import os
+import random
+import select
+import sys
+import termios
+import threading
+import time
+import tty
+
+# BLE bridge emulator.
+#
+# Sits between flasher.py and a serial device (usually the simulator PTY) and
+# reproduces what a BLE <-> UART bridge does to the byte stream :
+#   - data only moves at connection events, every 'interval' ms (+ jitter),
+#   - at most 'ppi' packets per direction and per connection event,
+#   - each packet carries at most ATT_MTU - 3 bytes (write without response
+#     and notification payload),
+#   - a packet can be lost ('loss' probability), e.g. bridge buffer overrun,
+#   - the bridge buffers at most 'buffer' bytes per direction, the rest is lost.
+#
+#   flasher.py <-> [host PTY, --link] <-> BleLink <-> [--device] <-> ota_sim
+#
+# usage : python ble_link.py --device /tmp/ttyOTA --link /tmp/ttyBLE
+#                            [--interval-ms 30] [--mtu 23] [--ppi 4]
+#                            [--jitter-ms 0] [--loss 0] [--buffer 4096]
+
+ATT_HEADER_SIZE = 3
+
+
+class BleDirection:
+    def __init__(self, name, buffer_size):
+        self.name = name
+        self.buffer_size = buffer_size
+        self.queue = bytearray()
+        self.packets = 0
+        self.bytes = 0
+        self.lost_packets = 0
+        self.lost_bytes = 0
+
+    def push(self, data):
+        room = self.buffer_size - len(self.queue)
+        if room < len(data):
+            self.lost_bytes += len(data) - max(room, 0)
+            data = data[:max(room, 0)]
+        self.queue += data
+
+    def stats(self):
+        return "%s : %d packets, %d B, lost %d packets / %d B" % (
+            self.name, self.packets, self.bytes, self.lost_packets, self.lost_bytes)
+
+
+class BleLink:
+    def __init__(self, device, link, interval_ms=30.0, mtu=23, ppi=4,
+                 jitter_ms=0.0, loss=0.0, buffer_size=4096, seed=None):
+        self.device = device
+        self.link = link
+        self.interval = interval_ms / 1000.0
+        self.payload = max(mtu - ATT_HEADER_SIZE, 1)
+        self.ppi = ppi
+        self.jitter = jitter_ms / 1000.0
+        self.loss = loss
+        self.rand = random.Random(seed)
+        self.to_device = BleDirection("host -> device", buffer_size)
+        self.to_host = BleDirection("device -> host", buffer_size)
+        self.running = False
+        self.thread = None
+
+    def _open(self):
+        # Host side : a PTY the flasher opens like a serial port
+        self.host_fd, self.host_slave = os.openpty()
+        tty.setraw(self.host_slave)
+        if os.path.lexists(self.link):
+            os.unlink(self.link)
+        os.symlink(os.ttyname(self.host_slave), self.link)
+
+        # Device side
+        self.dev_fd = os.open(self.device, os.O_RDWR | os.O_NOCTTY)
+        tty.setraw(self.dev_fd)
+        termios.tcflush(self.dev_fd, termios.TCIOFLUSH)
+
+    def _close(self):
+        for fd in (self.dev_fd, self.host_fd, self.host_slave):
+            try:
+                os.close(fd)
+            except OSError:
+                pass
+        if os.path.lexists(self.link):
+            os.unlink(self.link)
+
+    def _connection_event(self, direction, fd):
+        for i in range(0, self.ppi):
+            if not direction.queue:
+                break
+            packet = bytes(direction.queue[:self.payload])
+            del direction.queue[:self.payload]
+            if self.loss > 0.0 and self.rand.random() < self.loss:
+                direction.lost_packets += 1
+                direction.lost_bytes += len(packet)
+                continue
+            direction.packets += 1
+            direction.bytes += len(packet)
+            os.write(fd, packet)
+
+    def _run(self):
+        start = time.monotonic()
+        event = 0
+        next_event = start
+        while self.running:
+            timeout = max(next_event - time.monotonic(), 0.0)
+            readable, _, _ = select.select([self.host_fd, self.dev_fd], [], [], min(timeout, 0.1))
+            for fd in readable:
+                try:
+                    data = os.read(fd, 4096)
+                except OSError:
+                    # Host closed its side, wait for the next open
+                    data = b''
+                if fd == self.host_fd:
+                    self.to_device.push(data)
+                else:
+                    self.to_host.push(data)
+
+            now = time.monotonic()
+            if now >= next_event:
+                self._connection_event(self.to_device, self.dev_fd)
+                self._connection_event(self.to_host, self.host_fd)
+                event += 1
+                next_event = start + event * self.interval
+                if self.jitter > 0.0:
+                    next_event += self.rand.uniform(0.0, self.jitter)
+
+    def start(self):
+        self._open()
+        self.running = True
+        self.thread = threading.Thread(target=self._run, daemon=True)
+        self.thread.start()
+
+    def stop(self):
+        self.running = False
+        if self.thread is not None:
+            self.thread.join()
+        self._close()
+
+    def stats(self):
+        return [self.to_device.stats(), self.to_host.stats()]
+
+
+def add_link_arguments(parser, prefix=""):
+    # Shared with ota_bench.py
+    parser.add_argument("--%sinterval-ms" % prefix, type=float, default=30.0,
+                        help="connection interval (7.5 to 4000 ms)")
+    parser.add_argument("--%smtu" % prefix, type=int, default=23, help="ATT MTU (23 to 247)")
+    parser.add_argument("--%sppi" % prefix, type=int, default=4,
+                        help="packets per connection event and direction")
+    parser.add_argument("--%sjitter-ms" % prefix, type=float, default=0.0,
+                        help="random delay added to each connection event")
+    parser.add_argument("--%sloss" % prefix, type=float, default=0.0, help="packet loss probability")
+    parser.add_argument("--%sbuffer" % prefix, type=int, default=4096,
+                        help="bridge buffer per direction (bytes)")
+
+
+def main():
+    parser = argparse.ArgumentParser(description="BLE bridge emulator")
+    parser.add_argument("--device", required=True, help="device serial port (e.g. the ota_sim PTY)")
+    parser.add_argument("--link", required=True, help="symlink to create for the host tools")
+    parser.add_argument("--seed", type=int, default=None)
+    add_link_arguments(parser)
+    args = parser.parse_args()
+
+    link = BleLink(args.device, args.link, args.interval_ms, args.mtu, args.ppi,
+                   args.jitter_ms, args.loss, args.buffer, args.seed)
+    link.start()
+    print("BLE link %s <-> %s : interval %.1f ms, MTU %d, %d packets/event, jitter %.1f ms, loss %.4f" % (
+        args.link, args.device, args.interval_ms, args.mtu, args.ppi, args.jitter_ms, args.loss))
+    try:
+        while True:
+            time.sleep(1)
+    except KeyboardInterrupt:
+        pass
+    link.stop()
+    for line in link.stats():
+        print(line)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,80 @@
+import sys
+
+# Boot timing record decoder.
+#
+# The application prints the record handed over by the bootloader as one line:
+#   BOOTPROF:<phase 0 us as %08X><phase 1 us as %08X>...
+# Keep PHASES in sync with BOOT_PROF_PHASE_ in boot_prof.h.
+#
+# usage : python boot_prof_decode.py <log file | serial port> [baud]
+
+PHASES = [
+    "HAL_Init",
+    "Clock setup",
+    "Config read",
+    "Install (copy)",
+    "CRC verify",
+    "Jump",
+    "App start",
+    "App init",
+]
+
+PREFIX = "BOOTPROF:"
+
+
+def decode_line(line):
+    idx = line.find(PREFIX)
+    if idx < 0:
+        return None
+    hexdata = line[idx + len(PREFIX):].strip()
+    values = []
+    for i in range(0, len(hexdata) - 7, 8):
+        values.append(int(hexdata[i:i + 8], 16))
+    return values
+
+
+def print_record(values):
+    total = sum(values)
+    print("%-16s %12s %7s" % ("Phase", "Time (us)", "Share"))
+    for i in range(0, len(values)):
+        name = PHASES[i] if i < len(PHASES) else "Phase %d" % i
+        share = (values[i] * 100.0 / total) if total else 0.0
+        print("%-16s %12d %6.1f%%" % (name, values[i], share))
+    print("%-16s %12d" % ("Total", total))
+
+
+def lines_from_serial(port, baud):
+    import serial
+    ser = serial.Serial(port, baud, timeout=1)
+    try:
+        while True:
+            line = ser.readline()
+            if line:
+                yield line.decode("ascii", errors="replace")
+    finally:
+        ser.close()
+
+
+def main():
+    if len(sys.argv) < 2:
+        print("usage : python boot_prof_decode.py <log file | serial port> [baud]")
+        return -1
+
+    source = sys.argv[1]
+    baud = int(sys.argv[2]) if len(sys.argv) > 2 else 115200
+
+    try:
+        lines = open(source, "r", errors="replace")
+    except OSError:
+        lines = lines_from_serial(source, baud)
+
+    for line in lines:
+        values = decode_line(line)
+        if values is not None:
+            print_record(values)
+            print("")
+    return 0
+
+
+if __name__ == "__main__":
+    main()
@@ -1,8 +1,17 @@
+import argparse
+import binascii
+import collections
+import json
+import math
+import os
 import serial
+import struct
 import sys
-import os
 import time
-import struct
+import zlib
+
+import fw_image
+import ota_capture
 
 FW_TYPE_APP = 0x01
 FW_TYPE_BOOTLOADER = 0x02
@@ -11,41 +20,6 @@ FW_TYPE = FW_TYPE_APP
 #FW_TYPE = FW_TYPE_BOOTLOADER
 FW_VERSION = 0x3A67
 
-crc16_table = [
-    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
-    0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
-    0x1231, 0x0210, 0x3273, 0x2252, 0x52B5, 0x4294, 0x72F7, 0x62D6,
-    0x9339, 0x8318, 0xB37B, 0xA35A, 0xD3BD, 0xC39C, 0xF3FF, 0xE3DE,
-    0x2462, 0x3443, 0x0420, 0x1401, 0x64E6, 0x74C7, 0x44A4, 0x5485,
-    0xA56A, 0xB54B, 0x8528, 0x9509, 0xE5EE, 0xF5CF, 0xC5AC, 0xD58D,
-    0x3653, 0x2672, 0x1611, 0x0630, 0x76D7, 0x66F6, 0x5695, 0x46B4,
-    0xB75B, 0xA77A, 0x9719, 0x8738, 0xF7DF, 0xE7FE, 0xD79D, 0xC7BC,
-    0x48C4, 0x58E5, 0x6886, 0x78A7, 0x0840, 0x1861, 0x2802, 0x3823,
-    0xC9CC, 0xD9ED, 0xE98E, 0xF9AF, 0x8948, 0x9969, 0xA90A, 0xB92B,
-    0x5AF5, 0x4AD4, 0x7AB7, 0x6A96, 0x1A71, 0x0A50, 0x3A33, 0x2A12,
-    0xDBFD, 0xCBDC, 0xFBBF, 0xEB9E, 0x9B79, 0x8B58, 0xBB3B, 0xAB1A,
-    0x6CA6, 0x7C87, 0x4CE4, 0x5CC5, 0x2C22, 0x3C03, 0x0C60, 0x1C41,
-    0xEDAE, 0xFD8F, 0xCDEC, 0xDDCD, 0xAD2A, 0xBD0B, 0x8D68, 0x9D49,
-    0x7E97, 0x6EB6, 0x5ED5, 0x4EF4, 0x3E13, 0x2E32, 0x1E51, 0x0E70,
-    0xFF9F, 0xEFBE, 0xDFDD, 0xCFFC, 0xBF1B, 0xAF3A, 0x9F59, 0x8F78,
-    0x9188, 0x81A9, 0xB1CA, 0xA1EB, 0xD10C, 0xC12D, 0xF14E, 0xE16F,
-    0x1080, 0x00A1, 0x30C2, 0x20E3, 0x5004, 0x4025, 0x7046, 0x6067,
-    0x83B9, 0x9398, 0xA3FB, 0xB3DA, 0xC33D, 0xD31C, 0xE37F, 0xF35E,
-    0x02B1, 0x1290, 0x22F3, 0x32D2, 0x4235, 0x5214, 0x6277, 0x7256,
-    0xB5EA, 0xA5CB, 0x95A8, 0x8589, 0xF56E, 0xE54F, 0xD52C, 0xC50D,
-    0x34E2, 0x24C3, 0x14A0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
-    0xA7DB, 0xB7FA, 0x8799, 0x97B8, 0xE75F, 0xF77E, 0xC71D, 0xD73C,
-    0x26D3, 0x36F2, 0x0691, 0x16B0, 0x6657, 0x7676, 0x4615, 0x5634,
-    0xD94C, 0xC96D, 0xF90E, 0xE92F, 0x99C8, 0x89E9, 0xB98A, 0xA9AB,
-    0x5844, 0x4865, 0x7806, 0x6827, 0x18C0, 0x08E1, 0x3882, 0x28A3,
-    0xCB7D, 0xDB5C, 0xEB3F, 0xFB1E, 0x8BF9, 0x9BD8, 0xABBB, 0xBB9A,
-    0x4A75, 0x5A54, 0x6A37, 0x7A16, 0x0AF1, 0x1AD0, 0x2AB3, 0x3A92,
-    0xFD2E, 0xED0F, 0xDD6C, 0xCD4D, 0xBDAA, 0xAD8B, 0x9DE8, 0x8DC9,
-    0x7C26, 0x6C07, 0x5C64, 0x4C45, 0x3CA2, 0x2C83, 0x1CE0, 0x0CC1,
-    0xEF1F, 0xFF3E, 0xCF5D, 0xDF7C, 0xAF9B, 0xBFBA, 0x8FD9, 0x9FF8,
-    0x6E17, 0x7E36, 0x4E55, 0x5E74, 0x2E93, 0x3EB2, 0x0ED1, 0x1EF0
-]
-
 
 ACK = 0
 NACK = 1
@@ -59,7 +33,112 @@ CMD_START_PACKET_LENGTH = 0x01 # including cmd,2byte data length and 1 byte data
 CMD_FWDATA_PACKET = 0x03
 CMD_STOP_PACKET = 0x04
 CMD_STOP_PACKET_LENGTH = 0x01
+CMD_ABORT_PACKET = 0x05
+CMD_ENTER_PACKET = 0x06
+CMD_PING_PACKET = 0x07
+CMD_SESSION_PACKET = 0x08
+CMD_STATS_PACKET = 0x09
+CMD_PARITY_PACKET = 0x0A
+CMD_SKIP_PACKET = 0x0B
+CMD_PAGE_HASHES_PACKET = 0x0C
+CMD_COPY_PACKET = 0x0D
+
+# NACK status byte : the reason of the NACK (OTA_EX_ on the device)
+NACK_CRC = 2            # frame CRC mismatch
+NACK_FRAMING = 3        # no SOF/EOF, truncated or too long frame
+NACK_SEQUENCE = 4       # command not expected now, DATA out of the image
+NACK_FLASH = 5          # flash erase/program error
+NACK_NO_SPACE = 6       # image larger than the device region
+NACK_MISSING = 7        # PARITY : more than one frame of the block missing
+NACK_NAMES = {NACK: "error", NACK_CRC: "crc", NACK_FRAMING: "framing", NACK_SEQUENCE: "sequence",
+              NACK_FLASH: "flash", NACK_NO_SPACE: "no_space", NACK_MISSING: "missing"}
+# Reasons the frame is sent again for (the device keeps the session)
+NACK_RETRY = (NACK_CRC, NACK_FRAMING, NACK_FLASH)
+
+PACKET_RESP_TIMEOUT = 5.0
+PACKET_RESP_TIMEOUT_ERROR = 2
+# Times a frame is sent again after a response timeout or a transient NACK
+# (NACK_RETRY), before giving up
+DATA_RETRIES = 3
+
+# Single byte asking a running application to enter the OTA mode
+ENTER_REQ = 0x55
+ENTER_RESP_TIMEOUT = 1.0
+
+# Link probe (--auto) : PING payload sizes, as fractions of the device max
+# data size, and pings per size. The lowest RTT of each size is kept.
+PING_SIZES = (0.0, 0.25, 0.5, 1.0)
+PING_COUNT = 3
+PING_TIMEOUT = 1.0
+TUNE_CACHE = os.path.join(os.path.expanduser("~"), ".cache", "ota_flasher.json")
 
+# Frame : SOF | cmd | len (u16 LE) | payload | CRC16 (u16 LE) | EOF
+# The CRC covers cmd, len and payload. Responses carry a 1 byte status and
+# their CRC only covers their payload.
+FRAME_HEAD = struct.Struct("<BBH")
+FRAME_TAIL = struct.Struct("<HB")
+FRAME_OVERHEAD = FRAME_HEAD.size + FRAME_TAIL.size
+HEADER_PAYLOAD = struct.Struct("<IBHH")     # size, type, CRC, version
+# DATA payload : sequence number, image offset, then the data. The device
+# writes a frame received twice only once, so DATA frames can be sent again.
+DATA_HDR = struct.Struct("<HI")
+DATA_RESP = struct.Struct("<BH")            # status, sequence number
+# PARITY payload (FEC) : sequence number, image offset of the block, DATA
+# frames in the block, then the XOR of these frames (the last one zero
+# padded). The device rebuilds one missing frame of the block from it, the
+# answer is a DATA response, ACK once the block is complete.
+PARITY_HDR = struct.Struct("<HIB")
+# SKIP payload : sequence number, image offset, length. The image holds only
+# 0xFF there, the device marks the range as written (its slot is erased) and
+# answers with a DATA response. Protocol 5 and later.
+SKIP_PAYLOAD = struct.Struct("<HII")
+SKIP_MIN_PROTOCOL = 5
+# PAGE_HASHES : CRC-32 (zlib) of the FLASH_PAGE pages of the application the
+# device runs, from page 'first', a few per answer. COPY payload : sequence
+# number, image offset, length, offset in the running application : the
+# device copies the range from there and answers with a DATA response.
+# Protocol 7 and later.
+PAGE_HASHES_REQ = struct.Struct("<HH")
+PAGE_HASHES_RESP = struct.Struct("<BHH")
+COPY_PAYLOAD = struct.Struct("<HIII")
+COPY_MAX_SIZE = 2048
+FLASH_PAGE = 2048
+DEDUP_MIN_PROTOCOL = 7
+# SESSION : START and HEADER in one frame (HEADER payload + flags). The
+# answer has the PING capabilities, then what the slot holds (size, CRC,
+# version, flags) and the image offset to start the upload from. Protocol 6
+# adds the running application (size, CRC, version) and the action : with
+# SESSION_FLAG_NOOP the device closes the session itself when the image is
+# already running, or resets to install it when it is staged.
+SESSION_REQ = struct.Struct("<IBHHB")
+SESSION_RESP = struct.Struct("<BBHBH12sBIIHBI")
+SESSION_ACTIVE = struct.Struct("<IIHB")
+SESSION_FLAG_RESUME = 0x01
+SESSION_FLAG_NOOP = 0x02
+SLOT_FLAG_VALID = 0x01
+SLOT_FLAG_PENDING = 0x02
+SLOT_FLAG_STAGED = 0x04
+SESSION_UPLOAD = 0
+SESSION_UP_TO_DATE = 1
+SESSION_INSTALL = 2
+RESP_MAX_LENGTH = 1024
+# PING response payload : status, protocol, max data size, rx window,
+# max busy time (ms), 96 bit UID, max FEC block (0 : no PARITY), then the
+# echoed PING payload
+PING_CAPS = struct.Struct("<BBHBH12sB")
+# STATS response : status, frames received, duplicate DATA, frames rebuilt
+# from a PARITY, NACKs sent per reason (CRC, framing, sequence, flash,
+# other), longest run of bad frames, UART overrun errors (not sent by older
+# firmware)
+STATS_RESP = struct.Struct("<BIIHHHHHHBH")
+STATS_RESP_V1 = struct.Struct(STATS_RESP.format[:-1])
+# COBS transport (--cobs) : every frame COBS encoded and ended by a 0x00,
+# the first one also starts with a 0x00. The device answers the same way.
+COBS_DELIM = 0x00
+
+# Serial read timeout. Responses are read by length, so it only bounds how
+# late a deadline is noticed.
+PORT_TIMEOUT = 0.05
 
 
 ERROR_CODES = [
@@ -70,232 +149,881 @@ ERROR_CODES = [
 ]
 
 def calculate_crc16(data):
-    #print("calculating CRC of data :",data)
-    crc = 0xFFFF
-    for byte in data:
-        crc = (crc << 8) ^ crc16_table[((crc >> 8) ^ byte) & 0xFF];
-        #crc = (crc >> 8) ^ crc16_table[(crc ^ byte) & 0xFF]
-    return crc & 0xFFFF
-
-
-
-
-
-def ota_send_start_command(port):
-    #port.write("Sending OTA START".encode("utf-8"))
-    start_packet = []
-    start_packet.append(START_BYTE)
-    start_packet.append(CMD_START_PACKET)
-    start_packet.append(CMD_START_PACKET_LENGTH)
-    start_packet.append(0x00)
-    start_packet.append(0x01)
-    crc16 = calculate_crc16(start_packet[1:])
-    crc_byte_array = crc16.to_bytes(2, byteorder='big')
-    start_packet.append(crc_byte_array[1])
-    start_packet.append(crc_byte_array[0])
-    start_packet.append(END_BYTE)
-    print("Start Packet : ", start_packet)
-    #crc_byte_array = crc16.to_bytes(2, byteorder='big')
-    port.write(bytes(start_packet))
-
-def ota_send_header_command(port,fileSize,FW_TYPE,FW_CRC,Version):
-    #port.write("Sending OTA Header".encode("utf-8"))
-    #CMD_INFO_PACKET
-    info_packet = []
-    info_packet.append(START_BYTE)
-    info_packet.append(CMD_INFO_PACKET)
-    info_packet.append(0x09)
-    info_packet.append(0x00) # packet length
-
-    filesize_byte_array = fileSize.to_bytes(4, byteorder='big')
-    info_packet.append(int(filesize_byte_array[3]))
-    info_packet.append(int(filesize_byte_array[2]))
-    info_packet.append(int(filesize_byte_array[1]))
-    info_packet.append(int(filesize_byte_array[0]))
-
-    info_packet.append(FW_TYPE)
-
-    fwType_byte_array = FW_CRC.to_bytes(2, byteorder='big')
-    info_packet.append(int(fwType_byte_array[1]))
-    info_packet.append(int(fwType_byte_array[0]))
-
-    version_byte_array = Version.to_bytes(2, byteorder='big')
-    info_packet.append(int(version_byte_array[1]))
-    info_packet.append(int(version_byte_array[0]))
-
-    crc16 = calculate_crc16(info_packet[1:])
-    crc_byte_array = crc16.to_bytes(2, byteorder='big')
-    info_packet.append(crc_byte_array[1])
-    info_packet.append(crc_byte_array[0])
-    info_packet.append(END_BYTE)
-    print("header Packet : ", info_packet)
-    port.write(bytes(info_packet))
-    
-
-def ota_check_response(port,cmd):
+    # CRC16 CCITT-FALSE, same as CalcCRC() on the device (binascii runs it in C)
+    return binascii.crc_hqx(data, 0xFFFF)
+
+
+def cobs_encode(data):
+    # COBS : each zero is replaced by the distance to the next one, a code
+    # byte before each run of at most 254 non zero bytes
+    out = bytearray()
+    for block in bytes(data).split(b"\0"):
+        while len(block) >= 254:
+            out.append(0xFF)
+            out += block[:254]
+            block = block[254:]
+        out.append(len(block) + 1)
+        out += block
+    return bytes(out)
+
+
+def cobs_decode(data):
+    # Inverse of cobs_encode(), None if the code bytes do not add up
+    out = bytearray()
+    i = 0
+    while i < len(data):
+        code = data[i]
+        if code == 0 or i + code > len(data):
+            return None
+        out += data[i + 1:i + code]
+        i += code
+        if code != 0xFF and i < len(data):
+            out.append(0)
+    return bytes(out)
+
+
+class FrameBuilder:
+    # Builds the frames in place in one preallocated buffer. The returned
+    # memoryview is valid until the next build().
+    def __init__(self, max_payload=ETX_OTA_DATA_MAX_SIZE):
+        self.buf = bytearray(max_payload + FRAME_OVERHEAD)
+        self.view = memoryview(self.buf)
+
+    def build(self, cmd, payload):
+        n = len(payload)
+        FRAME_HEAD.pack_into(self.buf, 0, START_BYTE, cmd, n)
+        self.buf[4:4 + n] = payload
+        FRAME_TAIL.pack_into(self.buf, 4 + n, binascii.crc_hqx(self.view[1:4 + n], 0xFFFF), END_BYTE)
+        return self.view[:n + FRAME_OVERHEAD]
+
+    def build_data(self, seq, offset, data):
+        n = DATA_HDR.size + len(data)
+        FRAME_HEAD.pack_into(self.buf, 0, START_BYTE, CMD_FWDATA_PACKET, n)
+        DATA_HDR.pack_into(self.buf, 4, seq & 0xFFFF, offset)
+        self.buf[4 + DATA_HDR.size:4 + n] = data
+        FRAME_TAIL.pack_into(self.buf, 4 + n, binascii.crc_hqx(self.view[1:4 + n], 0xFFFF), END_BYTE)
+        return self.view[:n + FRAME_OVERHEAD]
+
+    def build_parity(self, seq, offset, frames, parity):
+        n = PARITY_HDR.size + len(parity)
+        FRAME_HEAD.pack_into(self.buf, 0, START_BYTE, CMD_PARITY_PACKET, n)
+        PARITY_HDR.pack_into(self.buf, 4, seq & 0xFFFF, offset, frames)
+        self.buf[4 + PARITY_HDR.size:4 + n] = parity
+        FRAME_TAIL.pack_into(self.buf, 4 + n, binascii.crc_hqx(self.view[1:4 + n], 0xFFFF), END_BYTE)
+        return self.view[:n + FRAME_OVERHEAD]
 
+
+class CobsPort:
+    # COBS transport over a serial port : the frames written are encoded, the
+    # frames read decoded (a broken one is dropped up to its delimiter). The
+    # enter request stays a raw byte, and so does its answer : the device
+    # only switches to COBS on the first encoded frame.
+    def __init__(self, ser):
+        self.ser = ser
+        self.raw = bytearray()          # encoded bytes, up to the next delimiter
+        self.rx = bytearray()           # decoded frames
+        self.started = False
+
+    def write(self, data):
+        if data[0] != START_BYTE:
+            return self.ser.write(data)
+        frame = cobs_encode(data) + bytes([COBS_DELIM])
+        if not self.started:
+            frame = bytes([COBS_DELIM]) + frame
+            self.started = True
+        self.ser.write(frame)
+        return len(data)
+
+    def read(self, size=1):
+        if not self.started:
+            return self.ser.read(size)
+        while len(self.rx) < size:
+            chunk = self.ser.read(max(1, getattr(self.ser, "in_waiting", 0)))
+            if not chunk:
+                break
+            self.raw += chunk
+            end = self.raw.find(COBS_DELIM)
+            while end >= 0:
+                frame = cobs_decode(self.raw[:end])
+                if frame:
+                    self.rx += frame
+                del self.raw[:end + 1]
+                end = self.raw.find(COBS_DELIM)
+        data = bytes(self.rx[:size])
+        del self.rx[:size]
+        return data
+
+    def reset_input_buffer(self):
+        self.raw.clear()
+        self.rx.clear()
+        self.ser.reset_input_buffer()
+
+    def __getattr__(self, name):
+        return getattr(self.ser, name)
+
+
+def ota_read_frame(port, timeout=PACKET_RESP_TIMEOUT):
+    # Read exactly one frame from the device, skipping anything before its
+    # SOF. Returns (cmd, payload), payload None if the frame is corrupted, or
+    # None on timeout.
+    deadline = time.monotonic() + timeout
+    data = bytearray()
+    need = FRAME_OVERHEAD + 1           # device frames carry at least a status
+    while len(data) < need:
+        data += port.read(need - len(data))
+        sof = data.find(START_BYTE)
+        if sof < 0:
+            data.clear()
+        elif sof > 0:
+            del data[:sof]
+        if len(data) >= FRAME_HEAD.size:
+            length = data[2] | (data[3] << 8)
+            if length > RESP_MAX_LENGTH:
+                # not a frame, look for the next SOF
+                del data[:1]
+                need = FRAME_OVERHEAD + 1
+                continue
+            need = FRAME_OVERHEAD + length
+        if len(data) < need and time.monotonic() >= deadline:
+            return None
+    payload = data[FRAME_HEAD.size:need - FRAME_TAIL.size]
+    crc, eof = FRAME_TAIL.unpack_from(data, need - FRAME_TAIL.size)
+    if eof != END_BYTE or binascii.crc_hqx(payload, 0xFFFF) != crc:
+        return data[1], None
+    return data[1], payload
+
+
+def ota_read_status(port, cmd, timeout=PACKET_RESP_TIMEOUT):
+    # Read one response to 'cmd' : (ACK, NACK or PACKET_RESP_TIMEOUT_ERROR,
+    # NACK reason). A corrupted response is a NACK_CRC.
+    frame = ota_read_frame(port, timeout)
+    if frame is None:
+        return PACKET_RESP_TIMEOUT_ERROR, None
+    rx_cmd, payload = frame
+    if payload is None:
+        return NACK, NACK_CRC
+    if not payload or payload[0] != ACK:
+        return NACK, payload[0] if payload else NACK
+    if rx_cmd != cmd:
+        return NACK, NACK
+    return ACK, None
+
+
+def ota_read_response(port, cmd, timeout=PACKET_RESP_TIMEOUT):
+    # Read one response to 'cmd' : ACK, NACK or PACKET_RESP_TIMEOUT_ERROR
+    return ota_read_status(port, cmd, timeout)[0]
+
+
+def ota_read_data_response(port, timeout=PACKET_RESP_TIMEOUT):
+    # Read one response to a DATA, PARITY, SKIP or COPY frame : (status, command,
+    # sequence number, NACK reason). The NACK of a frame the device could not
+    # read (CRC, framing) has no sequence number, a corrupted response is a
+    # NACK_CRC.
+    frame = ota_read_frame(port, timeout)
+    if frame is None:
+        return PACKET_RESP_TIMEOUT_ERROR, None, None, None
+    rx_cmd, payload = frame
+    if payload is None:
+        return NACK, rx_cmd, None, NACK_CRC
+    if rx_cmd in (CMD_FWDATA_PACKET, CMD_PARITY_PACKET, CMD_SKIP_PACKET, CMD_COPY_PACKET) and \
+            len(payload) == DATA_RESP.size:
+        status, seq = DATA_RESP.unpack(payload)
+        if status == ACK:
+            return ACK, rx_cmd, seq, None
+        return NACK, rx_cmd, seq, status
+    return NACK, rx_cmd, None, payload[0] if payload and payload[0] != ACK else NACK
+
+
+def ota_retryable(resp, code):
+    # True when the frame is worth sending again : lost, or a NACK for a
+    # transient error
+    return resp == PACKET_RESP_TIMEOUT_ERROR or (resp == NACK and code in NACK_RETRY)
+
+
+def ota_read_stats(port, timeout=PACKET_RESP_TIMEOUT):
+    # STATS round trip : dict of the device session counters, or None
+    port.write(FrameBuilder(0).build(CMD_STATS_PACKET, b""))
+    frame = ota_read_frame(port, timeout)
+    if frame is None:
+        return None
+    cmd, body = frame
+    if cmd != CMD_STATS_PACKET or body is None or len(body) not in (STATS_RESP.size, STATS_RESP_V1.size):
+        return None
+    if len(body) == STATS_RESP_V1.size:
+        body += b"\x00\x00"
+    status, frames, duplicates, fec_recovered, crc, framing, sequence, flash, other, max_retries, overruns = \
+        STATS_RESP.unpack(body)
+    if status != ACK:
+        return None
+    return {"frames": frames, "duplicates": duplicates, "fec_recovered": fec_recovered, "crc": crc,
+            "framing": framing, "sequence": sequence, "flash": flash, "other": other,
+            "max_retries": max_retries, "overruns": overruns}
+
+
+def ota_read_page_hashes(port, timeout=PACKET_RESP_TIMEOUT, retries=DATA_RETRIES):
+    # PAGE_HASHES round trips : list of the CRC-32 of the running application
+    # pages, or None
+    hashes = []
     while True:
-        data = port.readall();
-        if data == b'': continue
-        resp =[]
-        for i in range(0,len(data)):
-            resp.append(int(data[i]))
-
-        print("Response : ", resp)
-        # check CRC
-        #time.sleep(2)
-        if resp[1] == cmd:
-            if resp[4] == 0:
-                return ACK
+        for attempt in range(retries + 1):
+            port.write(FrameBuilder(PAGE_HASHES_REQ.size).build(
+                CMD_PAGE_HASHES_PACKET, PAGE_HASHES_REQ.pack(len(hashes), 0xFFFF)))
+            frame = ota_read_frame(port, timeout)
+            if frame is None or frame[0] != CMD_PAGE_HASHES_PACKET or frame[1] is None or \
+                    len(frame[1]) < PAGE_HASHES_RESP.size:
+                continue
+            status, first, count = PAGE_HASHES_RESP.unpack_from(frame[1])
+            if status == ACK and first == len(hashes) and len(frame[1]) == PAGE_HASHES_RESP.size + 4 * count:
+                break
+        else:
+            return None
+        if not count:
+            return hashes
+        hashes += struct.unpack_from("<%dI" % count, frame[1], PAGE_HASHES_RESP.size)
+
+
+def ota_send_enter_request(port):
+    # Ask the application to enter the OTA mode. A device that is already
+    # in OTA mode (boot button) ignores the byte and does not answer.
+    port.write(bytes([ENTER_REQ]))
+    if ota_read_response(port, CMD_ENTER_PACKET, ENTER_RESP_TIMEOUT) == ACK:
+        return ACK
+    return NACK
+
+
+def ota_ping(port, payload=b"", timeout=PING_TIMEOUT):
+    # One PING round trip. Returns (caps dict, RTT in s), None on timeout or
+    # on a corrupted answer.
+    port.write(FrameBuilder(len(payload)).build(CMD_PING_PACKET, payload))
+    start = time.monotonic()
+    frame = ota_read_frame(port, timeout)
+    rtt = time.monotonic() - start
+    if frame is None:
+        return None
+    cmd, body = frame
+    if cmd != CMD_PING_PACKET or body is None or len(body) < PING_CAPS.size or \
+            body[PING_CAPS.size:] != payload:
+        return None
+    status, proto, max_data, rx_window, max_busy_ms, uid, fec_max = PING_CAPS.unpack_from(body)
+    if status != ACK:
+        return None
+    return {"proto": proto, "max_data": max_data, "rx_window": rx_window,
+            "max_busy_ms": max_busy_ms, "uid": uid.hex(), "fec_max": fec_max}, rtt
+
+
+def ota_autotune(port, cache=TUNE_CACHE, retune=False, verbose=False):
+    # Probe the link with PINGs of a few sizes and pick the session
+    # parameters. RTT(n) = a + n * b : a is the fixed latency (bridge
+    # connection interval, USB polling, device turnaround), b the time per
+    # byte, both ways (the payload is echoed).
+    #   frame size : the device max data size
+    #   window     : enough frames to cover 'a' with data, within the device
+    #                rx window
+    #   timeout    : longest flash operation + a few RTT
+    # The result is cached per device UID, the next session only sends one
+    # PING. Returns a dict (frame_size, window, timeout, uid...) or None when
+    # the device does not answer the PING.
+    first = ota_ping(port)
+    if first is None:
+        return None
+    caps, rtt = first
+    cached = {}
+    if cache is not None and os.path.exists(cache):
+        with open(cache) as f:
+            cached = json.load(f)
+    if not retune and caps["uid"] in cached:
+        tune = cached[caps["uid"]]
+        if verbose:
+            print("Link parameters of %s from %s" % (caps["uid"], cache))
+        return tune
+
+    best = {}
+    for fraction in PING_SIZES:
+        n = int(caps["max_data"] * fraction)
+        payload = os.urandom(n)
+        for _ in range(PING_COUNT):
+            result = ota_ping(port, payload)
+            if result is not None:
+                best[n] = min(best.get(n, result[1]), result[1])
+    if len(best) < 2:
+        return None
+    # least squares on (2n, RTT) : 2n bytes cross the link per ping
+    xs = [2 * n for n in best]
+    ys = [best[n] for n in best]
+    mx = sum(xs) / len(xs)
+    my = sum(ys) / len(ys)
+    b = max(sum((x - mx) * (y - my) for x, y in zip(xs, ys)) / sum((x - mx) ** 2 for x in xs), 1e-9)
+    a = max(my - b * mx, 0.0)
+
+    frame_size = caps["max_data"]
+    window = max(1, min(caps["rx_window"], math.ceil(a / ((frame_size + FRAME_OVERHEAD) * b)) + 1))
+    timeout = caps["max_busy_ms"] / 1000.0 + 4 * max(ys) + 0.5
+    tune = dict(caps, frame_size=frame_size, window=window, timeout=round(timeout, 3),
+                latency_ms=round(a * 1e3, 3), bytes_per_s=round(1.0 / b))
+    if verbose:
+        print("Link : %.2f ms latency, %.0f B/s -> frame %d, window %d, timeout %.2f s" % (
+            a * 1e3, 1.0 / b, frame_size, window, timeout))
+    if cache is not None:
+        cached[caps["uid"]] = tune
+        os.makedirs(os.path.dirname(os.path.abspath(cache)), exist_ok=True)
+        with open(cache, "w") as f:
+            json.dump(cached, f, indent=2)
+    return tune
+
+
+def ota_open_session(port, size, fw_type, crc, version, resume=True, timeout=PACKET_RESP_TIMEOUT,
+                     noop=False):
+    # SESSION round trip. Returns a dict (device capabilities, slot content,
+    # resume_offset, and from protocol 6 the running image and the action)
+    # or (NACK / PACKET_RESP_TIMEOUT_ERROR, NACK reason).
+    # noop : let the device end the session when it already has the image
+    flags = (SESSION_FLAG_RESUME if resume else 0) | (SESSION_FLAG_NOOP if noop else 0)
+    payload = SESSION_REQ.pack(size, fw_type, crc, version, flags)
+    port.write(FrameBuilder(len(payload)).build(CMD_SESSION_PACKET, payload))
+    frame = ota_read_frame(port, timeout)
+    if frame is None:
+        return PACKET_RESP_TIMEOUT_ERROR, None
+    cmd, body = frame
+    if body is None:
+        return NACK, NACK_CRC
+    if not body or body[0] != ACK:
+        return NACK, body[0] if body else NACK
+    if cmd != CMD_SESSION_PACKET or len(body) not in (SESSION_RESP.size, SESSION_RESP.size + SESSION_ACTIVE.size):
+        return NACK, NACK
+    status, proto, max_data, rx_window, max_busy_ms, uid, fec_max, slot_size, slot_crc, slot_version, \
+        slot_flags, resume_offset = SESSION_RESP.unpack_from(body)
+    info = {"proto": proto, "max_data": max_data, "rx_window": rx_window, "max_busy_ms": max_busy_ms,
+            "uid": uid.hex(), "fec_max": fec_max, "slot_size": slot_size, "slot_crc": slot_crc,
+            "slot_version": slot_version, "slot_flags": slot_flags, "resume_offset": resume_offset}
+    if len(body) > SESSION_RESP.size:
+        info["active_size"], info["active_crc"], info["active_version"], info["action"] = \
+            SESSION_ACTIVE.unpack_from(body, SESSION_RESP.size)
+    return info
+
+
+def ota_update(ser, binfile_content, data_size=ETX_OTA_DATA_MAX_SIZE, window=1,
+               fw_type=FW_TYPE, version=FW_VERSION, log=None, on_phase=None,
+               timeout=PACKET_RESP_TIMEOUT, verbose=False, on_progress=None, tune=None,
+               retries=DATA_RETRIES, session=True, resume=True, force=False, stats=None, fec=0,
+               cobs=False, skip=True, dedup=True):
+    # Run a complete update on an open port.
+    # binfile_content : the image, or an ota_package.OtaPackage whose stored
+    #            frames are sent as they are (data_size, fw_type and version
+    #            then come from the package)
+    # window   : number of data frames in flight
+    # log      : optional file, gets every data payload as a CSV line
+    # on_phase : optional callback(name), called at each protocol step
+    #            (start, header_ack, data_start, data_done, end_sent, end_ack,
+    #            skipped)
+    # timeout  : time allowed for each response (s)
+    # retries  : times a frame is sent again (response timeout, transient
+    #            NACK, lost frame), before giving up
+    # on_progress : optional callback(bytes acknowledged)
+    # tune     : optional dict of ota_autotune() arguments, probe the link after
+    #            the enter request and use the frame size, window and timeout
+    #            it picks (the frame size never grows past data_size or the
+    #            package frames)
+    # session  : open the session with one SESSION round trip instead of
+    #            START then HEADER (False for a firmware without SESSION)
+    # resume   : let the device continue an interrupted upload of this image
+    # force    : update even if the device already has this image. Otherwise
+    #            ACK is returned after the SESSION round trip when the image
+    #            runs, or is staged (the device then resets to install it),
+    #            with phase "skipped". Before protocol 6, when the slot holds
+    #            it, the session is aborted.
+    # stats    : optional dict, gets the error counters of the session
+    #            (timeouts, nack_<reason>, retransmits) and, when it holds a
+    #            "device" key, the device STATS read before END
+    # fec      : DATA frames per PARITY block (0 : retransmission only),
+    #            limited to what the device takes. Only useful with a window
+    #            larger than the block : the PARITY then rebuilds a lost frame
+    #            without sending it again, which keeps the retries for the
+    #            frames the PARITY cannot save.
+    # cobs     : COBS encode the frames (protocol 4) : the device finds the
+    #            next frame right after a broken one instead of waiting out
+    #            a wrong length
+    # skip     : send one SKIP frame instead of each run of DATA frames left
+    #            erased (0xFF), when the device takes it
+    # dedup    : ask the device for the page hashes of the application it
+    #            runs and send one COPY frame instead of the DATA frames of
+    #            the pages it has already (at any page), when it takes it
+    def phase(name):
+        if on_phase is not None:
+            on_phase(name)
+
+    if stats is None:
+        stats = {}
+    for key in ["timeouts", "retransmits"] + ["nack_" + name for name in NACK_NAMES.values()]:
+        stats.setdefault(key, 0)
+
+    def failed(resp, code):
+        # count an error, tell if the frame is worth sending again
+        if resp == PACKET_RESP_TIMEOUT_ERROR:
+            stats["timeouts"] += 1
+        else:
+            stats["nack_" + NACK_NAMES.get(code, "error")] += 1
+        if verbose:
+            print("  %s" % ("response timeout" if resp == PACKET_RESP_TIMEOUT_ERROR else
+                            "NACK (%s)" % NACK_NAMES.get(code, code)))
+        return ota_retryable(resp, code)
+
+    def command(data, cmd):
+        # send a command frame and read its response, again on a transient
+        # error
+        for attempt in range(retries + 1):
+            if attempt:
+                stats["retransmits"] += 1
+            ser.write(data)
+            resp, code = ota_read_status(ser, cmd, timeout)
+            if resp == ACK or not failed(resp, code):
+                break
+        return resp
+
+    if cobs:
+        ser = CobsPort(ser)
+
+    phase("start")
+    # start ota update
+    if ota_send_enter_request(ser) == ACK:
+        if verbose:
+            print("Device entered OTA mode")
+    elif verbose:
+        print("No answer to the OTA enter request, assuming OTA mode")
+
+    if tune is not None:
+        params = ota_autotune(ser, verbose=verbose, **tune)
+        if params is None:
+            if verbose:
+                print("No answer to the PING, keeping the link parameters")
+        else:
+            data_size = min(data_size, params["frame_size"])
+            window = params["window"]
+            timeout = params["timeout"]
+
+    frame = FrameBuilder(max(data_size + PARITY_HDR.size, HEADER_PAYLOAD.size))
+    frames = getattr(binfile_content, "frames", None)
+    if frames is not None:
+        # prebuilt package
+        binfile_size = binfile_content.size
+        header = binfile_content.header_frame
+        fw_crc = binfile_content.crc
+        fw_type = binfile_content.fw_type
+        version = binfile_content.version
+        data_size = binfile_content.frame_size
+        count = len(frames)
+        data_frame = frames.__getitem__
+
+        def frame_data(k):
+            return frames[k][FRAME_HEAD.size + DATA_HDR.size:-FRAME_TAIL.size]
+    else:
+        image = memoryview(binfile_content)
+        binfile_size = len(image)
+        fw_crc = calculate_crc16(image)
+        header = bytes(frame.build(CMD_INFO_PACKET, HEADER_PAYLOAD.pack(binfile_size, fw_type, fw_crc, version)))
+        count = (binfile_size + data_size - 1) // data_size
+
+        def data_frame(k):
+            offset = k * data_size
+            return frame.build_data(k, offset, image[offset:offset + data_size])
+
+        def frame_data(k):
+            return image[k * data_size:(k + 1) * data_size]
+    if verbose:
+        print("FW CRC : 0x%04X" % fw_crc)
+
+    first = 0
+    if session:
+        for attempt in range(retries + 1):
+            if attempt:
+                stats["retransmits"] += 1
+            info = ota_open_session(ser, binfile_size, fw_type, fw_crc, version, resume, timeout,
+                                    noop=not force)
+            if isinstance(info, dict) or not failed(*info):
+                break
+        if not isinstance(info, dict):
+            return info[0]
+        phase("header_ack")
+        if info.get("action", SESSION_UPLOAD) != SESSION_UPLOAD:
+            # the device closed the session, nothing more to send
+            if verbose:
+                print("Device %s version 0x%04X (CRC 0x%04X), nothing to send" % (
+                    "already runs" if info["action"] == SESSION_UP_TO_DATE else
+                    "resets to install the staged", version, fw_crc))
+            phase("skipped")
+            return ACK
+        if not force and "action" not in info and info["slot_flags"] & SLOT_FLAG_VALID and \
+                (info["slot_size"], info["slot_crc"], info["slot_version"]) == (binfile_size, fw_crc, version):
+            if verbose:
+                print("Device already has version 0x%04X (CRC 0x%04X), nothing to do" % (version, fw_crc))
+            resp = command(frame.build(CMD_ABORT_PACKET, b'\x01'), CMD_ABORT_PACKET)
+            phase("skipped")
+            return resp
+        first = info["resume_offset"] // data_size
+        if verbose and first:
+            print("Resuming the upload at offset %d" % (first * data_size))
+        skip = skip and info["proto"] >= SKIP_MIN_PROTOCOL
+        dedup = dedup and info["proto"] >= DEDUP_MIN_PROTOCOL and fw_type == FW_TYPE_APP
+        if fec > info["fec_max"]:
+            if verbose:
+                print("FEC blocks of %d frames, the device takes %d" % (fec, info["fec_max"]))
+            fec = info["fec_max"]
+    else:
+        fec = 0         # no capabilities without SESSION
+        skip = False
+        dedup = False
+        resp = command(frame.build(CMD_START_PACKET, b'\x01'), CMD_START_PACKET)
+        if resp != ACK:
+            return resp
+
+        # send header command
+        resp = command(header, CMD_INFO_PACKET)
+        if resp != ACK:
+            return resp
+        phase("header_ack")
+
+    def parity_frame(b):
+        # XOR of the DATA frames of block b, the last one zero padded
+        start = b * fec
+        end = min(start + fec, count)
+        parity = 0
+        for k in range(start, end):
+            parity ^= int.from_bytes(frame_data(k), "little")
+        return frame.build_parity(b, start * data_size, end - start, parity.to_bytes(data_size, "little"))
+
+    # runs of DATA frames left erased : first frame -> frame after the run.
+    # With FEC a run stops at the block end, so that a PARITY never
+    # acknowledges a SKIP of frames out of its block.
+    skips = {}
+    if skip:
+        erased = b"\xff" * data_size
+        k = first
+        while k < count:
+            end = k
+            while end < count and frame_data(end) == erased[:len(frame_data(end))] and \
+                    (end == k or not fec or end % fec):
+                end += 1
+            if end > k:
+                skips[k] = end
+            k = max(end, k + 1)
+        if verbose and skips:
+            print("Skipping %d erased bytes, %d runs" % (
+                sum(min(e * data_size, binfile_size) - k * data_size for k, e in skips.items()), len(skips)))
+
+    # runs of DATA frames the device has in the application it runs, at the
+    # same or another page : first frame -> offset in the application, the
+    # run end in 'skips' too. A run stops at a block end as above and at
+    # COPY_MAX_SIZE.
+    copies = {}
+    hashes = ota_read_page_hashes(ser, timeout, retries) if dedup else None
+    if dedup and hashes is None and verbose:
+        print("No answer to PAGE_HASHES, sending every page")
+    if hashes:
+        content = image if frames is None else b"".join(bytes(frame_data(k)) for k in range(count))
+        where = {}
+        for page, h in enumerate(hashes):
+            where.setdefault(h, page)
+        # image page -> page of the running application holding the same bytes
+        source = {}
+        for page in range(binfile_size // FLASH_PAGE):
+            h = zlib.crc32(content[page * FLASH_PAGE:(page + 1) * FLASH_PAGE])
+            if page < len(hashes) and hashes[page] == h:
+                source[page] = page
+            elif h in where:
+                source[page] = where[h]
+
+        def shift(k):
+            # image offset -> application offset of frame k, None if its
+            # pages are not all in the application, in the same order
+            start = k * data_size
+            end = min(start + data_size, binfile_size)
+            moves = set(source[page] - page if page in source else None
+                        for page in range(start // FLASH_PAGE, (end - 1) // FLASH_PAGE + 1))
+            return moves.pop() * FLASH_PAGE if len(moves) == 1 and None not in moves else None
+
+        k = first
+        while k < count:
+            if k in skips:
+                k = skips[k]
+                continue
+            move = shift(k)
+            end = k
+            if move is not None:
+                while end < count and end not in skips and shift(end) == move and \
+                        (end + 1 - k) * data_size <= COPY_MAX_SIZE and (end == k or not fec or end % fec):
+                    end += 1
+                copies[k] = k * data_size + move
+                skips[k] = end
+            k = max(end, k + 1)
+        if verbose and copies:
+            print("Copying %d bytes from the running application, %d runs" % (
+                sum(min(skips[k] * data_size, binfile_size) - k * data_size for k in copies), len(copies)))
+
+    def skip_frame(k):
+        offset = k * data_size
+        length = min(skips[k] * data_size, binfile_size) - offset
+        if k in copies:
+            return frame.build(CMD_COPY_PACKET, COPY_PAYLOAD.pack(k & 0xFFFF, offset, length, copies[k]))
+        return frame.build(CMD_SKIP_PACKET, SKIP_PAYLOAD.pack(k & 0xFFFF, offset, length))
+
+    def schedule():
+        # DATA frames in order (one SKIP or COPY per run), with FEC the PARITY
+        # of each block after it, unless the block is all SKIP and COPY
+        k = first
+        data = False
+        while k < count:
+            end = skips.get(k, k + 1)
+            data = data or k not in skips
+            yield k
+            if fec and (end % fec == 0 or end == count):
+                if data:
+                    yield -1 - (end - 1) // fec
+                data = False
+            k = end
+
+    #send firmware
+    phase("data_start")
+    window = max(window, 1)
+    # frames sent, not acknowledged yet, in the order they were first sent :
+    # key (DATA frame number, or -1 - block for a PARITY) -> [first send,
+    # last send, sends]. The device answers in the order it reads the
+    # frames, so a frame sent before the one just answered, and not sent
+    # again since, is lost (or its answer is). It is sent again at once,
+    # unless the PARITY of its block is still to be answered : the device
+    # may rebuild it.
+    inflight = collections.OrderedDict()
+    sent = 0
+    opened = False                      # one frame at a time until the first ACK : the slot erase
+    percent = -1
+    i = min(first * data_size, binfile_size)
+    pending = schedule()
+    key = next(pending, None)
+
+    def send(n):
+        # send a frame (again), False once it was sent 1 + retries times
+        nonlocal sent
+        entry = inflight.get(n)
+        if entry is not None:
+            if entry[2] > retries:
+                return False
+            stats["retransmits"] += 1
+        data = parity_frame(-1 - n) if n < 0 else skip_frame(n) if n in skips else data_frame(n)
+        ser.write(data)
+        sent += 1
+        if entry is None:
+            inflight[n] = [sent, sent, 1]
+            if log is not None and n >= 0 and n not in skips:
+                log.write((",".join(map(str, data[4 + DATA_HDR.size:-3].tolist())) + ",\n").encode("utf-8"))
+        else:
+            entry[1] = sent
+            entry[2] += 1
+        return True
+
+    def covered(n):
+        return fec and -1 - n // fec in inflight
+
+    def done(n):
+        nonlocal i
+        del inflight[n]
+        if n >= 0:
+            i += min(skips.get(n, n + 1) * data_size, binfile_size) - n * data_size
+
+    while key is not None or inflight:
+        # keep up to 'window' frames in flight
+        while len(inflight) < (window if opened else 1) and key is not None:
+            send(key)
+            key = next(pending, None)
+        resp, rx_cmd, seq, code = ota_read_data_response(ser, timeout)
+        if resp == PACKET_RESP_TIMEOUT_ERROR:
+            # nothing comes back : send the DATA frames in flight again (the
+            # device ignores the copies of the frames it already wrote)
+            failed(resp, code)
+            for n in list(inflight):
+                if n < 0:
+                    del inflight[n]
+                elif not send(n):
+                    return resp
+            continue
+        if seq is None:
+            # frame the device could not read (or a corrupted answer). The
+            # device reads on from the next SOF, so it is the oldest frame in
+            # flight : the ones before it are answered already
+            if not failed(resp, code):
+                return resp
+            n = min(inflight, key=lambda n: inflight[n][1])
+            if n < 0:
+                # PARITY : its block frames still in flight go again instead
+                del inflight[n]
+                b = -1 - n
+                again = [k for k in inflight if b * fec <= k < (b + 1) * fec]
+            else:
+                again = [n] if not covered(n) else []
+            for n in again:
+                if not send(n):
+                    return resp
+            continue
+        if rx_cmd == CMD_PARITY_PACKET:
+            match = next((n for n in inflight if n < 0 and ((-1 - n) & 0xFFFF) == seq), None)
+        else:
+            match = next((n for n in inflight if n >= 0 and (n & 0xFFFF) == seq), None)
+        if match is None:
+            # answer to a copy sent again, already counted
+            continue
+        answered = inflight[match][0]
+        if resp != ACK:
+            if match < 0 and code == NACK_MISSING:
+                # block not rebuilt : its lost frames go again below
+                failed(resp, code)
+                del inflight[match]
+            elif failed(resp, code):
+                if not send(match):
+                    return resp
+                continue
             else:
-                return NACK
-
-def ota_send_data(port, data, datalen,log):
-    #port.write("Sending OTA Header".encode("utf-8"))
-    print("Sending OTA DATA : ", datalen, len(data))
-    fw_packet = []
-    fw_packet.append(START_BYTE)
-    fw_packet.append(CMD_FWDATA_PACKET)
-    
-    filesize_byte_array = datalen.to_bytes(4, byteorder='big')
-    fw_packet.append(int(datalen & 0x00FF))
-    fw_packet.append(int((datalen & 0xFF00) >> 8))
-    
-
-    for x in range(0,datalen):
-        fw_packet.append(int(data[x]))
-        val = int(data[x])
-        fmt_data = f"{val},"
-        log.write(fmt_data.encode("utf-8"));
-    #print("w data : %x",data)
-
-    crc16 = calculate_crc16(fw_packet[1:])
-    crc_byte_array = crc16.to_bytes(2, byteorder='big')
-    fw_packet.append(crc_byte_array[1])
-    fw_packet.append(crc_byte_array[0])
-    fw_packet.append(END_BYTE)
-
-    #print("fw packet : ", fw_packet)
-    port.write(bytes(fw_packet))
-    log.write(b'\n');
-
-
-def ota_send_stop_command(port):
-    #port.write("Sending OTA START".encode("utf-8"))
-    stop_packet = []
-    stop_packet.append(START_BYTE)
-    stop_packet.append(CMD_STOP_PACKET)
-    stop_packet.append(CMD_STOP_PACKET_LENGTH)
-    stop_packet.append(0x00)
-    stop_packet.append(0x01)
-    crc16 = calculate_crc16(stop_packet[1:])
-    crc_byte_array = crc16.to_bytes(2, byteorder='big')
-    stop_packet.append(crc_byte_array[1])
-    stop_packet.append(crc_byte_array[0])
-    stop_packet.append(END_BYTE)
-    print("Stop Packet : ", stop_packet)
-    #crc_byte_array = crc16.to_bytes(2, byteorder='big')
-    port.write(bytes(stop_packet))
+                return resp
+        elif match < 0:
+            # block complete, rebuilt or not
+            b = -1 - match
+            for n in range(b * fec, min((b + 1) * fec, count)):
+                if n in inflight:
+                    done(n)
+            del inflight[match]
+        else:
+            done(match)
+            opened = True
+        lost = [n for n, entry in inflight.items() if entry[1] < answered]
+        for n in lost:
+            if n < 0:
+                # PARITY lost, its block frames are sent again instead
+                del inflight[n]
+        for n in lost:
+            if n >= 0 and not covered(n) and not send(n):
+                return PACKET_RESP_TIMEOUT_ERROR
+        if on_progress is not None:
+            on_progress(i)
+        if verbose and int(i * 100 / binfile_size) != percent:
+            percent = int(i * 100 / binfile_size)
+            print("updating firmware : ", percent, "%")
+    phase("data_done")
 
+    if "device" in stats:
+        stats["device"] = ota_read_stats(ser, timeout)
+
+    # send stop command
+    ser.write(frame.build(CMD_STOP_PACKET, b'\x01'))
+    phase("end_sent")
+    resp, code = ota_read_status(ser, CMD_STOP_PACKET, timeout)
+    for attempt in range(retries):
+        if resp == ACK or not failed(resp, code):
+            break
+        stats["retransmits"] += 1
+        ser.write(frame.build(CMD_STOP_PACKET, b'\x01'))
+        resp, code = ota_read_status(ser, CMD_STOP_PACKET, timeout)
+    if resp != ACK:
+        return resp
+    phase("end_ack")
+    if verbose:
+        print("Firmware update successfull!")
+    return ACK
 
 
 def main():
-    # total arguments
-    n = len(sys.argv)
-    if(n < 3) : 
-        print("Please enter filename and port")
+    parser = argparse.ArgumentParser(description="Flash a firmware over the OTA UART")
+    parser.add_argument("binfile", help="firmware image (.bin, .elf, .hex) or package (.ota, see ota_package.py)")
+    parser.add_argument("--base", type=lambda x: int(x, 0),
+                        help="flash address of the image start (.elf/.hex, default : lowest address)")
+    parser.add_argument("port", help="serial port")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--frame-size", type=int, default=ETX_OTA_DATA_MAX_SIZE,
+                        help="data bytes per frame")
+    parser.add_argument("--window", type=int, default=1, help="data frames in flight")
+    parser.add_argument("--retries", type=int, default=DATA_RETRIES,
+                        help="times a frame is sent again after a timeout or a transient NACK")
+    parser.add_argument("--fec", type=int, default=0,
+                        help="send a PARITY frame after every FEC data frames (0 : off, needs --window)")
+    parser.add_argument("--cobs", action="store_true", help="COBS framing (firmware with protocol 4)")
+    parser.add_argument("--no-skip", action="store_true", help="send the erased (0xFF) frames too")
+    parser.add_argument("--no-dedup", action="store_true",
+                        help="send the pages the device already has in its application too")
+    parser.add_argument("--type", type=lambda x: int(x, 0), default=FW_TYPE,
+                        help="firmware type of a .bin (1 : application, 2 : bootloader)")
+    parser.add_argument("--version", type=lambda x: int(x, 0), default=FW_VERSION,
+                        help="firmware version of a .bin")
+    parser.add_argument("--timeout", type=float, default=PACKET_RESP_TIMEOUT,
+                        help="response timeout (s)")
+    parser.add_argument("--legacy-handshake", action="store_true",
+                        help="START then HEADER instead of SESSION (older firmware)")
+    parser.add_argument("--no-resume", action="store_true", help="restart an interrupted upload from 0")
+    parser.add_argument("--force", action="store_true", help="update even if the device has this image")
+    parser.add_argument("--auto", action="store_true",
+                        help="probe the link (PING) and pick frame size, window and timeout")
+    parser.add_argument("--tune-cache", default=TUNE_CACHE, help="per device link parameters of --auto")
+    parser.add_argument("--retune", action="store_true", help="probe again even if the device is cached")
+    parser.add_argument("--stats", action="store_true",
+                        help="print the error counters of the session, host and device side")
+    parser.add_argument("--log", help="write every data payload to this file (CSV)")
+    parser.add_argument("--record", help="capture the session (see ota_capture.py)")
+    args = parser.parse_args()
+
+    import ota_package      # here : ota_package itself builds on this module
+    if ota_package.is_package(args.binfile):
+        binfile_content = ota_package.OtaPackage.load(args.binfile)
+        print("Package : version 0x%04X, %d frames of %d bytes" % (
+            binfile_content.version, len(binfile_content.frames), binfile_content.frame_size))
     else:
-            
-        binfilePath = sys.argv[1]
-        port = sys.argv[2]
-
-        baud_rate = 115200  # Adjust this to match your device's baud rate
-
-        try:
-            # Open the serial port
-            ser = serial.Serial(port, baud_rate, timeout=0.1)
-
-            wfile = open("wfile.bin","wb")
-
-            #open binary file
-            #binfile_size = os.path.getsize(binfilePath)
-            
-            binfile = open(binfilePath,"rb")
-            binfile_content = binfile.read()
-            binfile_size = len(binfile_content)
-            print("Binary file size : ",binfile_size)
-            print(f"Serial port {port} is open.")
-
-            # calculate crc of the fw
-            fw_crc = calculate_crc16(binfile_content)
-            #fw_crc = crc16(binfile_content)
-            print("FW CRC : ", fw_crc)
-
-            # Read and print data from the serial port
-            #ser.flush()
-            # start ota update
-            ota_send_start_command(ser)
-            resp = ota_check_response(ser,CMD_START_PACKET)
-            if resp != ACK:
-                print(ERROR_CODES[resp])
-                return -1
-
-            # send header command 
-            ota_send_header_command(ser,binfile_size,FW_TYPE,fw_crc,FW_VERSION)
-            resp = ota_check_response(ser,CMD_INFO_PACKET)
-            if resp != ACK:
-                print(ERROR_CODES[resp])
-                return -1
-            
-            i=0
-            #send firmware 
-            print("updating firmware : ", 0 , "%" )
-            while True:
-                if binfile_size - i >= ETX_OTA_DATA_MAX_SIZE:
-                    tobesend = binfile_content[i:i + ETX_OTA_DATA_MAX_SIZE]
-                    ota_send_data(ser,tobesend,ETX_OTA_DATA_MAX_SIZE,wfile)
-                    
-
-                    resp = ota_check_response(ser,CMD_FWDATA_PACKET)
-                    if resp == ACK:
-                        i += ETX_OTA_DATA_MAX_SIZE
-                    else:
-                        print(ERROR_CODES[resp])
-                        return -1
-
-                    print("updating firmware : ", int(i/ binfile_size * 100) , "%" )
-                elif binfile_size - i > 0:
-                    tobesend = binfile_content[i:binfile_size]
-                    ota_send_data(ser,tobesend,binfile_size - i,wfile)
-                 
-
-                    resp = ota_check_response(ser,CMD_FWDATA_PACKET)
-                    if resp == ACK:
-                        i = binfile_size
-                        print("updating firmware : ", int(i/ binfile_size * 100)  , "%" )
-                        
-                    else:
-                        print(ERROR_CODES[resp])
-                        return -1
-
-                if i == binfile_size:
-                    print("Firmware update successfull!")
-                    # send stop command
-                    ota_send_stop_command(ser)
-                    break
-        
-        except serial.SerialException as e:
-            print(f"Error: {e}")
-        finally:
-            if ser.is_open:
-                ser.close()
-                binfile.close()
-                wfile.close()
-                print(f"Serial port {port} is closed.")
+        binfile_content, base = fw_image.load(args.binfile, args.base)
+        if base is not None:
+            print("Image base address : 0x%08X" % base)
+    print("Binary file size : ", len(binfile_content))
 
+    ser = None
+    capture = None
+    log = None
+    try:
+        # Open the serial port
+        ser = serial.Serial(args.port, args.baud, timeout=PORT_TIMEOUT)
+        print(f"Serial port {args.port} is open.")
 
+        link = ser
+        if args.record is not None:
+            capture = ota_capture.CaptureWriter(args.record)
+            link = ota_capture.RecordingSerial(ser, capture)
+        if args.log is not None:
+            log = open(args.log, "wb")
 
-if __name__=="__main__":
-    main()
+        stats = {"device": None} if args.stats else None
+        phases = []
+        start = time.monotonic()
+        resp = ota_update(link, binfile_content, data_size=args.frame_size, window=args.window,
+                          fw_type=args.type, version=args.version, log=log, on_phase=phases.append,
+                          timeout=args.timeout,
+                          verbose=True, retries=args.retries, session=not args.legacy_handshake,
+                          resume=not args.no_resume, force=args.force, stats=stats, fec=args.fec,
+                          cobs=args.cobs, skip=not args.no_skip, dedup=not args.no_dedup,
+                          tune={"cache": args.tune_cache, "retune": args.retune} if args.auto else None)
+        if stats is not None:
+            print("Host : " + ", ".join("%s %d" % (k, v) for k, v in stats.items() if k != "device"))
+            if stats["device"] is not None:
+                print("Device : " + ", ".join("%s %d" % kv for kv in stats["device"].items()))
+        if resp != ACK:
+            print(ERROR_CODES[resp])
+            return -1
+        print("%s in %.3f s" % ("Nothing to update" if "skipped" in phases else "Updated",
+                                time.monotonic() - start))
 
+    except serial.SerialException as e:
+        print(f"Error: {e}")
+        return -1
+    finally:
+        if log is not None:
+            log.close()
+        if capture is not None:
+            capture.close()
+            print("Session recorded to", args.record)
+        if ser is not None and ser.is_open:
+            ser.close()
+            print(f"Serial port {args.port} is closed.")
+    return 0
 
+
+if __name__=="__main__":
+    sys.exit(main())
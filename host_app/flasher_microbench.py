@@ -0,0 +1,154 @@
+import argparse
+import os
+import sys
+import time
+
+import flasher
+import ota_package
+
+# Host side cost of the flasher, without any serial port or device.
+#
+# A loopback port answers every frame with an ACK as soon as it is written,
+# so the time measured is only the host work per frame : build the frame,
+# CRC it, hand it to the port and parse the response.
+#
+#   crc16     : frame CRC, table driven Python vs binascii
+#   build     : one data frame, list of ints (previous flasher) vs in place
+#   response  : read and check one ACK
+#   update    : complete flasher.ota_update() loop, per data frame
+#   package   : same, streaming a prebuilt ota_package.OtaPackage
+#
+# usage : python flasher_microbench.py [--image-size 262144] [--frame-size 128]
+
+CRC16_TABLE = [0] * 256
+for _n in range(256):
+    _c = _n << 8
+    for _b in range(8):
+        _c = ((_c << 1) ^ 0x1021) if (_c & 0x8000) else (_c << 1)
+    CRC16_TABLE[_n] = _c & 0xFFFF
+
+
+def legacy_crc16(data):
+    # Previous calculate_crc16() : one table lookup per byte in Python
+    crc = 0xFFFF
+    for byte in data:
+        crc = (crc << 8) ^ CRC16_TABLE[((crc >> 8) ^ byte) & 0xFF]
+    return crc & 0xFFFF
+
+
+def legacy_frame(data):
+    # Previous ota_send_data() frame building
+    fw_packet = [flasher.START_BYTE, flasher.CMD_FWDATA_PACKET, len(data) & 0xFF, (len(data) >> 8) & 0xFF]
+    for x in range(0, len(data)):
+        fw_packet.append(int(data[x]))
+    crc16 = legacy_crc16(fw_packet[1:])
+    crc_byte_array = crc16.to_bytes(2, byteorder='big')
+    fw_packet.append(crc_byte_array[1])
+    fw_packet.append(crc_byte_array[0])
+    fw_packet.append(flasher.END_BYTE)
+    return bytes(fw_packet)
+
+
+def response_frame(cmd, status, payload=b""):
+    payload = bytes([status]) + payload
+    crc = flasher.calculate_crc16(payload)
+    return bytes([flasher.START_BYTE, cmd, len(payload), 0]) + payload + \
+        bytes([crc & 0xFF, crc >> 8, flasher.END_BYTE])
+
+
+RESPONSES = {cmd: response_frame(cmd, flasher.ACK) for cmd in
+             (flasher.CMD_START_PACKET, flasher.CMD_INFO_PACKET, flasher.CMD_FWDATA_PACKET,
+              flasher.CMD_STOP_PACKET, flasher.CMD_ENTER_PACKET)}
+# SESSION : empty slot, upload from the start
+RESPONSES[flasher.CMD_SESSION_PACKET] = response_frame(
+    flasher.CMD_SESSION_PACKET, flasher.ACK,
+    flasher.SESSION_RESP.pack(flasher.ACK, 2, flasher.ETX_OTA_DATA_MAX_SIZE, 1, 0, bytes(12), 0,
+                              0, 0, 0, 0, 0)[1:])
+
+
+class LoopbackPort:
+    # Answers every frame (and the enter request) with an ACK
+    def __init__(self):
+        self.rx = bytearray()
+        self.frames = 0
+
+    def write(self, data):
+        if data[0] == flasher.ENTER_REQ:
+            self.rx += RESPONSES[flasher.CMD_ENTER_PACKET]
+        elif data[1] == flasher.CMD_FWDATA_PACKET:
+            # DATA ACK carries the frame sequence number
+            self.rx += response_frame(flasher.CMD_FWDATA_PACKET, flasher.ACK, bytes(data[4:6]))
+            self.frames += 1
+        else:
+            self.rx += RESPONSES[data[1]]
+            self.frames += 1
+        return len(data)
+
+    def read(self, size=1):
+        data = bytes(self.rx[:size])
+        del self.rx[:size]
+        return data
+
+
+def per_call(fn, count):
+    start = time.perf_counter()
+    for _ in range(count):
+        fn()
+    return (time.perf_counter() - start) / count * 1e6
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Host cost of the flasher per frame")
+    parser.add_argument("--image-size", type=int, default=256 * 1024)
+    parser.add_argument("--frame-size", type=int, default=flasher.ETX_OTA_DATA_MAX_SIZE)
+    parser.add_argument("--count", type=int, default=20000, help="iterations of the small benchmarks")
+    args = parser.parse_args()
+
+    payload = os.urandom(args.frame_size)
+    data = flasher.DATA_HDR.pack(1, 0) + payload
+    frame = flasher.FrameBuilder(len(data))
+    head = bytes([flasher.CMD_FWDATA_PACKET, len(data) & 0xFF, len(data) >> 8]) + data
+    ack = response_frame(flasher.CMD_FWDATA_PACKET, flasher.ACK, b"\x01\x00")
+
+    assert legacy_frame(data) == bytes(frame.build_data(1, 0, payload))
+
+    port = LoopbackPort()
+
+    def read_ack():
+        port.rx += ack
+        flasher.ota_read_data_response(port)
+
+    print("%-10s %12s %12s   (us, frame of %d bytes)" % ("", "previous", "now", args.frame_size))
+    print("%-10s %12.2f %12.2f" % ("crc16", per_call(lambda: legacy_crc16(head), args.count // 10),
+                                    per_call(lambda: flasher.calculate_crc16(head), args.count)))
+    print("%-10s %12.2f %12.2f" % ("build", per_call(lambda: legacy_frame(data), args.count // 10),
+                                    per_call(lambda: frame.build_data(1, 0, payload), args.count)))
+    print("%-10s %12s %12.2f" % ("response", "-", per_call(read_ack, args.count)))
+
+    image = os.urandom(args.image_size)
+    port = LoopbackPort()
+    start = time.perf_counter()
+    resp = flasher.ota_update(port, image, data_size=args.frame_size)
+    elapsed = time.perf_counter() - start
+    if resp != flasher.ACK:
+        print("update failed (%d)" % resp)
+        return 1
+    per_frame = elapsed / port.frames * 1e6
+    print("%-10s %12s %12.2f   (%d frames, %.1f MB/s)" % ("update", "-", per_frame, port.frames,
+                                                        args.image_size / elapsed / 1e6))
+
+    pkg = ota_package.OtaPackage.from_image(image, frame_size=args.frame_size)
+    port = LoopbackPort()
+    start = time.perf_counter()
+    resp = flasher.ota_update(port, pkg)
+    elapsed = time.perf_counter() - start
+    if resp != flasher.ACK:
+        print("package update failed (%d)" % resp)
+        return 1
+    print("%-10s %12s %12.2f   (%d frames, %.1f MB/s)" % ("package", "-", elapsed / port.frames * 1e6,
+                                                        port.frames, args.image_size / elapsed / 1e6))
+    return 0 if per_frame < 50.0 else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
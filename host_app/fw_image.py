@@ -0,0 +1,119 @@
+import argparse
+import binascii
+import struct
+import sys
+
+# Firmware images for the flasher and the package builder.
+#
+# A .bin is used as it is. An ELF (its PT_LOAD segments, at their load
+# address) or an Intel HEX file (data records) is flattened into the flash
+# image : from the lowest address, or --base, to the end of the highest
+# segment, the gaps between the segments filled with 0xFF (erased flash).
+# The flasher does not send those gaps, see SKIP in flasher.py.
+#
+# usage : python fw_image.py app.elf [-o app.bin] [--base 0x08020000]
+
+ERASED = 0xFF
+
+ELF_MAGIC = b"\x7fELF"
+ELF_CLASS32 = 1
+ELF_DATA_LE = 1
+ELF_HEADER = struct.Struct("<16sHHIIIIIHHHHHH")
+ELF_PHDR = struct.Struct("<IIIIIIII")
+PT_LOAD = 1
+
+HEX_DATA = 0x00
+HEX_EOF = 0x01
+HEX_EXT_SEGMENT = 0x02
+HEX_EXT_LINEAR = 0x04
+
+
+def elf_segments(content):
+    # (load address, data) of the PT_LOAD segments with file content
+    ident, _, machine, _, entry, phoff, _, _, _, phentsize, phnum, _, _, _ = \
+        ELF_HEADER.unpack_from(content, 0)
+    if ident[4] != ELF_CLASS32 or ident[5] != ELF_DATA_LE:
+        raise ValueError("only 32 bit little endian ELF files are supported")
+    segments = []
+    for n in range(phnum):
+        p_type, offset, _, paddr, filesz, _, _, _ = ELF_PHDR.unpack_from(content, phoff + n * phentsize)
+        if p_type == PT_LOAD and filesz:
+            # the load address (LMA) : .data is stored in flash after .text
+            segments.append((paddr, bytes(content[offset:offset + filesz])))
+    return segments
+
+
+def hex_segments(text):
+    # (address, data) of every data record, in file order
+    segments = []
+    base = 0
+    for number, line in enumerate(text.splitlines(), 1):
+        line = line.strip()
+        if not line:
+            continue
+        if not line.startswith(":"):
+            raise ValueError("line %d : not an Intel HEX record" % number)
+        record = binascii.unhexlify(line[1:])
+        if len(record) < 5 or len(record) != record[0] + 5 or sum(record) & 0xFF:
+            raise ValueError("line %d : corrupted record" % number)
+        length, address, kind = record[0], (record[1] << 8) | record[2], record[3]
+        data = record[4:4 + length]
+        if kind == HEX_DATA:
+            segments.append((base + address, data))
+        elif kind == HEX_EOF:
+            break
+        elif kind == HEX_EXT_SEGMENT:
+            base = ((data[0] << 8) | data[1]) << 4
+        elif kind == HEX_EXT_LINEAR:
+            base = ((data[0] << 8) | data[1]) << 16
+    return segments
+
+
+def flatten(segments, base=None):
+    # Flash image of the segments, from 'base' (default : the lowest address)
+    if not segments:
+        raise ValueError("no data to flash")
+    low = min(address for address, _ in segments)
+    if base is None:
+        base = low
+    elif low < base:
+        raise ValueError("data at 0x%08X, below the base address 0x%08X" % (low, base))
+    end = max(address + len(data) for address, data in segments)
+    image = bytearray([ERASED]) * (end - base)
+    for address, data in segments:
+        image[address - base:address - base + len(data)] = data
+    return bytes(image), base
+
+
+def load(path, base=None):
+    # (image, base address) of a .bin, ELF or Intel HEX file. The base
+    # address of a .bin is 'base' (None if not given).
+    with open(path, "rb") as f:
+        content = f.read()
+    if content.startswith(ELF_MAGIC):
+        return flatten(elf_segments(content), base)
+    if content.startswith(b":") or path.lower().endswith((".hex", ".ihex")):
+        return flatten(hex_segments(content.decode("ascii")), base)
+    return content, base
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Flatten an ELF or Intel HEX file into a flash image")
+    parser.add_argument("image", help=".elf, .hex or .bin")
+    parser.add_argument("-o", "--output", help="write the flat image (.bin)")
+    parser.add_argument("--base", type=lambda x: int(x, 0), help="flash address of the image start")
+    args = parser.parse_args()
+
+    image, base = load(args.image, args.base)
+    erased = sum(1 for n in range(0, len(image), 8) if image[n:n + 8] == b"\xff" * len(image[n:n + 8]))
+    print("%s : %d bytes%s, %d erased doublewords (%.1f %%)" % (
+        args.image, len(image), " at 0x%08X" % base if base is not None else "", erased,
+        erased * 800.0 / max(len(image), 1)))
+    if args.output:
+        with open(args.output, "wb") as f:
+            f.write(image)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,284 @@
+import argparse
+import contextlib
+import csv
+import itertools
+import json
+import os
+import random
+import subprocess
+import sys
+import tempfile
+import time
+
+import serial
+
+import ble_link
+import flasher
+
+# End-to-end OTA benchmark on the simulated device (host_sim).
+#
+# Every run flashes a random image with flasher.ota_update() into a fresh
+# simulator and splits the update time into phases :
+#   handshake : enter request, START and HEADER            (host timestamps)
+#   erase     : slot/config erase during the data phase    (device events)
+#   transfer  : data phase without the erase
+#   verify    : END command up to its ACK (CRC check + config write)
+#   install   : reset and bootloader copy to the active slot
+#   boot      : bootloader CRC verify up to the jump
+# The device side of the session is also reported as the share of time the
+# core is awake (the rest in Sleep mode, WFI) and the estimated energy per KB
+# of image (simulator supply current model). --busy-wait runs the simulator
+# without Sleep mode, for comparison.
+# The simulator event log uses CLOCK_MONOTONIC like time.monotonic(), so the
+# host and device timestamps are directly comparable.
+#
+# With --ble, the flasher talks to the simulator through the BLE bridge
+# emulator (ble_link.py) instead of a direct cable. --ble-losses sweeps the
+# packet loss rate and --fecs the FEC block size (0 : retransmission only),
+# goodput is the image size over the data phase time.
+#
+# usage : python ota_bench.py [--frame-sizes 64,128] [--bauds 115200,921600]
+#                             [--windows 1] [--image-sizes 16384] [--csv F] [--json F]
+#                             [--ble [--ble-interval-ms 30] [--ble-mtu 23] ...]
+#                             [--ble-losses 0,0.01 --fecs 0,8 --windows 12]
+
+DEFAULT_SIM = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                           "..", "host_sim", "build", "ota_sim")
+
+PHASES = ["handshake", "erase", "transfer", "verify", "install", "boot"]
+
+FIELDS = ["image_size", "frame_size", "baud", "window", "fec", "loss", "repeat", "status"] + \
+         ["%s_s" % p for p in PHASES] + \
+         ["total_s", "throughput_Bps", "goodput_Bps", "rx_bytes", "tx_bytes", "overruns", "erase_pages",
+          "ble_lost", "retransmits", "timeouts", "fec_recovered", "awake_pct", "energy_mJ_per_KB"]
+
+
+def int_list(text):
+    return [int(x, 0) for x in text.split(",") if x]
+
+
+def float_list(text):
+    return [float(x) for x in text.split(",") if x]
+
+
+def read_events(path):
+    events = []
+    with open(path, "r") as f:
+        for line in f:
+            parts = line.split()
+            if len(parts) < 2:
+                continue
+            fields = {}
+            for p in parts[2:]:
+                if "=" in p:
+                    k, v = p.split("=", 1)
+                    fields[k] = v
+            events.append((float(parts[0]), parts[1], fields))
+    return events
+
+
+def first_event(events, name, after=0.0):
+    for t, n, f in events:
+        if n == name and t >= after:
+            return t, f
+    return None, None
+
+
+def run_one(args, image_size, frame_size, baud, window, fec, loss, repeat):
+    row = {"image_size": image_size, "frame_size": frame_size, "baud": baud,
+           "window": window, "fec": fec, "loss": loss, "repeat": repeat, "status": "fail"}
+    image = bytes(random.getrandbits(8) for _ in range(image_size))
+    host = {}
+
+    with tempfile.TemporaryDirectory(prefix="ota_bench_") as tmp:
+        link = os.path.join(tmp, "tty")
+        events_path = os.path.join(tmp, "events.txt")
+        sim = subprocess.Popen([args.sim, "--flash", os.path.join(tmp, "flash.bin"),
+                                "--link", link, "--events", events_path,
+                                "--baud", str(baud), "--rx-fifo", str(args.rx_fifo),
+                                "--time-scale", str(args.time_scale), "--once", "--quiet"] +
+                               (["--busy-wait"] if args.busy_wait else []),
+                               stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            deadline = time.monotonic() + 5.0
+            while not os.path.exists(link) and time.monotonic() < deadline:
+                time.sleep(0.01)
+            # Let the first power cycle arm the UART
+            time.sleep(0.2)
+
+            port = link
+            ble = None
+            if args.ble:
+                port = os.path.join(tmp, "ble")
+                ble = ble_link.BleLink(link, port, args.ble_interval_ms, args.ble_mtu, args.ble_ppi,
+                                       args.ble_jitter_ms, loss, args.ble_buffer,
+                                       args.seed + repeat)
+                ble.start()
+
+            ser = serial.Serial(port, baud, timeout=0.1)
+            stats = {"device": None}
+            try:
+                with open(os.devnull, "w") as null, contextlib.redirect_stdout(null):
+                    resp = flasher.ota_update(ser, image, data_size=frame_size, window=window,
+                                              on_phase=lambda n: host.__setitem__(n, time.monotonic()),
+                                              timeout=args.resp_timeout, fec=fec, stats=stats,
+                                              cobs=args.cobs)
+            finally:
+                ser.close()
+                if ble is not None:
+                    ble.stop()
+                    row["ble_lost"] = ble.to_device.lost_packets + ble.to_host.lost_packets
+            row["retransmits"] = stats["retransmits"]
+            row["timeouts"] = stats["timeouts"]
+            if stats["device"] is not None:
+                row["fec_recovered"] = stats["device"]["fec_recovered"]
+
+            if resp == flasher.ACK:
+                # Wait for the install (the simulator exits after the jump)
+                sim.wait(timeout=args.timeout)
+        except subprocess.TimeoutExpired:
+            resp = None
+        finally:
+            if sim.poll() is None:
+                sim.kill()
+                sim.wait()
+
+        events = read_events(events_path)
+
+    _, ota = first_event(events, "ota_done")
+    if ota is None:
+        _, ota = first_event(events, "ota_failed")
+    if ota is not None:
+        row["rx_bytes"] = int(ota.get("rx", 0))
+        row["tx_bytes"] = int(ota.get("tx", 0))
+        row["overruns"] = int(ota.get("overruns", 0))
+        row["erase_pages"] = int(ota.get("erase_pages", 0))
+        if int(ota.get("us", 0)):
+            row["awake_pct"] = 100.0 * (1.0 - int(ota.get("sleep_us", 0)) / int(ota["us"]))
+            row["energy_mJ_per_KB"] = int(ota.get("energy_uj", 0)) / 1e3 / (image_size / 1024.0)
+
+    if resp != flasher.ACK or "end_ack" not in host:
+        row["status"] = {flasher.NACK: "nack",
+                         flasher.PACKET_RESP_TIMEOUT_ERROR: "timeout"}.get(resp, "fail")
+        return row
+
+    erase = sum(int(f.get("us", 0)) for t, n, f in events
+                if n == "erase" and host["data_start"] <= t <= host["data_done"]) / 1e6
+    t_install, _ = first_event(events, "BOOT_INSTALL", host["end_ack"])
+    t_jump, jump = first_event(events, "jump", host["end_ack"])
+    if t_install is None or t_jump is None:
+        return row
+
+    ok = int(jump.get("crc", "0"), 0) == flasher.calculate_crc16(image)
+    row["status"] = "ok" if ok else "bad_crc"
+    row["handshake_s"] = host["header_ack"] - host["start"]
+    row["erase_s"] = erase
+    row["transfer_s"] = (host["data_done"] - host["data_start"]) - erase
+    row["verify_s"] = host["end_ack"] - host["end_sent"]
+    row["install_s"] = t_install - host["end_ack"]
+    row["boot_s"] = t_jump - t_install
+    row["total_s"] = t_jump - host["start"]
+    row["throughput_Bps"] = image_size / row["total_s"]
+    row["goodput_Bps"] = image_size / (host["data_done"] - host["data_start"])
+    for k in row:
+        if isinstance(row[k], float):
+            row[k] = round(row[k], 6)
+    return row
+
+
+def print_row(row):
+    if row["status"] != "ok":
+        print("%7d %6d %7d %3d %3d %6.4f  %s (overruns %s, BLE lost %s)" % (
+            row["image_size"], row["frame_size"], row["baud"], row["window"], row["fec"], row["loss"],
+            row["status"].upper(), row.get("overruns", "?"), row.get("ble_lost", "-")))
+        return
+    print("%7d %6d %7d %3d %3d %6.4f  %s %8.3f %9.1f %9.1f %5d %5s %6.1f %6.2f" % (
+        row["image_size"], row["frame_size"], row["baud"], row["window"], row["fec"], row["loss"],
+        " ".join("%8.3f" % row["%s_s" % p] for p in PHASES),
+        row["total_s"], row["throughput_Bps"], row["goodput_Bps"], row["retransmits"],
+        row.get("fec_recovered", "-"), row.get("awake_pct", 0.0), row.get("energy_mJ_per_KB", 0.0)))
+
+
+def print_goodput(rows):
+    # goodput per loss rate, FEC block sizes against retransmission only
+    fecs = sorted(set(r["fec"] for r in rows))
+    print()
+    print("%6s %s" % ("loss", " ".join("%12s" % ("ARQ only" if f == 0 else "FEC %d" % f) for f in fecs)))
+    for loss in sorted(set(r["loss"] for r in rows)):
+        cells = []
+        for f in fecs:
+            ok = [r["goodput_Bps"] for r in rows if r["loss"] == loss and r["fec"] == f and r["status"] == "ok"]
+            cells.append("%10.1f/s" % (sum(ok) / len(ok)) if ok else "%12s" % "fail")
+        print("%6.4f %s" % (loss, " ".join(cells)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="End-to-end OTA benchmark on the simulated device")
+    parser.add_argument("--sim", default=DEFAULT_SIM, help="ota_sim binary (make -C host_sim)")
+    parser.add_argument("--frame-sizes", type=int_list, default=[64, 128])
+    parser.add_argument("--bauds", type=int_list, default=[115200, 921600])
+    parser.add_argument("--windows", type=int_list, default=[1])
+    parser.add_argument("--fecs", type=int_list, default=[0],
+                        help="DATA frames per PARITY block (0 : retransmission only)")
+    parser.add_argument("--image-sizes", type=int_list, default=[16384])
+    parser.add_argument("--cobs", action="store_true", help="COBS framing")
+    parser.add_argument("--repeat", type=int, default=1)
+    parser.add_argument("--rx-fifo", type=int, default=64,
+                        help="device receive buffer depth (1 : bare L4 RDR)")
+    parser.add_argument("--time-scale", type=float, default=1.0, help="flash timing scale")
+    parser.add_argument("--busy-wait", action="store_true", help="simulator without Sleep mode (WFI)")
+    parser.add_argument("--timeout", type=float, default=60.0,
+                        help="time allowed for the install after the update (s)")
+    parser.add_argument("--resp-timeout", type=float, default=flasher.PACKET_RESP_TIMEOUT,
+                        help="flasher response timeout (s)")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--ble", action="store_true", help="go through the BLE bridge emulator")
+    ble_link.add_link_arguments(parser, "ble-")
+    parser.add_argument("--ble-losses", type=float_list,
+                        help="packet loss probabilities to sweep (instead of --ble-loss)")
+    parser.add_argument("--csv", help="write the results as CSV")
+    parser.add_argument("--json", help="write the results as JSON")
+    args = parser.parse_args()
+
+    if not os.path.exists(args.sim):
+        print("%s not found, build it with : make -C host_sim" % args.sim)
+        return -1
+    random.seed(args.seed)
+
+    losses = args.ble_losses if args.ble_losses else [args.ble_loss]
+    print("%7s %6s %7s %3s %3s %6s  %s %8s %9s %9s %5s %5s %6s %6s" % (
+        "image", "frame", "baud", "win", "fec", "loss", " ".join("%8s" % p for p in PHASES),
+        "total", "B/s", "good B/s", "rexmt", "fec", "awake%", "mJ/KB"))
+    rows = []
+    for image_size, frame_size, baud, window, loss, fec, repeat in itertools.product(
+            args.image_sizes, args.frame_sizes, args.bauds, args.windows, losses, args.fecs,
+            range(args.repeat)):
+        row = run_one(args, image_size, frame_size, baud, window, fec, loss, repeat)
+        print_row(row)
+        sys.stdout.flush()
+        rows.append(row)
+    if len(args.fecs) > 1 or len(losses) > 1:
+        print_goodput(rows)
+
+    if args.csv:
+        with open(args.csv, "w", newline="") as f:
+            writer = csv.DictWriter(f, fieldnames=FIELDS)
+            writer.writeheader()
+            for row in rows:
+                writer.writerow(row)
+    if args.json:
+        with open(args.json, "w") as f:
+            config = {"rx_fifo": args.rx_fifo, "time_scale": args.time_scale, "busy_wait": args.busy_wait,
+                      "resp_timeout": args.resp_timeout, "seed": args.seed, "cobs": args.cobs}
+            if args.ble:
+                config["ble"] = {"interval_ms": args.ble_interval_ms, "mtu": args.ble_mtu,
+                                 "ppi": args.ble_ppi, "jitter_ms": args.ble_jitter_ms,
+                                 "losses": losses, "buffer": args.ble_buffer}
+            json.dump({"config": config,
+                       "results": rows}, f, indent=2)
+
+    return 0 if all(r["status"] == "ok" for r in rows) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,143 @@
+import argparse
+import contextlib
+import io
+import os
+import random
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+import serial
+
+import flasher
+
+# Bootloader image upload on the simulated device (host_sim).
+#
+# Both slots hold a valid application : the rollback image and an older
+# one. The host then sends a bootloader image (FW_TYPE_BOOTLOADER). Then :
+#   - END is acknowledged and the image is in the new bootloader region,
+#   - both slot entries and images are the same as before.
+#
+# usage : python ota_boot_image_check.py [--size 9000] [--window 4]
+
+DEFAULT_SIM = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                           "..", "host_sim", "build", "ota_sim")
+
+# Flash map (boot_fw/Core/Inc/boot.h)
+FLASH_BASE = 0x08000000
+FLASH_SIZE = 512 * 1024
+PAGE_SIZE = 2048
+ACTIVE_ADDR = FLASH_BASE + 25 * PAGE_SIZE
+SLOT0_ADDR = FLASH_BASE + 126 * PAGE_SIZE
+SLOT_SIZE = 49 * PAGE_SIZE
+NEW_BOOTLOADER_ADDR = FLASH_BASE + 226 * PAGE_SIZE
+NEW_BOOTLOADER_SIZE = 25 * PAGE_SIZE
+CONFIG_ADDR = FLASH_BASE + 252 * PAGE_SIZE
+
+NORMAL_BOOT = 0xBEEFFEED
+FW_TYPE_APP = 0x01
+
+# OTA_GNRL_CFG_ : reboot cause, OTA_SLOT_ x 2, OTA_ACTIVE_FW_
+SLOT = struct.Struct("<BBBIIHBBII")
+ACTIVE = struct.Struct("<IIHBB")
+CFG = struct.Struct("<I" + SLOT.format[1:] * 2 + ACTIVE.format[1:])
+SLOT_FIELDS = len(SLOT.format) - 1
+
+
+def slot_entry(image, version, stage_seq):
+    # valid, not active, not staged, size, crc, version, type, seq
+    return (0, 0, 0, len(image), flasher.calculate_crc16(image), version, 0, FW_TYPE_APP,
+            stage_seq, 0xFFFFFFFF)
+
+
+def read_slots(flash):
+    cfg = CFG.unpack_from(flash, CONFIG_ADDR - FLASH_BASE)
+    return [cfg[1 + n * SLOT_FIELDS:1 + (n + 1) * SLOT_FIELDS] for n in range(2)]
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Check that a bootloader image leaves the slots as they are")
+    parser.add_argument("--size", type=int, default=9000, help="bootloader image size")
+    parser.add_argument("--window", type=int, default=4, help="data frames in flight")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--sim", default=DEFAULT_SIM, help="ota_sim binary")
+    args = parser.parse_args()
+
+    if not 0 < args.size <= NEW_BOOTLOADER_SIZE:
+        print("--size must be 1 to %d" % NEW_BOOTLOADER_SIZE)
+        return -1
+    rng = random.Random(args.seed)
+    old, older, rollback, boot = (bytes(rng.getrandbits(8) for _ in range(n))
+                                   for n in (8000, 6000, 7000, args.size))
+    problems = []
+
+    flash = bytearray(b"\xff") * FLASH_SIZE
+    flash[ACTIVE_ADDR - FLASH_BASE:ACTIVE_ADDR - FLASH_BASE + len(old)] = old
+    for n, image in enumerate((older, rollback)):
+        addr = SLOT0_ADDR + n * SLOT_SIZE - FLASH_BASE
+        flash[addr:addr + len(image)] = image
+    slots = slot_entry(older, 0x0080, 0) + slot_entry(rollback, 0x0090, 1)
+    active = (len(old), flasher.calculate_crc16(old), 0x0100, FW_TYPE_APP, 0xFF)
+    cfg = CFG.pack(NORMAL_BOOT, *(slots + active))
+    flash[CONFIG_ADDR - FLASH_BASE:CONFIG_ADDR - FLASH_BASE + len(cfg)] = cfg
+    before = read_slots(flash)
+    resp = None
+
+    with tempfile.TemporaryDirectory(prefix="ota_boot_image_check_") as tmp:
+        flash_path = os.path.join(tmp, "flash.bin")
+        link = os.path.join(tmp, "tty")
+        events_path = os.path.join(tmp, "events.log")
+        with open(flash_path, "wb") as f:
+            f.write(flash)
+
+        sim = subprocess.Popen([args.sim, "--flash", flash_path, "--link", link, "--events", events_path,
+                                "--time-scale", "0", "--quiet"],
+                               stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            deadline = time.monotonic() + 5.0
+            while not os.path.exists(link) and time.monotonic() < deadline:
+                time.sleep(0.01)
+            time.sleep(0.2)
+
+            out = io.StringIO()
+            ser = serial.Serial(link, 115200, timeout=0.1)
+            try:
+                with contextlib.redirect_stdout(out):
+                    resp = flasher.ota_update(ser, boot, fw_type=flasher.FW_TYPE_BOOTLOADER, version=0x0300,
+                                              window=args.window, timeout=1.0, verbose=True)
+            finally:
+                ser.close()
+            if resp != flasher.ACK:
+                problems.append("bootloader upload failed")
+            time.sleep(0.5)
+        finally:
+            sim.terminate()
+            sim.wait()
+
+        with open(flash_path, "rb") as f:
+            flash = f.read()
+
+    addr = NEW_BOOTLOADER_ADDR - FLASH_BASE
+    if flash[addr:addr + len(boot)] != boot:
+        problems.append("image not in the new bootloader region")
+    after = read_slots(flash)
+    for n in range(2):
+        if after[n] != before[n]:
+            problems.append("slot %d changed : %s -> %s" % (n, before[n], after[n]))
+    for n, image in enumerate((older, rollback)):
+        addr = SLOT0_ADDR + n * SLOT_SIZE - FLASH_BASE
+        if flash[addr:addr + len(image)] != image:
+            problems.append("slot %d image changed" % n)
+    print("bootloader image : %s" % ("sent" if resp == flasher.ACK else "failed"))
+    print("slots            : %s" % ("kept" if after == before else "changed"))
+
+    for p in problems:
+        print("  %s" % p)
+    print("bootloader image check : %s" % ("ok" if not problems else "FAILED"))
+    return 1 if problems else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
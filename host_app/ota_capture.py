@@ -0,0 +1,104 @@
+import struct
+import sys
+import time
+
+# OTA serial capture files.
+#
+# A capture holds the bytes exchanged on the OTA UART, in both directions,
+# with their time. Written by flasher.py (--record) on the host side and by
+# the simulator (ota_sim --record) on the device side, read by ota_replay.py.
+#
+#   header : "OTACAP" version(u8) reserved(u8)
+#   record : direction(u8) time_us(u32 LE) length(u16 LE) data[length]
+#
+# time_us counts from the start of the capture (wraps after 71 minutes).
+# direction 0 is host -> device, 1 is device -> host.
+# Same layout as host_sim/src/sim_capture.c.
+
+CAPTURE_MAGIC = b"OTACAP"
+CAPTURE_VERSION = 1
+CAPTURE_HEADER = CAPTURE_MAGIC + bytes([CAPTURE_VERSION, 0])
+RECORD = struct.Struct("<BIH")
+
+TO_DEVICE = 0
+TO_HOST = 1
+
+
+class CaptureWriter:
+    def __init__(self, path):
+        self.file = open(path, "wb")
+        self.file.write(CAPTURE_HEADER)
+        self.start = time.monotonic()
+
+    def write(self, direction, data):
+        if not data:
+            return
+        t_us = int((time.monotonic() - self.start) * 1e6) & 0xFFFFFFFF
+        for i in range(0, len(data), 0xFFFF):
+            chunk = data[i:i + 0xFFFF]
+            self.file.write(RECORD.pack(direction, t_us, len(chunk)) + chunk)
+
+    def close(self):
+        self.file.close()
+
+
+def read_capture(path):
+    # Returns [(time_s, direction, bytes)], time unwrapped
+    records = []
+    with open(path, "rb") as f:
+        content = f.read()
+    if content[:len(CAPTURE_MAGIC)] != CAPTURE_MAGIC or content[len(CAPTURE_MAGIC)] != CAPTURE_VERSION:
+        raise ValueError("%s is not a version %d OTA capture" % (path, CAPTURE_VERSION))
+
+    pos = len(CAPTURE_HEADER)
+    last = 0
+    wraps = 0
+    while pos + RECORD.size <= len(content):
+        direction, t_us, length = RECORD.unpack_from(content, pos)
+        pos += RECORD.size
+        data = content[pos:pos + length]
+        pos += length
+        if t_us < last and last - t_us > 0x80000000:
+            wraps += 1
+        last = t_us
+        records.append(((wraps * 0x100000000 + t_us) / 1e6, direction, data))
+    return records
+
+
+class RecordingSerial:
+    # Wraps a serial.Serial and records what goes through it
+    def __init__(self, ser, writer):
+        self.ser = ser
+        self.writer = writer
+
+    def write(self, data):
+        self.writer.write(TO_DEVICE, bytes(data))
+        return self.ser.write(data)
+
+    def read(self, size=1):
+        data = self.ser.read(size)
+        self.writer.write(TO_HOST, data)
+        return data
+
+    def readall(self):
+        data = self.ser.readall()
+        self.writer.write(TO_HOST, data)
+        return data
+
+    def __getattr__(self, name):
+        return getattr(self.ser, name)
+
+
+def main():
+    if len(sys.argv) < 2:
+        print("usage : python ota_capture.py capture.otacap")
+        return -1
+    records = read_capture(sys.argv[1])
+    for t, direction, data in records:
+        print("%12.6f %s %4d  %s" % (t, "H>D" if direction == TO_DEVICE else "D>H", len(data),
+                                      data[:32].hex(" ") + (" ..." if len(data) > 32 else "")))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,173 @@
+import argparse
+import contextlib
+import io
+import os
+import random
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+
+import serial
+
+import flasher
+
+# END check of a corrupted slot on the simulated device (host_sim).
+#
+# The device runs v1 and the host sends v2 : a new first page, then the
+# pages of v1 one page further, which the device copies from its
+# application (COPY, see flasher.py --no-dedup). Once the host has read the
+# page hashes, one page of the running application is changed in the flash
+# image, so the page the device copies from it is not the one the host
+# meant. Then :
+#   - END is answered NACK (CRC), the slot is not valid nor staged,
+#   - the next session uploads the whole image again (no resume of the
+#     corrupted slot), END is acknowledged and the bootloader installs v2.
+#
+# usage : python ota_end_check.py [--pages 10] [--corrupt-page 3]
+
+DEFAULT_SIM = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                           "..", "host_sim", "build", "ota_sim")
+
+# Flash map (boot_fw/Core/Inc/boot.h)
+FLASH_BASE = 0x08000000
+FLASH_SIZE = 512 * 1024
+PAGE_SIZE = 2048
+ACTIVE_ADDR = FLASH_BASE + 25 * PAGE_SIZE
+CONFIG_ADDR = FLASH_BASE + 252 * PAGE_SIZE
+
+NORMAL_BOOT = 0xBEEFFEED
+FW_TYPE_APP = 0x01
+
+# OTA_GNRL_CFG_ : reboot cause, OTA_SLOT_ x 2, OTA_ACTIVE_FW_
+SLOT = struct.Struct("<BBBIIHBBII")
+ACTIVE = struct.Struct("<IIHBB")
+CFG = struct.Struct("<I" + SLOT.format[1:] * 2 + ACTIVE.format[1:])
+ERASED_SLOT = (0xFF, 0xFF, 0xFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFF, 0xFF, 0xFF, 0xFFFFFFFF, 0xFFFFFFFF)
+
+
+def base_flash(old, old_version):
+    flash = bytearray(b"\xff") * FLASH_SIZE
+    flash[ACTIVE_ADDR - FLASH_BASE:ACTIVE_ADDR - FLASH_BASE + len(old)] = old
+    active = (len(old), flasher.calculate_crc16(old), old_version, FW_TYPE_APP, 0xFF)
+    cfg = CFG.pack(NORMAL_BOOT, *(ERASED_SLOT * 2 + active))
+    flash[CONFIG_ADDR - FLASH_BASE:CONFIG_ADDR - FLASH_BASE + len(cfg)] = cfg
+    return bytes(flash)
+
+
+def read_events(path):
+    events = []
+    with open(path, "r") as f:
+        for line in f:
+            parts = line.split()
+            if len(parts) >= 2:
+                events.append((parts[1], parts[2:]))
+    return events
+
+
+def update(args, link, image, version, on_phase=None):
+    # one flasher session, its result and what it printed
+    out = io.StringIO()
+    stats = {}
+    ser = serial.Serial(link, 115200, timeout=0.1)
+    try:
+        with contextlib.redirect_stdout(out):
+            resp = flasher.ota_update(ser, image, version=version, window=args.window,
+                                      on_phase=on_phase, timeout=1.0, stats=stats, verbose=True)
+    finally:
+        ser.close()
+    return resp, stats, out.getvalue()
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Check that END rejects a slot whose copied page is wrong")
+    parser.add_argument("--pages", type=int, default=10, help="running image pages")
+    parser.add_argument("--corrupt-page", type=int, default=3, help="running image page changed")
+    parser.add_argument("--window", type=int, default=4, help="data frames in flight")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--timeout", type=float, default=20.0, help="time for the install (s)")
+    parser.add_argument("--sim", default=DEFAULT_SIM, help="ota_sim binary")
+    args = parser.parse_args()
+
+    if not 0 <= args.corrupt_page < args.pages - 1:
+        print("--corrupt-page must be one of the pages copied (0 to %d)" % (args.pages - 2))
+        return -1
+    rng = random.Random(args.seed)
+    old = bytes(rng.getrandbits(8) for _ in range(args.pages * PAGE_SIZE))
+    new = bytes(rng.getrandbits(8) for _ in range(PAGE_SIZE)) + old[:-PAGE_SIZE]
+    old_version, new_version = 0x0100, 0x0200
+    problems = []
+
+    with tempfile.TemporaryDirectory(prefix="ota_end_check_") as tmp:
+        flash_path = os.path.join(tmp, "flash.bin")
+        link = os.path.join(tmp, "tty")
+        events_path = os.path.join(tmp, "events.log")
+        with open(flash_path, "wb") as f:
+            f.write(base_flash(old, old_version))
+
+        sim = subprocess.Popen([args.sim, "--flash", flash_path, "--link", link, "--events", events_path,
+                                "--time-scale", "0", "--quiet"],
+                               stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            deadline = time.monotonic() + 5.0
+            while not os.path.exists(link) and time.monotonic() < deadline:
+                time.sleep(0.01)
+            time.sleep(0.2)
+
+            def corrupt(name):
+                # the page hashes are read : the copy source changes under the host
+                if name == "data_start":
+                    with open(flash_path, "r+b") as f:
+                        f.seek(ACTIVE_ADDR - FLASH_BASE + args.corrupt_page * PAGE_SIZE + 100)
+                        byte = f.read(1)
+                        f.seek(-1, os.SEEK_CUR)
+                        f.write(bytes([byte[0] ^ 0x5A]))
+
+            resp, stats, out = update(args, link, new, new_version, corrupt)
+            if "Copy" not in out:
+                problems.append("no page copied from the application")
+            if resp == flasher.ACK:
+                problems.append("END acknowledged")
+            elif stats.get("nack_crc", 0) == 0:
+                problems.append("END not answered NACK (CRC)")
+            with open(flash_path, "rb") as f:
+                cfg = CFG.unpack_from(f.read(), CONFIG_ADDR - FLASH_BASE)
+            for n in range(2):
+                slot = cfg[1 + n * len(ERASED_SLOT):1 + (n + 1) * len(ERASED_SLOT)]
+                if slot[0] == 0 and slot[3:5] == (len(new), flasher.calculate_crc16(new)):
+                    problems.append("slot %d is valid %s" % (n, slot))
+            print("corrupted copy : %s" % ("rejected" if resp != flasher.ACK else "accepted"))
+
+            time.sleep(1.0)
+            start = time.monotonic()
+            booted = sum(name == "jump" for name, _ in read_events(events_path))
+            resp, stats, out = update(args, link, new, new_version)
+            if "Resuming" in out:
+                problems.append("the upload resumed the corrupted slot")
+            if resp != flasher.ACK:
+                problems.append("second upload failed")
+            jump = None
+            while resp == flasher.ACK and jump is None and time.monotonic() < start + args.timeout:
+                time.sleep(0.1)
+                jumps = [e for name, e in read_events(events_path) if name == "jump"]
+                jump = jumps[-1] if len(jumps) > booted else None
+            if resp == flasher.ACK:
+                crc = dict(p.split("=", 1) for p in (jump or []) if "=" in p).get("crc", "0")
+                if int(crc, 0) != flasher.calculate_crc16(new):
+                    problems.append("v2 not installed")
+            print("upload again : %s" % ("installed" if not problems else "failed"))
+        finally:
+            sim.terminate()
+            sim.wait()
+        if not any(name == "TRC_OTA_FW_CRC_ERR" for name, _ in read_events(events_path)):
+            problems.append("no CRC error traced")
+
+    for p in problems:
+        print("  %s" % p)
+    print("END check : %s" % ("ok" if not problems else "FAILED"))
+    return 1 if problems else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
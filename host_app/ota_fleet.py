@@ -0,0 +1,187 @@
+import argparse
+import concurrent.futures
+import glob
+import json
+import os
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+import serial
+
+import flasher
+import fw_image
+import ota_package
+
+# Flash many devices at once.
+#
+# One worker thread per session, all streaming the same prebuilt package
+# (ota_package.py), so the host work per frame is a write and a response
+# check. The threads spend their time blocked in the serial reads.
+# Each device has its own retry count and response timeout, transient errors
+# (timeouts, CRC/framing NACKs) are retried per frame first. A progress line
+# is printed while the sessions run, then one line per device and the
+# aggregate throughput. A device that already runs the image (or has it
+# staged) is done after the SESSION round trip, its status is "current".
+#
+# --sim N starts N simulators (host_sim) and flashes them, to check how the
+# fleet mode scales.
+#
+# usage : python ota_fleet.py app.ota /dev/ttyUSB* [--jobs 16] [--retries 2]
+#         python ota_fleet.py app.bin --sim 50 [--baud 921600]
+
+DEFAULT_SIM = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                           "..", "host_sim", "build", "ota_sim")
+
+STATUS = {flasher.ACK: "ok", flasher.NACK: "nack", flasher.PACKET_RESP_TIMEOUT_ERROR: "timeout"}
+
+
+class Device:
+    def __init__(self, port):
+        self.port = port
+        self.state = "waiting"
+        self.sent = 0
+        self.attempts = 0
+        self.status = None
+        self.start = None
+        self.elapsed = 0.0
+        self.error = ""
+        self.stats = {}         # flasher error counters, all attempts
+
+
+def flash_device(dev, pkg, args):
+    dev.start = time.monotonic()
+    dev.state = "running"
+    while dev.attempts <= args.retries:
+        dev.attempts += 1
+        dev.sent = 0
+        try:
+            phases = []
+            with serial.Serial(dev.port, args.baud, timeout=flasher.PORT_TIMEOUT) as ser:
+                resp = flasher.ota_update(ser, pkg, window=args.window, timeout=args.timeout, fec=args.fec,
+                                          cobs=args.cobs, force=args.force, on_phase=phases.append,
+                                          on_progress=lambda n: setattr(dev, "sent", n), stats=dev.stats)
+            dev.status = STATUS.get(resp, "fail")
+            if dev.status == "ok" and "skipped" in phases:
+                dev.status = "current"
+        except (serial.SerialException, OSError) as e:
+            dev.status = "error"
+            dev.error = str(e)
+        if dev.status in ("ok", "current"):
+            break
+        # let the device time out its session (and reset) before the retry
+        time.sleep(args.retry_delay)
+    dev.elapsed = time.monotonic() - dev.start
+    dev.state = "done"
+
+
+def progress(devices, size, stop, start):
+    while not stop.wait(1.0):
+        done = [d for d in devices if d.state == "done"]
+        running = sum(1 for d in devices if d.state == "running")
+        sent = sum(d.sent for d in devices)
+        elapsed = time.monotonic() - start
+        print("[%6.1f s] %d/%d done (%d failed), %d running, %.1f/%.1f kB, %.1f kB/s" % (
+            elapsed, len(done), len(devices), sum(1 for d in done if d.status not in ("ok", "current")), running,
+            sent / 1e3, size * len(devices) / 1e3, sent / elapsed / 1e3))
+        sys.stdout.flush()
+
+
+def start_sims(args, count, tmp):
+    sims = []
+    ports = []
+    for n in range(count):
+        link = os.path.join(tmp, "tty%d" % n)
+        sims.append(subprocess.Popen([args.sim, "--flash", os.path.join(tmp, "flash%d.bin" % n),
+                                      "--link", link, "--baud", str(args.baud), "--once", "--quiet",
+                                      "--time-scale", str(args.time_scale)],
+                                     stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL))
+        ports.append(link)
+    deadline = time.monotonic() + 10.0
+    while not all(os.path.exists(p) for p in ports) and time.monotonic() < deadline:
+        time.sleep(0.05)
+    time.sleep(0.2)
+    return sims, ports
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Flash many devices at once")
+    parser.add_argument("image", help="package (.ota) or image (.bin, .elf, .hex)")
+    parser.add_argument("ports", nargs="*", help="serial ports or globs (e.g. '/dev/ttyUSB*')")
+    parser.add_argument("--jobs", type=int, default=0, help="concurrent sessions (default : all)")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--window", type=int, default=1)
+    parser.add_argument("--fec", type=int, default=0, help="data frames per PARITY frame (0 : off)")
+    parser.add_argument("--cobs", action="store_true", help="COBS framing")
+    parser.add_argument("--force", action="store_true", help="update the devices that already have the image")
+    parser.add_argument("--timeout", type=float, default=flasher.PACKET_RESP_TIMEOUT,
+                        help="response timeout (s)")
+    parser.add_argument("--retries", type=int, default=1, help="session retries per device")
+    parser.add_argument("--retry-delay", type=float, default=1.0, help="delay before a retry (s)")
+    parser.add_argument("--sim", dest="sim_count", type=int, default=0, metavar="N",
+                        help="flash N simulated devices instead of ports")
+    parser.add_argument("--sim-binary", dest="sim", default=DEFAULT_SIM, help="ota_sim binary")
+    parser.add_argument("--time-scale", type=float, default=1.0, help="simulator flash timing scale")
+    parser.add_argument("--json", help="write the per device results as JSON")
+    args = parser.parse_args()
+
+    if ota_package.is_package(args.image):
+        pkg = ota_package.OtaPackage.load(args.image)
+    else:
+        pkg = ota_package.OtaPackage.from_image(fw_image.load(args.image)[0])
+
+    tmp = None
+    sims = []
+    ports = []
+    for p in args.ports:
+        ports += sorted(glob.glob(p)) if any(c in p for c in "*?[") else [p]
+    if args.sim_count:
+        tmp = tempfile.TemporaryDirectory(prefix="ota_fleet_")
+        sims, ports = start_sims(args, args.sim_count, tmp.name)
+    if not ports:
+        print("no port to flash")
+        return -1
+
+    devices = [Device(p) for p in ports]
+    print("flashing %d devices, %d bytes, version 0x%04X" % (len(devices), pkg.size, pkg.version))
+    start = time.monotonic()
+    stop = threading.Event()
+    reporter = threading.Thread(target=progress, args=(devices, pkg.size, stop, start), daemon=True)
+    reporter.start()
+    try:
+        with concurrent.futures.ThreadPoolExecutor(max_workers=args.jobs or len(devices)) as pool:
+            for f in [pool.submit(flash_device, d, pkg, args) for d in devices]:
+                f.result()
+    finally:
+        stop.set()
+        reporter.join()
+        for sim in sims:
+            if sim.poll() is None:
+                sim.terminate()
+            sim.wait()
+        if tmp is not None:
+            tmp.cleanup()
+    elapsed = time.monotonic() - start
+
+    for d in devices:
+        print("%-32s %-8s %2d attempt(s) %4d retransmit(s) %8.2f s %s" % (
+            d.port, d.status, d.attempts, d.stats.get("retransmits", 0), d.elapsed, d.error))
+    ok = sum(1 for d in devices if d.status == "ok")
+    current = sum(1 for d in devices if d.status == "current")
+    print("%d/%d updated, %d already current, in %.2f s, %.1f kB/s aggregate, %.2f s CPU" % (
+        ok, len(devices), current, elapsed, ok * pkg.size / elapsed / 1e3, time.process_time()))
+
+    if args.json:
+        with open(args.json, "w") as f:
+            json.dump({"size": pkg.size, "version": pkg.version, "elapsed_s": elapsed,
+                       "devices": [{"port": d.port, "status": d.status, "attempts": d.attempts,
+                                    "elapsed_s": d.elapsed, "error": d.error, "errors": d.stats}
+                                   for d in devices]},
+                      f, indent=2)
+    return 0 if ok + current == len(devices) else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,209 @@
+import argparse
+import hashlib
+import struct
+import sys
+import zlib
+
+import flasher
+import fw_image
+
+# OTA package (.ota) : an image prepared once, flashed many times.
+#
+#   header   : magic "OTAPKG", format, fw type, fw version, fw CRC16, fw size,
+#              frame size, flags, SHA-256 of the image
+#   sections : type (u8), reserved (u8), length (u32 LE), data
+#     FRAMES    the HEADER frame then every DATA frame (sequence number and
+#               offset included), ready to send
+#     IMAGE_Z   the image, zlib compressed
+#     PAGE_CRC  CRC32 (zlib) of every 2 KB flash page of the image
+#
+# A package holds FRAMES, IMAGE_Z or both. With FRAMES the flasher only
+# writes the stored frames, no CRC and no framing on the host. A package with
+# only IMAGE_Z is smaller to distribute and is framed once when loaded.
+#
+# usage : python ota_package.py build app.bin -o app.ota [--type app] [--version 0x3A67]
+#                                   [--frame-size 128] [--page-crc] [--compress] [--no-frames]
+#                                   (app.elf or app.hex [--base 0x08020000] : see fw_image.py)
+#         python ota_package.py info app.ota
+
+PKG_MAGIC = b"OTAPKG"
+PKG_FORMAT = 2
+PKG_HEADER = struct.Struct("<6sBBHHIHH32s")
+PKG_SECTION = struct.Struct("<BBI")
+
+PKG_FLAG_FRAMES = 0x0001
+PKG_FLAG_IMAGE_Z = 0x0002
+PKG_FLAG_PAGE_CRC = 0x0004
+
+SECT_FRAMES = 1
+SECT_IMAGE_Z = 2
+SECT_PAGE_CRC = 3
+
+FLASH_PAGE_SIZE = 2048
+
+FW_TYPES = {"app": flasher.FW_TYPE_APP, "bootloader": flasher.FW_TYPE_BOOTLOADER}
+
+
+def page_crcs(image):
+    return [zlib.crc32(image[i:i + FLASH_PAGE_SIZE]) for i in range(0, len(image), FLASH_PAGE_SIZE)]
+
+
+def build_frames(image, fw_type, version, frame_size):
+    # HEADER frame then DATA frames, concatenated
+    image = memoryview(image)
+    builder = flasher.FrameBuilder(max(frame_size + flasher.DATA_HDR.size, flasher.HEADER_PAYLOAD.size))
+    out = bytearray(builder.build(flasher.CMD_INFO_PACKET, flasher.HEADER_PAYLOAD.pack(
+        len(image), fw_type, flasher.calculate_crc16(image), version)))
+    for k, i in enumerate(range(0, len(image), frame_size)):
+        out += builder.build_data(k, i, image[i:i + frame_size])
+    return out
+
+
+def split_frames(data):
+    # memoryviews of the frames stored back to back in 'data'
+    view = memoryview(data)
+    frames = []
+    pos = 0
+    while pos + flasher.FRAME_OVERHEAD <= len(view):
+        length = view[pos + 2] | (view[pos + 3] << 8)
+        end = pos + flasher.FRAME_OVERHEAD + length
+        if view[pos] != flasher.START_BYTE or end > len(view) or view[end - 1] != flasher.END_BYTE:
+            raise ValueError("corrupted frame at offset %d" % pos)
+        frames.append(view[pos:end])
+        pos = end
+    return frames
+
+
+class OtaPackage:
+    # Loaded package, what flasher.ota_update() streams :
+    #   header_frame : the HEADER frame
+    #   frames       : the DATA frames
+    def __init__(self, fw_type, version, image, frame_size, frames=None, page_crc=None):
+        self.fw_type = fw_type
+        self.version = version
+        self.image = image
+        self.size = len(image)
+        self.crc = flasher.calculate_crc16(image)
+        self.sha256 = hashlib.sha256(image).digest()
+        self.frame_size = frame_size
+        self.page_crc = page_crc
+        if frames is None:
+            frames = split_frames(build_frames(image, fw_type, version, frame_size))
+        self.header_frame = frames[0]
+        self.frames = frames[1:]
+
+    def __len__(self):
+        return self.size
+
+    @classmethod
+    def from_image(cls, image, fw_type=flasher.FW_TYPE, version=flasher.FW_VERSION,
+                   frame_size=flasher.ETX_OTA_DATA_MAX_SIZE, page_crc=False):
+        return cls(fw_type, version, bytes(image), frame_size,
+                   page_crc=page_crcs(image) if page_crc else None)
+
+    def save(self, path, frames=True, compress=False):
+        flags = 0
+        sections = b""
+        if frames:
+            flags |= PKG_FLAG_FRAMES
+            data = b"".join([self.header_frame] + self.frames)
+            sections += PKG_SECTION.pack(SECT_FRAMES, 0, len(data)) + data
+        if compress:
+            flags |= PKG_FLAG_IMAGE_Z
+            data = zlib.compress(self.image, 9)
+            sections += PKG_SECTION.pack(SECT_IMAGE_Z, 0, len(data)) + data
+        if self.page_crc is not None:
+            flags |= PKG_FLAG_PAGE_CRC
+            data = struct.pack("<%dI" % len(self.page_crc), *self.page_crc)
+            sections += PKG_SECTION.pack(SECT_PAGE_CRC, 0, len(data)) + data
+        with open(path, "wb") as f:
+            f.write(PKG_HEADER.pack(PKG_MAGIC, PKG_FORMAT, self.fw_type, self.version, self.crc,
+                                    self.size, self.frame_size, flags, self.sha256))
+            f.write(sections)
+
+    @classmethod
+    def load(cls, path):
+        with open(path, "rb") as f:
+            content = f.read()
+        magic, fmt, fw_type, version, crc, size, frame_size, flags, sha256 = \
+            PKG_HEADER.unpack_from(content, 0)
+        if magic != PKG_MAGIC or fmt != PKG_FORMAT:
+            raise ValueError("%s is not a format %d OTA package" % (path, PKG_FORMAT))
+
+        sections = {}
+        pos = PKG_HEADER.size
+        while pos + PKG_SECTION.size <= len(content):
+            sect, _, length = PKG_SECTION.unpack_from(content, pos)
+            pos += PKG_SECTION.size
+            sections[sect] = memoryview(content)[pos:pos + length]
+            pos += length
+
+        frames = None
+        if SECT_FRAMES in sections:
+            frames = split_frames(sections[SECT_FRAMES])
+            image = b"".join(f[4 + flasher.DATA_HDR.size:-3] for f in frames[1:])
+        elif SECT_IMAGE_Z in sections:
+            image = zlib.decompress(sections[SECT_IMAGE_Z])
+        else:
+            raise ValueError("%s has no image" % path)
+
+        page_crc = None
+        if SECT_PAGE_CRC in sections:
+            data = sections[SECT_PAGE_CRC]
+            page_crc = list(struct.unpack("<%dI" % (len(data) // 4), data))
+
+        pkg = cls(fw_type, version, image, frame_size, frames, page_crc)
+        if pkg.size != size or pkg.crc != crc or pkg.sha256 != sha256:
+            raise ValueError("%s : image does not match the package header" % path)
+        return pkg
+
+
+def is_package(path):
+    with open(path, "rb") as f:
+        return f.read(len(PKG_MAGIC)) == PKG_MAGIC
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Build or inspect OTA packages")
+    sub = parser.add_subparsers(dest="command", required=True)
+
+    build = sub.add_parser("build", help="build a package from a .bin, .elf or .hex image")
+    build.add_argument("binfile")
+    build.add_argument("--base", type=lambda x: int(x, 0), help="flash address of the image start (.elf/.hex)")
+    build.add_argument("-o", "--output", required=True)
+    build.add_argument("--type", choices=sorted(FW_TYPES), default="app")
+    build.add_argument("--version", type=lambda x: int(x, 0), default=flasher.FW_VERSION)
+    build.add_argument("--frame-size", type=int, default=flasher.ETX_OTA_DATA_MAX_SIZE)
+    build.add_argument("--page-crc", action="store_true", help="store the CRC32 of every flash page")
+    build.add_argument("--compress", action="store_true", help="store the image compressed")
+    build.add_argument("--no-frames", action="store_true",
+                       help="do not store the frames (needs --compress)")
+
+    info = sub.add_parser("info", help="print a package header")
+    info.add_argument("package")
+    args = parser.parse_args()
+
+    if args.command == "build":
+        if args.no_frames and not args.compress:
+            print("--no-frames needs --compress")
+            return -1
+        image, _ = fw_image.load(args.binfile, args.base)
+        pkg = OtaPackage.from_image(image, FW_TYPES[args.type], args.version, args.frame_size, args.page_crc)
+        pkg.save(args.output, frames=not args.no_frames, compress=args.compress)
+        print("%s : %d bytes, CRC 0x%04X, version 0x%04X, %d frames" % (
+            args.output, pkg.size, pkg.crc, pkg.version, len(pkg.frames)))
+        return 0
+
+    pkg = OtaPackage.load(args.package)
+    print("type       : %s" % {v: k for k, v in FW_TYPES.items()}.get(pkg.fw_type, hex(pkg.fw_type)))
+    print("version    : 0x%04X" % pkg.version)
+    print("size       : %d" % pkg.size)
+    print("CRC16      : 0x%04X" % pkg.crc)
+    print("SHA-256    : %s" % pkg.sha256.hex())
+    print("frames     : %d x %d bytes" % (len(pkg.frames), pkg.frame_size))
+    print("page CRC32 : %s" % ("%d pages" % len(pkg.page_crc) if pkg.page_crc is not None else "-"))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
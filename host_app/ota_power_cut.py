@@ -0,0 +1,206 @@
+import argparse
+import os
+import random
+import shutil
+import signal
+import struct
+import subprocess
+import sys
+import tempfile
+
+import flasher
+
+# Power cut sweep of the swap install on the simulated device (host_sim).
+#
+# A flash image is prepared with the old application running and the new one
+# staged in a slot (--slot). The bootloader alone (ota_sim --boot-only) installs it by
+# swapping the slot with the active region through the scratch page. A first
+# run counts the flash operations (page erases and doubleword programs) of
+# the install, then the install is started again from the same image with
+# the power cut in each of them (--power-cut N) : the operation is left half
+# done, the next power up has to resume the install. A half done double
+# word is torn : reading it is an ECC error (NMI), see host_sim/README.md.
+# After every run :
+#   - the active region holds the new image and the bootloader jumped to it,
+#   - the slot holds the old image, valid and not staged (rollback target),
+#     unless the old image is larger than a slot : it is not kept,
+#   - the configuration describes both.
+# --bad-crc stages the new image with a wrong CRC : the bootloader installs
+# it, finds it corrupted and swaps the old one back. It then runs, from the
+# active region, and the slot is no longer valid.
+# --second-cut also cuts the power once during the recovery, in an operation
+# drawn from the ones it takes.
+# --stride N only cuts every Nth operation, for a quicker sweep.
+#
+# usage : python ota_power_cut.py [--old-size 40000] [--new-size 42048] [--slot 0]
+#                                 [--bad-crc] [--second-cut] [--stride 1]
+
+DEFAULT_SIM = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                           "..", "host_sim", "build", "ota_sim")
+
+# Flash map (boot_fw/Core/Inc/boot.h)
+FLASH_BASE = 0x08000000
+FLASH_SIZE = 512 * 1024
+PAGE_SIZE = 2048
+ACTIVE_ADDR = FLASH_BASE + 25 * PAGE_SIZE
+ACTIVE_SIZE = 101 * PAGE_SIZE
+SLOT0_ADDR = FLASH_BASE + 126 * PAGE_SIZE
+CONFIG_ADDR = FLASH_BASE + 252 * PAGE_SIZE
+SLOT_SIZE = 49 * PAGE_SIZE
+SLOTS = 2
+
+NORMAL_BOOT = 0xBEEFFEED
+FW_TYPE_APP = 0x01
+NO_STAGE = 0xFFFFFFFF
+
+# OTA_GNRL_CFG_ : reboot cause, OTA_SLOT_ x 2, OTA_ACTIVE_FW_
+SLOT = struct.Struct("<BBBIIHBBII")
+ACTIVE = struct.Struct("<IIHBB")
+CFG = struct.Struct("<I" + SLOT.format[1:] * 2 + ACTIVE.format[1:])
+ERASED_SLOT = (0xFF, 0xFF, 0xFF, 0xFFFFFFFF, 0xFFFFFFFF, 0xFFFF, 0xFF, 0xFF, NO_STAGE, 0xFFFFFFFF)
+
+
+def slot_addr(slot):
+    return SLOT0_ADDR + slot * SLOT_SIZE
+
+
+def base_flash(args, old, new, old_version, new_version):
+    flash = bytearray(b"\xff") * FLASH_SIZE
+    flash[ACTIVE_ADDR - FLASH_BASE:ACTIVE_ADDR - FLASH_BASE + len(old)] = old
+    flash[slot_addr(args.slot) - FLASH_BASE:slot_addr(args.slot) - FLASH_BASE + len(new)] = new
+    crc = flasher.calculate_crc16(new) ^ (0x0001 if args.bad_crc else 0)
+    slots = [ERASED_SLOT] * SLOTS
+    slots[args.slot] = (0, 0, 1, len(new), crc, new_version, 1, FW_TYPE_APP, 0, 0xFFFFFFFF)
+    active = (len(old), flasher.calculate_crc16(old), old_version, FW_TYPE_APP, 0xFF)
+    cfg = CFG.pack(NORMAL_BOOT, *(sum(slots, ()) + active))
+    flash[CONFIG_ADDR - FLASH_BASE:CONFIG_ADDR - FLASH_BASE + len(cfg)] = cfg
+    return bytes(flash)
+
+
+def run_sim(args, flash_path, events_path, power_cut=0):
+    cmd = [args.sim, "--flash", flash_path, "--boot-only", "--quiet", "--time-scale", "0",
+           "--events", events_path]
+    if power_cut:
+        cmd += ["--power-cut", ",".join(str(n) for n in power_cut)]
+    if os.path.exists(events_path):
+        os.remove(events_path)
+    # its own process group : a halted bootloader (CRC check failed) spins in
+    # the power cycle child process, killed with the simulator
+    sim = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL, start_new_session=True)
+    try:
+        sim.wait(timeout=args.timeout)
+    except subprocess.TimeoutExpired:
+        os.killpg(sim.pid, signal.SIGKILL)
+        sim.wait()
+    events = []
+    with open(events_path, "r") as f:
+        for line in f:
+            parts = line.split()
+            if len(parts) >= 2:
+                events.append((parts[1], dict(p.split("=", 1) for p in parts[2:] if "=" in p)))
+    return events
+
+
+def check(args, flash_path, events, old, new, old_version, new_version):
+    # Problems found after a run, empty if the install (or the swap back of a
+    # corrupted image) is complete
+    with open(flash_path, "rb") as f:
+        flash = f.read()
+    problems = []
+    running, version = (old, old_version) if args.bad_crc else (new, new_version)
+    kept = None if args.bad_crc or len(old) > SLOT_SIZE else old
+    jumps = [e for name, e in events if name == "jump"]
+    if not jumps:
+        problems.append("the bootloader halted")
+    elif int(jumps[-1].get("crc", "0"), 0) != flasher.calculate_crc16(running):
+        problems.append("no jump to the %s image" % ("old" if args.bad_crc else "new"))
+    if flash[ACTIVE_ADDR - FLASH_BASE:ACTIVE_ADDR - FLASH_BASE + len(running)] != running:
+        problems.append("active region is not the %s image" % ("old" if args.bad_crc else "new"))
+    if kept is not None and flash[slot_addr(args.slot) - FLASH_BASE:slot_addr(args.slot) - FLASH_BASE + len(kept)] != kept:
+        problems.append("slot %d is not the old image" % args.slot)
+    cfg = CFG.unpack_from(flash, CONFIG_ADDR - FLASH_BASE)
+    slot, active = cfg[1 + args.slot * len(ERASED_SLOT):1 + (args.slot + 1) * len(ERASED_SLOT)], cfg[-5:]
+    if active[:4] != (len(running), flasher.calculate_crc16(running), version, FW_TYPE_APP):
+        problems.append("config : active image %s" % (active,))
+    if kept is None:
+        if slot[0] == 0:
+            problems.append("config : slot %d %s, still valid" % (args.slot, slot))
+    elif slot[0] != 0 or slot[2] != 0 or slot[3:6] != (len(old), flasher.calculate_crc16(old), old_version):
+        problems.append("config : slot %d %s" % (args.slot, slot))
+    return problems
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Cut the power in every flash operation of the swap install")
+    parser.add_argument("--old-size", type=int, default=40000, help="running image size")
+    parser.add_argument("--new-size", type=int, default=42048, help="staged image size")
+    parser.add_argument("--slot", type=int, default=0, choices=range(SLOTS), help="slot the new image is staged in")
+    parser.add_argument("--bad-crc", action="store_true", help="stage the new image with a wrong CRC")
+    parser.add_argument("--second-cut", action="store_true", help="cut the power again during the recovery")
+    parser.add_argument("--stride", type=int, default=1, help="cut every Nth operation only")
+    parser.add_argument("--seed", type=int, default=1)
+    parser.add_argument("--timeout", type=float, default=5.0, help="time for the bootloader to jump (s)")
+    parser.add_argument("--sim", default=DEFAULT_SIM, help="ota_sim binary")
+    args = parser.parse_args()
+
+    if args.new_size > SLOT_SIZE or args.old_size > ACTIVE_SIZE:
+        print("the new image must fit in a slot (%d bytes), the old one in the active region (%d bytes)" % (
+            SLOT_SIZE, ACTIVE_SIZE))
+        return -1
+    if args.bad_crc and args.old_size > SLOT_SIZE:
+        print("an old image larger than a slot is not kept, there is nothing to swap back")
+        return -1
+    rng = random.Random(args.seed)
+    old = bytes(rng.getrandbits(8) for _ in range(args.old_size))
+    new = bytes(rng.getrandbits(8) for _ in range(args.new_size))
+    old_version, new_version = 0x0100, 0x0200
+
+    with tempfile.TemporaryDirectory(prefix="ota_power_cut_") as tmp:
+        base = os.path.join(tmp, "base.bin")
+        flash = os.path.join(tmp, "flash.bin")
+        events_path = os.path.join(tmp, "events.log")
+        with open(base, "wb") as f:
+            f.write(base_flash(args, old, new, old_version, new_version))
+
+        shutil.copyfile(base, flash)
+        events = run_sim(args, flash, events_path)
+        problems = check(args, flash, events, old, new, old_version, new_version)
+        if problems:
+            print("install without a power cut failed : %s" % ", ".join(problems))
+            return 1
+        total = int([e for name, e in events if name == "jump"][-1]["ops"])
+        print("install : %d flash operations, old image %d bytes, new image %d bytes" % (
+            total, len(old), len(new)))
+
+        failed = []
+        torn = 0
+        cuts = range(1, total + 1, max(args.stride, 1))
+        for n in cuts:
+            power_cut = [n]
+            shutil.copyfile(base, flash)
+            events = run_sim(args, flash, events_path, power_cut)
+            jumps = [e for name, e in events if name == "jump"]
+            if args.second_cut and jumps and int(jumps[-1]["ops"]) > 0:
+                # the recovery, the power cycle after the cut, takes that many
+                power_cut.append(rng.randint(1, int(jumps[-1]["ops"])))
+                shutil.copyfile(base, flash)
+                events = run_sim(args, flash, events_path, power_cut)
+            torn += any(name == "ecc_error" for name, _ in events)
+            if sum(name == "power_cut" for name, _ in events) != len(power_cut):
+                problems = ["the power was not cut"]
+            else:
+                problems = check(args, flash, events, old, new, old_version, new_version)
+            if problems:
+                failed.append(n)
+                print("power cut in operation %s : %s" % (",".join(str(c) for c in power_cut), ", ".join(problems)))
+            elif n % 1000 == 1:
+                print("power cut in operation %d/%d : ok" % (n, total))
+            sys.stdout.flush()
+
+    print("%d/%d power cuts recovered, %d of them read a torn double word (ECC error)" % (
+        len(cuts) - len(failed), len(cuts), torn))
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
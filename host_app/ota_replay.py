@@ -0,0 +1,238 @@
+import argparse
+import os
+import statistics
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+import serial
+
+import flasher
+import ota_capture
+
+# Replay of a recorded OTA session on the simulated device (host_sim).
+#
+# The host -> device bytes of a capture (flasher.py --record or
+# ota_sim --record) are sent again to a fresh simulator at their original
+# time, or faster with --speed. The device side parser and state machine
+# are the firmware sources, so two firmware versions can be compared on
+# the same traffic. The report puts the original and the replayed session
+# side by side :
+#   frames    : host frames per command, and host bytes outside any frame
+#   responses : ACK / NACK per command
+#   resyncs   : times a parser had to skip bytes to find the next valid frame
+#   latency   : end of a host frame to the start of its response
+#
+# usage : python ota_replay.py capture.otacap [--speed 1] [--flash F] [--record F]
+
+DEFAULT_SIM = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                           "..", "host_sim", "build", "ota_sim")
+
+CMD_NAMES = {flasher.CMD_START_PACKET: "START", flasher.CMD_INFO_PACKET: "HEADER",
+             flasher.CMD_FWDATA_PACKET: "DATA", flasher.CMD_STOP_PACKET: "END",
+             flasher.CMD_ENTER_PACKET: "ENTER"}
+
+
+def flatten(records, direction):
+    # One byte array and the arrival time of every byte
+    data = bytearray()
+    times = []
+    for t, d, chunk in records:
+        if d == direction:
+            data += chunk
+            times += [t] * len(chunk)
+    return data, times
+
+
+def parse_frames(data, times, skip=(), crc_header=True):
+    # Returns the valid frames as (start_time, end_time, cmd, payload) and the
+    # number of resyncs and skipped bytes. Bytes in 'skip' are ignored between
+    # frames (OTA_ENTER_REQ). The host frames CRC covers cmd, length and
+    # payload (crc_header), the device responses CRC only the payload.
+    frames = []
+    resyncs = 0
+    skipped = 0
+    in_garbage = False
+    i = 0
+    while i < len(data):
+        if data[i] != flasher.START_BYTE or i + 4 > len(data):
+            if data[i] not in skip:
+                skipped += 1
+                if not in_garbage:
+                    resyncs += 1
+                in_garbage = True
+            i += 1
+            continue
+        cmd = data[i + 1]
+        length = data[i + 2] | (data[i + 3] << 8)
+        end = i + 4 + length + 3
+        crc_start = i + 1 if crc_header else i + 4
+        if end > len(data) or data[end - 1] != flasher.END_BYTE or \
+                flasher.calculate_crc16(data[crc_start:i + 4 + length]) != (data[end - 3] | (data[end - 2] << 8)):
+            skipped += 1
+            if not in_garbage:
+                resyncs += 1
+            in_garbage = True
+            i += 1
+            continue
+        frames.append((times[i], times[end - 1], cmd, bytes(data[i + 4:i + 4 + length])))
+        in_garbage = False
+        i = end
+    return frames, resyncs, skipped
+
+
+def analyze(records):
+    host, host_t = flatten(records, ota_capture.TO_DEVICE)
+    dev, dev_t = flatten(records, ota_capture.TO_HOST)
+    frames, host_resyncs, host_skipped = parse_frames(host, host_t, skip=(flasher.ENTER_REQ,))
+    resps, dev_resyncs, dev_skipped = parse_frames(dev, dev_t, crc_header=False)
+
+    result = {"duration": (records[-1][0] - records[0][0]) if records else 0.0,
+              "frames": {}, "ack": {}, "nack": {}, "responses": [],
+              "resyncs": host_resyncs + dev_resyncs, "skipped": host_skipped + dev_skipped,
+              "latency": []}
+    for f in frames:
+        name = CMD_NAMES.get(f[2], "0x%02X" % f[2])
+        result["frames"][name] = result["frames"].get(name, 0) + 1
+    for r in resps:
+        name = CMD_NAMES.get(r[2], "0x%02X" % r[2])
+        status = r[3][0] if r[3] else None
+        key = "ack" if status == flasher.ACK else "nack"
+        result[key][name] = result[key].get(name, 0) + 1
+        result["responses"].append((name, key))
+
+    # Pair every host frame with the first response that follows it
+    j = 0
+    for f in frames:
+        while j < len(resps) and resps[j][0] < f[1]:
+            j += 1
+        if j < len(resps):
+            result["latency"].append(resps[j][0] - f[1])
+            j += 1
+    return result
+
+
+def summary(values):
+    if not values:
+        return "-"
+    values = sorted(values)
+    return "mean %.1f / p50 %.1f / p95 %.1f / max %.1f ms" % (
+        statistics.mean(values) * 1e3, values[len(values) // 2] * 1e3,
+        values[min(int(len(values) * 0.95), len(values) - 1)] * 1e3, values[-1] * 1e3)
+
+
+def counts(d):
+    return " ".join("%s %d" % (k, v) for k, v in sorted(d.items())) or "-"
+
+
+def replay(args, records):
+    # Returns the records of the replayed session and the simulator events
+    out = []
+    with tempfile.TemporaryDirectory(prefix="ota_replay_") as tmp:
+        link = os.path.join(tmp, "tty")
+        events_path = os.path.join(tmp, "events.txt")
+        cmd = [args.sim, "--flash", args.flash or os.path.join(tmp, "flash.bin"),
+               "--link", link, "--events", events_path, "--baud", str(args.baud),
+               "--rx-fifo", str(args.rx_fifo), "--time-scale", str(args.time_scale), "--quiet"]
+        if args.record:
+            cmd += ["--record", args.record]
+        sim = subprocess.Popen(cmd, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+        try:
+            deadline = time.monotonic() + 5.0
+            while not os.path.exists(link) and time.monotonic() < deadline:
+                time.sleep(0.01)
+            time.sleep(0.2)
+
+            ser = serial.Serial(link, args.baud, timeout=0.05)
+            running = True
+            start = time.monotonic()
+
+            def reader():
+                while running:
+                    try:
+                        data = ser.read(256)
+                    except serial.SerialException:
+                        # simulator gone
+                        break
+                    if data:
+                        out.append((time.monotonic() - start, ota_capture.TO_HOST, data))
+
+            thread = threading.Thread(target=reader, daemon=True)
+            thread.start()
+
+            t0 = records[0][0]
+            for t, direction, data in records:
+                if direction != ota_capture.TO_DEVICE:
+                    continue
+                due = (t - t0) / args.speed
+                delay = due - (time.monotonic() - start)
+                if delay > 0:
+                    time.sleep(delay)
+                out.append((time.monotonic() - start, ota_capture.TO_DEVICE, data))
+                ser.write(data)
+
+            time.sleep(args.tail)
+            running = False
+            thread.join()
+            ser.close()
+        finally:
+            sim.terminate()
+            sim.wait()
+        with open(events_path, "r") as f:
+            events = [line.split()[1] for line in f if len(line.split()) > 1]
+    out.sort(key=lambda r: r[0])
+    return out, events
+
+
+def main():
+    parser = argparse.ArgumentParser(description="Replay a recorded OTA session on the simulated device")
+    parser.add_argument("capture", help="capture file (flasher.py --record, ota_sim --record)")
+    parser.add_argument("--sim", default=DEFAULT_SIM, help="ota_sim binary (make -C host_sim)")
+    parser.add_argument("--speed", type=float, default=1.0, help="replay speed, 2 : twice as fast")
+    parser.add_argument("--baud", type=int, default=115200)
+    parser.add_argument("--rx-fifo", type=int, default=64, help="device receive buffer depth")
+    parser.add_argument("--time-scale", type=float, default=1.0, help="flash timing scale")
+    parser.add_argument("--flash", help="flash image to start from (default : erased)")
+    parser.add_argument("--tail", type=float, default=3.0,
+                        help="time kept after the last host byte (s)")
+    parser.add_argument("--record", help="capture the replayed session")
+    args = parser.parse_args()
+
+    if not os.path.exists(args.sim):
+        print("%s not found, build it with : make -C host_sim" % args.sim)
+        return -1
+    if args.speed <= 0:
+        print("--speed must be > 0")
+        return -1
+
+    records = ota_capture.read_capture(args.capture)
+    if not any(d == ota_capture.TO_DEVICE for _, d, _ in records):
+        print("%s has no host -> device traffic" % args.capture)
+        return -1
+
+    replayed, events = replay(args, records)
+    before = analyze(records)
+    after = analyze(replayed)
+
+    print("%-10s %-50s %s" % ("", "original", "replay (x%g)" % args.speed))
+    print("%-10s %-50s %.3f s" % ("duration", "%.3f s" % before["duration"], after["duration"]))
+    print("%-10s %-50s %s" % ("frames", counts(before["frames"]), counts(after["frames"])))
+    print("%-10s %-50s %s" % ("ack", counts(before["ack"]), counts(after["ack"])))
+    print("%-10s %-50s %s" % ("nack", counts(before["nack"]), counts(after["nack"])))
+    print("%-10s %-50s %s" % ("resyncs", "%d (%d B skipped)" % (before["resyncs"], before["skipped"]),
+                              "%d (%d B skipped)" % (after["resyncs"], after["skipped"])))
+    print("%-10s %-50s %s" % ("latency", summary(before["latency"]), summary(after["latency"])))
+
+    diff = sum(1 for a, b in zip(before["responses"], after["responses"]) if a != b) + \
+        abs(len(before["responses"]) - len(after["responses"]))
+    print("device    : %d power ups, %d sessions done, %d failed, %d CRC errors" % (
+        events.count("power_up"), events.count("ota_done"), events.count("ota_failed"),
+        events.count("TRC_CHUNK_CRC_ERR")))
+    print("responses : %s" % ("identical" if diff == 0 else "%d differ" % diff))
+    return 0 if diff == 0 else 1
+
+
+if __name__ == "__main__":
+    sys.exit(main())
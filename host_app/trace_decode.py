@@ -0,0 +1,154 @@
+import os
+import re
+import struct
+import sys
+
+# Binary trace decoder.
+#
+# The application sends tokenized trace records interleaved with the printf
+# text on the console UART (see app_fw/app_firmware/Core/Inc/trace.h):
+#   0x1E | event id u16 | nargs u8 | timestamp u32 (DWT cycles) | args u32 * nargs
+# The event formats are read from trace.h so the table never gets out of sync.
+#
+# usage : python trace_decode.py <log file | serial port> [baud] [--core-hz HZ] [--trace-h PATH]
+
+TRACE_SOR = 0x1E
+REC_HDR_SIZE = 8
+DEFAULT_CORE_HZ = 64000000
+DEFAULT_TRACE_H = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                               "..", "app_fw", "app_firmware", "Core", "Inc", "trace.h")
+
+EVENT_RE = re.compile(r'^\s*X\(\s*(\w+)\s*,\s*"((?:[^"\\]|\\.)*)"\s*\)', re.MULTILINE)
+
+
+def load_events(path):
+    with open(path, "r") as f:
+        text = f.read()
+    events = []
+    for m in EVENT_RE.finditer(text):
+        events.append((m.group(1), m.group(2)))
+    return events
+
+
+class TraceDecoder:
+    def __init__(self, events, core_hz):
+        self.events = events
+        self.core_hz = core_hz
+        self.buf = bytearray()
+        self.text = bytearray()
+        self.last_ts = None
+        self.wraps = 0
+
+    def _time_us(self, ts):
+        # Unwrap the 32 bit cycle counter (wraps every ~67 s at 64 MHz)
+        if self.last_ts is not None and ts < self.last_ts:
+            self.wraps += 1
+        self.last_ts = ts
+        return ((self.wraps << 32) + ts) * 1000000.0 / self.core_hz
+
+    def _format(self, rec_id, args):
+        if rec_id >= len(self.events):
+            return "UNKNOWN_EVENT_%d %s" % (rec_id, " ".join("0x%X" % a for a in args))
+        name, fmt = self.events[rec_id]
+        try:
+            msg = fmt % tuple(args)
+        except (TypeError, ValueError):
+            msg = fmt + " " + " ".join("0x%X" % a for a in args)
+        return "%-20s %s" % (name, msg)
+
+    def _flush_text(self, out):
+        while True:
+            idx = self.text.find(b"\n")
+            if idx < 0:
+                break
+            line = self.text[:idx + 1].decode("ascii", errors="replace").rstrip("\r\n")
+            del self.text[:idx + 1]
+            out.append(line)
+
+    def feed(self, data):
+        """Feed raw bytes, return the decoded lines."""
+        out = []
+        self.buf += data
+        while self.buf:
+            if self.buf[0] != TRACE_SOR:
+                idx = self.buf.find(bytes([TRACE_SOR]))
+                end = len(self.buf) if idx < 0 else idx
+                self.text += self.buf[:end]
+                del self.buf[:end]
+                self._flush_text(out)
+                continue
+            if len(self.buf) < REC_HDR_SIZE:
+                break
+            rec_id, nargs, ts = struct.unpack_from("<HBI", self.buf, 1)
+            if nargs > 3:
+                # Not a record, treat the byte as text
+                self.text.append(self.buf[0])
+                del self.buf[:1]
+                continue
+            size = REC_HDR_SIZE + 4 * nargs
+            if len(self.buf) < size:
+                break
+            args = struct.unpack_from("<%dI" % nargs, self.buf, REC_HDR_SIZE)
+            del self.buf[:size]
+            out.append("[%12.1f us] %s" % (self._time_us(ts), self._format(rec_id, args)))
+        return out
+
+
+def chunks_from_serial(port, baud):
+    import serial
+    ser = serial.Serial(port, baud, timeout=0.1)
+    try:
+        while True:
+            data = ser.read(4096)
+            if data:
+                yield data
+    finally:
+        ser.close()
+
+
+def chunks_from_file(f):
+    while True:
+        data = f.read(4096)
+        if not data:
+            break
+        yield data
+
+
+def main():
+    args = sys.argv[1:]
+    core_hz = DEFAULT_CORE_HZ
+    trace_h = DEFAULT_TRACE_H
+    if "--core-hz" in args:
+        i = args.index("--core-hz")
+        core_hz = int(args[i + 1])
+        del args[i:i + 2]
+    if "--trace-h" in args:
+        i = args.index("--trace-h")
+        trace_h = args[i + 1]
+        del args[i:i + 2]
+
+    if len(args) < 1:
+        print("usage : python trace_decode.py <log file | serial port> [baud] [--core-hz HZ] [--trace-h PATH]")
+        return -1
+
+    source = args[0]
+    baud = int(args[1]) if len(args) > 1 else 115200
+
+    decoder = TraceDecoder(load_events(trace_h), core_hz)
+
+    if os.path.isfile(source):
+        chunks = chunks_from_file(open(source, "rb"))
+    else:
+        chunks = chunks_from_serial(source, baud)
+
+    try:
+        for data in chunks:
+            for line in decoder.feed(data):
+                print(line)
+    except KeyboardInterrupt:
+        pass
+    return 0
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,108 @@
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "stm32l4xx_hal.h"
+
+/*
+ * Host simulator of the OTA device.
+ *
+ * The real OTA sources (app boot.c, bootloader boot.c, flash.c) are built
+ * unmodified against the mock HAL. This header is the simulator internal API.
+ */
+
+/*
+ * STM32L451 flash timings (datasheet, typical values)
+ */
+#define SIM_FLASH_ERASE_PAGE_US    ( 22000u )    //tERASE, one 2 KB page
+#define SIM_FLASH_PROG_DW_US       ( 82u )       //tPROG, one double word
+
+#define SIM_UART_RX_FIFO_DEFAULT   ( 4096u )     //Host side buffer, not the L4 RDR
+
+/*
+ * STM32L451 supply current at 64 MHz, range 1, from flash (datasheet,
+ * typical values), for the energy estimate
+ */
+#define SIM_RUN_MA_DEFAULT         ( 6.1 )       //Run mode
+#define SIM_SLEEP_MA_DEFAULT       ( 1.55 )      //Sleep mode, peripherals clocked
+#define SIM_VDD                    ( 3.3 )
+
+/*
+ * Simulator configuration (command line)
+ */
+typedef struct
+{
+  const char *flash_file;       //Flash image, kept between runs
+  const char *pty_link;         //Symlink to the PTY slave, NULL for none
+  const char *events_file;      //Machine readable event log, NULL for none
+  const char *capture_file;     //OTA UART capture, NULL for none
+  uint32_t    baud;             //Wire speed, 0 : no pacing
+  uint32_t    rx_fifo;          //Receive buffer depth, 1 : L4 RDR only
+  uint32_t    rx_overrun;       //Every Nth byte received in interrupt mode overruns, 0 : none
+  double      time_scale;       //Flash timing scale, 0 : instant
+  bool        ota_on_boot;      //Press BOOT_SWITCH at power up
+  bool        once;             //Exit after the first successful update
+  bool        verbose;          //Print the firmware traces
+  bool        busy_wait;        //WFI returns at once (no low power wait)
+  double      run_ma;           //Supply current awake (mA)
+  double      sleep_ma;         //Supply current in Sleep mode (mA)
+  bool        boot_only;        //Stop every power cycle after the bootloader
+  uint32_t    power_cut;        //Flash operation the power is cut at (1 : the first), 0 : none
+  const char  *power_cut_next;  //Cuts of the next power cycles ("N,M"), NULL : none
+}SIM_CFG_;
+
+/*
+ * Counters, reset on every simulated power up
+ */
+typedef struct
+{
+  uint64_t erase_us;            //Time spent erasing
+  uint64_t prog_us;             //Time spent programming
+  uint32_t pages_erased;
+  uint32_t dw_programmed;
+  uint32_t prog_errors;         //Program/erase rejected by the flash
+  uint32_t rx_bytes;
+  uint32_t tx_bytes;
+  uint32_t rx_overruns;         //Bytes lost because the receive buffer was full
+  uint64_t sleep_us;            //Time in Sleep mode (WFI)
+  uint32_t wakeups;
+  uint32_t ecc_errors;          //Reads of torn double words (NMI)
+}SIM_STATS_;
+
+extern SIM_CFG_   sim_cfg;
+extern SIM_STATS_ sim_stats;
+
+/* Time */
+uint64_t sim_now_us( void );
+void sim_sleep_us( uint64_t us );
+
+/* Interrupts (wake the core from HAL_PWR_EnterSLEEPMode()) */
+void sim_irq_raise( void );
+
+/* Power */
+void sim_power_cut( void ) __attribute__((noreturn));
+void sim_nmi( void );
+
+/* Flash */
+int  sim_flash_init( const char *path );
+void sim_flash_power_up( void );
+void sim_flash_close( void );
+uint16_t sim_flash_crc16( uint32_t addr, uint32_t len );
+
+/* UART */
+int  sim_uart_init( const char *link );
+int  sim_uart_start( void );
+void sim_uart_close( void );
+
+/* Capture (host_app/ota_capture.py format) */
+#define SIM_CAPTURE_TO_DEVICE      ( 0u )
+#define SIM_CAPTURE_TO_HOST        ( 1u )
+int  sim_capture_open( const char *path );
+void sim_capture( uint8_t dir, const uint8_t *data, uint32_t len );
+
+/* Logging */
+void sim_log( const char *fmt, ... ) __attribute__((format(printf, 1, 2)));
+int  sim_event_open( const char *path );
+void sim_event( const char *fmt, ... ) __attribute__((format(printf, 1, 2)));
+#endif /* SIM_H */
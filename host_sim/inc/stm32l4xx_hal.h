@@ -0,0 +1,161 @@
+#ifndef STM32L4xx_HAL_H
+#define STM32L4xx_HAL_H
+
+/*
+ * Host (Linux) replacement of the STM32L4 HAL.
+ *
+ * Only what the OTA engine uses is provided. The flash is emulated at its
+ * real address (0x08000000) so the firmware keeps reading it through plain
+ * pointers. Everything else is implemented in host_sim/src.
+ */
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define __IO    volatile
+
+/*
+ * HAL status
+ */
+typedef enum
+{
+  HAL_OK       = 0x00,
+  HAL_ERROR    = 0x01,
+  HAL_BUSY     = 0x02,
+  HAL_TIMEOUT  = 0x03
+}HAL_StatusTypeDef;
+
+#define HAL_MAX_DELAY      0xFFFFFFFFU
+
+/*
+ * Flash (STM32L451 : 512 KB, single bank, 2 KB pages)
+ */
+#define FLASH_BASE                    ( 0x08000000UL )
+#define FLASH_SIZE                    ( 0x00080000UL )
+#define FLASH_BANK_SIZE               FLASH_SIZE
+#define FLASH_PAGE_SIZE               ( 0x00000800UL )
+#define FLASH_PAGE_NB                 ( FLASH_SIZE / FLASH_PAGE_SIZE )
+#define FLASH_BANK_1                  ( 0x01U )
+
+#define FLASH_TYPEERASE_PAGES         ( 0x00U )
+#define FLASH_TYPEERASE_MASSERASE     ( 0x01U )
+
+#define FLASH_TYPEPROGRAM_DOUBLEWORD  ( 0x00U )
+#define FLASH_TYPEPROGRAM_FAST        ( 0x01U )
+#define FLASH_TYPEPROGRAM_FAST_AND_LAST ( 0x02U )
+
+#define FLASH_FLAG_OPTVERR            ( 1UL << 15 )
+#define FLASH_FLAG_PROGERR            ( 1UL << 3 )
+#define FLASH_FLAG_WRPERR             ( 1UL << 4 )
+#define FLASH_FLAG_PGAERR             ( 1UL << 5 )
+#define FLASH_FLAG_ECCD               ( 1UL << 31 )     //ECC double error (FLASH_ECCR)
+
+#define __HAL_FLASH_GET_FLAG( flag )     ( sim_flash_get_flag( flag ) )
+#define __HAL_FLASH_CLEAR_FLAG( flag )   sim_flash_clear_flag( flag )
+
+typedef struct
+{
+  uint32_t TypeErase;
+  uint32_t Banks;
+  uint32_t Page;
+  uint32_t NbPages;
+}FLASH_EraseInitTypeDef;
+
+HAL_StatusTypeDef HAL_FLASH_Unlock( void );
+HAL_StatusTypeDef HAL_FLASH_Lock( void );
+HAL_StatusTypeDef HAL_FLASH_Program( uint32_t TypeProgram, uint32_t Address, uint64_t Data );
+HAL_StatusTypeDef HAL_FLASHEx_Erase( FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError );
+HAL_StatusTypeDef FLASH_WaitForLastOperation( uint32_t Timeout );
+void sim_flash_clear_flag( uint32_t flag );
+int  sim_flash_get_flag( uint32_t flag );
+
+/*
+ * UART
+ */
+typedef struct
+{
+  uint32_t Instance;          //Peripheral number, informative only
+  volatile uint32_t ErrorCode;  //HAL_UART_ERROR_, reset by HAL_UART_Receive_IT()
+}UART_HandleTypeDef;
+
+#define HAL_UART_ERROR_NONE  ( 0x00u )
+#define HAL_UART_ERROR_PE    ( 0x01u )
+#define HAL_UART_ERROR_NE    ( 0x02u )
+#define HAL_UART_ERROR_FE    ( 0x04u )
+#define HAL_UART_ERROR_ORE   ( 0x08u )
+
+HAL_StatusTypeDef HAL_UART_Transmit( UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size, uint32_t Timeout );
+HAL_StatusTypeDef HAL_UART_Receive( UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout );
+HAL_StatusTypeDef HAL_UART_Receive_IT( UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size );
+HAL_StatusTypeDef HAL_UART_AbortReceive_IT( UART_HandleTypeDef *huart );
+uint32_t HAL_UART_GetError( UART_HandleTypeDef *huart );
+void HAL_UART_RxCpltCallback( UART_HandleTypeDef *huart );
+void HAL_UART_ErrorCallback( UART_HandleTypeDef *huart );
+
+/*
+ * CRC
+ */
+typedef struct
+{
+  uint32_t Instance;
+}CRC_HandleTypeDef;
+
+uint32_t HAL_CRC_Calculate( CRC_HandleTypeDef *hcrc, uint32_t pBuffer[], uint32_t BufferLength );
+
+/*
+ * GPIO
+ */
+typedef struct
+{
+  uint32_t ODR;
+}GPIO_TypeDef;
+
+typedef enum
+{
+  GPIO_PIN_RESET = 0,
+  GPIO_PIN_SET
+}GPIO_PinState;
+
+extern GPIO_TypeDef sim_gpioa;
+#define GPIOA         ( &sim_gpioa )
+#define GPIO_PIN_5    ( (uint16_t)0x0020 )
+#define GPIO_PIN_15   ( (uint16_t)0x8000 )
+
+void HAL_GPIO_WritePin( GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState );
+void HAL_GPIO_TogglePin( GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin );
+
+/*
+ * Power : Sleep mode. The core waits for an interrupt (a byte received by an
+ * IT reception, the 1 ms SysTick). The interrupts masked by __disable_irq()
+ * stay pending and end the WFI.
+ */
+#define PWR_MAINREGULATOR_ON          ( 0x00U )
+#define PWR_LOWPOWERREGULATOR_ON      ( 0x01U )
+#define PWR_SLEEPENTRY_WFI            ( (uint8_t)0x01U )
+#define PWR_SLEEPENTRY_WFE            ( (uint8_t)0x02U )
+
+void HAL_PWR_EnterSLEEPMode( uint32_t Regulator, uint8_t SLEEPEntry );
+void sim_irq_disable( void );
+#define __disable_irq()               sim_irq_disable()
+#define __enable_irq()                do{}while( 0 )
+#define __DSB()                       __sync_synchronize()
+
+/*
+ * System
+ */
+uint32_t HAL_GetTick( void );
+void HAL_Delay( uint32_t Delay );
+void HAL_NVIC_SystemReset( void );
+uint32_t HAL_GetUIDw0( void );
+uint32_t HAL_GetUIDw1( void );
+uint32_t HAL_GetUIDw2( void );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* STM32L4xx_HAL_H */
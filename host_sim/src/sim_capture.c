@@ -0,0 +1,84 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include "sim.h"
+
+/*
+ * OTA UART capture (--record), same file format as host_app/ota_capture.py :
+ *
+ *   header : "OTACAP" version(u8) reserved(u8)
+ *   record : direction(u8) time_us(u32 LE) length(u16 LE) data[length]
+ *
+ * The file is opened by the parent and shared by all the power cycles. Each
+ * record is written with a single write() on an O_APPEND descriptor, so
+ * records from the reader thread, the firmware and successive power cycles
+ * never mix.
+ */
+
+#define SIM_CAPTURE_VERSION     ( 1u )
+#define SIM_CAPTURE_RECORD_MAX  ( 512u )
+
+static int sim_capture_fd = -1;
+
+/**
+  * @brief Create the capture file and write its header.
+  * @param path capture file
+  * @retval 0 on success, -1 on error
+  */
+int sim_capture_open( const char *path )
+{
+  static const uint8_t header[8] = { 'O', 'T', 'A', 'C', 'A', 'P', SIM_CAPTURE_VERSION, 0u };
+
+  sim_capture_fd = open( path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644 );
+  if( sim_capture_fd < 0 )
+  {
+    return -1;
+  }
+  if( write( sim_capture_fd, header, sizeof(header) ) != (ssize_t)sizeof(header) )
+  {
+    close( sim_capture_fd );
+    sim_capture_fd = -1;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+  * @brief Record bytes seen on the OTA UART.
+  * @param dir SIM_CAPTURE_TO_DEVICE or SIM_CAPTURE_TO_HOST
+  * @param data bytes
+  * @param len number of bytes
+  * @retval none
+  */
+void sim_capture( uint8_t dir, const uint8_t *data, uint32_t len )
+{
+  uint8_t  rec[7u + SIM_CAPTURE_RECORD_MAX];
+  uint32_t t_us;
+
+  if( sim_capture_fd < 0 )
+  {
+    return;
+  }
+
+  t_us = (uint32_t)sim_now_us();
+  while( len > 0u )
+  {
+    uint16_t n = ( len > SIM_CAPTURE_RECORD_MAX ) ? SIM_CAPTURE_RECORD_MAX : (uint16_t)len;
+
+    rec[0] = dir;
+    rec[1] = (uint8_t)( t_us );
+    rec[2] = (uint8_t)( t_us >> 8 );
+    rec[3] = (uint8_t)( t_us >> 16 );
+    rec[4] = (uint8_t)( t_us >> 24 );
+    rec[5] = (uint8_t)( n );
+    rec[6] = (uint8_t)( n >> 8 );
+    memcpy( &rec[7], data, n );
+    if( write( sim_capture_fd, rec, 7u + n ) < 0 )
+    {
+      sim_capture_fd = -1;
+      return;
+    }
+    data += n;
+    len  -= n;
+  }
+}
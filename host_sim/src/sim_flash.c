@@ -0,0 +1,494 @@
+#define _GNU_SOURCE       //REG_EFL
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <ucontext.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "sim.h"
+
+/*
+ * Emulated STM32L451 flash.
+ *
+ * The flash image file is mapped twice :
+ *  - read only at FLASH_BASE, where the firmware reads it through pointers.
+ *    A stray write from the firmware faults like it would (bus error) on
+ *    the target.
+ *  - read/write somewhere else, only used by the program/erase functions.
+ *
+ * L4 rules that are enforced :
+ *  - program/erase only when unlocked,
+ *  - double word program, 8 bytes aligned, into an erased double word only
+ *    (PROGERR otherwise, no bit can go from 0 to 1 without an erase),
+ *  - page erase sets the 2 KB page to 0xFF.
+ * Operations take their datasheet time (scaled by sim_cfg.time_scale).
+ *
+ * --power-cut N stops the Nth program/erase of a power cycle half way : the
+ * page or double word is left with random bits (an erase sets some of them,
+ * a program clears some of them), then the power is cut.
+ *
+ * Such a double word is torn : its ECC does not match, reading it is a
+ * double ECC error (ECCD), which raises the NMI on the target. The torn
+ * double words are remembered (for all the power cycles) until they are
+ * erased, or programmed to zero. Their host pages are not readable, a
+ * firmware read of one faults (SIGSEGV) : the fault handler sets ECCD and
+ * runs the NMI (sim_nmi()), then lets the read through for one instruction
+ * (single step, SIGTRAP) and protects the page again.
+ */
+
+#ifndef MAP_FIXED_NOREPLACE
+#define MAP_FIXED_NOREPLACE 0x100000
+#endif
+
+static int       flash_fd = -1;
+static uint8_t  *flash_rw;                  //Read/write alias of the image
+static bool      flash_locked = true;
+static uint32_t  flash_sr;                  //Error flags of the last operation
+/* Flash busy time not slept yet (sleeps are batched, see flash_busy()) */
+static uint64_t  flash_busy_debt_us;
+/* Torn double words, one bit each, shared by the power cycles */
+static uint8_t  *flash_torn;
+static uint32_t  flash_eccr;                //ECC flags (FLASH_FLAG_ECCD)
+static uintptr_t flash_host_page;           //Host page size
+static uintptr_t flash_step_page;           //Page readable for one instruction, 0 : none
+
+#define FLASH_DW_NB    ( FLASH_SIZE / 8u )
+
+/**
+  * @brief Account for the time the flash is busy. The CPU stalls on the
+  *        target, so the caller sleeps. Short operations are batched to keep
+  *        the total accurate despite the host sleep granularity.
+  * @param us busy time at the datasheet speed
+  * @retval none
+  */
+static void flash_busy( uint64_t us )
+{
+  flash_busy_debt_us += (uint64_t)( (double)us * sim_cfg.time_scale );
+  if( flash_busy_debt_us >= 1000u )
+  {
+    uint64_t start = sim_now_us();
+    sim_sleep_us( flash_busy_debt_us );
+    uint64_t slept = sim_now_us() - start;
+    flash_busy_debt_us = ( slept >= flash_busy_debt_us ) ? 0u : ( flash_busy_debt_us - slept );
+  }
+}
+
+/**
+  * @brief Tell if a double word is torn.
+  * @param addr flash address
+  * @retval true if torn
+  */
+static bool flash_is_torn( uint32_t addr )
+{
+  uint32_t dw = ( addr - FLASH_BASE ) / 8u;
+
+  return ( flash_torn[dw / 8u] & ( 1u << ( dw % 8u ) ) ) != 0u;
+}
+
+/**
+  * @brief Protect the host page holding a flash address when it holds a
+  *        torn double word, make it readable otherwise.
+  * @param addr flash address
+  * @retval none
+  */
+static void flash_protect( uint32_t addr )
+{
+  uintptr_t page = (uintptr_t)addr & ~( flash_host_page - 1u );
+  int       prot = PROT_READ;
+
+  for( uint32_t a = (uint32_t)page; a < ( page + flash_host_page ); a += 8u )
+  {
+    if( flash_is_torn( a ) )
+    {
+      prot = PROT_NONE;
+      break;
+    }
+  }
+  mprotect( (void *)page, flash_host_page, prot );
+}
+
+/**
+  * @brief Mark flash double words as torn (power cut) or sound again.
+  * @param addr flash address
+  * @param len length
+  * @param torn true for torn
+  * @retval none
+  */
+static void flash_set_torn( uint32_t addr, uint32_t len, bool torn )
+{
+  bool changed = false;
+
+  for( uint32_t a = addr & ~7u; a < ( addr + len ); a += 8u )
+  {
+    uint32_t dw  = ( a - FLASH_BASE ) / 8u;
+    uint8_t  bit = (uint8_t)( 1u << ( dw % 8u ) );
+
+    if( ( ( flash_torn[dw / 8u] & bit ) != 0u ) != torn )
+    {
+      flash_torn[dw / 8u] ^= bit;
+      changed = true;
+    }
+  }
+  if( changed )
+  {
+    for( uint32_t a = addr; a < ( addr + len ); a += (uint32_t)flash_host_page )
+    {
+      flash_protect( a );
+    }
+    flash_protect( addr + len - 1u );
+  }
+}
+
+/**
+  * @brief Firmware read of a protected page : a torn double word is a
+  *        double ECC error, the NMI runs. The read is then let through for
+  *        one instruction.
+  */
+static void flash_on_fault( int sig, siginfo_t *si, void *context )
+{
+  uintptr_t addr = (uintptr_t)si->si_addr;
+
+  if( ( addr < FLASH_BASE ) || ( addr >= ( FLASH_BASE + FLASH_SIZE ) ) || ( flash_step_page != 0u ) )
+  {
+    //Not a flash read : the default action (crash)
+    signal( sig, SIG_DFL );
+    return;
+  }
+  if( flash_is_torn( (uint32_t)addr ) )
+  {
+    sim_stats.ecc_errors++;
+    sim_event( "ecc_error addr=0x%08lX", (unsigned long)( addr & ~7u ) );
+    flash_eccr |= FLASH_FLAG_ECCD;
+    sim_nmi();
+  }
+  flash_step_page = addr & ~( flash_host_page - 1u );
+  mprotect( (void *)flash_step_page, flash_host_page, PROT_READ );
+#if defined( __x86_64__ )
+  ( (ucontext_t *)context )->uc_mcontext.gregs[REG_EFL] |= 0x100;    //TF : trap after one instruction
+#else
+  //No single step : the page stays readable until the next flash operation
+  (void)context;
+#endif
+}
+
+/**
+  * @brief The faulting read is done : protect its page again.
+  */
+static void flash_on_step( int sig, siginfo_t *si, void *context )
+{
+  (void)sig;
+  (void)si;
+#if defined( __x86_64__ )
+  ( (ucontext_t *)context )->uc_mcontext.gregs[REG_EFL] &= ~0x100;
+#else
+  (void)context;
+#endif
+  if( flash_step_page != 0u )
+  {
+    flash_protect( (uint32_t)flash_step_page );
+    flash_step_page = 0u;
+  }
+}
+
+/**
+  * @brief Power up : protect the pages that hold torn double words, a
+  *        firmware read of one of them raises the NMI.
+  * @param none
+  * @retval none
+  */
+void sim_flash_power_up( void )
+{
+  struct sigaction sa;
+
+  memset( &sa, 0, sizeof(sa) );
+  sa.sa_flags     = SA_SIGINFO | SA_NODEFER;
+  sa.sa_sigaction = flash_on_fault;
+  sigaction( SIGSEGV, &sa, NULL );
+  sigaction( SIGBUS, &sa, NULL );
+  sa.sa_sigaction = flash_on_step;
+  sigaction( SIGTRAP, &sa, NULL );
+
+  for( uint32_t addr = FLASH_BASE; addr < ( FLASH_BASE + FLASH_SIZE ); addr += (uint32_t)flash_host_page )
+  {
+    flash_protect( addr );
+  }
+}
+
+/**
+  * @brief Cut the power if the operation about to start is the one given by
+  *        --power-cut, once it left the flash half erased or programmed.
+  * @param addr flash address of the operation
+  * @param data value being programmed, NULL for an erase
+  * @param len length
+  * @retval none
+  */
+static void flash_power_cut( uint32_t addr, const uint8_t *data, uint32_t len )
+{
+  uint8_t *mem = &flash_rw[addr - FLASH_BASE];
+
+  if( ( sim_cfg.power_cut == 0u ) ||
+      ( ( sim_stats.pages_erased + sim_stats.dw_programmed + 1u ) != sim_cfg.power_cut ) )
+  {
+    return;
+  }
+
+  srand( sim_cfg.power_cut );
+  for( uint32_t i = 0u; i < len; i++ )
+  {
+    uint8_t bits = (uint8_t)rand();
+    mem[i] = ( data == NULL ) ? (uint8_t)( mem[i] | bits ) : (uint8_t)( mem[i] & ( data[i] | bits ) );
+  }
+  flash_set_torn( addr, len, true );
+  sim_power_cut();
+}
+
+/**
+  * @brief Open (or create, erased) the flash image and map it at FLASH_BASE.
+  * @param path flash image file
+  * @retval 0 on success, -1 on error
+  */
+int sim_flash_init( const char *path )
+{
+  struct stat st;
+  void *ro;
+
+  flash_fd = open( path, O_RDWR | O_CREAT, 0644 );
+  if( flash_fd < 0 )
+  {
+    sim_log( "flash: cannot open %s (%s)", path, strerror( errno ) );
+    return -1;
+  }
+
+  if( ( fstat( flash_fd, &st ) != 0 ) || ( st.st_size != (off_t)FLASH_SIZE ) )
+  {
+    //New (or bad size) image : start from a fully erased part
+    static uint8_t erased[FLASH_PAGE_SIZE];
+    memset( erased, 0xFF, sizeof(erased) );
+    if( ftruncate( flash_fd, 0 ) != 0 )
+    {
+      return -1;
+    }
+    for( uint32_t i = 0u; i < FLASH_PAGE_NB; i++ )
+    {
+      if( write( flash_fd, erased, sizeof(erased) ) != (ssize_t)sizeof(erased) )
+      {
+        return -1;
+      }
+    }
+    sim_log( "flash: created erased image %s", path );
+  }
+
+  flash_rw = mmap( NULL, FLASH_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, flash_fd, 0 );
+  if( flash_rw == MAP_FAILED )
+  {
+    sim_log( "flash: mmap failed (%s)", strerror( errno ) );
+    return -1;
+  }
+
+  ro = mmap( (void *)(uintptr_t)FLASH_BASE, FLASH_SIZE, PROT_READ,
+             MAP_SHARED | MAP_FIXED_NOREPLACE, flash_fd, 0 );
+  if( ro != (void *)(uintptr_t)FLASH_BASE )
+  {
+    sim_log( "flash: cannot map the flash at 0x%08lX (%s)", (unsigned long)FLASH_BASE, strerror( errno ) );
+    return -1;
+  }
+
+  //Torn double words : shared with the power cycles (child processes)
+  flash_torn = mmap( NULL, FLASH_DW_NB / 8u, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0 );
+  if( flash_torn == MAP_FAILED )
+  {
+    sim_log( "flash: mmap failed (%s)", strerror( errno ) );
+    return -1;
+  }
+  flash_host_page = (uintptr_t)sysconf( _SC_PAGESIZE );
+
+  flash_locked = true;
+  return 0;
+}
+
+/**
+  * @brief Write the image back and unmap it.
+  * @param none
+  * @retval none
+  */
+void sim_flash_close( void )
+{
+  if( flash_fd >= 0 )
+  {
+    msync( flash_rw, FLASH_SIZE, MS_SYNC );
+    munmap( flash_rw, FLASH_SIZE );
+    munmap( (void *)(uintptr_t)FLASH_BASE, FLASH_SIZE );
+    close( flash_fd );
+    flash_fd = -1;
+  }
+}
+
+/**
+  * @brief CRC16 (CCITT-FALSE, same as CalcCRC()) of a flash area.
+  * @param addr start address
+  * @param len number of bytes
+  * @retval CRC16
+  */
+uint16_t sim_flash_crc16( uint32_t addr, uint32_t len )
+{
+  const uint8_t *p = &flash_rw[addr - FLASH_BASE];     //the simulator reads past the ECC
+  uint16_t crc = 0xFFFF;
+
+  for( uint32_t i = 0u; i < len; i++ )
+  {
+    crc ^= (uint16_t)p[i] << 8;
+    for( int b = 0; b < 8; b++ )
+    {
+      crc = ( crc & 0x8000u ) ? (uint16_t)( ( crc << 1 ) ^ 0x1021u ) : (uint16_t)( crc << 1 );
+    }
+  }
+  return crc;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Unlock( void )
+{
+  flash_locked = false;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock( void )
+{
+  flash_locked = true;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef FLASH_WaitForLastOperation( uint32_t Timeout )
+{
+  (void)Timeout;
+  //Operations complete synchronously. Report the last error like the HAL.
+  return ( flash_sr != 0u ) ? HAL_ERROR : HAL_OK;
+}
+
+void sim_flash_clear_flag( uint32_t flag )
+{
+  flash_sr   &= ~flag;
+  flash_eccr &= ~flag;
+}
+
+int sim_flash_get_flag( uint32_t flag )
+{
+  return ( ( flash_sr | flash_eccr ) & flag ) == flag;
+}
+
+/**
+  * @brief Program one double word.
+  * @param addr flash address
+  * @param data value
+  * @retval HAL_StatusTypeDef
+  */
+static HAL_StatusTypeDef flash_program_dw( uint32_t addr, uint64_t data )
+{
+  uint64_t cur;
+
+  if( ( addr < FLASH_BASE ) || ( addr > ( FLASH_BASE + FLASH_SIZE - 8u ) ) || ( ( addr & 7u ) != 0u ) )
+  {
+    flash_sr |= FLASH_FLAG_PGAERR;
+    return HAL_ERROR;
+  }
+
+  memcpy( &cur, &flash_rw[addr - FLASH_BASE], sizeof(cur) );
+  if( ( cur != UINT64_MAX ) && ( data != 0u ) )
+  {
+    //Only an erased double word can be programmed (writing all zeros is allowed)
+    flash_sr |= FLASH_FLAG_PROGERR;
+    return HAL_ERROR;
+  }
+
+  flash_power_cut( addr, (const uint8_t *)&data, sizeof(data) );
+  memcpy( &flash_rw[addr - FLASH_BASE], &data, sizeof(data) );
+  if( flash_is_torn( addr ) )
+  {
+    //Zero over a torn double word : data and ECC all zero, sound again
+    flash_set_torn( addr, sizeof(data), false );
+  }
+  sim_stats.dw_programmed++;
+  sim_stats.prog_us += SIM_FLASH_PROG_DW_US;
+  flash_busy( SIM_FLASH_PROG_DW_US );
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program( uint32_t TypeProgram, uint32_t Address, uint64_t Data )
+{
+  HAL_StatusTypeDef ret = HAL_ERROR;
+
+  flash_sr = 0u;
+  do
+  {
+    if( flash_locked )
+    {
+      flash_sr |= FLASH_FLAG_WRPERR;
+      break;
+    }
+
+    if( TypeProgram == FLASH_TYPEPROGRAM_DOUBLEWORD )
+    {
+      ret = flash_program_dw( Address, Data );
+    }
+    else
+    {
+      //Fast programming : one row (32 double words), Data is the source address
+      const uint8_t *src = (const uint8_t *)(uintptr_t)Data;
+      for( uint32_t i = 0u; i < 32u; i++ )
+      {
+        uint64_t dw;
+        memcpy( &dw, &src[i * 8u], sizeof(dw) );
+        ret = flash_program_dw( Address + ( i * 8u ), dw );
+        if( ret != HAL_OK )
+        {
+          break;
+        }
+      }
+    }
+  }while( false );
+
+  if( ret != HAL_OK )
+  {
+    sim_stats.prog_errors++;
+  }
+  return ret;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase( FLASH_EraseInitTypeDef *pEraseInit, uint32_t *PageError )
+{
+  uint32_t first = pEraseInit->Page;
+  uint32_t count = pEraseInit->NbPages;
+  uint64_t start = sim_now_us();
+
+  flash_sr   = 0u;
+  *PageError = 0xFFFFFFFFu;
+
+  if( pEraseInit->TypeErase == FLASH_TYPEERASE_MASSERASE )
+  {
+    first = 0u;
+    count = FLASH_PAGE_NB;
+  }
+
+  for( uint32_t page = first; page < ( first + count ); page++ )
+  {
+    if( flash_locked || ( page >= FLASH_PAGE_NB ) )
+    {
+      flash_sr |= FLASH_FLAG_WRPERR;
+      *PageError = page;
+      sim_stats.prog_errors++;
+      return HAL_ERROR;
+    }
+    flash_power_cut( FLASH_BASE + ( page * FLASH_PAGE_SIZE ), NULL, FLASH_PAGE_SIZE );
+    memset( &flash_rw[page * FLASH_PAGE_SIZE], 0xFF, FLASH_PAGE_SIZE );
+    flash_set_torn( FLASH_BASE + ( page * FLASH_PAGE_SIZE ), FLASH_PAGE_SIZE, false );
+    sim_stats.pages_erased++;
+    sim_stats.erase_us += SIM_FLASH_ERASE_PAGE_US;
+    flash_busy( SIM_FLASH_ERASE_PAGE_US );
+  }
+
+  sim_event( "erase page=%lu pages=%lu us=%lu", (unsigned long)first, (unsigned long)count,
+             (unsigned long)( sim_now_us() - start ) );
+  return HAL_OK;
+}
@@ -0,0 +1,75 @@
+#include <stdio.h>
+#include "sim.h"
+#include "trace.h"
+#include "boot_prof.h"
+
+/*
+ * Firmware services that only make sense on the target.
+ */
+
+/* Format strings of the trace events, the host decoder does the same */
+#define TRACE_FMT_( id, fmt )  fmt,
+static const char *const trace_fmt[TRC_EVENT_COUNT] =
+{
+  TRACE_EVENTS( TRACE_FMT_ )
+};
+#undef TRACE_FMT_
+
+#define TRACE_NAME_( id, fmt )  #id,
+static const char *const trace_name[TRC_EVENT_COUNT] =
+{
+  TRACE_EVENTS( TRACE_NAME_ )
+};
+#undef TRACE_NAME_
+
+static const char *const boot_prof_name[BOOT_PROF_PHASE_COUNT] =
+{
+  "BOOT_HAL_INIT", "BOOT_CLOCK", "BOOT_CFG_READ", "BOOT_INSTALL",
+  "BOOT_VERIFY", "BOOT_JUMP", "BOOT_APP_START", "BOOT_APP_INIT",
+};
+
+/**
+  * @brief Print the trace event as text instead of a binary record.
+  */
+void trace_emit( uint16_t id, uint8_t nargs, uint32_t a0, uint32_t a1, uint32_t a2 )
+{
+  (void)nargs;
+
+  if( id >= TRC_EVENT_COUNT )
+  {
+    return;
+  }
+  sim_event( "%s %lu %lu %lu", trace_name[id], (unsigned long)a0, (unsigned long)a1, (unsigned long)a2 );
+  if( !sim_cfg.verbose )
+  {
+    return;
+  }
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+  printf( "[%8lu] ", (unsigned long)HAL_GetTick() );
+  printf( trace_fmt[id], a0, a1, a2 );
+  printf( "\n" );
+#pragma GCC diagnostic pop
+  fflush( stdout );
+}
+
+void trace_init( void )
+{
+}
+
+/* No DWT on the host : the boot phases go to the event log */
+void boot_prof_start( void )
+{
+}
+
+void boot_prof_mark( BOOT_PROF_PHASE_ phase )
+{
+  if( phase < BOOT_PROF_PHASE_COUNT )
+  {
+    sim_event( "%s", boot_prof_name[phase] );
+  }
+}
+
+void boot_prof_report( void )
+{
+}
@@ -0,0 +1,273 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include "sim.h"
+
+/*
+ * Remaining HAL services : time base, Sleep mode, GPIO, CRC unit and reset.
+ */
+
+GPIO_TypeDef sim_gpioa;
+
+static uint64_t sim_epoch_us;
+static int      sim_event_fd = -1;
+
+/* Interrupts raised so far (sim_irq_raise()), and their count when the
+ * firmware masked them : a WFI ends at once if one came in between */
+static pthread_mutex_t sim_irq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  sim_irq_cond;
+static bool            sim_irq_cond_init;
+static uint32_t        sim_irq_count;
+static uint32_t        sim_irq_mark;
+
+/**
+  * @brief CLOCK_MONOTONIC (us). Python's time.monotonic() uses the same clock.
+  */
+static uint64_t sim_mono_us( void )
+{
+  struct timespec ts;
+
+  clock_gettime( CLOCK_MONOTONIC, &ts );
+  return ( (uint64_t)ts.tv_sec * 1000000u ) + ( (uint64_t)ts.tv_nsec / 1000u );
+}
+
+/**
+  * @brief Monotonic time since the simulator started (us).
+  */
+uint64_t sim_now_us( void )
+{
+  uint64_t now = sim_mono_us();
+
+  if( sim_epoch_us == 0u )
+  {
+    sim_epoch_us = now;
+  }
+  return now - sim_epoch_us;
+}
+
+/**
+  * @brief Sleep (us), restarted when interrupted.
+  */
+void sim_sleep_us( uint64_t us )
+{
+  struct timespec ts =
+  {
+    .tv_sec  = (time_t)( us / 1000000u ),
+    .tv_nsec = (long)( ( us % 1000000u ) * 1000u )
+  };
+
+  if( us == 0u )
+  {
+    return;
+  }
+  while( nanosleep( &ts, &ts ) != 0 )
+  {
+  }
+}
+
+/**
+  * @brief Simulator message, on stderr so it never mixes with the traces.
+  */
+void sim_log( const char *fmt, ... )
+{
+  va_list ap;
+
+  fprintf( stderr, "[%9.3f] SIM: ", (double)sim_now_us() / 1000000.0 );
+  va_start( ap, fmt );
+  vfprintf( stderr, fmt, ap );
+  va_end( ap );
+  fputc( '\n', stderr );
+}
+
+/**
+  * @brief Open the event log. Shared by all the power cycles (O_APPEND).
+  * @param path event log file
+  * @retval 0 on success, -1 on error
+  */
+int sim_event_open( const char *path )
+{
+  sim_event_fd = open( path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644 );
+  return ( sim_event_fd < 0 ) ? -1 : 0;
+}
+
+/**
+  * @brief Log a machine readable event : "<CLOCK_MONOTONIC s> <event>".
+  *        Used by host_app/ota_bench.py to split an update into phases.
+  */
+void sim_event( const char *fmt, ... )
+{
+  char    line[256];
+  int     len;
+  va_list ap;
+
+  if( sim_event_fd < 0 )
+  {
+    return;
+  }
+
+  len = snprintf( line, sizeof(line), "%.6f ", (double)sim_mono_us() / 1000000.0 );
+  va_start( ap, fmt );
+  len += vsnprintf( &line[len], sizeof(line) - (size_t)len - 1u, fmt, ap );
+  va_end( ap );
+  if( len > (int)sizeof(line) - 2 )
+  {
+    len = (int)sizeof(line) - 2;
+  }
+  line[len++] = '\n';
+
+  //One write per line, lines from the successive power cycles never mix
+  if( write( sim_event_fd, line, (size_t)len ) < 0 )
+  {
+    sim_event_fd = -1;
+  }
+}
+
+/**
+  * @brief An interrupt fired (reader thread) : wake the core from WFI.
+  */
+void sim_irq_raise( void )
+{
+  pthread_mutex_lock( &sim_irq_lock );
+  sim_irq_count++;
+  if( sim_irq_cond_init )
+  {
+    pthread_cond_broadcast( &sim_irq_cond );
+  }
+  pthread_mutex_unlock( &sim_irq_lock );
+}
+
+void sim_irq_disable( void )
+{
+  pthread_mutex_lock( &sim_irq_lock );
+  sim_irq_mark = sim_irq_count;
+  pthread_mutex_unlock( &sim_irq_lock );
+}
+
+/**
+  * @brief WFI : wait for an interrupt raised since __disable_irq(), or the
+  *        next SysTick (1 ms). The time asleep goes to sim_stats.
+  */
+void HAL_PWR_EnterSLEEPMode( uint32_t Regulator, uint8_t SLEEPEntry )
+{
+  uint64_t        start = sim_now_us();
+  uint64_t        wake  = sim_epoch_us + ( ( start / 1000u ) + 1u ) * 1000u;
+  struct timespec ts    = { .tv_sec = (time_t)( wake / 1000000u ), .tv_nsec = (long)( ( wake % 1000000u ) * 1000u ) };
+
+  (void)Regulator;
+  (void)SLEEPEntry;
+  if( sim_cfg.busy_wait )
+  {
+    //Core kept running : the loop polls again at once
+    return;
+  }
+
+  pthread_mutex_lock( &sim_irq_lock );
+  if( !sim_irq_cond_init )
+  {
+    pthread_condattr_t attr;
+
+    pthread_condattr_init( &attr );
+    pthread_condattr_setclock( &attr, CLOCK_MONOTONIC );
+    pthread_cond_init( &sim_irq_cond, &attr );
+    pthread_condattr_destroy( &attr );
+    sim_irq_cond_init = true;
+  }
+  while( sim_irq_count == sim_irq_mark )
+  {
+    if( pthread_cond_timedwait( &sim_irq_cond, &sim_irq_lock, &ts ) != 0 )
+    {
+      break;
+    }
+  }
+  pthread_mutex_unlock( &sim_irq_lock );
+
+  sim_stats.sleep_us += sim_now_us() - start;
+  sim_stats.wakeups++;
+}
+
+uint32_t HAL_GetTick( void )
+{
+  return (uint32_t)( sim_now_us() / 1000u );
+}
+
+void HAL_Delay( uint32_t Delay )
+{
+  sim_sleep_us( (uint64_t)Delay * 1000u );
+}
+
+void HAL_NVIC_SystemReset( void )
+{
+  //One process per power cycle (see sim_main.c) : RAM is lost like on the target
+  fflush( stdout );
+  _exit( 0 );
+}
+
+//96 bit unique ID : FNV-1a of the flash file path, so that every simulated
+//device keeps its own ID between runs and two devices never share one
+static uint32_t sim_uid( uint32_t word )
+{
+  uint32_t    hash = 2166136261u ^ word;
+  const char *c;
+
+  for( c = ( sim_cfg.flash_file != NULL ) ? sim_cfg.flash_file : ""; *c != '\0'; c++ )
+  {
+    hash = ( hash ^ (uint8_t)*c ) * 16777619u;
+  }
+  return hash;
+}
+
+uint32_t HAL_GetUIDw0( void )
+{
+  return sim_uid( 0u );
+}
+
+uint32_t HAL_GetUIDw1( void )
+{
+  return sim_uid( 1u );
+}
+
+uint32_t HAL_GetUIDw2( void )
+{
+  return sim_uid( 2u );
+}
+
+void HAL_GPIO_WritePin( GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin, GPIO_PinState PinState )
+{
+  if( PinState == GPIO_PIN_SET )
+  {
+    GPIOx->ODR |= GPIO_Pin;
+  }
+  else
+  {
+    GPIOx->ODR &= ~(uint32_t)GPIO_Pin;
+  }
+}
+
+void HAL_GPIO_TogglePin( GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin )
+{
+  GPIOx->ODR ^= GPIO_Pin;
+}
+
+/**
+  * @brief CRC unit in its reset configuration : CRC-32 (0x04C11DB7),
+  *        init 0xFFFFFFFF, 32-bit input words, no reflection.
+  */
+uint32_t HAL_CRC_Calculate( CRC_HandleTypeDef *hcrc, uint32_t pBuffer[], uint32_t BufferLength )
+{
+  uint32_t crc = 0xFFFFFFFFu;
+
+  (void)hcrc;
+  for( uint32_t i = 0u; i < BufferLength; i++ )
+  {
+    crc ^= pBuffer[i];
+    for( int b = 0; b < 32; b++ )
+    {
+      crc = ( crc & 0x80000000u ) ? ( ( crc << 1 ) ^ 0x04C11DB7u ) : ( crc << 1 );
+    }
+  }
+  return crc;
+}
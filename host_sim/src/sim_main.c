@@ -0,0 +1,426 @@
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "sim.h"
+#include "boot.h"
+#include "flash.h"
+
+/*
+ * OTA device simulator.
+ *
+ * Every power cycle runs in a fresh child process, so a reset (including
+ * HAL_NVIC_SystemReset()) loses the RAM exactly like the target does. The
+ * flash image and the PTY belong to the parent and survive the resets.
+ *
+ * One power cycle :
+ *   bootloader  load_new_app()            (boot_fw/Core/Src/boot.c)
+ *   application ota_entry_init(), then ota_poll() every main loop pass,
+ *               the OTA session runs in the background
+ *                                         (app_fw/.../Core/Src/boot.c)
+ */
+
+#define SIM_EXIT_RESET   ( 0 )      //Reset
+#define SIM_EXIT_UPDATED ( 1 )      //Reset after a successful update
+#define SIM_EXIT_DONE    ( 2 )      //Update installed (or already running) and --once given
+#define SIM_EXIT_ERROR   ( 3 )      //Simulator failure
+#define SIM_EXIT_POWER_CUT ( 4 )    //Power cut in a flash operation (--power-cut)
+
+SIM_CFG_ sim_cfg =
+{
+  .flash_file   = "sim_flash.bin",
+  .pty_link     = NULL,
+  .events_file  = NULL,
+  .capture_file = NULL,
+  .baud         = 115200u,
+  .rx_fifo      = SIM_UART_RX_FIFO_DEFAULT,
+  .rx_overrun   = 0u,
+  .time_scale   = 1.0,
+  .ota_on_boot  = false,
+  .once         = false,
+  .verbose      = true,
+  .busy_wait    = false,
+  .run_ma       = SIM_RUN_MA_DEFAULT,
+  .sleep_ma     = SIM_SLEEP_MA_DEFAULT,
+  .boot_only    = false,
+  .power_cut    = 0u,
+  .power_cut_next = NULL,
+};
+
+SIM_STATS_ sim_stats;
+
+/* Peripherals used by the OTA sources */
+UART_HandleTypeDef huart3   = { .Instance = 3u };
+UART_HandleTypeDef hlpuart1 = { .Instance = 1u };
+CRC_HandleTypeDef  hcrc;
+
+/* Process running the current power cycle */
+static pid_t sim_device = -1;
+
+/**
+  * @brief Same as the application's HAL_UART_RxCpltCallback() (main.c).
+  */
+void HAL_UART_RxCpltCallback( UART_HandleTypeDef *huart )
+{
+  if( huart == &huart3 )
+  {
+    ota_entry_uart_rx_cplt();
+  }
+}
+
+/**
+  * @brief Same as the application's HAL_UART_ErrorCallback() (main.c).
+  */
+void HAL_UART_ErrorCallback( UART_HandleTypeDef *huart )
+{
+  if( huart == &huart3 )
+  {
+    ota_entry_uart_error();
+  }
+}
+
+/**
+  * @brief Cut the power in the middle of a flash operation (sim_flash.c).
+  */
+void sim_power_cut( void )
+{
+  sim_log( "power cut in the flash operation %lu", (unsigned long)sim_cfg.power_cut );
+  sim_event( "power_cut op=%lu", (unsigned long)sim_cfg.power_cut );
+  fflush( stdout );
+  _exit( SIM_EXIT_POWER_CUT );
+}
+
+/**
+  * @brief Take the next cut of a --power-cut list ("N,M,...") : one per
+  *        power cycle, counted from its power up.
+  * @param list rest of the list, NULL : no more cuts
+  */
+static void sim_power_cut_next( const char *list )
+{
+  char *end = NULL;
+
+  sim_cfg.power_cut      = ( list != NULL ) ? (uint32_t)strtoul( list, &end, 0 ) : 0u;
+  sim_cfg.power_cut_next = ( ( end != NULL ) && ( *end == ',' ) ) ? ( end + 1 ) : NULL;
+}
+
+/**
+  * @brief Same as NMI_Handler() (stm32l4xx_it.c) : a flash ECC error is
+  *        reported to the read, any other NMI halts.
+  */
+void sim_nmi( void )
+{
+  if( !flash_ecc_nmi() )
+  {
+    sim_log( "NMI, halted" );
+    _exit( SIM_EXIT_ERROR );
+  }
+}
+
+/**
+  * @brief Print what the bootloader left in the active region.
+  */
+static void sim_report_active_image( void )
+{
+  OTA_GNRL_CFG_ *cfg = (OTA_GNRL_CFG_ *)(uintptr_t)OTA_CONFIG_FLASH_START_ADDR;
+  uint32_t size = cfg->active_fw.fw_size;
+  uint32_t ops  = sim_stats.pages_erased + sim_stats.dw_programmed;
+
+  if( ( size == 0u ) || ( size > ( OTA_NEW_FW_START_ADDR - OTA_ACTV_FW_START_ADDR ) ) )
+  {
+    sim_log( "boot: no application installed" );
+    sim_event( "jump size=0 ops=%lu", (unsigned long)ops );
+    return;
+  }
+  sim_event( "jump size=%lu crc=0x%04X ops=%lu", (unsigned long)size, sim_flash_crc16( OTA_ACTV_FW_START_ADDR, size ),
+             (unsigned long)ops );
+  sim_log( "boot: jump to application, size %lu, CRC 0x%04X (installed CRC 0x%04lX, version 0x%04X), "
+           "%lu flash operations",
+           (unsigned long)size, sim_flash_crc16( OTA_ACTV_FW_START_ADDR, size ),
+           (unsigned long)cfg->active_fw.fw_crc, cfg->active_fw.fw_version, (unsigned long)ops );
+}
+
+/**
+  * @brief One power cycle : bootloader then application. Never returns.
+  * @param first true on the first power up
+  * @param stop_after_boot true to stop once the bootloader is done
+  */
+static void sim_power_cycle( bool first, bool stop_after_boot )
+{
+  if( sim_uart_start() != 0 )
+  {
+    _exit( SIM_EXIT_ERROR );
+  }
+  sim_event( "power_up" );
+  sim_flash_power_up();
+
+  /* Bootloader */
+  load_new_app();
+  sim_report_active_image();
+  if( stop_after_boot )
+  {
+    fflush( stdout );
+    _exit( SIM_EXIT_DONE );
+  }
+
+  /* Application (main.c) */
+  ota_entry_init();
+  if( first && sim_cfg.ota_on_boot )
+  {
+    ota_entry_request( OTA_ENTRY_BUTTON );
+  }
+
+  /* Main loop (main.c) : ota_poll(), then sleep until the next interrupt */
+  uint64_t start     = 0u;
+  uint64_t poll_max  = 0u;
+  uint32_t app_loops = 0u;
+  bool     running   = false;
+
+  while( 1 )
+  {
+    uint64_t poll_start = sim_now_us();
+    OTA_EX_  ret        = ota_poll();
+    uint64_t poll_us    = sim_now_us() - poll_start;
+
+    if( ret == OTA_EX_IDLE )
+    {
+      ota_sleep();
+      continue;
+    }
+    if( !running )
+    {
+      memset( &sim_stats, 0, sizeof(sim_stats) );
+      sim_log( "app: OTA mode, download in the background" );
+      start     = poll_start;
+      poll_max  = 0u;
+      app_loops = 0u;
+      running   = true;
+    }
+    if( poll_us > poll_max )
+    {
+      poll_max = poll_us;
+    }
+    if( ret == OTA_EX_BUSY )
+    {
+      //The application keeps running between the polls
+      app_loops++;
+      ota_sleep();
+      continue;
+    }
+    running = false;
+
+    /* Duty cycle and energy : awake at run_ma, asleep (WFI) at sleep_ma */
+    double total_s  = (double)( sim_now_us() - start ) / 1000000.0;
+    double sleep_s  = (double)sim_stats.sleep_us / 1000000.0;
+    double energy   = SIM_VDD * ( sim_cfg.run_ma * ( total_s - sleep_s ) + sim_cfg.sleep_ma * sleep_s );
+    double kbytes   = (double)sim_stats.rx_bytes / 1024.0;
+
+    sim_log( "app: OTA %s in %.3f s : rx %lu B, tx %lu B, overruns %lu, "
+             "erase %lu pages (%.3f s), program %lu DW (%.3f s), flash errors %lu, "
+             "longest poll %.3f ms, app loops %lu",
+             ( ret == OTA_EX_OK ) ? "done" : ( ret == OTA_EX_NO_UPDATE ) ? "up to date" :
+             ( ret == OTA_EX_ABORTED ) ? "aborted" : "FAILED",
+             total_s,
+             (unsigned long)sim_stats.rx_bytes, (unsigned long)sim_stats.tx_bytes,
+             (unsigned long)sim_stats.rx_overruns,
+             (unsigned long)sim_stats.pages_erased, (double)sim_stats.erase_us / 1000000.0,
+             (unsigned long)sim_stats.dw_programmed, (double)sim_stats.prog_us / 1000000.0,
+             (unsigned long)sim_stats.prog_errors, (double)poll_max / 1000.0, (unsigned long)app_loops );
+    sim_log( "app: awake %.1f %% (asleep %.3f s, %lu wakeups), %.1f mJ, %.2f mJ/KB",
+             ( total_s > 0.0 ) ? 100.0 * ( total_s - sleep_s ) / total_s : 0.0, sleep_s,
+             (unsigned long)sim_stats.wakeups, energy, ( kbytes > 0.0 ) ? energy / kbytes : 0.0 );
+
+    sim_event( "ota_%s rx=%lu tx=%lu overruns=%lu erase_pages=%lu dw=%lu flash_errors=%lu "
+               "poll_max_us=%lu app_loops=%lu us=%lu sleep_us=%lu wakeups=%lu energy_uj=%lu",
+               ( ret == OTA_EX_OK ) ? "done" : ( ret == OTA_EX_NO_UPDATE ) ? "up_to_date" :
+               ( ret == OTA_EX_ABORTED ) ? "aborted" : "failed",
+               (unsigned long)sim_stats.rx_bytes, (unsigned long)sim_stats.tx_bytes,
+               (unsigned long)sim_stats.rx_overruns, (unsigned long)sim_stats.pages_erased,
+               (unsigned long)sim_stats.dw_programmed, (unsigned long)sim_stats.prog_errors,
+               (unsigned long)poll_max, (unsigned long)app_loops,
+               (unsigned long)( total_s * 1000000.0 ), (unsigned long)sim_stats.sleep_us, (unsigned long)sim_stats.wakeups,
+               (unsigned long)( energy * 1000.0 ) );
+    fflush( stdout );
+    if( ( ret == OTA_EX_NO_UPDATE ) || ( ret == OTA_EX_ABORTED ) )
+    {
+      //No reset, the application keeps running (main.c)
+      if( sim_cfg.once )
+      {
+        _exit( SIM_EXIT_DONE );
+      }
+      continue;
+    }
+    if( ret != OTA_EX_OK )
+    {
+      //The target resets after a failed session (HAL_NVIC_SystemReset())
+      sim_log( "app: session failed, resetting" );
+      _exit( SIM_EXIT_RESET );
+    }
+    _exit( SIM_EXIT_UPDATED );    //HAL_NVIC_SystemReset()
+  }
+}
+
+static void sim_on_signal( int sig )
+{
+  (void)sig;
+  if( sim_device > 0 )
+  {
+    kill( sim_device, SIGKILL );
+  }
+  sim_uart_close();
+  sim_flash_close();
+  _exit( 0 );
+}
+
+static void sim_usage( const char *name )
+{
+  fprintf( stderr,
+    "usage : %s [options]\n"
+    "  -f, --flash FILE       flash image (default sim_flash.bin, created erased)\n"
+    "  -l, --link PATH        symlink to the OTA PTY (e.g. /tmp/ttyOTA)\n"
+    "  -e, --events FILE      machine readable event log (for ota_bench.py)\n"
+    "  -c, --record FILE      capture the OTA UART traffic (for ota_replay.py)\n"
+    "  -b, --baud N           UART speed, 0 : no pacing (default 115200)\n"
+    "  -r, --rx-fifo N        receive buffer depth, 1 : L4 RDR only (default %u)\n"
+    "  -O, --rx-overrun N     lose every Nth byte received in interrupt mode (overrun error)\n"
+    "  -t, --time-scale F     flash timing scale, 0 : instant (default 1.0)\n"
+    "  -o, --ota              press BOOT_SWITCH at the first power up\n"
+    "  -1, --once             exit once the first update is installed (or found running)\n"
+    "  -q, --quiet            do not print the firmware traces\n"
+    "  -w, --busy-wait        no Sleep mode, the core polls between frames\n"
+    "  -R, --run-ma F         supply current awake, mA (default %.2f)\n"
+    "  -S, --sleep-ma F       supply current in Sleep mode, mA (default %.2f)\n"
+    "  -B, --boot-only        stop every power cycle after the bootloader\n"
+    "  -P, --power-cut N[,M]  cut the power in the Nth flash operation after the first power up,\n"
+    "                         then in the Mth one after the next power up...\n",
+    name, SIM_UART_RX_FIFO_DEFAULT, SIM_RUN_MA_DEFAULT, SIM_SLEEP_MA_DEFAULT );
+}
+
+int main( int argc, char *argv[] )
+{
+  static const struct option opts[] =
+  {
+    { "flash",      required_argument, NULL, 'f' },
+    { "link",       required_argument, NULL, 'l' },
+    { "events",     required_argument, NULL, 'e' },
+    { "record",     required_argument, NULL, 'c' },
+    { "baud",       required_argument, NULL, 'b' },
+    { "rx-fifo",    required_argument, NULL, 'r' },
+    { "rx-overrun", required_argument, NULL, 'O' },
+    { "time-scale", required_argument, NULL, 't' },
+    { "ota",        no_argument,       NULL, 'o' },
+    { "once",       no_argument,       NULL, '1' },
+    { "quiet",      no_argument,       NULL, 'q' },
+    { "busy-wait",  no_argument,       NULL, 'w' },
+    { "run-ma",     required_argument, NULL, 'R' },
+    { "sleep-ma",   required_argument, NULL, 'S' },
+    { "boot-only",  no_argument,       NULL, 'B' },
+    { "power-cut",  required_argument, NULL, 'P' },
+    { "help",       no_argument,       NULL, 'h' },
+    { NULL, 0, NULL, 0 }
+  };
+  bool first   = true;
+  bool updated = false;
+  int  opt;
+
+  while( ( opt = getopt_long( argc, argv, "f:l:e:c:b:r:O:t:o1qwR:S:BP:h", opts, NULL ) ) != -1 )
+  {
+    switch( opt )
+    {
+      case 'f': sim_cfg.flash_file = optarg;                          break;
+      case 'l': sim_cfg.pty_link   = optarg;                          break;
+      case 'e': sim_cfg.events_file = optarg;                         break;
+      case 'c': sim_cfg.capture_file = optarg;                        break;
+      case 'b': sim_cfg.baud       = (uint32_t)strtoul( optarg, NULL, 0 ); break;
+      case 'r': sim_cfg.rx_fifo    = (uint32_t)strtoul( optarg, NULL, 0 ); break;
+      case 'O': sim_cfg.rx_overrun = (uint32_t)strtoul( optarg, NULL, 0 ); break;
+      case 't': sim_cfg.time_scale = strtod( optarg, NULL );          break;
+      case 'o': sim_cfg.ota_on_boot = true;                           break;
+      case '1': sim_cfg.once       = true;                            break;
+      case 'q': sim_cfg.verbose    = false;                           break;
+      case 'w': sim_cfg.busy_wait  = true;                            break;
+      case 'R': sim_cfg.run_ma     = strtod( optarg, NULL );          break;
+      case 'S': sim_cfg.sleep_ma   = strtod( optarg, NULL );          break;
+      case 'B': sim_cfg.boot_only  = true;                            break;
+      case 'P': sim_power_cut_next( optarg );                         break;
+      default:
+        sim_usage( argv[0] );
+        return ( opt == 'h' ) ? 0 : 1;
+    }
+  }
+  if( sim_cfg.rx_fifo == 0u )
+  {
+    sim_cfg.rx_fifo = 1u;
+  }
+
+  (void)sim_now_us();     //Time origin, shared by all the power cycles
+  setvbuf( stdout, NULL, _IOLBF, 0 );
+
+  if( ( sim_flash_init( sim_cfg.flash_file ) != 0 ) || ( sim_uart_init( sim_cfg.pty_link ) != 0 ) )
+  {
+    return 1;
+  }
+  if( ( sim_cfg.events_file != NULL ) && ( sim_event_open( sim_cfg.events_file ) != 0 ) )
+  {
+    sim_log( "cannot open %s", sim_cfg.events_file );
+    return 1;
+  }
+  if( ( sim_cfg.capture_file != NULL ) && ( sim_capture_open( sim_cfg.capture_file ) != 0 ) )
+  {
+    sim_log( "cannot open %s", sim_cfg.capture_file );
+    return 1;
+  }
+  signal( SIGINT, sim_on_signal );
+  signal( SIGTERM, sim_on_signal );
+
+  while( 1 )
+  {
+    int status;
+
+    sim_log( "power up" );
+    sim_device = fork();
+    if( sim_device < 0 )
+    {
+      break;
+    }
+    if( sim_device == 0 )
+    {
+      signal( SIGINT, SIG_DFL );
+      signal( SIGTERM, SIG_DFL );
+      sim_power_cycle( first, ( updated && sim_cfg.once ) || sim_cfg.boot_only );
+    }
+
+    waitpid( sim_device, &status, 0 );
+    first = false;
+
+    if( WIFEXITED( status ) &&
+        ( ( WEXITSTATUS( status ) == SIM_EXIT_RESET ) || ( WEXITSTATUS( status ) == SIM_EXIT_UPDATED ) ) )
+    {
+      updated = ( WEXITSTATUS( status ) == SIM_EXIT_UPDATED );
+      sim_log( "reset" );
+      continue;
+    }
+    if( WIFEXITED( status ) && ( WEXITSTATUS( status ) == SIM_EXIT_POWER_CUT ) )
+    {
+      //The next cut of the list, if any, else the next power up runs to the end
+      sim_power_cut_next( sim_cfg.power_cut_next );
+      continue;
+    }
+    if( !WIFEXITED( status ) || ( WEXITSTATUS( status ) != SIM_EXIT_DONE ) )
+    {
+      sim_log( "device stopped (status 0x%X)", status );
+    }
+    break;
+  }
+
+  //Give the host time to read the last response before the PTY hangs up
+  if( !sim_cfg.boot_only )
+  {
+    sim_sleep_us( 500000u );
+  }
+  sim_uart_close();
+  sim_flash_close();
+  return 0;
+}
@@ -0,0 +1,379 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <unistd.h>
+#include "sim.h"
+
+/*
+ * OTA UART (USART3) over a pseudo terminal.
+ *
+ * The host tool opens the PTY slave like a serial port. A reader thread
+ * plays the wire : every byte is delivered at the time it would finish
+ * arriving at sim_cfg.baud (10 bits per byte), into a receive buffer of
+ * sim_cfg.rx_fifo bytes. When the buffer is full the byte is lost and
+ * counted as an overrun (rx_fifo = 1 behaves like the L4 RDR).
+ * Interrupt mode receptions (HAL_UART_Receive_IT) are completed from the
+ * reader thread, which calls HAL_UART_RxCpltCallback() like the ISR would,
+ * and wakes the core from WFI. With sim_cfg.rx_overrun, every Nth byte of
+ * them is lost instead : the reception is aborted and
+ * HAL_UART_ErrorCallback() called (ORE), like the L4 HAL does.
+ */
+
+static int pty_master = -1;
+static int pty_slave  = -1;         //Kept open so the master never sees a hang up
+static char pty_link_path[256];
+static pthread_t rx_thread;
+static volatile bool rx_thread_run;
+
+static pthread_mutex_t rx_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  rx_cond = PTHREAD_COND_INITIALIZER;
+static uint8_t  *rx_buf;
+static uint32_t  rx_head;
+static uint32_t  rx_tail;
+
+/* Interrupt mode reception in progress */
+static UART_HandleTypeDef *it_huart;
+static uint8_t  *it_buf;
+static uint16_t  it_size;
+static uint16_t  it_count;
+
+/**
+  * @brief Time (us) to send len bytes at the configured baud rate.
+  */
+static uint64_t uart_wire_time_us( uint32_t len )
+{
+  if( sim_cfg.baud == 0u )
+  {
+    return 0u;
+  }
+  return ( (uint64_t)len * 10u * 1000000u ) / sim_cfg.baud;
+}
+
+/**
+  * @brief Deliver one byte that just finished arriving on the wire.
+  *        Called with rx_lock held.
+  * @retval UART handle to call back when an IT reception completed, or NULL
+  */
+static UART_HandleTypeDef *uart_deliver( uint8_t byte )
+{
+  UART_HandleTypeDef *done = NULL;
+
+  sim_stats.rx_bytes++;
+
+  if( ( it_buf != NULL ) && ( sim_cfg.rx_overrun != 0u ) &&
+      ( ( sim_stats.rx_bytes % sim_cfg.rx_overrun ) == 0u ) )
+  {
+    sim_stats.rx_overruns++;
+    done = it_huart;
+    done->ErrorCode |= HAL_UART_ERROR_ORE;
+    it_buf   = NULL;
+    it_huart = NULL;
+    return done;
+  }
+
+  if( it_buf != NULL )
+  {
+    it_buf[it_count++] = byte;
+    if( it_count >= it_size )
+    {
+      done    = it_huart;
+      it_buf  = NULL;
+      it_huart = NULL;
+    }
+    return done;
+  }
+
+  if( ( rx_head - rx_tail ) >= sim_cfg.rx_fifo )
+  {
+    sim_stats.rx_overruns++;
+    return NULL;
+  }
+
+  rx_buf[ rx_head % sim_cfg.rx_fifo ] = byte;
+  rx_head++;
+  pthread_cond_broadcast( &rx_cond );
+  return NULL;
+}
+
+/**
+  * @brief Reader thread : PTY -> wire pacing -> receive buffer.
+  */
+static void *uart_rx_thread( void *arg )
+{
+  uint8_t  chunk[512];
+  uint64_t wire_free_us = 0u;       //Time the wire finishes the previous byte
+
+  (void)arg;
+  while( rx_thread_run )
+  {
+    struct pollfd pfd = { .fd = pty_master, .events = POLLIN };
+    if( poll( &pfd, 1, 100 ) <= 0 )
+    {
+      continue;
+    }
+
+    ssize_t n = read( pty_master, chunk, sizeof(chunk) );
+    if( n <= 0 )
+    {
+      continue;
+    }
+    sim_capture( SIM_CAPTURE_TO_DEVICE, chunk, (uint32_t)n );
+
+    uint64_t now = sim_now_us();
+    if( wire_free_us < now )
+    {
+      wire_free_us = now;
+    }
+
+    for( ssize_t i = 0; i < n; i++ )
+    {
+      UART_HandleTypeDef *done;
+
+      wire_free_us += uart_wire_time_us( 1u );
+      now = sim_now_us();
+      if( wire_free_us > now )
+      {
+        sim_sleep_us( wire_free_us - now );
+      }
+
+      pthread_mutex_lock( &rx_lock );
+      done = uart_deliver( chunk[i] );
+      pthread_mutex_unlock( &rx_lock );
+
+      if( done != NULL )
+      {
+        //"Interrupt" : the callback may re-arm the reception
+        if( done->ErrorCode != HAL_UART_ERROR_NONE )
+        {
+          HAL_UART_ErrorCallback( done );
+        }
+        else
+        {
+          HAL_UART_RxCpltCallback( done );
+        }
+        sim_irq_raise();
+      }
+    }
+  }
+  return NULL;
+}
+
+/**
+  * @brief Create the PTY. It outlives the simulated resets.
+  * @param link optional symlink to create to the PTY slave
+  * @retval 0 on success, -1 on error
+  */
+int sim_uart_init( const char *link )
+{
+  struct termios tio;
+  const char *slave_name;
+
+  pty_master = posix_openpt( O_RDWR | O_NOCTTY );
+  if( ( pty_master < 0 ) || ( grantpt( pty_master ) != 0 ) || ( unlockpt( pty_master ) != 0 ) )
+  {
+    sim_log( "uart: cannot create the PTY (%s)", strerror( errno ) );
+    return -1;
+  }
+
+  fcntl( pty_master, F_SETFL, fcntl( pty_master, F_GETFL ) | O_NONBLOCK );
+  slave_name = ptsname( pty_master );
+  pty_slave  = open( slave_name, O_RDWR | O_NOCTTY );
+  if( pty_slave < 0 )
+  {
+    return -1;
+  }
+
+  //Raw 8N1, the PTY must not touch the binary frames
+  tcgetattr( pty_slave, &tio );
+  cfmakeraw( &tio );
+  tcsetattr( pty_slave, TCSANOW, &tio );
+
+  if( link != NULL )
+  {
+    unlink( link );
+    if( symlink( slave_name, link ) != 0 )
+    {
+      sim_log( "uart: cannot create %s (%s)", link, strerror( errno ) );
+      return -1;
+    }
+    strncpy( pty_link_path, link, sizeof(pty_link_path) - 1u );
+  }
+  sim_log( "uart: OTA port is %s%s%s", slave_name,
+           ( link != NULL ) ? " -> " : "", ( link != NULL ) ? link : "" );
+
+  return 0;
+}
+
+/**
+  * @brief Power up the UART : start the reader thread. Bytes that were
+  *        received while the device was in reset are lost.
+  * @param none
+  * @retval 0 on success, -1 on error
+  */
+int sim_uart_start( void )
+{
+  uint8_t flush[256];
+
+  rx_buf = malloc( sim_cfg.rx_fifo );
+  if( rx_buf == NULL )
+  {
+    return -1;
+  }
+  while( read( pty_master, flush, sizeof(flush) ) > 0 )
+  {
+  }
+
+  rx_thread_run = true;
+  if( pthread_create( &rx_thread, NULL, uart_rx_thread, NULL ) != 0 )
+  {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+  * @brief Remove the PTY.
+  * @param none
+  * @retval none
+  */
+void sim_uart_close( void )
+{
+  if( pty_link_path[0] != '\0' )
+  {
+    unlink( pty_link_path );
+  }
+  if( pty_slave >= 0 )
+  {
+    close( pty_slave );
+  }
+  if( pty_master >= 0 )
+  {
+    close( pty_master );
+  }
+}
+
+HAL_StatusTypeDef HAL_UART_Transmit( UART_HandleTypeDef *huart, const uint8_t *pData, uint16_t Size, uint32_t Timeout )
+{
+  uint16_t sent = 0u;
+
+  (void)huart;
+  (void)Timeout;
+
+  //Polled transmit : the CPU waits until the last byte left the wire
+  sim_sleep_us( uart_wire_time_us( Size ) );
+  sim_capture( SIM_CAPTURE_TO_HOST, pData, Size );
+
+  while( sent < Size )
+  {
+    ssize_t n = write( pty_master, &pData[sent], Size - sent );
+    if( n < 0 )
+    {
+      if( errno == EAGAIN )
+      {
+        //Host is not reading. The target would just keep sending.
+        struct pollfd pfd = { .fd = pty_master, .events = POLLOUT };
+        poll( &pfd, 1, 10 );
+        continue;
+      }
+      if( errno == EINTR )
+      {
+        continue;
+      }
+      return HAL_ERROR;
+    }
+    sent += (uint16_t)n;
+  }
+  sim_stats.tx_bytes += Size;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive( UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size, uint32_t Timeout )
+{
+  HAL_StatusTypeDef ret = HAL_OK;
+  uint32_t start = HAL_GetTick();
+
+  (void)huart;
+
+  pthread_mutex_lock( &rx_lock );
+  for( uint16_t i = 0u; i < Size; i++ )
+  {
+    while( rx_head == rx_tail )
+    {
+      if( Timeout == HAL_MAX_DELAY )
+      {
+        pthread_cond_wait( &rx_cond, &rx_lock );
+      }
+      else
+      {
+        uint32_t elapsed = HAL_GetTick() - start;
+        struct timespec ts;
+
+        if( elapsed >= Timeout )
+        {
+          ret = HAL_TIMEOUT;
+          break;
+        }
+        clock_gettime( CLOCK_REALTIME, &ts );
+        uint64_t ns = (uint64_t)ts.tv_nsec + ( (uint64_t)( Timeout - elapsed ) * 1000000u );
+        ts.tv_sec  += (time_t)( ns / 1000000000u );
+        ts.tv_nsec  = (long)( ns % 1000000000u );
+        pthread_cond_timedwait( &rx_cond, &rx_lock, &ts );
+      }
+    }
+    if( ret != HAL_OK )
+    {
+      break;
+    }
+    pData[i] = rx_buf[ rx_tail % sim_cfg.rx_fifo ];
+    rx_tail++;
+  }
+  pthread_mutex_unlock( &rx_lock );
+
+  return ret;
+}
+
+HAL_StatusTypeDef HAL_UART_Receive_IT( UART_HandleTypeDef *huart, uint8_t *pData, uint16_t Size )
+{
+  HAL_StatusTypeDef ret = HAL_OK;
+
+  pthread_mutex_lock( &rx_lock );
+  if( it_buf != NULL )
+  {
+    ret = HAL_BUSY;
+  }
+  else
+  {
+    //Bytes already waiting in the buffer were received "before" the call
+    rx_tail  = rx_head;
+    huart->ErrorCode = HAL_UART_ERROR_NONE;
+    it_huart = huart;
+    it_buf   = pData;
+    it_size  = Size;
+    it_count = 0u;
+  }
+  pthread_mutex_unlock( &rx_lock );
+
+  return ret;
+}
+
+uint32_t HAL_UART_GetError( UART_HandleTypeDef *huart )
+{
+  return huart->ErrorCode;
+}
+
+HAL_StatusTypeDef HAL_UART_AbortReceive_IT( UART_HandleTypeDef *huart )
+{
+  (void)huart;
+
+  pthread_mutex_lock( &rx_lock );
+  it_buf   = NULL;
+  it_huart = NULL;
+  pthread_mutex_unlock( &rx_lock );
+
+  return HAL_OK;
+}